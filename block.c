@@ -263,8 +263,10 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_queue_init(&bs->throttled_reqs[0]);
     qemu_co_queue_init(&bs->throttled_reqs[1]);
+    bs->throttle_share.weight = THROTTLE_SHARE_DEFAULT_WEIGHT;
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
+    block_acct_init(&bs->stats, true);
 
     return bs;
 }
@@ -1966,6 +1968,15 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     memcpy(&bs_dest->throttle_timers,
            &bs_src->throttle_timers,
            sizeof(ThrottleTimers));
+    bs_dest->throttle_share     = bs_src->throttle_share;
+    memcpy(bs_dest->throttle_vstart,
+           bs_src->throttle_vstart,
+           sizeof(bs_dest->throttle_vstart));
+    memcpy(bs_dest->throttle_reserve_tag,
+           bs_src->throttle_reserve_tag,
+           sizeof(bs_dest->throttle_reserve_tag));
+    bs_dest->throttle_wait_stats = bs_src->throttle_wait_stats;
+    bs_dest->stats.group        = bs_src->stats.group;
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -2960,6 +2971,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(const BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
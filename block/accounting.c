@@ -25,6 +25,45 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+
+const unsigned block_acct_interval_lengths[BLOCK_ACCT_INTERVALS] = {
+    1, 60, 300
+};
+
+void block_acct_init(BlockAcctStats *stats, bool timed_stats)
+{
+    int i, j;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!timed_stats) {
+        return;
+    }
+
+    for (i = 0; i < BLOCK_ACCT_INTERVALS; i++) {
+        BlockAcctTimedStats *ts = &stats->timed_stats[i];
+
+        ts->interval_length = block_acct_interval_lengths[i];
+        for (j = 0; j < BLOCK_MAX_IOTYPE; j++) {
+            timed_average_init(&ts->latency[j], QEMU_CLOCK_REALTIME,
+                               ts->interval_length * get_ticks_per_sec());
+        }
+    }
+    stats->has_timed_stats = true;
+}
+
+static inline int block_acct_bucket(uint64_t value, int shift, int buckets)
+{
+    int bucket;
+
+    value >>= shift;
+    if (!value) {
+        return 0;
+    }
+    bucket = 63 - clz64(value);
+    return MIN(bucket, buckets - 1);
+}
 
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
@@ -38,12 +77,40 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
-    assert(cookie->type < BLOCK_MAX_IOTYPE);
+    BlockAcctStats *group = stats->group;
+    int type = cookie->type;
+    int64_t latency_ns;
+    int lat_bucket, size_bucket;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
 
-    stats->nr_bytes[cookie->type] += cookie->bytes;
-    stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] +=
-        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    latency_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cookie->start_time_ns;
+    lat_bucket = block_acct_bucket(MAX(latency_ns, 0) / SCALE_US, 0,
+                                   BLOCK_ACCT_LATENCY_BUCKETS);
+    size_bucket = block_acct_bucket(cookie->bytes, BDRV_SECTOR_BITS,
+                                    BLOCK_ACCT_SIZE_BUCKETS);
+
+    stats->nr_bytes[type] += cookie->bytes;
+    stats->nr_ops[type]++;
+    stats->total_time_ns[type] += latency_ns;
+    stats->latency_histogram[type][lat_bucket]++;
+    stats->size_histogram[type][size_bucket]++;
+
+    if (stats->has_timed_stats) {
+        for (i = 0; i < BLOCK_ACCT_INTERVALS; i++) {
+            timed_average_account(&stats->timed_stats[i].latency[type],
+                                  latency_ns);
+        }
+    }
+
+    if (group) {
+        atomic_add(&group->nr_bytes[type], cookie->bytes);
+        atomic_inc(&group->nr_ops[type]);
+        atomic_add(&group->total_time_ns[type], latency_ns);
+        atomic_inc(&group->latency_histogram[type][lat_bucket]);
+        atomic_inc(&group->size_histogram[type][size_bucket]);
+    }
 }
 
 
@@ -0,0 +1,1932 @@
+/*
+ * Persistent block cache filter driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The blkcache driver keeps copies of blocks of its image (typically on slow
+ * network storage) in a cache file (typically on local flash storage). The
+ * cache file is formatted on first use and survives restarts:
+ *
+ *   header (BLKCACHE_TABLE_OFFSET bytes)
+ *   table  (one BlkcacheEntry per slot, padded to the block size)
+ *   data   (nb_slots blocks of block_size bytes)
+ *
+ * Every table entry names the image block cached in its slot and whether the
+ * slot is valid and dirty. The cache is crash consistent because an entry on
+ * disk never claims more than the data on disk backs:
+ *
+ * - A slot is only made valid on disk after its data was flushed, i.e. new
+ *   entries are written lazily by blkcache_sync_table() on flush.
+ *
+ * - A slot whose entry is valid on disk is invalidated on disk (and that is
+ *   flushed) before it is reused for another block or, in writethrough mode,
+ *   before the image is written.
+ *
+ * - In writeback mode, a clean slot whose entry is valid on disk is marked
+ *   dirty on disk before its data is overwritten.
+ *
+ * Only clean slots are evicted. Dirty blocks are tracked in a bitmap over the
+ * image blocks and written back in ascending order once writeback-threshold
+ * percent of the slots are dirty, and completely when the image is closed.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/hbitmap.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "trace.h"
+
+#define BLKCACHE_MAGIC              0x51424c4b43414348ULL /* "QBLKCACH" */
+#define BLKCACHE_VERSION            1
+#define BLKCACHE_TABLE_OFFSET       4096
+
+#define BLKCACHE_ENTRY_VALID        (1 << 0)
+#define BLKCACHE_ENTRY_DIRTY        (1 << 1)
+
+#define BLKCACHE_MIN_BLOCK_SIZE     4096
+#define BLKCACHE_MAX_BLOCK_SIZE     (2 * 1024 * 1024)
+#define BLKCACHE_MAX_SLOTS          (1 << 20)
+#define BLKCACHE_EVICT_BATCH        32
+#define BLKCACHE_EVICT_SCAN         128
+#define BLKCACHE_WRITEBACK_BATCH    32
+
+#define BLKCACHE_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define BLKCACHE_DEFAULT_THRESHOLD  50 /* percent of the slots dirty */
+
+typedef struct QEMU_PACKED BlkcacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t nb_slots;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+    char image_name[1024];
+} BlkcacheHeader;
+
+typedef struct QEMU_PACKED BlkcacheEntry {
+    uint64_t block;
+    uint32_t flags;
+    uint32_t reserved;
+} BlkcacheEntry;
+
+#define BLKCACHE_ENTRIES_PER_SECTOR (BDRV_SECTOR_SIZE / sizeof(BlkcacheEntry))
+
+typedef struct BlkcacheSlot {
+    uint32_t index;
+    int64_t block;              /* cached image block, -1 if none */
+    uint32_t flags;             /* BLKCACHE_ENTRY_* backed by the slot data */
+    int64_t disk_block;         /* table entry as it is on disk */
+    uint32_t disk_flags;
+    uint64_t write_gen;
+    int users;                  /* requests that hold or wait for the lock */
+    CoRwlock lock;
+    bool in_cache;
+    int list;                   /* eviction list */
+    QTAILQ_ENTRY(BlkcacheSlot) next;
+} BlkcacheSlot;
+
+/* ARC remembers recently evicted blocks to adapt its target size */
+typedef struct BlkcacheGhost {
+    int64_t block;
+    int list;
+    QTAILQ_ENTRY(BlkcacheGhost) next;
+} BlkcacheGhost;
+
+/* A write that goes to the image while the blocks it touches are not cached */
+typedef struct BlkcacheBypass {
+    int64_t first_block;
+    int64_t last_block;
+    QLIST_ENTRY(BlkcacheBypass) next;
+} BlkcacheBypass;
+
+typedef struct BDRVBlkcacheState {
+    BlockDriverState *image;
+    BlkcacheMode mode;
+    BlkcacheEviction eviction;
+    bool read_only;
+    bool broken;                /* table could not be written */
+
+    /* Cache file geometry */
+    int block_size;
+    int nb_slots;
+    int64_t data_offset;
+    int64_t image_size;
+
+    BlkcacheSlot *slots;
+    GHashTable *cache;          /* image block -> BlkcacheSlot */
+    QTAILQ_HEAD(, BlkcacheSlot) free;
+    QTAILQ_HEAD(, BlkcacheSlot) stale;   /* still valid on disk */
+    int nb_stale;
+
+    /* LRU uses lists[0] only; ARC uses lists[0] for blocks that were used
+     * once and lists[1] for blocks that were used more often */
+    QTAILQ_HEAD(, BlkcacheSlot) lists[2];
+    int list_len[2];
+    GHashTable *ghosts;         /* image block -> BlkcacheGhost */
+    QTAILQ_HEAD(, BlkcacheGhost) ghost_lists[2];
+    int nb_ghosts[2];
+    int arc_target;             /* target length of lists[0] */
+
+    QLIST_HEAD(, BlkcacheBypass) bypass;
+
+    /* Table entries that differ between memory and disk */
+    HBitmap *pending;
+    CoMutex table_lock;
+
+    /* Dirty image blocks */
+    HBitmap *dirty;
+    int writeback_threshold;
+    Coroutine *writeback_co;
+    bool closing;
+
+    struct {
+        uint64_t read_hits;
+        uint64_t read_misses;
+        uint64_t write_hits;
+        uint64_t write_misses;
+        uint64_t evictions;
+        uint64_t writebacks;
+    } stats;
+} BDRVBlkcacheState;
+
+/* Valid blkcache filenames look like blkcache:path/to/cache:path/to/image */
+static void blkcache_parse_filename(const char *filename, QDict *options,
+                                    Error **errp)
+{
+    const char *c;
+    QString *cache_path;
+
+    /* Parse the blkcache: prefix */
+    if (!strstart(filename, "blkcache:", &filename)) {
+        /* There was no prefix; therefore, all options have to be already
+           present in the QDict (except for the filename) */
+        qdict_put(options, "x-image", qstring_from_str(filename));
+        return;
+    }
+
+    /* Parse the cache file name */
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        error_setg(errp, "blkcache requires both cache file and image path");
+        return;
+    }
+
+    cache_path = qstring_from_substr(filename, 0, c - filename - 1);
+    qdict_put(options, "x-cache-file", cache_path);
+
+    filename = c + 1;
+    qdict_put(options, "x-image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "blkcache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "x-cache-file",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "mode",
+            .type = QEMU_OPT_STRING,
+            .help = "Write mode (writethrough, writeback)",
+        },
+        {
+            .name = "eviction",
+            .type = QEMU_OPT_STRING,
+            .help = "Eviction policy (lru, arc)",
+        },
+        {
+            .name = "block-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of a cache block when formatting the cache file",
+        },
+        {
+            .name = "writeback-threshold",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Percentage of dirty blocks at which writeback starts",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int parse_enum_opt(const char *opt, const char *lookup[], int max,
+                          int def)
+{
+    int i;
+
+    if (!opt) {
+        return def;
+    }
+
+    for (i = 0; i < max; i++) {
+        if (!strcmp(opt, lookup[i])) {
+            return i;
+        }
+    }
+
+    return -EINVAL;
+}
+
+static int64_t blkcache_slot_offset(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    return s->data_offset + (int64_t)slot->index * s->block_size;
+}
+
+/* Number of bytes of the given block that lie inside the image */
+static int blkcache_block_bytes(BDRVBlkcacheState *s, int64_t block)
+{
+    return MIN(s->block_size, s->image_size - block * s->block_size);
+}
+
+static int coroutine_fn blkcache_co_io(BlockDriverState *child, int64_t offset,
+                                       int bytes, QEMUIOVector *qiov,
+                                       size_t qiov_offset, bool is_write)
+{
+    QEMUIOVector local_qiov;
+    int ret;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_iovec_concat(&local_qiov, qiov, qiov_offset, bytes);
+
+    if (is_write) {
+        ret = bdrv_co_writev(child, offset >> BDRV_SECTOR_BITS,
+                             bytes >> BDRV_SECTOR_BITS, &local_qiov);
+    } else {
+        ret = bdrv_co_readv(child, offset >> BDRV_SECTOR_BITS,
+                            bytes >> BDRV_SECTOR_BITS, &local_qiov);
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_buf_io(BlockDriverState *child,
+                                           int64_t offset, int bytes,
+                                           uint8_t *buf, bool is_write)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = buf,
+        .iov_len    = bytes,
+    };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return blkcache_co_io(child, offset, bytes, &qiov, 0, is_write);
+}
+
+/* Reads an image block into buf, padded with zeros to the block size */
+static int coroutine_fn blkcache_read_image_block(BlockDriverState *bs,
+                                                  int64_t block, uint8_t *buf)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int bytes = blkcache_block_bytes(s, block);
+
+    memset(buf + bytes, 0, s->block_size - bytes);
+    return blkcache_co_buf_io(s->image, block * s->block_size, bytes, buf,
+                              false);
+}
+
+/*** Eviction policies ***/
+
+static void blkcache_drop_ghost(BDRVBlkcacheState *s, BlkcacheGhost *ghost)
+{
+    g_hash_table_remove(s->ghosts, &ghost->block);
+    QTAILQ_REMOVE(&s->ghost_lists[ghost->list], ghost, next);
+    s->nb_ghosts[ghost->list]--;
+    g_free(ghost);
+}
+
+static void blkcache_add_ghost(BDRVBlkcacheState *s, int64_t block, int list)
+{
+    BlkcacheGhost *ghost;
+
+    ghost = g_new(BlkcacheGhost, 1);
+    *ghost = (BlkcacheGhost) {
+        .block  = block,
+        .list   = list,
+    };
+    g_hash_table_insert(s->ghosts, &ghost->block, ghost);
+    QTAILQ_INSERT_TAIL(&s->ghost_lists[list], ghost, next);
+    s->nb_ghosts[list]++;
+
+    /* Remember at most as many blocks as fit into the cache per list, and at
+     * most twice the cache size in total */
+    while (s->list_len[0] + s->nb_ghosts[0] > s->nb_slots &&
+           s->nb_ghosts[0] > 0)
+    {
+        blkcache_drop_ghost(s, QTAILQ_FIRST(&s->ghost_lists[0]));
+    }
+    while (s->list_len[0] + s->list_len[1] + s->nb_ghosts[0] +
+           s->nb_ghosts[1] > 2 * s->nb_slots && s->nb_ghosts[1] > 0)
+    {
+        blkcache_drop_ghost(s, QTAILQ_FIRST(&s->ghost_lists[1]));
+    }
+}
+
+/* Adds a slot that was just allocated for slot->block to the eviction lists */
+static void blkcache_policy_insert(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    BlkcacheGhost *ghost;
+    int list = 0;
+
+    if (s->eviction == BLKCACHE_EVICTION_ARC) {
+        ghost = g_hash_table_lookup(s->ghosts, &slot->block);
+        if (ghost) {
+            /* A block that was evicted recently is used again, so the list
+             * it was evicted from should have been longer */
+            if (ghost->list == 0) {
+                s->arc_target = MIN(s->nb_slots, s->arc_target +
+                                    MAX(s->nb_ghosts[1] / s->nb_ghosts[0], 1));
+            } else {
+                s->arc_target = MAX(0, s->arc_target -
+                                    MAX(s->nb_ghosts[0] / s->nb_ghosts[1], 1));
+            }
+            blkcache_drop_ghost(s, ghost);
+            list = 1;
+        }
+    }
+
+    slot->list = list;
+    QTAILQ_INSERT_TAIL(&s->lists[list], slot, next);
+    s->list_len[list]++;
+}
+
+static void blkcache_policy_touch(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    if (!slot->in_cache) {
+        return;
+    }
+
+    QTAILQ_REMOVE(&s->lists[slot->list], slot, next);
+    s->list_len[slot->list]--;
+
+    if (s->eviction == BLKCACHE_EVICTION_ARC) {
+        slot->list = 1;
+    }
+    QTAILQ_INSERT_TAIL(&s->lists[slot->list], slot, next);
+    s->list_len[slot->list]++;
+}
+
+static void blkcache_policy_remove(BDRVBlkcacheState *s, BlkcacheSlot *slot,
+                                   bool evicted)
+{
+    QTAILQ_REMOVE(&s->lists[slot->list], slot, next);
+    s->list_len[slot->list]--;
+
+    if (evicted && s->eviction == BLKCACHE_EVICTION_ARC) {
+        blkcache_add_ghost(s, slot->block, slot->list);
+    }
+}
+
+static bool blkcache_can_evict(BlkcacheSlot *slot)
+{
+    return slot->users == 0 && !(slot->flags & BLKCACHE_ENTRY_DIRTY);
+}
+
+/* Returns the slot to evict to make room for block, or NULL if there is none */
+static BlkcacheSlot *blkcache_policy_victim(BDRVBlkcacheState *s,
+                                            int64_t block)
+{
+    BlkcacheSlot *slot;
+    BlkcacheGhost *ghost;
+    int order[2] = { 0, 1 };
+    int i, n;
+
+    if (s->eviction == BLKCACHE_EVICTION_ARC) {
+        bool in_b2, from_t1;
+
+        ghost = g_hash_table_lookup(s->ghosts, &block);
+        in_b2 = ghost && ghost->list == 1;
+        from_t1 = s->list_len[0] > 0 &&
+                  (s->list_len[0] > s->arc_target ||
+                   (in_b2 && s->list_len[0] == s->arc_target));
+        if (!from_t1) {
+            order[0] = 1;
+            order[1] = 0;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        n = 0;
+        QTAILQ_FOREACH(slot, &s->lists[order[i]], next) {
+            if (blkcache_can_evict(slot)) {
+                return slot;
+            }
+            if (++n >= BLKCACHE_EVICT_SCAN) {
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*** Cache table ***/
+
+static void blkcache_slot_changed(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    hbitmap_set(s->pending, slot->index, 1);
+}
+
+/* Writes the table sector that contains the entry of the given slot */
+static int blkcache_write_table_sector(BlockDriverState *bs, int index)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheEntry entries[BLKCACHE_ENTRIES_PER_SECTOR];
+    int first = index - index % BLKCACHE_ENTRIES_PER_SECTOR;
+    int i;
+
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < BLKCACHE_ENTRIES_PER_SECTOR; i++) {
+        BlkcacheSlot *slot;
+
+        if (first + i >= s->nb_slots) {
+            break;
+        }
+        slot = &s->slots[first + i];
+        if (slot->disk_flags & BLKCACHE_ENTRY_VALID) {
+            entries[i].block = cpu_to_be64(slot->disk_block);
+            entries[i].flags = cpu_to_be32(slot->disk_flags);
+        }
+    }
+
+    return bdrv_pwrite(bs->file,
+                       BLKCACHE_TABLE_OFFSET +
+                       (int64_t)first * sizeof(BlkcacheEntry),
+                       entries, sizeof(entries));
+}
+
+static void blkcache_table_error(BlockDriverState *bs, int ret)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (!s->broken) {
+        error_report("blkcache: Could not update the table of cache file "
+                     "'%s': %s; no more blocks are cached",
+                     bs->file->filename, strerror(-ret));
+        s->broken = true;
+    }
+}
+
+/*
+ * Brings the table entry of a slot that is valid on disk up to date and
+ * flushes it. Entries that are invalid on disk are left alone because the
+ * slot data may not be on disk yet; blkcache_sync_table() writes them.
+ */
+static int coroutine_fn blkcache_update_entry(BlockDriverState *bs,
+                                              BlkcacheSlot *slot)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->table_lock);
+
+    if ((slot->disk_flags & BLKCACHE_ENTRY_VALID) &&
+        (slot->disk_block != slot->block || slot->disk_flags != slot->flags))
+    {
+        slot->disk_block = slot->block;
+        slot->disk_flags = slot->flags;
+
+        ret = blkcache_write_table_sector(bs, slot->index);
+        if (ret >= 0) {
+            ret = bdrv_co_flush(bs->file);
+        }
+        if (ret < 0) {
+            blkcache_table_error(bs, ret);
+        }
+    }
+
+    qemu_co_mutex_unlock(&s->table_lock);
+    return ret;
+}
+
+typedef struct BlkcacheEntryState {
+    int index;
+    int64_t block;
+    uint32_t flags;
+} BlkcacheEntryState;
+
+/*
+ * Writes all table entries that differ from the in-memory state. The state of
+ * each slot is recorded before the cache file is flushed, so that the entries
+ * written afterwards only refer to data that is already stable.
+ */
+static int coroutine_fn blkcache_sync_table(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    HBitmapIter hbi;
+    GArray *states;
+    int64_t index;
+    int last_sector = -1;
+    int i, ret;
+
+    if (hbitmap_empty(s->pending)) {
+        return 0;
+    }
+    if (s->broken) {
+        return -EIO;
+    }
+
+    qemu_co_mutex_lock(&s->table_lock);
+
+    states = g_array_new(false, false, sizeof(BlkcacheEntryState));
+    hbitmap_iter_init(&hbi, s->pending, 0);
+    while ((index = hbitmap_iter_next(&hbi)) >= 0) {
+        BlkcacheEntryState state = {
+            .index  = index,
+            .block  = s->slots[index].block,
+            .flags  = s->slots[index].flags,
+        };
+        g_array_append_val(states, state);
+    }
+    hbitmap_reset_all(s->pending);
+
+    ret = bdrv_co_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < states->len; i++) {
+        BlkcacheEntryState *state = &g_array_index(states,
+                                                   BlkcacheEntryState, i);
+        BlkcacheSlot *slot = &s->slots[state->index];
+
+        if (slot->block != state->block || slot->flags != state->flags) {
+            /* Changed while flushing, this is for the next sync */
+            blkcache_slot_changed(s, slot);
+            continue;
+        }
+
+        slot->disk_block = state->block;
+        slot->disk_flags = state->flags;
+
+        if (state->index / BLKCACHE_ENTRIES_PER_SECTOR != last_sector) {
+            last_sector = state->index / BLKCACHE_ENTRIES_PER_SECTOR;
+            ret = blkcache_write_table_sector(bs, state->index);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    ret = bdrv_co_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    trace_blkcache_sync(s, states->len);
+    g_array_free(states, true);
+    qemu_co_mutex_unlock(&s->table_lock);
+    return 0;
+
+fail:
+    blkcache_table_error(bs, ret);
+    g_array_free(states, true);
+    qemu_co_mutex_unlock(&s->table_lock);
+    return ret;
+}
+
+/*** Slot management ***/
+
+static BlkcacheSlot *blkcache_lookup(BDRVBlkcacheState *s, int64_t block)
+{
+    return g_hash_table_lookup(s->cache, &block);
+}
+
+static bool blkcache_bypassed(BDRVBlkcacheState *s, int64_t block)
+{
+    BlkcacheBypass *bypass;
+
+    QLIST_FOREACH(bypass, &s->bypass, next) {
+        if (block >= bypass->first_block && block <= bypass->last_block) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void coroutine_fn blkcache_rdlock(BlkcacheSlot *slot)
+{
+    slot->users++;
+    qemu_co_rwlock_rdlock(&slot->lock);
+}
+
+static void coroutine_fn blkcache_wrlock(BlkcacheSlot *slot)
+{
+    slot->users++;
+    qemu_co_rwlock_wrlock(&slot->lock);
+}
+
+static void blkcache_free_slot(BDRVBlkcacheState *s, BlkcacheSlot *slot)
+{
+    if (slot->disk_flags & BLKCACHE_ENTRY_VALID) {
+        QTAILQ_INSERT_TAIL(&s->stale, slot, next);
+        s->nb_stale++;
+    } else {
+        QTAILQ_INSERT_TAIL(&s->free, slot, next);
+    }
+}
+
+static void coroutine_fn blkcache_unlock(BDRVBlkcacheState *s,
+                                         BlkcacheSlot *slot)
+{
+    qemu_co_rwlock_unlock(&slot->lock);
+    if (--slot->users == 0 && !slot->in_cache) {
+        blkcache_free_slot(s, slot);
+    }
+}
+
+/* Removes a slot from the cache; it is freed once nobody uses it any more */
+static void blkcache_remove_slot(BDRVBlkcacheState *s, BlkcacheSlot *slot,
+                                 bool evicted)
+{
+    assert(slot->in_cache);
+
+    g_hash_table_remove(s->cache, &slot->block);
+    blkcache_policy_remove(s, slot, evicted);
+    slot->in_cache = false;
+
+    if (slot->flags & BLKCACHE_ENTRY_DIRTY) {
+        hbitmap_reset(s->dirty, slot->block, 1);
+    }
+    slot->block = -1;
+    slot->flags = 0;
+    blkcache_slot_changed(s, slot);
+
+    if (slot->users == 0) {
+        blkcache_free_slot(s, slot);
+    }
+}
+
+/*
+ * Evicts up to BLKCACHE_EVICT_BATCH clean slots and invalidates the stale
+ * slots on disk so that they can be reused.
+ */
+static int coroutine_fn blkcache_evict(BlockDriverState *bs, int64_t block)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slot, *next_slot;
+    BlkcacheSlot **stale;
+    int nb_stale;
+    int i, ret;
+
+    for (i = 0; i < BLKCACHE_EVICT_BATCH; i++) {
+        slot = blkcache_policy_victim(s, block);
+        if (!slot) {
+            break;
+        }
+        trace_blkcache_evict(s, slot->block, slot->index);
+        blkcache_remove_slot(s, slot, true);
+        s->stats.evictions++;
+    }
+
+    if (QTAILQ_EMPTY(&s->stale)) {
+        return 0;
+    }
+
+    /* Take the stale slots out of the list, concurrent evictions must not
+     * free them before they are invalid on disk */
+    stale = g_new(BlkcacheSlot *, s->nb_stale);
+    nb_stale = 0;
+    QTAILQ_FOREACH_SAFE(slot, &s->stale, next, next_slot) {
+        QTAILQ_REMOVE(&s->stale, slot, next);
+        stale[nb_stale++] = slot;
+    }
+    s->nb_stale = 0;
+
+    qemu_co_mutex_lock(&s->table_lock);
+
+    ret = 0;
+    for (i = 0; i < nb_stale; i++) {
+        stale[i]->disk_flags = 0;
+    }
+    for (i = 0; i < nb_stale && ret >= 0; i++) {
+        ret = blkcache_write_table_sector(bs, stale[i]->index);
+    }
+    if (ret >= 0) {
+        ret = bdrv_co_flush(bs->file);
+    }
+
+    if (ret < 0) {
+        /* The entries may still be valid on disk, so the slots are not
+         * reused */
+        blkcache_table_error(bs, ret);
+    } else {
+        for (i = 0; i < nb_stale; i++) {
+            QTAILQ_INSERT_TAIL(&s->free, stale[i], next);
+        }
+    }
+
+    qemu_co_mutex_unlock(&s->table_lock);
+    g_free(stale);
+    return ret;
+}
+
+/*
+ * Allocates a slot for block. On success, *pslot is the write locked slot with
+ * invalid data, or NULL if no slot could be freed. Returns -EAGAIN if the
+ * block was cached or bypassed by a concurrent request in the meantime.
+ */
+static int coroutine_fn blkcache_alloc_slot(BlockDriverState *bs,
+                                            int64_t block,
+                                            BlkcacheSlot **pslot)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slot;
+    int ret;
+
+    *pslot = NULL;
+    if (s->read_only || s->broken) {
+        return 0;
+    }
+
+    if (QTAILQ_EMPTY(&s->free)) {
+        ret = blkcache_evict(bs, block);
+        if (ret < 0) {
+            return ret;
+        }
+        if (blkcache_lookup(s, block) || blkcache_bypassed(s, block)) {
+            return -EAGAIN;
+        }
+    }
+
+    slot = QTAILQ_FIRST(&s->free);
+    if (!slot) {
+        return 0;
+    }
+    QTAILQ_REMOVE(&s->free, slot, next);
+
+    slot->block = block;
+    slot->flags = 0;
+    slot->in_cache = true;
+    g_hash_table_insert(s->cache, &slot->block, slot);
+    blkcache_policy_insert(s, slot);
+    blkcache_wrlock(slot);
+
+    *pslot = slot;
+    return 0;
+}
+
+/*** Writeback ***/
+
+/*
+ * Writes back up to BLKCACHE_WRITEBACK_BATCH dirty blocks in ascending order
+ * and flushes the image. Blocks that were not written to while this was going
+ * on become clean. Returns the number of blocks written back or -errno.
+ */
+static int coroutine_fn blkcache_writeback_batch(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slots[BLKCACHE_WRITEBACK_BATCH];
+    uint64_t gens[BLKCACHE_WRITEBACK_BATCH];
+    HBitmapIter hbi;
+    uint8_t *buf;
+    int64_t block;
+    int nb_slots = 0;
+    int i, ret = 0;
+
+    buf = qemu_try_blockalign(s->image, s->block_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    hbitmap_iter_init(&hbi, s->dirty, 0);
+    while (nb_slots < BLKCACHE_WRITEBACK_BATCH &&
+           (block = hbitmap_iter_next(&hbi)) >= 0)
+    {
+        BlkcacheSlot *slot = blkcache_lookup(s, block);
+
+        if (!slot || !(slot->flags & BLKCACHE_ENTRY_DIRTY)) {
+            hbitmap_reset(s->dirty, block, 1);
+            continue;
+        }
+        slot->users++;
+        slots[nb_slots++] = slot;
+    }
+
+    for (i = 0; i < nb_slots && ret >= 0; i++) {
+        BlkcacheSlot *slot = slots[i];
+
+        /* Copy the data out so that the slot isn't locked while the (slow)
+         * image is written; write_gen tells if the block changed meanwhile */
+        qemu_co_rwlock_rdlock(&slot->lock);
+        block = slot->block;
+        gens[i] = slot->write_gen;
+        if (slot->in_cache) {
+            ret = blkcache_co_buf_io(bs->file, blkcache_slot_offset(s, slot),
+                                     s->block_size, buf, false);
+        }
+        qemu_co_rwlock_unlock(&slot->lock);
+
+        if (ret >= 0 && block >= 0) {
+            ret = blkcache_co_buf_io(s->image, block * s->block_size,
+                                     blkcache_block_bytes(s, block), buf,
+                                     true);
+            trace_blkcache_writeback(s, block, ret);
+        }
+    }
+
+    if (ret >= 0) {
+        ret = bdrv_co_flush(s->image);
+    }
+
+    for (i = 0; i < nb_slots; i++) {
+        BlkcacheSlot *slot = slots[i];
+
+        if (ret >= 0 && slot->in_cache && slot->write_gen == gens[i]) {
+            hbitmap_reset(s->dirty, slot->block, 1);
+            slot->flags &= ~BLKCACHE_ENTRY_DIRTY;
+            blkcache_slot_changed(s, slot);
+            s->stats.writebacks++;
+        }
+        if (--slot->users == 0 && !slot->in_cache) {
+            blkcache_free_slot(s, slot);
+        }
+    }
+
+    qemu_vfree(buf);
+    return ret < 0 ? ret : nb_slots;
+}
+
+static int coroutine_fn blkcache_writeback_all(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    while (!hbitmap_empty(s->dirty)) {
+        ret = blkcache_writeback_batch(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static bool blkcache_over_threshold(BDRVBlkcacheState *s, int percent)
+{
+    return hbitmap_count(s->dirty) * 100 > (uint64_t)s->nb_slots * percent;
+}
+
+static void coroutine_fn blkcache_writeback_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    /* Stop at half of the threshold so that writeback runs in bursts */
+    while (!s->closing &&
+           blkcache_over_threshold(s, s->writeback_threshold / 2))
+    {
+        ret = blkcache_writeback_batch(bs);
+        if (ret < 0) {
+            error_report("blkcache: Could not write back to '%s': %s",
+                         s->image->filename, strerror(-ret));
+            break;
+        }
+    }
+
+    s->writeback_co = NULL;
+}
+
+static void blkcache_kick_writeback(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    if (s->writeback_co || s->closing || s->read_only ||
+        !blkcache_over_threshold(s, s->writeback_threshold))
+    {
+        return;
+    }
+
+    s->writeback_co = qemu_coroutine_create(blkcache_writeback_entry);
+    qemu_coroutine_enter(s->writeback_co, bs);
+}
+
+/*** Requests ***/
+
+static int coroutine_fn blkcache_read_block(BlockDriverState *bs,
+                                            int64_t block, int in_block,
+                                            int bytes, QEMUIOVector *qiov,
+                                            size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheSlot *slot;
+    uint8_t *buf;
+    int ret;
+
+retry:
+    slot = blkcache_lookup(s, block);
+    if (slot) {
+        blkcache_rdlock(slot);
+        if (slot->block != block || !(slot->flags & BLKCACHE_ENTRY_VALID)) {
+            /* Filling the slot failed */
+            blkcache_unlock(s, slot);
+            goto retry;
+        }
+
+        trace_blkcache_read(s, block, true);
+        s->stats.read_hits++;
+        ret = blkcache_co_io(bs->file, blkcache_slot_offset(s, slot) + in_block,
+                             bytes, qiov, qiov_offset, false);
+        blkcache_policy_touch(s, slot);
+        blkcache_unlock(s, slot);
+        return ret;
+    }
+
+    trace_blkcache_read(s, block, false);
+    s->stats.read_misses++;
+
+    if (!blkcache_bypassed(s, block)) {
+        ret = blkcache_alloc_slot(bs, block, &slot);
+        if (ret == -EAGAIN) {
+            goto retry;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (!slot) {
+        return blkcache_co_io(s->image, block * s->block_size + in_block,
+                              bytes, qiov, qiov_offset, false);
+    }
+
+    /* Fill the slot with the whole block */
+    buf = qemu_try_blockalign(bs->file, s->block_size);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = blkcache_read_image_block(bs, block, buf);
+    if (ret < 0) {
+        goto fail;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + in_block, bytes);
+
+    ret = blkcache_co_buf_io(bs->file, blkcache_slot_offset(s, slot),
+                             s->block_size, buf, true);
+    if (ret < 0) {
+        /* The guest has its data, only caching it failed */
+        ret = 0;
+        goto fail;
+    }
+
+    slot->flags = BLKCACHE_ENTRY_VALID;
+    blkcache_slot_changed(s, slot);
+    blkcache_unlock(s, slot);
+    qemu_vfree(buf);
+    return 0;
+
+fail:
+    blkcache_remove_slot(s, slot, false);
+    blkcache_unlock(s, slot);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    int64_t end = offset + (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    size_t qiov_offset = 0;
+    int ret;
+
+    while (offset < end) {
+        int64_t block = offset / s->block_size;
+        int in_block = offset % s->block_size;
+        int bytes = MIN(end - offset, s->block_size - in_block);
+
+        ret = blkcache_read_block(bs, block, in_block, bytes, qiov,
+                                  qiov_offset);
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += bytes;
+        qiov_offset += bytes;
+    }
+
+    return 0;
+}
+
+/* Writes to the image, none of the touched blocks may be cached */
+static int coroutine_fn blkcache_bypass_write(BlockDriverState *bs,
+                                              int64_t offset, int bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheBypass bypass = {
+        .first_block    = offset / s->block_size,
+        .last_block     = (offset + bytes - 1) / s->block_size,
+    };
+    int ret;
+
+    /* Fills started from now on would cache stale data */
+    QLIST_INSERT_HEAD(&s->bypass, &bypass, next);
+    ret = blkcache_co_io(s->image, offset, bytes, qiov, qiov_offset, true);
+    QLIST_REMOVE(&bypass, next);
+
+    return ret;
+}
+
+static int coroutine_fn blkcache_write_through(BlockDriverState *bs,
+                                               int64_t block, int in_block,
+                                               int bytes, QEMUIOVector *qiov,
+                                               size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = block * s->block_size + in_block;
+    BlkcacheSlot *slot;
+    int ret;
+
+retry:
+    slot = blkcache_lookup(s, block);
+    if (!slot) {
+        trace_blkcache_write(s, block, false);
+        s->stats.write_misses++;
+        return blkcache_bypass_write(bs, offset, bytes, qiov, qiov_offset);
+    }
+
+    blkcache_wrlock(slot);
+    if (slot->block != block || !(slot->flags & BLKCACHE_ENTRY_VALID)) {
+        blkcache_unlock(s, slot);
+        goto retry;
+    }
+
+    trace_blkcache_write(s, block, true);
+    s->stats.write_hits++;
+
+    /* After a crash, the cached data could be older than the image */
+    slot->flags = 0;
+    blkcache_slot_changed(s, slot);
+    ret = blkcache_update_entry(bs, slot);
+    if (ret < 0) {
+        blkcache_remove_slot(s, slot, false);
+        blkcache_unlock(s, slot);
+        return ret;
+    }
+
+    ret = blkcache_co_io(s->image, offset, bytes, qiov, qiov_offset, true);
+    if (ret < 0) {
+        blkcache_remove_slot(s, slot, false);
+        blkcache_unlock(s, slot);
+        return ret;
+    }
+
+    ret = blkcache_co_io(bs->file, blkcache_slot_offset(s, slot) + in_block,
+                         bytes, qiov, qiov_offset, true);
+    if (ret < 0) {
+        blkcache_remove_slot(s, slot, false);
+    } else {
+        slot->flags = BLKCACHE_ENTRY_VALID;
+        blkcache_slot_changed(s, slot);
+        blkcache_policy_touch(s, slot);
+    }
+
+    blkcache_unlock(s, slot);
+    return 0;
+}
+
+static int coroutine_fn blkcache_write_back(BlockDriverState *bs,
+                                            int64_t block, int in_block,
+                                            int bytes, QEMUIOVector *qiov,
+                                            size_t qiov_offset)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = block * s->block_size + in_block;
+    BlkcacheSlot *slot;
+    uint8_t *buf = NULL;
+    int ret;
+
+retry:
+    slot = blkcache_lookup(s, block);
+    if (slot) {
+        blkcache_wrlock(slot);
+        if (slot->block != block || !(slot->flags & BLKCACHE_ENTRY_VALID)) {
+            blkcache_unlock(s, slot);
+            goto retry;
+        }
+
+        trace_blkcache_write(s, block, true);
+        s->stats.write_hits++;
+
+        slot->flags |= BLKCACHE_ENTRY_DIRTY;
+        slot->write_gen++;
+        blkcache_slot_changed(s, slot);
+        hbitmap_set(s->dirty, block, 1);
+
+        ret = blkcache_update_entry(bs, slot);
+        if (ret >= 0) {
+            ret = blkcache_co_io(bs->file,
+                                 blkcache_slot_offset(s, slot) + in_block,
+                                 bytes, qiov, qiov_offset, true);
+        }
+        blkcache_policy_touch(s, slot);
+        blkcache_unlock(s, slot);
+        return ret;
+    }
+
+    trace_blkcache_write(s, block, false);
+    s->stats.write_misses++;
+
+    if (!blkcache_bypassed(s, block)) {
+        ret = blkcache_alloc_slot(bs, block, &slot);
+        if (ret == -EAGAIN) {
+            goto retry;
+        } else if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (!slot) {
+        return blkcache_bypass_write(bs, offset, bytes, qiov, qiov_offset);
+    }
+
+    if (bytes < s->block_size) {
+        buf = qemu_try_blockalign(bs->file, s->block_size);
+        if (buf == NULL) {
+            ret = -ENOMEM;
+            goto fail;
+        }
+        ret = blkcache_read_image_block(bs, block, buf);
+        if (ret < 0) {
+            goto fail;
+        }
+        qemu_iovec_to_buf(qiov, qiov_offset, buf + in_block, bytes);
+        ret = blkcache_co_buf_io(bs->file, blkcache_slot_offset(s, slot),
+                                 s->block_size, buf, true);
+    } else {
+        ret = blkcache_co_io(bs->file, blkcache_slot_offset(s, slot),
+                             bytes, qiov, qiov_offset, true);
+    }
+
+    if (ret < 0) {
+        /* Caching failed, write to the image instead */
+        blkcache_remove_slot(s, slot, false);
+        blkcache_unlock(s, slot);
+        qemu_vfree(buf);
+        return blkcache_bypass_write(bs, offset, bytes, qiov, qiov_offset);
+    }
+
+    slot->flags = BLKCACHE_ENTRY_VALID | BLKCACHE_ENTRY_DIRTY;
+    slot->write_gen++;
+    blkcache_slot_changed(s, slot);
+    hbitmap_set(s->dirty, block, 1);
+    blkcache_unlock(s, slot);
+    qemu_vfree(buf);
+    return 0;
+
+fail:
+    blkcache_remove_slot(s, slot, false);
+    blkcache_unlock(s, slot);
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn blkcache_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    int64_t end = offset + (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    size_t qiov_offset = 0;
+    int64_t block;
+    int ret;
+
+    if (s->mode == BLKCACHE_MODE_WRITETHROUGH) {
+        /* Don't split requests that don't touch any cached block */
+        for (block = offset / s->block_size;
+             block <= (end - 1) / s->block_size; block++)
+        {
+            if (blkcache_lookup(s, block)) {
+                break;
+            }
+        }
+        if (block > (end - 1) / s->block_size) {
+            s->stats.write_misses += block - offset / s->block_size;
+            return blkcache_bypass_write(bs, offset, end - offset, qiov, 0);
+        }
+    }
+
+    while (offset < end) {
+        int in_block = offset % s->block_size;
+        int bytes = MIN(end - offset, s->block_size - in_block);
+
+        block = offset / s->block_size;
+        if (s->mode == BLKCACHE_MODE_WRITETHROUGH) {
+            ret = blkcache_write_through(bs, block, in_block, bytes, qiov,
+                                         qiov_offset);
+        } else {
+            ret = blkcache_write_back(bs, block, in_block, bytes, qiov,
+                                      qiov_offset);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += bytes;
+        qiov_offset += bytes;
+    }
+
+    blkcache_kick_writeback(bs);
+    return 0;
+}
+
+static int coroutine_fn blkcache_co_flush(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int ret;
+
+    /* Clean entries may only become valid on disk once the image is stable.
+     * Writes that bypassed the cache went straight to the image, too, and the
+     * generic code only flushes bs->file, so this is needed in both modes. */
+    ret = bdrv_co_flush(s->image);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return blkcache_sync_table(bs);
+}
+
+/*** Open and close ***/
+
+typedef struct BlkcacheCo {
+    BlockDriverState *bs;
+    int (*fn)(BlockDriverState *bs);
+    int ret;
+    bool done;
+} BlkcacheCo;
+
+static void coroutine_fn blkcache_co_entry(void *opaque)
+{
+    BlkcacheCo *co = opaque;
+
+    co->ret = co->fn(co->bs);
+    co->done = true;
+}
+
+static int blkcache_run_co(BlockDriverState *bs,
+                           int (*fn)(BlockDriverState *bs))
+{
+    BlkcacheCo co = {
+        .bs = bs,
+        .fn = fn,
+    };
+    Coroutine *c;
+
+    if (qemu_in_coroutine()) {
+        return fn(bs);
+    }
+
+    c = qemu_coroutine_create(blkcache_co_entry);
+    qemu_coroutine_enter(c, &co);
+    while (!co.done) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+
+    return co.ret;
+}
+
+static int coroutine_fn blkcache_writeback_and_sync(BlockDriverState *bs)
+{
+    int ret;
+
+    ret = blkcache_writeback_all(bs);
+    if (ret < 0) {
+        error_report("blkcache: Could not write back dirty blocks: %s",
+                     strerror(-ret));
+    }
+
+    /* Write the table even on failure, it contains the dirty blocks */
+    return blkcache_sync_table(bs);
+}
+
+/* Writes an empty cache with the given block size to the cache file */
+static int blkcache_format(BlockDriverState *bs, int block_size, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader header;
+    int64_t file_size, table_end;
+    int64_t nb_slots;
+    int ret;
+
+    if (s->read_only) {
+        error_setg(errp, "Cache file '%s' is not formatted for this image "
+                   "and cannot be written", bs->file->filename);
+        return -EACCES;
+    }
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        error_setg_errno(errp, -file_size, "Could not get cache file size");
+        return file_size;
+    }
+
+    nb_slots = MAX(file_size - BLKCACHE_TABLE_OFFSET, 0) /
+               (block_size + sizeof(BlkcacheEntry));
+    nb_slots = MIN(nb_slots, BLKCACHE_MAX_SLOTS);
+    for (;;) {
+        table_end = BLKCACHE_TABLE_OFFSET + nb_slots * sizeof(BlkcacheEntry);
+        s->data_offset = ROUND_UP(table_end, block_size);
+        if (nb_slots == 0 ||
+            s->data_offset + nb_slots * block_size <= file_size)
+        {
+            break;
+        }
+        nb_slots--;
+    }
+
+    if (nb_slots < 2) {
+        error_setg(errp, "Cache file '%s' is too small for a block size of "
+                   "%d bytes", bs->file->filename, block_size);
+        return -ENOSPC;
+    }
+
+    s->block_size = block_size;
+    s->nb_slots = nb_slots;
+
+    /* The old header stays consistent with the old table until the new
+     * header is written, so invalidate it first */
+    memset(&header, 0, sizeof(header));
+    ret = bdrv_pwrite_sync(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_write_zeroes(bs->file,
+                            BLKCACHE_TABLE_OFFSET >> BDRV_SECTOR_BITS,
+                            (s->data_offset - BLKCACHE_TABLE_OFFSET) >>
+                            BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    header = (BlkcacheHeader) {
+        .magic          = cpu_to_be64(BLKCACHE_MAGIC),
+        .version        = cpu_to_be32(BLKCACHE_VERSION),
+        .block_size     = cpu_to_be32(block_size),
+        .nb_slots       = cpu_to_be64(nb_slots),
+        .table_offset   = cpu_to_be64(BLKCACHE_TABLE_OFFSET),
+        .data_offset    = cpu_to_be64(s->data_offset),
+        .image_size     = cpu_to_be64(s->image_size),
+    };
+    pstrcpy(header.image_name, sizeof(header.image_name),
+            s->image->filename);
+
+    ret = bdrv_pwrite_sync(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    error_setg_errno(errp, -ret, "Could not format cache file '%s'",
+                     bs->file->filename);
+    return ret;
+}
+
+/*
+ * Reads the header of the cache file. Returns 1 if the cache file is formatted
+ * for the image, 0 if it is not or -errno.
+ */
+static int blkcache_read_header(BlockDriverState *bs, int block_size,
+                                Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlkcacheHeader header;
+    char image_name[sizeof(header.image_name)];
+    int64_t file_size;
+    uint64_t nb_slots, data_offset;
+    uint32_t header_block_size;
+    int ret;
+
+    file_size = bdrv_getlength(bs->file);
+    if (file_size < 0) {
+        error_setg_errno(errp, -file_size, "Could not get cache file size");
+        return file_size;
+    }
+    if (file_size < sizeof(header)) {
+        return 0;
+    }
+
+    ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache file header");
+        return ret;
+    }
+
+    if (be64_to_cpu(header.magic) != BLKCACHE_MAGIC) {
+        return 0;
+    }
+    if (be32_to_cpu(header.version) != BLKCACHE_VERSION) {
+        error_setg(errp, "Unsupported blkcache version %" PRIu32,
+                   be32_to_cpu(header.version));
+        return -ENOTSUP;
+    }
+
+    header_block_size = be32_to_cpu(header.block_size);
+    nb_slots = be64_to_cpu(header.nb_slots);
+    data_offset = be64_to_cpu(header.data_offset);
+
+    if (header_block_size < BLKCACHE_MIN_BLOCK_SIZE ||
+        header_block_size > BLKCACHE_MAX_BLOCK_SIZE ||
+        !is_power_of_2(header_block_size) ||
+        nb_slots < 2 || nb_slots > BLKCACHE_MAX_SLOTS ||
+        be64_to_cpu(header.table_offset) != BLKCACHE_TABLE_OFFSET ||
+        data_offset % header_block_size ||
+        data_offset < BLKCACHE_TABLE_OFFSET +
+                      nb_slots * sizeof(BlkcacheEntry) ||
+        data_offset + nb_slots * header_block_size > file_size)
+    {
+        error_setg(errp, "Cache file '%s' is corrupt", bs->file->filename);
+        return -EINVAL;
+    }
+
+    s->block_size = header_block_size;
+    s->nb_slots = nb_slots;
+    s->data_offset = data_offset;
+
+    /* Dirty blocks decide whether another image or block size is an error,
+     * so only report the mismatch here */
+    pstrcpy(image_name, sizeof(image_name), s->image->filename);
+    header.image_name[sizeof(header.image_name) - 1] = '\0';
+
+    return be64_to_cpu(header.image_size) == s->image_size &&
+           !strcmp(header.image_name, image_name) &&
+           (!block_size || block_size == header_block_size);
+}
+
+static void blkcache_alloc_state(BDRVBlkcacheState *s)
+{
+    int i;
+
+    s->slots = g_new0(BlkcacheSlot, s->nb_slots);
+    s->cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+    s->ghosts = g_hash_table_new(g_int64_hash, g_int64_equal);
+    s->pending = hbitmap_alloc(s->nb_slots, 0);
+    s->dirty = hbitmap_alloc(DIV_ROUND_UP(s->image_size, s->block_size), 0);
+
+    QTAILQ_INIT(&s->free);
+    QTAILQ_INIT(&s->stale);
+    for (i = 0; i < 2; i++) {
+        QTAILQ_INIT(&s->lists[i]);
+        QTAILQ_INIT(&s->ghost_lists[i]);
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        BlkcacheSlot *slot = &s->slots[i];
+
+        slot->index = i;
+        slot->block = -1;
+        slot->disk_block = -1;
+        qemu_co_rwlock_init(&slot->lock);
+    }
+}
+
+static void blkcache_free_state(BDRVBlkcacheState *s)
+{
+    GHashTableIter iter;
+    gpointer ghost;
+
+    if (s->ghosts) {
+        g_hash_table_iter_init(&iter, s->ghosts);
+        while (g_hash_table_iter_next(&iter, NULL, &ghost)) {
+            g_free(ghost);
+        }
+        g_hash_table_destroy(s->ghosts);
+    }
+    if (s->cache) {
+        g_hash_table_destroy(s->cache);
+    }
+    if (s->pending) {
+        hbitmap_free(s->pending);
+    }
+    if (s->dirty) {
+        hbitmap_free(s->dirty);
+    }
+    g_free(s->slots);
+
+    s->ghosts = NULL;
+    s->cache = NULL;
+    s->pending = NULL;
+    s->dirty = NULL;
+    s->slots = NULL;
+    s->nb_stale = 0;
+    memset(s->list_len, 0, sizeof(s->list_len));
+    memset(s->nb_ghosts, 0, sizeof(s->nb_ghosts));
+}
+
+/*
+ * Loads the table of the cache file. Returns the number of dirty blocks or
+ * -errno.
+ */
+static int blkcache_load_table(BlockDriverState *bs, Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    int64_t nb_blocks = DIV_ROUND_UP(s->image_size, s->block_size);
+    BlkcacheEntry *entries;
+    int chunk = 65536;
+    int nb_dirty = 0;
+    int i, j, ret;
+
+    entries = g_new(BlkcacheEntry, chunk);
+
+    for (i = 0; i < s->nb_slots; i += chunk) {
+        int n = MIN(chunk, s->nb_slots - i);
+
+        ret = bdrv_pread(bs->file,
+                         BLKCACHE_TABLE_OFFSET +
+                         (int64_t)i * sizeof(BlkcacheEntry),
+                         entries, n * sizeof(BlkcacheEntry));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read cache table");
+            goto out;
+        }
+
+        for (j = 0; j < n; j++) {
+            BlkcacheSlot *slot = &s->slots[i + j];
+            int64_t block = be64_to_cpu(entries[j].block);
+            uint32_t flags = be32_to_cpu(entries[j].flags);
+
+            if (!(flags & BLKCACHE_ENTRY_VALID)) {
+                QTAILQ_INSERT_TAIL(&s->free, slot, next);
+                continue;
+            }
+
+            slot->disk_block = block;
+            slot->disk_flags = flags &
+                               (BLKCACHE_ENTRY_VALID | BLKCACHE_ENTRY_DIRTY);
+            if (flags & BLKCACHE_ENTRY_DIRTY) {
+                nb_dirty++;
+            }
+
+            if (block < 0 || block >= nb_blocks || blkcache_lookup(s, block)) {
+                /* Can't be used, but must be invalidated before reuse */
+                blkcache_slot_changed(s, slot);
+                QTAILQ_INSERT_TAIL(&s->stale, slot, next);
+                s->nb_stale++;
+                continue;
+            }
+
+            slot->block = block;
+            slot->flags = slot->disk_flags;
+            slot->in_cache = true;
+            g_hash_table_insert(s->cache, &slot->block, slot);
+            blkcache_policy_insert(s, slot);
+
+            if (flags & BLKCACHE_ENTRY_DIRTY) {
+                hbitmap_set(s->dirty, block, 1);
+            }
+        }
+    }
+
+    ret = nb_dirty;
+out:
+    g_free(entries);
+    return ret;
+}
+
+static int blkcache_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t block_size;
+    int64_t threshold;
+    int i, ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = parse_enum_opt(qemu_opt_get(opts, "mode"), BlkcacheMode_lookup,
+                         BLKCACHE_MODE_MAX, BLKCACHE_MODE_WRITETHROUGH);
+    if (ret < 0) {
+        error_setg(errp, "mode must be writethrough or writeback");
+        goto out;
+    }
+    s->mode = ret;
+
+    ret = parse_enum_opt(qemu_opt_get(opts, "eviction"),
+                         BlkcacheEviction_lookup, BLKCACHE_EVICTION_MAX,
+                         BLKCACHE_EVICTION_LRU);
+    if (ret < 0) {
+        error_setg(errp, "eviction must be lru or arc");
+        goto out;
+    }
+    s->eviction = ret;
+
+    block_size = qemu_opt_get_size(opts, "block-size", 0);
+    if (block_size &&
+        (block_size < BLKCACHE_MIN_BLOCK_SIZE ||
+         block_size > BLKCACHE_MAX_BLOCK_SIZE || !is_power_of_2(block_size)))
+    {
+        error_setg(errp, "block-size must be a power of two between %d and "
+                   "%d bytes", BLKCACHE_MIN_BLOCK_SIZE,
+                   BLKCACHE_MAX_BLOCK_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    threshold = qemu_opt_get_number(opts, "writeback-threshold",
+                                    BLKCACHE_DEFAULT_THRESHOLD);
+    if (threshold < 0 || threshold > 100) {
+        error_setg(errp, "writeback-threshold must be between 0 and 100");
+        ret = -EINVAL;
+        goto out;
+    }
+    s->writeback_threshold = threshold;
+
+    /* Open the cache file */
+    assert(bs->file == NULL);
+    ret = bdrv_open_image(&bs->file, qemu_opt_get(opts, "x-cache-file"),
+                          options, "cache-file", bs, &child_file, false,
+                          &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    /* Open the image */
+    assert(s->image == NULL);
+    ret = bdrv_open_image(&s->image, qemu_opt_get(opts, "x-image"), options,
+                          "image", bs, &child_format, false, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail_unref_file;
+    }
+
+    s->read_only = bdrv_is_read_only(bs->file);
+    s->image_size = bdrv_getlength(s->image);
+    if (s->image_size < 0) {
+        ret = s->image_size;
+        error_setg_errno(errp, -ret, "Could not get image size");
+        goto fail;
+    }
+
+    ret = blkcache_read_header(bs, block_size, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (ret == 1) {
+        blkcache_alloc_state(s);
+        ret = blkcache_load_table(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else if (ret == 0 && s->nb_slots) {
+        /* Formatted for another image or block size; the cached data is
+         * useless unless it is dirty */
+        blkcache_alloc_state(s);
+        ret = blkcache_load_table(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        } else if (ret > 0) {
+            error_setg(errp, "Cache file '%s' contains dirty data of another "
+                       "image or for another block size", bs->file->filename);
+            ret = -EBUSY;
+            goto fail;
+        }
+        blkcache_free_state(s);
+        s->nb_slots = 0;
+    }
+
+    if (s->nb_slots == 0) {
+        ret = blkcache_format(bs, block_size ?: BLKCACHE_DEFAULT_BLOCK_SIZE,
+                              errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        blkcache_alloc_state(s);
+        for (i = 0; i < s->nb_slots; i++) {
+            QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], next);
+        }
+    }
+
+    s->arc_target = s->nb_slots / 2;
+    qemu_co_mutex_init(&s->table_lock);
+    QLIST_INIT(&s->bypass);
+
+    /* Writethrough mode expects the image to be up to date */
+    if (s->mode == BLKCACHE_MODE_WRITETHROUGH && !s->read_only &&
+        !hbitmap_empty(s->dirty))
+    {
+        ret = blkcache_run_co(bs, blkcache_writeback_and_sync);
+        if (ret < 0 || !hbitmap_empty(s->dirty)) {
+            error_setg(errp, "Could not write back the dirty blocks of cache "
+                       "file '%s'", bs->file->filename);
+            ret = ret < 0 ? ret : -EIO;
+            goto fail;
+        }
+    }
+
+    ret = 0;
+    goto out;
+
+fail:
+    blkcache_free_state(s);
+    bdrv_unref(s->image);
+    s->image = NULL;
+fail_unref_file:
+    bdrv_unref(bs->file);
+    bs->file = NULL;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void blkcache_close(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+
+    s->closing = true;
+    while (s->writeback_co) {
+        aio_poll(ctx, true);
+    }
+
+    if (!s->read_only) {
+        blkcache_run_co(bs, blkcache_writeback_and_sync);
+    }
+
+    blkcache_free_state(s);
+    bdrv_unref(s->image);
+    s->image = NULL;
+}
+
+static int blkcache_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static int64_t blkcache_getlength(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    return s->image_size;
+}
+
+static BlockStatsSpecific *blkcache_get_specific_stats(
+    const BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .kind  = BLOCK_STATS_SPECIFIC_KIND_BLKCACHE,
+        {
+            .blkcache = g_new(BlockStatsSpecificBlkcache, 1),
+        },
+    };
+    *stats->blkcache = (BlockStatsSpecificBlkcache){
+        .read_hits      = s->stats.read_hits,
+        .read_misses    = s->stats.read_misses,
+        .write_hits     = s->stats.write_hits,
+        .write_misses   = s->stats.write_misses,
+        .evictions      = s->stats.evictions,
+        .writebacks     = s->stats.writebacks,
+        .total_blocks   = s->nb_slots,
+        .cached_blocks  = g_hash_table_size(s->cache),
+        .dirty_blocks   = hbitmap_count(s->dirty),
+    };
+
+    return stats;
+}
+
+static bool blkcache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                 BlockDriverState *candidate)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    return bdrv_recurse_is_first_non_filter(s->image, candidate);
+}
+
+/* Propagate AioContext changes to ->image */
+static void blkcache_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    bdrv_detach_aio_context(s->image);
+}
+
+static void blkcache_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+
+    bdrv_attach_aio_context(s->image, new_context);
+}
+
+static bool blkcache_is_child_option(const char *key)
+{
+    return !strcmp(key, "x-image") || !strcmp(key, "image") ||
+           !strncmp(key, "image.", strlen("image.")) ||
+           !strcmp(key, "x-cache-file") || !strcmp(key, "cache-file") ||
+           !strncmp(key, "cache-file.", strlen("cache-file."));
+}
+
+static void blkcache_refresh_filename(BlockDriverState *bs)
+{
+    BDRVBlkcacheState *s = bs->opaque;
+    QDict *opts;
+    const QDictEntry *e;
+    bool force_json = false;
+
+    /* bs->file has already been refreshed */
+    bdrv_refresh_filename(s->image);
+
+    for (e = qdict_first(bs->options); e; e = qdict_next(bs->options, e)) {
+        if (!blkcache_is_child_option(qdict_entry_key(e))) {
+            force_json = true;
+            break;
+        }
+    }
+
+    if (!force_json && bs->file->exact_filename[0] &&
+        s->image->exact_filename[0])
+    {
+        snprintf(bs->exact_filename, sizeof(bs->exact_filename),
+                 "blkcache:%s:%s",
+                 bs->file->exact_filename, s->image->exact_filename);
+    }
+
+    if (!bs->file->full_open_options || !s->image->full_open_options) {
+        return;
+    }
+
+    opts = qdict_new();
+    qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("blkcache")));
+
+    QINCREF(bs->file->full_open_options);
+    qdict_put_obj(opts, "cache-file", QOBJECT(bs->file->full_open_options));
+    QINCREF(s->image->full_open_options);
+    qdict_put_obj(opts, "image", QOBJECT(s->image->full_open_options));
+
+    for (e = qdict_first(bs->options); e; e = qdict_next(bs->options, e)) {
+        if (!blkcache_is_child_option(qdict_entry_key(e))) {
+            qobject_incref(qdict_entry_value(e));
+            qdict_put_obj(opts, qdict_entry_key(e), qdict_entry_value(e));
+        }
+    }
+
+    bs->full_open_options = opts;
+}
+
+static BlockDriver bdrv_blkcache = {
+    .format_name                      = "blkcache",
+    .protocol_name                    = "blkcache",
+    .instance_size                    = sizeof(BDRVBlkcacheState),
+
+    .bdrv_parse_filename              = blkcache_parse_filename,
+    .bdrv_file_open                   = blkcache_open,
+    .bdrv_close                       = blkcache_close,
+    .bdrv_reopen_prepare              = blkcache_reopen_prepare,
+    .bdrv_getlength                   = blkcache_getlength,
+    .bdrv_refresh_filename            = blkcache_refresh_filename,
+    .bdrv_get_specific_stats          = blkcache_get_specific_stats,
+
+    .bdrv_co_readv                    = blkcache_co_readv,
+    .bdrv_co_writev                   = blkcache_co_writev,
+    .bdrv_co_flush_to_disk            = blkcache_co_flush,
+
+    .bdrv_attach_aio_context          = blkcache_attach_aio_context,
+    .bdrv_detach_aio_context          = blkcache_detach_aio_context,
+
+    .is_filter                        = true,
+    .bdrv_recurse_is_first_non_filter = blkcache_recurse_is_first_non_filter,
+};
+
+static void bdrv_blkcache_init(void)
+{
+    bdrv_register(&bdrv_blkcache);
+}
+
+block_init(bdrv_blkcache_init);
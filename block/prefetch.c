@@ -0,0 +1,899 @@
+/*
+ * Read-ahead and prefetch filter driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The prefetch driver sits on top of another node (typically a backing file on
+ * slow network storage) and reads data ahead of the guest into a bounded
+ * memory cache of PREFETCH_CHUNK_SIZE chunks:
+ *
+ * - Each read is matched against a small table of streams. A stream that was
+ *   continued sequentially or with a constant stride twice in a row gets the
+ *   following readahead-size bytes of its pattern prefetched.
+ *
+ * - If a trace file is given, the extents read during the first trace-time
+ *   seconds after opening are recorded and written to the file on close. If
+ *   the file already exists when the image is opened, its extents are
+ *   prefetched in order in the background, which speeds up the next boot of
+ *   the same guest.
+ *
+ * Reads that are completely covered by the cache (possibly waiting for
+ * prefetches in flight) are served from memory, all others are passed
+ * through. Writes are passed through and invalidate overlapping chunks; a
+ * prefetch that overlapped with any write is thrown away.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "trace.h"
+
+#define PREFETCH_CHUNK_SIZE         (64 * 1024)
+#define PREFETCH_STREAMS            8
+#define PREFETCH_MAX_IN_FLIGHT      16
+#define PREFETCH_MAX_TRACE_EXTENTS  65536
+
+#define PREFETCH_DEFAULT_CACHE_SIZE     (16 * 1024 * 1024)
+#define PREFETCH_DEFAULT_READAHEAD_SIZE (1024 * 1024)
+#define PREFETCH_DEFAULT_TRACE_TIME     60 /* seconds */
+
+typedef struct PrefetchChunk {
+    BlockDriverState *bs;
+    int64_t index;
+    int bytes;
+    uint8_t *buf;
+    bool in_flight;
+    bool used;                  /* read by the guest since it was prefetched */
+    int ref;                    /* cache reference plus waiting readers */
+    CoQueue wait_queue;
+    QTAILQ_ENTRY(PrefetchChunk) next;
+} PrefetchChunk;
+
+typedef struct PrefetchStream {
+    int64_t last_offset;
+    int64_t next_offset;        /* end of the last request */
+    int64_t stride;             /* 0 for a sequential stream */
+    int64_t prefetched_until;
+    int bytes;
+    int hits;
+    uint64_t last_use;
+} PrefetchStream;
+
+typedef struct PrefetchExtent {
+    int64_t offset;
+    int64_t bytes;
+} PrefetchExtent;
+
+typedef struct BDRVPrefetchState {
+    /* Cache, indexed by chunk index; LRU order in chunk_lru */
+    GHashTable *chunks;
+    QTAILQ_HEAD(, PrefetchChunk) chunk_lru;
+    int nb_chunks;
+    int max_chunks;
+    int nb_in_flight;
+    int nb_unused;
+
+    /* Any write that is in flight or completed while a prefetch was in flight
+     * makes its data stale */
+    int writes_in_flight;
+    uint64_t write_gen;
+
+    PrefetchStream streams[PREFETCH_STREAMS];
+    uint64_t stream_clock;
+    int64_t readahead_size;
+
+    /* Boot trace */
+    char *trace_file;
+    GArray *trace;              /* PrefetchExtent recorded in this run */
+    int64_t trace_end_ns;
+    GArray *replay;             /* PrefetchExtent loaded from trace_file */
+    Coroutine *replay_co;
+    CoQueue replay_queue;       /* replay waits here for cache space */
+    bool closing;
+} BDRVPrefetchState;
+
+/* Valid prefetch filenames look like prefetch:path/to/trace:path/to/image */
+static void prefetch_parse_filename(const char *filename, QDict *options,
+                                    Error **errp)
+{
+    const char *c;
+
+    /* Parse the prefetch: prefix */
+    if (!strstart(filename, "prefetch:", &filename)) {
+        /* There was no prefix; therefore, all options have to be already
+           present in the QDict (except for the filename) */
+        qdict_put(options, "x-image", qstring_from_str(filename));
+        return;
+    }
+
+    /* Parse trace file path */
+    c = strchr(filename, ':');
+    if (c == NULL) {
+        error_setg(errp, "prefetch requires both trace file and image path");
+        return;
+    }
+
+    if (c != filename) {
+        QString *trace_path;
+        trace_path = qstring_from_substr(filename, 0, c - filename - 1);
+        qdict_put(options, "trace", trace_path);
+    }
+
+    filename = c + 1;
+    qdict_put(options, "x-image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "prefetch",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = "cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum amount of prefetched data kept in memory",
+        },
+        {
+            .name = "readahead-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Amount of data prefetched ahead of a detected stream",
+        },
+        {
+            .name = "trace",
+            .type = QEMU_OPT_STRING,
+            .help = "File to replay and record the boot access trace",
+        },
+        {
+            .name = "trace-time",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Seconds after opening during which reads are traced",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void prefetch_chunk_unref(PrefetchChunk *chunk)
+{
+    if (--chunk->ref == 0) {
+        qemu_vfree(chunk->buf);
+        g_free(chunk);
+    }
+}
+
+/* Removes a chunk that is not in flight from the cache */
+static void prefetch_drop_chunk(BDRVPrefetchState *s, PrefetchChunk *chunk)
+{
+    assert(!chunk->in_flight);
+
+    if (!chunk->used) {
+        s->nb_unused--;
+    }
+    g_hash_table_remove(s->chunks, &chunk->index);
+    QTAILQ_REMOVE(&s->chunk_lru, chunk, next);
+    s->nb_chunks--;
+    prefetch_chunk_unref(chunk);
+}
+
+/* Evicts the least recently used chunk that no reader is waiting for */
+static bool prefetch_evict_chunk(BDRVPrefetchState *s)
+{
+    PrefetchChunk *chunk;
+
+    QTAILQ_FOREACH(chunk, &s->chunk_lru, next) {
+        if (!chunk->in_flight && chunk->ref == 1) {
+            prefetch_drop_chunk(s, chunk);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void coroutine_fn prefetch_chunk_entry(void *opaque)
+{
+    PrefetchChunk *chunk = opaque;
+    BlockDriverState *bs = chunk->bs;
+    BDRVPrefetchState *s = bs->opaque;
+    uint64_t write_gen = s->write_gen;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = chunk->buf;
+    iov.iov_len = chunk->bytes;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs->file,
+                        chunk->index * (PREFETCH_CHUNK_SIZE / BDRV_SECTOR_SIZE),
+                        chunk->bytes / BDRV_SECTOR_SIZE, &qiov);
+
+    chunk->in_flight = false;
+    s->nb_in_flight--;
+    chunk->used = false;
+    s->nb_unused++;
+
+    if (ret < 0 || write_gen != s->write_gen || s->writes_in_flight) {
+        prefetch_drop_chunk(s, chunk);
+    }
+
+    qemu_co_queue_restart_all(&chunk->wait_queue);
+    qemu_co_queue_restart_all(&s->replay_queue);
+    prefetch_chunk_unref(chunk);
+}
+
+/*
+ * Starts prefetching the chunk with the given index unless it is cached
+ * already. Returns -EAGAIN if the chunk cannot be prefetched right now.
+ */
+static int prefetch_chunk(BlockDriverState *bs, int64_t index)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    PrefetchChunk *chunk;
+    int64_t offset = index * PREFETCH_CHUNK_SIZE;
+    int64_t length = bs->total_sectors * BDRV_SECTOR_SIZE;
+    Coroutine *co;
+
+    if (offset >= length || g_hash_table_lookup(s->chunks, &index)) {
+        return 0;
+    }
+
+    if (s->nb_in_flight >= PREFETCH_MAX_IN_FLIGHT || s->writes_in_flight ||
+        (s->nb_chunks >= s->max_chunks && !prefetch_evict_chunk(s)))
+    {
+        return -EAGAIN;
+    }
+
+    chunk = g_new0(PrefetchChunk, 1);
+    chunk->bs = bs;
+    chunk->index = index;
+    chunk->bytes = MIN(PREFETCH_CHUNK_SIZE, length - offset);
+    chunk->buf = qemu_try_blockalign(bs->file, chunk->bytes);
+    if (chunk->buf == NULL) {
+        g_free(chunk);
+        return -EAGAIN;
+    }
+    chunk->in_flight = true;
+    chunk->used = true;
+    chunk->ref = 2; /* cache and the prefetch coroutine */
+    qemu_co_queue_init(&chunk->wait_queue);
+
+    g_hash_table_insert(s->chunks, &chunk->index, chunk);
+    QTAILQ_INSERT_TAIL(&s->chunk_lru, chunk, next);
+    s->nb_chunks++;
+    s->nb_in_flight++;
+
+    trace_prefetch_chunk(bs, offset, chunk->bytes);
+    co = qemu_coroutine_create(prefetch_chunk_entry);
+    qemu_coroutine_enter(co, chunk);
+    return 0;
+}
+
+/*
+ * Prefetches the chunks covering a byte range as far as possible. Returns the
+ * end of the part that is cached or in flight.
+ */
+static int64_t prefetch_range(BlockDriverState *bs, int64_t offset,
+                              int64_t bytes)
+{
+    int64_t index;
+
+    for (index = offset / PREFETCH_CHUNK_SIZE;
+         index * PREFETCH_CHUNK_SIZE < offset + bytes;
+         index++)
+    {
+        if (prefetch_chunk(bs, index) < 0) {
+            return MAX(offset, index * PREFETCH_CHUNK_SIZE);
+        }
+    }
+    return offset + bytes;
+}
+
+/*
+ * Matches a read against the stream table and prefetches ahead of streams
+ * that have been continued at least twice.
+ */
+static void prefetch_detect_stream(BlockDriverState *bs, int64_t offset,
+                                   int bytes)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    PrefetchStream *stream = NULL, *lru = &s->streams[0];
+    int i;
+
+    for (i = 0; i < PREFETCH_STREAMS; i++) {
+        PrefetchStream *st = &s->streams[i];
+
+        if (st->last_use < lru->last_use) {
+            lru = st;
+        }
+        if (!st->last_use) {
+            continue;
+        }
+
+        if (offset == st->next_offset) {
+            /* sequential */
+            stream = st;
+            stream->hits = stream->stride == 0 ? stream->hits + 1 : 1;
+            stream->stride = 0;
+            break;
+        } else if (st->stride && offset == st->last_offset + st->stride &&
+                   bytes == st->bytes) {
+            /* strided */
+            stream = st;
+            stream->hits++;
+            break;
+        }
+    }
+
+    if (!stream) {
+        /* A read shortly after one of a stream may start a strided pattern;
+         * established sequential streams are kept, though */
+        for (i = 0; i < PREFETCH_STREAMS; i++) {
+            PrefetchStream *st = &s->streams[i];
+            int64_t stride = offset - st->last_offset;
+
+            if (st->last_use && (st->stride || st->hits < 2) &&
+                bytes == st->bytes && stride > st->bytes &&
+                stride <= s->readahead_size) {
+                stream = st;
+                stream->stride = stride;
+                stream->hits = 1;
+                stream->prefetched_until = 0;
+                break;
+            }
+        }
+    }
+
+    if (!stream) {
+        stream = lru;
+        *stream = (PrefetchStream) { .hits = 0 };
+    }
+
+    stream->last_offset = offset;
+    stream->next_offset = offset + bytes;
+    stream->bytes = bytes;
+    stream->last_use = ++s->stream_clock;
+
+    if (stream->hits < 2) {
+        return;
+    }
+
+    trace_prefetch_stream(bs, offset, stream->stride, stream->hits);
+
+    if (stream->stride == 0) {
+        int64_t start = MAX(stream->next_offset, stream->prefetched_until);
+        int64_t end = stream->next_offset + s->readahead_size;
+
+        if (start < end) {
+            stream->prefetched_until = prefetch_range(bs, start, end - start);
+        }
+    } else {
+        int64_t next;
+
+        for (next = offset + stream->stride;
+             next < offset + s->readahead_size;
+             next += stream->stride)
+        {
+            if (next < stream->prefetched_until) {
+                continue;
+            }
+            stream->prefetched_until = prefetch_range(bs, next, bytes);
+            if (stream->prefetched_until < next + bytes) {
+                break;
+            }
+        }
+    }
+}
+
+static void prefetch_record(BDRVPrefetchState *s, int64_t offset, int bytes)
+{
+    PrefetchExtent *last;
+    PrefetchExtent extent = {
+        .offset = offset,
+        .bytes  = bytes,
+    };
+
+    if (!s->trace || qemu_clock_get_ns(QEMU_CLOCK_REALTIME) > s->trace_end_ns) {
+        return;
+    }
+
+    if (s->trace->len > 0) {
+        last = &g_array_index(s->trace, PrefetchExtent, s->trace->len - 1);
+        if (last->offset + last->bytes == offset) {
+            last->bytes += bytes;
+            return;
+        }
+    }
+
+    if (s->trace->len < PREFETCH_MAX_TRACE_EXTENTS) {
+        g_array_append_val(s->trace, extent);
+    }
+}
+
+/*
+ * Copies the request from the cache if all of its chunks are cached. Returns
+ * false if the request must be read from the image.
+ */
+static bool coroutine_fn prefetch_read_cached(BlockDriverState *bs,
+                                              int64_t offset, int bytes,
+                                              QEMUIOVector *qiov)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    int64_t first = offset / PREFETCH_CHUNK_SIZE;
+    int64_t last = (offset + bytes - 1) / PREFETCH_CHUNK_SIZE;
+    PrefetchChunk *chunk;
+    size_t qiov_offset = 0;
+    int64_t index;
+
+again:
+    for (index = first; index <= last; index++) {
+        chunk = g_hash_table_lookup(s->chunks, &index);
+        if (!chunk) {
+            return false;
+        }
+    }
+
+    for (index = first; index <= last; index++) {
+        chunk = g_hash_table_lookup(s->chunks, &index);
+        if (!chunk) {
+            return false;
+        }
+        if (chunk->in_flight) {
+            /* The chunk may be dropped while we wait, so look up all chunks
+             * again afterwards */
+            chunk->ref++;
+            qemu_co_queue_wait(&chunk->wait_queue);
+            prefetch_chunk_unref(chunk);
+            goto again;
+        }
+    }
+
+    /* All chunks are valid now and nothing can drop them before the copy
+     * below is done, because it doesn't yield */
+    for (index = first; index <= last; index++) {
+        int64_t chunk_offset = index * PREFETCH_CHUNK_SIZE;
+        int64_t start = MAX(offset, chunk_offset);
+        int64_t end = MIN(offset + bytes, chunk_offset + PREFETCH_CHUNK_SIZE);
+
+        chunk = g_hash_table_lookup(s->chunks, &index);
+        qemu_iovec_from_buf(qiov, qiov_offset, chunk->buf + start - chunk_offset,
+                            end - start);
+        qiov_offset += end - start;
+
+        if (!chunk->used) {
+            chunk->used = true;
+            s->nb_unused--;
+            qemu_co_queue_restart_all(&s->replay_queue);
+        }
+        QTAILQ_REMOVE(&s->chunk_lru, chunk, next);
+        QTAILQ_INSERT_TAIL(&s->chunk_lru, chunk, next);
+    }
+
+    return true;
+}
+
+static int coroutine_fn prefetch_co_readv(BlockDriverState *bs,
+                                          int64_t sector_num, int nb_sectors,
+                                          QEMUIOVector *qiov)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    int bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    bool hit;
+
+    prefetch_record(s, offset, bytes);
+    prefetch_detect_stream(bs, offset, bytes);
+
+    hit = prefetch_read_cached(bs, offset, bytes, qiov);
+    trace_prefetch_read(bs, offset, bytes, hit);
+    if (hit) {
+        return 0;
+    }
+
+    return bdrv_co_readv(bs->file, sector_num, nb_sectors, qiov);
+}
+
+/*
+ * Drops the cached chunks covering a byte range that is about to be modified.
+ * Chunks in flight are dropped when their prefetch completes.
+ */
+static void prefetch_modify_begin(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    int64_t index;
+
+    s->writes_in_flight++;
+    s->write_gen++;
+
+    for (index = offset / PREFETCH_CHUNK_SIZE;
+         index * PREFETCH_CHUNK_SIZE < offset + bytes;
+         index++)
+    {
+        PrefetchChunk *chunk = g_hash_table_lookup(s->chunks, &index);
+        if (chunk && !chunk->in_flight) {
+            prefetch_drop_chunk(s, chunk);
+        }
+    }
+}
+
+static void prefetch_modify_end(BlockDriverState *bs)
+{
+    BDRVPrefetchState *s = bs->opaque;
+
+    s->write_gen++;
+    s->writes_in_flight--;
+    qemu_co_queue_restart_all(&s->replay_queue);
+}
+
+static int coroutine_fn prefetch_co_writev(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    int ret;
+
+    prefetch_modify_begin(bs, sector_num * BDRV_SECTOR_SIZE,
+                          (int64_t) nb_sectors * BDRV_SECTOR_SIZE);
+    ret = bdrv_co_writev(bs->file, sector_num, nb_sectors, qiov);
+    prefetch_modify_end(bs);
+
+    return ret;
+}
+
+static int coroutine_fn prefetch_co_discard(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors)
+{
+    int ret;
+
+    prefetch_modify_begin(bs, sector_num * BDRV_SECTOR_SIZE,
+                          (int64_t) nb_sectors * BDRV_SECTOR_SIZE);
+    ret = bdrv_co_discard(bs->file, sector_num, nb_sectors);
+    prefetch_modify_end(bs);
+
+    return ret;
+}
+
+static void coroutine_fn prefetch_replay_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVPrefetchState *s = bs->opaque;
+    int i;
+
+    trace_prefetch_replay(bs, s->replay->len);
+
+    for (i = 0; i < s->replay->len && !s->closing; i++) {
+        PrefetchExtent *extent = &g_array_index(s->replay, PrefetchExtent, i);
+        int64_t index;
+
+        for (index = extent->offset / PREFETCH_CHUNK_SIZE;
+             index * PREFETCH_CHUNK_SIZE < extent->offset + extent->bytes;
+             index++)
+        {
+            /* Leave half of the cache for data the guest has already read, so
+             * that the replay can't evict its own chunks before they are
+             * used */
+            while (!s->closing &&
+                   (s->nb_unused >= s->max_chunks / 2 ||
+                    prefetch_chunk(bs, index) < 0))
+            {
+                qemu_co_queue_wait(&s->replay_queue);
+            }
+            if (s->closing) {
+                break;
+            }
+        }
+    }
+
+    s->replay_co = NULL;
+}
+
+static int prefetch_load_trace(BDRVPrefetchState *s, Error **errp)
+{
+    FILE *f;
+    char line[128];
+    int line_nr = 0;
+    int ret = 0;
+
+    f = fopen(s->trace_file, "r");
+    if (f == NULL) {
+        if (errno == ENOENT) {
+            /* No trace yet; it is recorded in this run */
+            return 0;
+        }
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not read prefetch trace '%s'",
+                         s->trace_file);
+        return ret;
+    }
+
+    s->replay = g_array_new(false, false, sizeof(PrefetchExtent));
+
+    while (fgets(line, sizeof(line), f)) {
+        PrefetchExtent extent;
+
+        line_nr++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%" SCNd64 " %" SCNd64, &extent.offset,
+                   &extent.bytes) != 2 ||
+            extent.offset < 0 || extent.bytes <= 0)
+        {
+            error_setg(errp, "Invalid prefetch trace '%s' in line %d",
+                       s->trace_file, line_nr);
+            ret = -EINVAL;
+            break;
+        }
+        if (s->replay->len < PREFETCH_MAX_TRACE_EXTENTS) {
+            g_array_append_val(s->replay, extent);
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
+
+static void prefetch_save_trace(BDRVPrefetchState *s)
+{
+    char *tmp_file;
+    FILE *f;
+    int i;
+
+    if (s->trace->len == 0) {
+        return;
+    }
+
+    /* Replace the old trace only once the new one is complete */
+    tmp_file = g_strdup_printf("%s.tmp", s->trace_file);
+    f = fopen(tmp_file, "w");
+    if (f == NULL) {
+        error_report("Could not write prefetch trace '%s': %s", tmp_file,
+                     strerror(errno));
+        g_free(tmp_file);
+        return;
+    }
+
+    fprintf(f, "# offset length\n");
+    for (i = 0; i < s->trace->len; i++) {
+        PrefetchExtent *extent = &g_array_index(s->trace, PrefetchExtent, i);
+        fprintf(f, "%" PRId64 " %" PRId64 "\n", extent->offset, extent->bytes);
+    }
+
+    if (fclose(f) != 0 || rename(tmp_file, s->trace_file) != 0) {
+        error_report("Could not write prefetch trace '%s': %s",
+                     s->trace_file, strerror(errno));
+        unlink(tmp_file);
+    }
+    g_free(tmp_file);
+}
+
+static int prefetch_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t cache_size;
+    int64_t trace_time;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_size = qemu_opt_get_size(opts, "cache-size",
+                                   PREFETCH_DEFAULT_CACHE_SIZE);
+    s->readahead_size = qemu_opt_get_size(opts, "readahead-size",
+                                          PREFETCH_DEFAULT_READAHEAD_SIZE);
+    trace_time = qemu_opt_get_number(opts, "trace-time",
+                                     PREFETCH_DEFAULT_TRACE_TIME);
+
+    if (cache_size < 2 * PREFETCH_CHUNK_SIZE || cache_size > INT_MAX) {
+        error_setg(errp, "cache-size must be between %d and %d bytes",
+                   2 * PREFETCH_CHUNK_SIZE, INT_MAX);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->readahead_size < 0 || s->readahead_size > cache_size / 2) {
+        error_setg(errp, "readahead-size may not exceed half of cache-size");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (trace_time < 0) {
+        error_setg(errp, "trace-time may not be negative");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->max_chunks = cache_size / PREFETCH_CHUNK_SIZE;
+    s->chunks = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->chunk_lru);
+    qemu_co_queue_init(&s->replay_queue);
+
+    /* Open the image */
+    assert(bs->file == NULL);
+    ret = bdrv_open_image(&bs->file, qemu_opt_get(opts, "x-image"), options,
+                          "image", bs, &child_file, false, &local_err);
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    if (qemu_opt_get(opts, "trace")) {
+        s->trace_file = g_strdup(qemu_opt_get(opts, "trace"));
+        ret = prefetch_load_trace(s, errp);
+        if (ret < 0) {
+            goto fail_unref;
+        }
+
+        s->trace = g_array_new(false, false, sizeof(PrefetchExtent));
+        s->trace_end_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                          trace_time * get_ticks_per_sec();
+    }
+
+    if (s->replay && s->replay->len > 0) {
+        /* bdrv_open() has not set the length yet */
+        ret = bdrv_getlength(bs->file);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not get image size");
+            goto fail_unref;
+        }
+        bs->total_sectors = ret / BDRV_SECTOR_SIZE;
+
+        s->replay_co = qemu_coroutine_create(prefetch_replay_entry);
+        qemu_coroutine_enter(s->replay_co, bs);
+    }
+
+    ret = 0;
+    goto out;
+
+fail_unref:
+    bdrv_unref(bs->file);
+fail:
+    if (s->replay) {
+        g_array_free(s->replay, true);
+    }
+    if (s->trace) {
+        g_array_free(s->trace, true);
+    }
+    g_free(s->trace_file);
+    g_hash_table_destroy(s->chunks);
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void prefetch_close(BlockDriverState *bs)
+{
+    BDRVPrefetchState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    PrefetchChunk *chunk;
+
+    /* Stop the replay and wait for all prefetches */
+    s->closing = true;
+    while (qemu_co_enter_next(&s->replay_queue)) {
+        /* do nothing */
+    }
+    while (s->replay_co || s->nb_in_flight > 0) {
+        aio_poll(ctx, true);
+    }
+
+    while ((chunk = QTAILQ_FIRST(&s->chunk_lru)) != NULL) {
+        prefetch_drop_chunk(s, chunk);
+    }
+    g_hash_table_destroy(s->chunks);
+
+    if (s->trace) {
+        prefetch_save_trace(s);
+        g_array_free(s->trace, true);
+    }
+    if (s->replay) {
+        g_array_free(s->replay, true);
+    }
+    g_free(s->trace_file);
+}
+
+static int prefetch_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static int64_t prefetch_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file);
+}
+
+static int prefetch_truncate(BlockDriverState *bs, int64_t offset)
+{
+    return bdrv_truncate(bs->file, offset);
+}
+
+static void prefetch_refresh_filename(BlockDriverState *bs)
+{
+    QDict *opts;
+    const QDictEntry *e;
+    bool force_json = false;
+
+    for (e = qdict_first(bs->options); e; e = qdict_next(bs->options, e)) {
+        if (strcmp(qdict_entry_key(e), "trace") &&
+            strcmp(qdict_entry_key(e), "x-image") &&
+            strcmp(qdict_entry_key(e), "image") &&
+            strncmp(qdict_entry_key(e), "image.", strlen("image.")))
+        {
+            force_json = true;
+            break;
+        }
+    }
+
+    if (force_json && !bs->file->full_open_options) {
+        return;
+    }
+
+    if (!force_json && bs->file->exact_filename[0]) {
+        snprintf(bs->exact_filename, sizeof(bs->exact_filename),
+                 "prefetch:%s:%s",
+                 qdict_get_try_str(bs->options, "trace") ?: "",
+                 bs->file->exact_filename);
+    }
+
+    if (!bs->file->full_open_options) {
+        return;
+    }
+
+    opts = qdict_new();
+    qdict_put_obj(opts, "driver", QOBJECT(qstring_from_str("prefetch")));
+
+    QINCREF(bs->file->full_open_options);
+    qdict_put_obj(opts, "image", QOBJECT(bs->file->full_open_options));
+
+    for (e = qdict_first(bs->options); e; e = qdict_next(bs->options, e)) {
+        if (strcmp(qdict_entry_key(e), "x-image") &&
+            strcmp(qdict_entry_key(e), "image") &&
+            strncmp(qdict_entry_key(e), "image.", strlen("image.")))
+        {
+            qobject_incref(qdict_entry_value(e));
+            qdict_put_obj(opts, qdict_entry_key(e), qdict_entry_value(e));
+        }
+    }
+
+    bs->full_open_options = opts;
+}
+
+static BlockDriver bdrv_prefetch = {
+    .format_name            = "prefetch",
+    .protocol_name          = "prefetch",
+    .instance_size          = sizeof(BDRVPrefetchState),
+
+    .bdrv_parse_filename    = prefetch_parse_filename,
+    .bdrv_file_open         = prefetch_open,
+    .bdrv_close             = prefetch_close,
+    .bdrv_reopen_prepare    = prefetch_reopen_prepare,
+    .bdrv_getlength         = prefetch_getlength,
+    .bdrv_truncate          = prefetch_truncate,
+    .bdrv_refresh_filename  = prefetch_refresh_filename,
+
+    .bdrv_co_readv          = prefetch_co_readv,
+    .bdrv_co_writev         = prefetch_co_writev,
+    .bdrv_co_discard        = prefetch_co_discard,
+};
+
+static void bdrv_prefetch_init(void)
+{
+    bdrv_register(&bdrv_prefetch);
+}
+
+block_init(bdrv_prefetch_init);
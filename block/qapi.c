@@ -66,6 +66,7 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
     if (bs->io_limits_enabled) {
         ThrottleConfig cfg;
+        ThrottleShare share;
 
         throttle_group_get_config(bs, &cfg);
 
@@ -96,6 +97,16 @@ BlockDeviceInfo *bdrv_block_device_info(BlockDriverState *bs, Error **errp)
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(bs));
+
+        throttle_group_get_share(bs, &share);
+        info->has_scheduler = true;
+        info->scheduler = throttle_group_get_scheduler(bs);
+        info->has_weight = true;
+        info->weight = share.weight;
+        info->has_iops_min = true;
+        info->iops_min = share.iops_min;
+        info->has_burst_credit = true;
+        info->burst_credit = share.burst_credit;
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
@@ -326,7 +337,98 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
-static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
+static intList *bdrv_query_histogram(const uint64_t *buckets, int nb_buckets)
+{
+    intList *head = NULL, **p_next = &head;
+    int i;
+
+    for (i = 0; i < nb_buckets; i++) {
+        intList *entry = g_new0(intList, 1);
+        entry->value = buckets[i];
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return head;
+}
+
+static BlockDeviceStats *bdrv_query_acct_stats(BlockAcctStats *stats)
+{
+    BlockDeviceStats *ds = g_new0(BlockDeviceStats, 1);
+    BlockDeviceHistograms *h;
+    BlockDeviceTimedStatsList **p_next = &ds->timed_stats;
+    int i;
+
+    ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
+    ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
+    ds->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
+    ds->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
+    ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
+    ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
+    ds->wr_highest_offset = stats->wr_highest_sector * BDRV_SECTOR_SIZE;
+    ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
+    ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
+    ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
+    ds->flush_total_time_ns = stats->total_time_ns[BLOCK_ACCT_FLUSH];
+
+    h = ds->histograms = g_new0(BlockDeviceHistograms, 1);
+    h->rd_latency = bdrv_query_histogram(
+        stats->latency_histogram[BLOCK_ACCT_READ], BLOCK_ACCT_LATENCY_BUCKETS);
+    h->wr_latency = bdrv_query_histogram(
+        stats->latency_histogram[BLOCK_ACCT_WRITE], BLOCK_ACCT_LATENCY_BUCKETS);
+    h->flush_latency = bdrv_query_histogram(
+        stats->latency_histogram[BLOCK_ACCT_FLUSH], BLOCK_ACCT_LATENCY_BUCKETS);
+    h->rd_size = bdrv_query_histogram(
+        stats->size_histogram[BLOCK_ACCT_READ], BLOCK_ACCT_SIZE_BUCKETS);
+    h->wr_size = bdrv_query_histogram(
+        stats->size_histogram[BLOCK_ACCT_WRITE], BLOCK_ACCT_SIZE_BUCKETS);
+
+    if (!stats->has_timed_stats) {
+        return ds;
+    }
+
+    ds->has_timed_stats = true;
+    for (i = 0; i < BLOCK_ACCT_INTERVALS; i++) {
+        BlockAcctTimedStats *ts = &stats->timed_stats[i];
+        BlockDeviceTimedStatsList *entry = g_new0(BlockDeviceTimedStatsList, 1);
+        BlockDeviceTimedStats *dev_stats = g_new0(BlockDeviceTimedStats, 1);
+        TimedAverage *rd = &ts->latency[BLOCK_ACCT_READ];
+        TimedAverage *wr = &ts->latency[BLOCK_ACCT_WRITE];
+        TimedAverage *fl = &ts->latency[BLOCK_ACCT_FLUSH];
+        uint64_t rd_sum, wr_sum, rd_elapsed, wr_elapsed;
+
+        dev_stats->interval_length = ts->interval_length;
+
+        dev_stats->min_rd_latency_ns = timed_average_min(rd);
+        dev_stats->max_rd_latency_ns = timed_average_max(rd);
+        dev_stats->avg_rd_latency_ns = timed_average_avg(rd);
+
+        dev_stats->min_wr_latency_ns = timed_average_min(wr);
+        dev_stats->max_wr_latency_ns = timed_average_max(wr);
+        dev_stats->avg_wr_latency_ns = timed_average_avg(wr);
+
+        dev_stats->min_flush_latency_ns = timed_average_min(fl);
+        dev_stats->max_flush_latency_ns = timed_average_max(fl);
+        dev_stats->avg_flush_latency_ns = timed_average_avg(fl);
+
+        /* Little's law: the average number of pending requests is the total
+         * time they spent pending divided by the length of the window */
+        rd_sum = timed_average_sum(rd, &rd_elapsed);
+        wr_sum = timed_average_sum(wr, &wr_elapsed);
+        dev_stats->avg_rd_queue_depth =
+            rd_elapsed ? (double) rd_sum / rd_elapsed : 0;
+        dev_stats->avg_wr_queue_depth =
+            wr_elapsed ? (double) wr_sum / wr_elapsed : 0;
+
+        entry->value = dev_stats;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    return ds;
+}
+
+static BlockStats *bdrv_query_stats(BlockDriverState *bs,
                                     bool query_backing)
 {
     BlockStats *s;
@@ -343,19 +445,31 @@ static BlockStats *bdrv_query_stats(const BlockDriverState *bs,
         s->node_name = g_strdup(bdrv_get_node_name(bs));
     }
 
-    s->stats = g_malloc0(sizeof(*s->stats));
-    s->stats->rd_bytes = bs->stats.nr_bytes[BLOCK_ACCT_READ];
-    s->stats->wr_bytes = bs->stats.nr_bytes[BLOCK_ACCT_WRITE];
-    s->stats->rd_operations = bs->stats.nr_ops[BLOCK_ACCT_READ];
-    s->stats->wr_operations = bs->stats.nr_ops[BLOCK_ACCT_WRITE];
-    s->stats->rd_merged = bs->stats.merged[BLOCK_ACCT_READ];
-    s->stats->wr_merged = bs->stats.merged[BLOCK_ACCT_WRITE];
-    s->stats->wr_highest_offset =
-        bs->stats.wr_highest_sector * BDRV_SECTOR_SIZE;
-    s->stats->flush_operations = bs->stats.nr_ops[BLOCK_ACCT_FLUSH];
-    s->stats->wr_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_WRITE];
-    s->stats->rd_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_READ];
-    s->stats->flush_total_time_ns = bs->stats.total_time_ns[BLOCK_ACCT_FLUSH];
+    s->stats = bdrv_query_acct_stats(&bs->stats);
+
+    if (bs->stats.group) {
+        s->has_throttle_group_stats = true;
+        s->throttle_group_stats = bdrv_query_acct_stats(bs->stats.group);
+    }
+
+    if (bs->io_limits_enabled) {
+        ThrottleWaitStats wait;
+        BlockThrottleWaitStats *ws = g_new0(BlockThrottleWaitStats, 1);
+
+        throttle_group_get_wait_stats(bs, &wait);
+        ws->rd_throttled     = wait.throttled[0];
+        ws->wr_throttled     = wait.throttled[1];
+        ws->rd_total_wait_ns = wait.total_wait_ns[0];
+        ws->wr_total_wait_ns = wait.total_wait_ns[1];
+        ws->rd_max_wait_ns   = wait.max_wait_ns[0];
+        ws->wr_max_wait_ns   = wait.max_wait_ns[1];
+
+        s->has_throttle_wait_stats = true;
+        s->throttle_wait_stats = ws;
+    }
+
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
 
     if (bs->file) {
         s->has_parent = true;
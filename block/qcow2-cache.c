@@ -39,6 +39,7 @@ struct Qcow2Cache {
     struct Qcow2Cache      *depends;
     int                     size;
     bool                    depends_on_flush;
+    bool                    depends_on_journal;
     void                   *table_array;
     uint64_t                lru_counter;
 };
@@ -136,6 +137,17 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         return ret;
     }
 
+    /* Refcount blocks may only be written once the journal describes them */
+    if (c->depends_on_journal ||
+        (c == s->refcount_block_cache && s->refcount_journal))
+    {
+        ret = qcow2_journal_flush(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        c->depends_on_journal = false;
+    }
+
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
                 c->entries[i].offset, s->cluster_size);
@@ -197,8 +209,36 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
+    BDRVQcowState *s = bs->opaque;
     int ret;
 
+    /* With a refcount journal, L2 tables don't need to wait for the refcount
+     * blocks, but only for the journal entries of the new refcounts; refcount
+     * decreases in turn must not be journalled before the L2 tables are
+     * stable. Resolve the opposite dependency first to avoid a cycle. */
+    if (s->refcount_journal && qcow2_need_accurate_refcounts(s)) {
+        if (dependency == s->refcount_block_cache) {
+            if (qcow2_journal_has_l2_dependency(bs)) {
+                ret = qcow2_journal_flush(bs);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            c->depends_on_journal = true;
+        } else {
+            assert(c == s->refcount_block_cache);
+            if (dependency->depends_on_journal) {
+                ret = qcow2_journal_flush(bs);
+                if (ret < 0) {
+                    return ret;
+                }
+                dependency->depends_on_journal = false;
+            }
+            qcow2_journal_depends_on_l2(bs);
+        }
+        return 0;
+    }
+
     if (dependency->depends) {
         ret = qcow2_cache_flush_dependency(bs, dependency);
         if (ret < 0) {
@@ -330,6 +370,32 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/*
+ * Like qcow2_cache_get(), but only returns tables that are already cached and
+ * never yields. Returns -ENOENT on a cache miss; the caller must then fall
+ * back to qcow2_cache_get() with s->lock held.
+ */
+int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, lookup_index;
+
+    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
+    do {
+        if (c->entries[i].offset == offset) {
+            c->entries[i].ref++;
+            *table = qcow2_cache_get_table_addr(bs, c, i);
+            return 0;
+        }
+        if (++i == c->size) {
+            i = 0;
+        }
+    } while (i != lookup_index);
+
+    return -ENOENT;
+}
+
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(bs, c, *table);
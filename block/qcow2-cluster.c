@@ -22,8 +22,6 @@
  * THE SOFTWARE.
  */
 
-#include <zlib.h>
-
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "block/qcow2.h"
@@ -221,7 +219,13 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    /* The L1 entry may only be written once the refcount is stable; with a
+     * refcount journal, it is enough for the journal entry to be stable */
+    if (s->refcount_journal) {
+        ret = qcow2_journal_flush(bs);
+    } else {
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -439,9 +443,13 @@ out:
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
+ *
+ * If nowait is true, the lookup never yields: it returns -EAGAIN instead of
+ * loading the L2 table from disk or reporting a corruption, and the caller
+ * must retry with s->lock held.
  */
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int *num, uint64_t *cluster_offset)
+static int get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool nowait)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l2_index;
@@ -487,6 +495,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     }
 
     if (offset_into_cluster(s, l2_offset)) {
+        if (nowait) {
+            return -EAGAIN;
+        }
         qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#" PRIx64
                                 " unaligned (L1 index: %#" PRIx64 ")",
                                 l2_offset, l1_index);
@@ -495,9 +506,17 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 table in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
-    if (ret < 0) {
-        return ret;
+    if (nowait) {
+        ret = qcow2_cache_lookup(bs, s->l2_table_cache, l2_offset,
+                                 (void **) &l2_table);
+        if (ret < 0) {
+            return -EAGAIN;
+        }
+    } else {
+        ret = l2_load(bs, l2_offset, &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* find the cluster offset for the given disk offset */
@@ -515,6 +534,10 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         break;
     case QCOW2_CLUSTER_ZERO:
         if (s->qcow_version < 3) {
+            if (nowait) {
+                ret = -EAGAIN;
+                goto fail;
+            }
             qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
                                     " in pre-v3 image (L2 offset: %#" PRIx64
                                     ", L2 index: %#x)", l2_offset, l2_index);
@@ -536,6 +559,10 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                 &l2_table[l2_index], QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
+            if (nowait) {
+                ret = -EAGAIN;
+                goto fail;
+            }
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
                                     PRIx64 " unaligned (L2 offset: %#" PRIx64
                                     ", L2 index: %#x)", *cluster_offset,
@@ -565,6 +592,23 @@ fail:
     return ret;
 }
 
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, false);
+}
+
+/*
+ * Same as qcow2_get_cluster_offset(), but can be called without s->lock:
+ * it only succeeds if the L2 table is cached and returns -EAGAIN otherwise.
+ * Because it doesn't yield, it can't observe a half-done metadata update.
+ */
+int qcow2_get_cluster_offset_nowait(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, true);
+}
+
 /*
  * get_cluster_table
  *
@@ -797,6 +841,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
         for (i = 0; i < j; i++) {
             qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
                                     QCOW2_DISCARD_NEVER);
+            qcow2_dedup_unshare(bs, be64_to_cpu(old_cluster[i]));
         }
     }
 
@@ -1015,6 +1060,77 @@ out:
     return ret;
 }
 
+/*
+ * Checks without s->lock whether the request at offset can be written in
+ * place: the L2 table must be cached, the clusters must be allocated with
+ * QCOW_OFLAG_COPIED set and no allocation may be in flight for them. Never
+ * yields.
+ *
+ * Returns 1 and sets *host_offset to the start of the first cluster and *num
+ * (in sectors, possibly reduced) on success. Returns 0 if the caller has to take the allocating path.
+ */
+int qcow2_get_copied_offset_nowait(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *old_alloc;
+    uint64_t l1_index, l2_offset, l2_entry, *l2_table;
+    unsigned int l2_index, nb_clusters, keep_clusters;
+    uint64_t bytes = (uint64_t) *num << BDRV_SECTOR_BITS;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index];
+    if (!(l2_offset & QCOW_OFLAG_COPIED)) {
+        return 0;
+    }
+    l2_offset &= L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return 0;
+    }
+
+    if (qcow2_cache_lookup(bs, s->l2_table_cache, l2_offset,
+                           (void **) &l2_table) < 0) {
+        return 0;
+    }
+
+    l2_index = offset_to_l2_index(s, offset);
+    nb_clusters = size_to_clusters(s, offset_into_cluster(s, offset) + bytes);
+    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+
+    l2_entry = be64_to_cpu(l2_table[l2_index]);
+    if (qcow2_get_cluster_type(l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        !(l2_entry & QCOW_OFLAG_COPIED) ||
+        offset_into_cluster(s, l2_entry & L2E_OFFSET_MASK)) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        return 0;
+    }
+
+    keep_clusters = count_contiguous_clusters(nb_clusters, s->cluster_size,
+                                              &l2_table[l2_index],
+                                              QCOW_OFLAG_COPIED |
+                                              QCOW_OFLAG_ZERO);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    bytes = MIN(bytes, keep_clusters * s->cluster_size
+                       - offset_into_cluster(s, offset));
+
+    /* COW for a running allocation may still cover these clusters */
+    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
+        if (offset < l2meta_cow_end(old_alloc) &&
+            offset + bytes > l2meta_cow_start(old_alloc)) {
+            return 0;
+        }
+    }
+
+    *host_offset = l2_entry & L2E_OFFSET_MASK;
+    *num = bytes >> BDRV_SECTOR_BITS;
+    return 1;
+}
+
 /*
  * Allocates new clusters for the given guest_offset.
  *
@@ -1044,7 +1160,10 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == 0) {
+    if (s->alloc_extent_size) {
+        return qcow2_alloc_clusters_extent(bs, guest_offset, host_offset,
+                                           nb_clusters);
+    } else if (*host_offset == 0) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
@@ -1342,33 +1461,6 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1385,8 +1477,9 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
+        if (qcow2_decompress_buffer(bs, s->cluster_cache, s->cluster_size,
+                                    s->cluster_data + sector_offset,
+                                    csize) < 0) {
             return -EIO;
         }
         s->cluster_cache_offset = coffset;
@@ -1465,6 +1558,7 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
+        qcow2_dedup_unshare(bs, old_l2_entry);
     }
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
@@ -1589,6 +1683,79 @@ fail:
     return ret;
 }
 
+/*
+ * Sets or clears QCOW_OFLAG_COPIED in the L2 entry for @guest_offset, which
+ * must refer to a normal data cluster.
+ */
+int qcow2_set_copied_flag(BlockDriverState *bs, uint64_t guest_offset,
+                          bool copied)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t l2_entry;
+    int l2_index;
+    int ret;
+
+    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = be64_to_cpu(l2_table[l2_index]);
+    assert(qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_NORMAL);
+
+    if (copied) {
+        l2_entry |= QCOW_OFLAG_COPIED;
+    } else {
+        l2_entry &= ~QCOW_OFLAG_COPIED;
+    }
+
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    l2_table[l2_index] = cpu_to_be64(l2_entry);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    return 0;
+}
+
+/*
+ * Points the L2 entry for @guest_offset to the data cluster at @host_offset,
+ * which is shared with other guest clusters and whose refcount the caller has
+ * already increased. The cluster previously referenced by the entry is freed.
+ */
+int qcow2_link_shared_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                              uint64_t host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t old_entry;
+    int l2_index;
+    int ret;
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    old_entry = be64_to_cpu(l2_table[l2_index]);
+
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    l2_table[l2_index] = cpu_to_be64(host_offset);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    qcow2_free_any_clusters(bs, old_entry, 1, QCOW2_DISCARD_NEVER);
+    qcow2_dedup_unshare(bs, old_entry);
+
+    return 0;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
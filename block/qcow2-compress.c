@@ -0,0 +1,318 @@
+/*
+ * Compressed clusters for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Each cluster is compressed independently of all others, so the clusters of
+ * one compressed write are handed to the thread pool of the image's
+ * AioContext and compressed in parallel. Only allocating the compressed
+ * clusters and writing them out is done sequentially by the caller.
+ *
+ * The compression type is a property of the whole image. zlib (raw deflate
+ * with a 4k window) is the default; images using a different type carry a
+ * header extension and QCOW2_INCOMPAT_COMPRESSION.
+ */
+
+#include <zlib.h>
+#ifdef CONFIG_LZO
+#include <lzo/lzo1x.h>
+#endif
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "block/thread-pool.h"
+#include "block/coroutine.h"
+
+typedef struct Qcow2CompressBatch {
+    int in_flight;
+    Coroutine *co;
+} Qcow2CompressBatch;
+
+typedef struct Qcow2CompressJob {
+    Qcow2CompressBatch *batch;
+    int type;
+    int cluster_size;
+    const uint8_t *in_buf;
+    uint8_t *out_buf;
+    int out_len;
+} Qcow2CompressJob;
+
+static const char *compression_type_names[] = {
+    [QCOW2_COMPRESSION_TYPE_ZLIB] = "zlib",
+    [QCOW2_COMPRESSION_TYPE_LZO]  = "lzo",
+};
+
+int qcow2_compression_type_from_str(const char *str)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(compression_type_names); i++) {
+        if (!strcmp(str, compression_type_names[i])) {
+            return i;
+        }
+    }
+    return -EINVAL;
+}
+
+/*
+ * Checks that this build can read and write clusters of the given compression
+ * type and initialises the library for it.
+ */
+int qcow2_compression_init(int type, Error **errp)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return 0;
+
+    case QCOW2_COMPRESSION_TYPE_LZO:
+#ifdef CONFIG_LZO
+        if (lzo_init() != LZO_E_OK) {
+            error_setg(errp, "Could not initialise lzo");
+            return -EIO;
+        }
+        return 0;
+#else
+        error_setg(errp, "Compression type 'lzo' is not supported by this "
+                   "build");
+        return -ENOTSUP;
+#endif
+
+    default:
+        error_setg(errp, "Unknown compression type %d", type);
+        return -ENOTSUP;
+    }
+}
+
+/*
+ * Compresses one cluster into out_buf, which has space for cluster_size bytes.
+ * Returns the compressed size, 0 if the data does not become smaller than a
+ * cluster, or -errno.
+ */
+static int compress_buffer(int type, uint8_t *out_buf, const uint8_t *buf,
+                           int cluster_size)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+    {
+        z_stream strm;
+        int ret, out_len;
+
+        /* best compression, small window, no zlib header */
+        memset(&strm, 0, sizeof(strm));
+        ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                           Z_DEFLATED, -12,
+                           9, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            return -EINVAL;
+        }
+
+        strm.avail_in = cluster_size;
+        strm.next_in = (uint8_t *)buf;
+        strm.avail_out = cluster_size;
+        strm.next_out = out_buf;
+
+        ret = deflate(&strm, Z_FINISH);
+        out_len = strm.next_out - out_buf;
+        deflateEnd(&strm);
+
+        if (ret != Z_STREAM_END && ret != Z_OK) {
+            return -EINVAL;
+        }
+        if (ret != Z_STREAM_END || out_len >= cluster_size) {
+            return 0;
+        }
+        return out_len;
+    }
+
+#ifdef CONFIG_LZO
+    case QCOW2_COMPRESSION_TYPE_LZO:
+    {
+        /* lzo has no output limit, so compress into a buffer large enough for
+         * incompressible data (see the LZO FAQ) */
+        size_t tmp_size = cluster_size + cluster_size / 16 + 64 + 3;
+        uint8_t *tmp_buf = g_malloc(tmp_size);
+        uint8_t *wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+        lzo_uint out_len = 0;
+        int ret;
+
+        ret = lzo1x_1_compress(buf, cluster_size, tmp_buf, &out_len, wrkmem);
+        if (ret != LZO_E_OK) {
+            ret = -EINVAL;
+        } else if (out_len >= cluster_size) {
+            ret = 0;
+        } else {
+            memcpy(out_buf, tmp_buf, out_len);
+            ret = out_len;
+        }
+
+        g_free(wrkmem);
+        g_free(tmp_buf);
+        return ret;
+    }
+#endif
+
+    default:
+        return -ENOTSUP;
+    }
+}
+
+static int compress_worker(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    int ret;
+
+    ret = compress_buffer(job->type, job->out_buf, job->in_buf,
+                          job->cluster_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    job->out_len = ret;
+    return 0;
+}
+
+static void compress_complete(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+    Qcow2CompressBatch *batch = job->batch;
+
+    if (ret < 0) {
+        job->out_len = ret;
+    }
+
+    if (--batch->in_flight == 0 && batch->co) {
+        qemu_coroutine_enter(batch->co, NULL);
+    }
+}
+
+/*
+ * Compresses nb_clusters consecutive clusters from buf. The compressed data of
+ * cluster i is stored at out_buf + i * cluster_size and its length in
+ * out_lens[i]; a length of 0 means that the cluster must be written
+ * uncompressed.
+ *
+ * All clusters are compressed in parallel in the thread pool. This function
+ * waits for them to complete, either by yielding if it runs in a coroutine or
+ * by running the AioContext otherwise.
+ */
+int qcow2_compress_clusters(BlockDriverState *bs, const uint8_t *buf,
+                            int nb_clusters, uint8_t *out_buf, int *out_lens)
+{
+    BDRVQcowState *s = bs->opaque;
+    AioContext *ctx = bdrv_get_aio_context(bs);
+    ThreadPool *pool = aio_get_thread_pool(ctx);
+    Qcow2CompressBatch batch = {
+        .in_flight = nb_clusters,
+        .co = qemu_in_coroutine() ? qemu_coroutine_self() : NULL,
+    };
+    Qcow2CompressJob *jobs;
+    int i, ret;
+
+    jobs = g_new(Qcow2CompressJob, nb_clusters);
+    for (i = 0; i < nb_clusters; i++) {
+        jobs[i] = (Qcow2CompressJob) {
+            .batch          = &batch,
+            .type           = s->compression_type,
+            .cluster_size   = s->cluster_size,
+            .in_buf         = buf + (size_t)i * s->cluster_size,
+            .out_buf        = out_buf + (size_t)i * s->cluster_size,
+        };
+        thread_pool_submit_aio(pool, compress_worker, &jobs[i],
+                               compress_complete, &jobs[i]);
+    }
+
+    while (batch.in_flight > 0) {
+        if (batch.co) {
+            qemu_coroutine_yield();
+        } else {
+            aio_poll(ctx, true);
+        }
+    }
+
+    ret = 0;
+    for (i = 0; i < nb_clusters; i++) {
+        if (jobs[i].out_len < 0) {
+            ret = jobs[i].out_len;
+        }
+        out_lens[i] = MAX(jobs[i].out_len, 0);
+    }
+
+    g_free(jobs);
+    return ret;
+}
+
+/*
+ * Decompresses a compressed cluster. buf may extend beyond the end of the
+ * compressed data because compressed clusters are read in whole sectors.
+ */
+int qcow2_decompress_buffer(BlockDriverState *bs, uint8_t *out_buf,
+                            int out_buf_size, const uint8_t *buf,
+                            int buf_size)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+    {
+        z_stream strm1, *strm = &strm1;
+        int ret, out_len;
+
+        memset(strm, 0, sizeof(*strm));
+
+        strm->next_in = (uint8_t *)buf;
+        strm->avail_in = buf_size;
+        strm->next_out = out_buf;
+        strm->avail_out = out_buf_size;
+
+        ret = inflateInit2(strm, -12);
+        if (ret != Z_OK) {
+            return -1;
+        }
+        ret = inflate(strm, Z_FINISH);
+        out_len = strm->next_out - out_buf;
+        if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+            out_len != out_buf_size) {
+            inflateEnd(strm);
+            return -1;
+        }
+        inflateEnd(strm);
+        return 0;
+    }
+
+#ifdef CONFIG_LZO
+    case QCOW2_COMPRESSION_TYPE_LZO:
+    {
+        lzo_uint out_len = out_buf_size;
+        int ret;
+
+        ret = lzo1x_decompress_safe(buf, buf_size, out_buf, &out_len, NULL);
+        if ((ret != LZO_E_OK && ret != LZO_E_INPUT_NOT_CONSUMED) ||
+            out_len != out_buf_size) {
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    default:
+        return -1;
+    }
+}
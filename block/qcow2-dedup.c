@@ -0,0 +1,656 @@
+/*
+ * Content based deduplication for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Guest writes that cover a whole cluster are looked up by a hash of their
+ * content in the deduplication index. The index remembers, for each hash, the
+ * host cluster that the content was written to and the guest cluster it was
+ * written through. If that guest cluster still refers to the host cluster and
+ * the host cluster still has the same content, the new guest cluster is
+ * pointed to it and its refcount is increased instead of writing the data.
+ * Shared clusters don't have QCOW_OFLAG_COPIED, so a later write to any of
+ * the guest clusters copies them like a cluster shared with a snapshot. When
+ * only one reference is left, qcow2_dedup_unshare() sets the flag again.
+ *
+ * The index is only a hint. It is not updated when clusters are overwritten
+ * or freed, so every entry is checked against the L2 table and the cluster
+ * content before it is used, and it needs no ordering against other metadata
+ * updates. Its clusters are cached in a Qcow2Cache like L2 tables and refcount
+ * blocks.
+ *
+ * QCOW2_AUTOCLEAR_DEDUP says that the clusters named by the header extension
+ * still belong to the index. Versions that don't know the feature clear the
+ * bit when they write to the image; the index is then recreated empty.
+ */
+
+#include "block/block_int.h"
+#include "qemu-common.h"
+#include "block/qcow2.h"
+#include "trace.h"
+
+static size_t dedup_bucket_size(void)
+{
+    return QCOW2_DEDUP_BUCKET_ENTRIES * sizeof(Qcow2DedupEntry);
+}
+
+static int dedup_get_bucket(BlockDriverState *bs, const uint8_t *hash,
+                            void **table, Qcow2DedupEntry **bucket)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t nb_buckets = s->dedup_index_size / dedup_bucket_size();
+    uint64_t offset;
+    int ret;
+
+    offset = s->dedup_index_offset +
+             (ldq_be_p(hash) % nb_buckets) * dedup_bucket_size();
+
+    ret = qcow2_cache_get(bs, s->dedup_index_cache,
+                          start_of_cluster(s, offset), table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *bucket = (Qcow2DedupEntry *)((uint8_t *)*table +
+                                  offset_into_cluster(s, offset));
+    return 0;
+}
+
+static int dedup_remove(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DedupEntry *bucket;
+    void *table;
+    int i, ret;
+
+    ret = dedup_get_bucket(bs, hash, &table, &bucket);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < QCOW2_DEDUP_BUCKET_ENTRIES; i++) {
+        if (be64_to_cpu(bucket[i].host_offset) == host_offset &&
+            !memcmp(bucket[i].hash, hash, QCOW2_DEDUP_HASH_SIZE))
+        {
+            qcow2_cache_entry_mark_dirty(bs, s->dedup_index_cache, table);
+            memset(&bucket[i], 0, sizeof(bucket[i]));
+        }
+    }
+
+    qcow2_cache_put(bs, s->dedup_index_cache, &table);
+    return 0;
+}
+
+static bool dedup_alloc_in_flight(BDRVQcowState *s, uint64_t guest_offset)
+{
+    QCowL2Meta *m;
+
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (guest_offset < l2meta_cow_end(m) &&
+            guest_offset + s->cluster_size > l2meta_cow_start(m))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Reads the cluster at @host_offset and compares it with @buf. Returns 1 if
+ * the content is the same, 0 if it differs and -errno on failure.
+ */
+static int dedup_compare(BlockDriverState *bs, uint64_t host_offset,
+                         const uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t *cluster;
+    int ret;
+
+    cluster = qemu_try_blockalign(bs->file, s->cluster_size);
+    if (cluster == NULL) {
+        return -ENOMEM;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+    ret = bdrv_pread(bs->file, host_offset, cluster, s->cluster_size);
+    if (ret >= 0) {
+        ret = !memcmp(cluster, buf, s->cluster_size);
+    }
+
+    qemu_vfree(cluster);
+    return ret;
+}
+
+/*
+ * Makes @guest_offset refer to @host_offset, which holds the content of @buf
+ * if it is still the data cluster of @orig_offset. Returns 1 on success, 0 if
+ * the index entry turned out to be stale and -errno on failure.
+ */
+static int coroutine_fn dedup_share(BlockDriverState *bs, uint64_t guest_offset,
+                                    uint64_t host_offset, uint64_t orig_offset,
+                                    const uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t refcount, mapped;
+    bool cleared_copied = false;
+    int num, ret;
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    }
+    if (refcount == 0 || refcount >= s->refcount_max) {
+        return 0;
+    }
+
+    /* A cluster that was freed may have been reused for anything, including
+     * metadata, so only share data clusters of the guest cluster that wrote
+     * them */
+    num = s->cluster_sectors;
+    ret = qcow2_get_cluster_offset(bs, orig_offset, &num, &mapped);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != QCOW2_CLUSTER_NORMAL || mapped != host_offset) {
+        return 0;
+    }
+
+    /* Rewriting the same data in place */
+    num = s->cluster_sectors;
+    ret = qcow2_get_cluster_offset(bs, guest_offset, &num, &mapped);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret == QCOW2_CLUSTER_NORMAL && mapped == host_offset) {
+        return dedup_compare(bs, host_offset, buf);
+    }
+
+    /* Stop in-place writes to the cluster before it becomes shared */
+    if (refcount == 1) {
+        ret = qcow2_set_copied_flag(bs, orig_offset, false);
+        if (ret < 0) {
+            return ret;
+        }
+        cleared_copied = true;
+    }
+
+    /* Writes that were started before, either to this cluster or to the one
+     * that guest_offset refers to and that is freed below, must be complete
+     * before the content is compared and the mapping changes */
+    qcow2_drain_data_writes(bs);
+
+    ret = dedup_compare(bs, host_offset, buf);
+    if (ret <= 0) {
+        goto fail;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* orig_offset must not be written in place after a crash once guest_offset
+     * refers to its cluster as well */
+    if (cleared_copied) {
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret < 0) {
+            goto fail_refcount;
+        }
+    }
+
+    ret = qcow2_link_shared_cluster(bs, guest_offset, host_offset);
+    if (ret < 0) {
+        goto fail_refcount;
+    }
+
+    trace_qcow2_dedup_share(qemu_coroutine_self(), guest_offset, host_offset,
+                            refcount + 1);
+    return 1;
+
+fail_refcount:
+    qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                  1, true, QCOW2_DISCARD_NEVER);
+fail:
+    if (cleared_copied) {
+        qcow2_set_copied_flag(bs, orig_offset, true);
+    }
+    return ret;
+}
+
+void qcow2_dedup_hash(BlockDriverState *bs, const uint8_t *buf, uint8_t *hash)
+{
+    BDRVQcowState *s = bs->opaque;
+    GChecksum *checksum;
+    uint8_t digest[32];
+    gsize len = sizeof(digest);
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, buf, s->cluster_size);
+    g_checksum_get_digest(checksum, digest, &len);
+    g_checksum_free(checksum);
+
+    memcpy(hash, digest, QCOW2_DEDUP_HASH_SIZE);
+}
+
+/*
+ * Tries to point the cluster at @guest_offset to an existing host cluster
+ * with the content @buf, whose hash is @hash. Must be called with s->lock
+ * held.
+ *
+ * Returns 1 if the guest cluster refers to a cluster with the content now and
+ * nothing needs to be written, 0 if the data must be written normally and
+ * -errno on failure.
+ */
+int coroutine_fn qcow2_dedup_lookup(BlockDriverState *bs, uint64_t guest_offset,
+                                    const uint8_t *buf, const uint8_t *hash)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DedupEntry *bucket;
+    uint64_t host_offset = 0, orig_offset = 0;
+    void *table;
+    int i, ret;
+
+    assert(!offset_into_cluster(s, guest_offset));
+
+    /* Leave guest clusters with allocations in flight to the normal write
+     * path, which knows how to wait for them */
+    if (dedup_alloc_in_flight(s, guest_offset)) {
+        return 0;
+    }
+
+    ret = dedup_get_bucket(bs, hash, &table, &bucket);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < QCOW2_DEDUP_BUCKET_ENTRIES; i++) {
+        if (bucket[i].host_offset &&
+            !memcmp(bucket[i].hash, hash, QCOW2_DEDUP_HASH_SIZE))
+        {
+            host_offset = be64_to_cpu(bucket[i].host_offset);
+            orig_offset = be64_to_cpu(bucket[i].guest_offset);
+            break;
+        }
+    }
+
+    qcow2_cache_put(bs, s->dedup_index_cache, &table);
+
+    if (!host_offset) {
+        return 0;
+    }
+
+    if (offset_into_cluster(s, host_offset) ||
+        offset_into_cluster(s, orig_offset))
+    {
+        ret = 0;
+    } else {
+        ret = dedup_share(bs, guest_offset, host_offset, orig_offset, buf);
+    }
+
+    if (ret == 0) {
+        ret = dedup_remove(bs, hash, host_offset);
+    }
+    return ret;
+}
+
+/*
+ * Sets QCOW_OFLAG_COPIED on the L2 entry in the active L1 table that refers to
+ * the data cluster at @host_offset. Returns 1 if there is such an entry, 0 if
+ * there is none and -errno on failure.
+ */
+static int dedup_set_copied(BlockDriverState *bs, uint64_t host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *l2_table;
+    int i, j, ret;
+
+    for (i = 0; i < s->l1_size; i++) {
+        uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+
+        if (!l2_offset) {
+            continue;
+        }
+
+        ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
+                              (void **) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (j = 0; j < s->l2_size; j++) {
+            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+
+            if (qcow2_get_cluster_type(l2_entry) == QCOW2_CLUSTER_NORMAL &&
+                (l2_entry & L2E_OFFSET_MASK) == host_offset)
+            {
+                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+                l2_table[j] = cpu_to_be64(l2_entry | QCOW_OFLAG_COPIED);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                return 1;
+            }
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    }
+
+    return 0;
+}
+
+/*
+ * Called after a reference to a data cluster through the L2 entry @l2_entry
+ * has been dropped. If the cluster was shared and only one reference is left,
+ * that reference gets QCOW_OFLAG_COPIED again so that the cluster is written
+ * in place, and the index entry for the cluster is removed. Must be called
+ * with s->lock held.
+ *
+ * With snapshots, the remaining reference may be a snapshot's; deleting the
+ * snapshot sets the flag in the active L1 table again where appropriate, so
+ * such clusters are left alone here.
+ */
+void qcow2_dedup_unshare(BlockDriverState *bs, uint64_t l2_entry)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t host_offset = l2_entry & L2E_OFFSET_MASK;
+    uint64_t refcount, orig_offset = 0, mapped;
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    Qcow2DedupEntry *bucket;
+    uint8_t *cluster;
+    void *table;
+    int i, num, ret;
+
+    if (s->dedup_index_cache == NULL || s->nb_snapshots ||
+        qcow2_get_cluster_type(l2_entry) != QCOW2_CLUSTER_NORMAL ||
+        (l2_entry & QCOW_OFLAG_COPIED) || !host_offset)
+    {
+        return;
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0 || refcount != 1) {
+        return;
+    }
+
+    /* The index usually names the remaining reference: unless it was
+     * overwritten first, that is the guest cluster that wrote the data */
+    cluster = qemu_try_blockalign(bs->file, s->cluster_size);
+    if (cluster == NULL) {
+        return;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+    ret = bdrv_pread(bs->file, host_offset, cluster, s->cluster_size);
+    if (ret >= 0) {
+        qcow2_dedup_hash(bs, cluster, hash);
+    }
+    qemu_vfree(cluster);
+    if (ret < 0) {
+        return;
+    }
+
+    ret = dedup_get_bucket(bs, hash, &table, &bucket);
+    if (ret < 0) {
+        return;
+    }
+
+    for (i = 0; i < QCOW2_DEDUP_BUCKET_ENTRIES; i++) {
+        if (be64_to_cpu(bucket[i].host_offset) == host_offset &&
+            !memcmp(bucket[i].hash, hash, QCOW2_DEDUP_HASH_SIZE))
+        {
+            orig_offset = be64_to_cpu(bucket[i].guest_offset);
+            break;
+        }
+    }
+
+    qcow2_cache_put(bs, s->dedup_index_cache, &table);
+
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    ret = -ENOENT;
+    if (i < QCOW2_DEDUP_BUCKET_ENTRIES &&
+        !offset_into_cluster(s, orig_offset))
+    {
+        num = s->cluster_sectors;
+        ret = qcow2_get_cluster_offset(bs, orig_offset, &num, &mapped);
+    }
+
+    if (ret == QCOW2_CLUSTER_NORMAL && mapped == host_offset) {
+        ret = qcow2_set_copied_flag(bs, orig_offset, true);
+    } else {
+        /* Without snapshots the reference must be in the active L1 table */
+        ret = dedup_set_copied(bs, host_offset);
+    }
+
+    if (ret >= 0) {
+        dedup_remove(bs, hash, host_offset);
+    }
+}
+
+/*
+ * Records that @host_offset was written through @guest_offset with content
+ * that has @hash. Must be called with s->lock held.
+ */
+int qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                       uint64_t guest_offset, uint64_t host_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DedupEntry *bucket, *entry = NULL;
+    void *table;
+    int i, ret;
+
+    ret = dedup_get_bucket(bs, hash, &table, &bucket);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Replace an entry for the same content, else use a free slot, else evict
+     * a slot picked by the hash bits that didn't select the bucket */
+    for (i = 0; i < QCOW2_DEDUP_BUCKET_ENTRIES; i++) {
+        if (!memcmp(bucket[i].hash, hash, QCOW2_DEDUP_HASH_SIZE)) {
+            entry = &bucket[i];
+            break;
+        }
+        if (!bucket[i].host_offset && !entry) {
+            entry = &bucket[i];
+        }
+    }
+    if (!entry) {
+        entry = &bucket[hash[QCOW2_DEDUP_HASH_SIZE - 1] %
+                        QCOW2_DEDUP_BUCKET_ENTRIES];
+    }
+
+    qcow2_cache_entry_mark_dirty(bs, s->dedup_index_cache, table);
+    memcpy(entry->hash, hash, QCOW2_DEDUP_HASH_SIZE);
+    entry->host_offset = cpu_to_be64(host_offset);
+    entry->guest_offset = cpu_to_be64(guest_offset);
+
+    qcow2_cache_put(bs, s->dedup_index_cache, &table);
+    return 0;
+}
+
+static int dedup_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cache_size;
+
+    cache_size = MIN(DEFAULT_DEDUP_CACHE_BYTE_SIZE, s->dedup_index_size)
+                 / s->cluster_size;
+    s->dedup_index_cache = qcow2_cache_create(bs, MAX(cache_size, 1));
+    if (s->dedup_index_cache == NULL) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+int qcow2_dedup_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    if (bs->read_only || (flags & BDRV_O_INCOMING) || bs->encrypted) {
+        return 0;
+    }
+
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP)) {
+        BdrvCheckResult result = {0};
+
+        /* The old index clusters are leaked, unless the version that cleared
+         * the bit has repaired leaks since and maybe reused them. Only a leak
+         * check can tell which of them may be freed. */
+        ret = qcow2_check_refcounts(bs, &result, BDRV_FIX_LEAKS);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not free the old "
+                             "deduplication index");
+            return ret;
+        }
+
+        s->dedup_index_offset = 0;
+        s->dedup_index_size = 0;
+        ret = qcow2_dedup_create(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not recreate the "
+                             "deduplication index");
+        }
+        return ret;
+    }
+
+    ret = dedup_init(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not open the deduplication index");
+        return ret;
+    }
+
+    return 0;
+}
+
+void qcow2_dedup_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->dedup_index_cache) {
+        qcow2_cache_destroy(bs, s->dedup_index_cache);
+        s->dedup_index_cache = NULL;
+    }
+}
+
+int qcow2_dedup_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->dedup_index_cache == NULL) {
+        return 0;
+    }
+
+    return qcow2_cache_flush(bs, s->dedup_index_cache);
+}
+
+/*
+ * Allocates an empty index with one entry per guest cluster (within
+ * QCOW2_MAX_DEDUP_INDEX_SIZE), links it from the image header and starts
+ * using it.
+ */
+int qcow2_dedup_create(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t size;
+    int64_t offset;
+    int ret;
+
+    assert(s->qcow_version >= 3);
+    assert(!s->dedup_index_offset);
+
+    size = size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE) *
+           sizeof(Qcow2DedupEntry);
+    size = align_offset(size, s->cluster_size);
+    size = MIN(MAX(size, s->cluster_size), QCOW2_MAX_DEDUP_INDEX_SIZE);
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_write_zeroes(bs->file, offset >> BDRV_SECTOR_BITS,
+                            size >> BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->dedup_index_offset = offset;
+    s->dedup_index_size = size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_index_offset = 0;
+        s->dedup_index_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP;
+        goto fail;
+    }
+
+    return dedup_init(bs);
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+    return ret;
+}
+
+/*
+ * Stops deduplicating and frees the index. Clusters that are shared already
+ * stay shared.
+ */
+int qcow2_dedup_drop(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = s->dedup_index_offset;
+    uint64_t size = s->dedup_index_size;
+    bool valid = s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP;
+    int ret;
+
+    qcow2_dedup_close(bs);
+
+    s->dedup_index_offset = 0;
+    s->dedup_index_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_DEDUP;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->dedup_index_offset = offset;
+        s->dedup_index_size = size;
+        if (valid) {
+            s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+        }
+        return ret;
+    }
+
+    if (valid) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+    return 0;
+}
@@ -0,0 +1,534 @@
+/*
+ * Refcount journal for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Refcount updates are appended to the journal before the refcount block
+ * containing them may be written. Allocating writes therefore only have to
+ * wait for one small sequential journal write (and a flush) before their L2
+ * table update can go to disk, while the refcount blocks themselves stay
+ * dirty in the cache until they are evicted, or until the journal is full
+ * and a checkpoint writes all of them back.
+ *
+ * The QCOW2_INCOMPAT_JOURNAL bit is set in the image header as long as the
+ * journal may contain updates that are not reflected in the refcount blocks
+ * yet. If it is set when the image is opened, the journal is replayed.
+ */
+
+#include "block/block_int.h"
+#include "qemu-common.h"
+#include "qemu/crc32c.h"
+#include "qemu/error-report.h"
+#include "block/qcow2.h"
+#include "trace.h"
+
+struct Qcow2RefcountJournal {
+    Qcow2JournalSector *buf;    /* sector that is being filled */
+    int nb_entries;
+    uint64_t seq0;              /* sequence number of sector 0 */
+    int64_t sector;             /* index of the next sector to write */
+    int64_t nb_sectors;
+    bool unsynced;              /* written sectors need a bdrv_flush() */
+    bool depends_on_l2;         /* L2 cache must be flushed before writing */
+    bool need_replay;           /* opened read-only with the bit set */
+};
+
+static uint32_t journal_sector_crc(Qcow2JournalSector *sector)
+{
+    uint32_t old_crc = sector->crc;
+    uint32_t crc;
+
+    sector->crc = 0;
+    crc = crc32c(0xffffffff, (uint8_t *)sector, sizeof(*sector));
+    sector->crc = old_crc;
+
+    return crc;
+}
+
+static bool journal_sector_valid(Qcow2JournalSector *sector, uint64_t seq)
+{
+    return be32_to_cpu(sector->magic) == QCOW2_JOURNAL_MAGIC &&
+           be32_to_cpu(sector->nb_entries) <= QCOW2_JOURNAL_SECTOR_ENTRIES &&
+           be64_to_cpu(sector->seq) == seq &&
+           be32_to_cpu(sector->crc) == journal_sector_crc(sector);
+}
+
+/*
+ * Sets or clears QCOW2_INCOMPAT_JOURNAL in the image header. Callers must make
+ * sure that the refcount blocks or the current sector 0 are stable before.
+ */
+static int journal_set_active(BlockDriverState *bs, bool active)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t features, val;
+    int ret;
+
+    if (active) {
+        features = s->incompatible_features | QCOW2_INCOMPAT_JOURNAL;
+    } else {
+        features = s->incompatible_features & ~QCOW2_INCOMPAT_JOURNAL;
+    }
+    if (features == s->incompatible_features) {
+        return 0;
+    }
+
+    val = cpu_to_be64(features);
+    ret = bdrv_pwrite(bs->file, offsetof(QCowHeader, incompatible_features),
+                      &val, sizeof(val));
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->incompatible_features = features;
+    return 0;
+}
+
+/*
+ * Starts over at sector 0. All refcount blocks must be stable already.
+ */
+static int journal_new_round(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    int ret;
+
+    ret = journal_set_active(bs, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    j->seq0 += j->nb_sectors;
+    j->sector = 0;
+    return 0;
+}
+
+/*
+ * Refcount decreases may only become stable after the L2 update that dropped
+ * the reference.
+ */
+static int journal_flush_l2(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    int ret;
+
+    if (j->depends_on_l2) {
+        j->depends_on_l2 = false;
+        ret = qcow2_cache_flush(bs, s->l2_table_cache);
+        if (ret < 0) {
+            j->depends_on_l2 = true;
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int journal_write_sector(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    int64_t offset;
+    int ret;
+
+    assert(j->sector < j->nb_sectors);
+
+    ret = journal_flush_l2(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_qcow2_journal_write_sector(qemu_coroutine_self(), j->sector,
+                                     j->nb_entries);
+
+    j->buf->magic = cpu_to_be32(QCOW2_JOURNAL_MAGIC);
+    j->buf->nb_entries = cpu_to_be32(j->nb_entries);
+    j->buf->seq = cpu_to_be64(j->seq0 + j->sector);
+    j->buf->crc = cpu_to_be32(journal_sector_crc(j->buf));
+
+    offset = s->refcount_journal_offset + j->sector * BDRV_SECTOR_SIZE;
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset, BDRV_SECTOR_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, j->buf, sizeof(*j->buf));
+    if (ret < 0) {
+        return ret;
+    }
+
+    j->sector++;
+    j->nb_entries = 0;
+    memset(j->buf, 0, sizeof(*j->buf));
+    j->unsynced = true;
+
+    /* The first sector of a round must be stable before the bit is set, or
+     * a replay would pick up the stale sector 0 of the previous round */
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL)) {
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            return ret;
+        }
+        j->unsynced = false;
+
+        ret = journal_set_active(bs, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int journal_replay(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    int sectors_per_cluster = s->cluster_size / BDRV_SECTOR_SIZE;
+    uint8_t *buf;
+    int64_t i;
+    int k, nb_entries, applied = 0;
+    int ret = 0;
+
+    j->need_replay = false;
+
+    buf = qemu_try_blockalign(bs->file, s->cluster_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < j->nb_sectors; i++) {
+        Qcow2JournalSector *sector;
+
+        if (i % sectors_per_cluster == 0) {
+            ret = bdrv_pread(bs->file, s->refcount_journal_offset +
+                             i * BDRV_SECTOR_SIZE, buf, s->cluster_size);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+
+        sector = (Qcow2JournalSector *)
+                 (buf + (i % sectors_per_cluster) * BDRV_SECTOR_SIZE);
+        if (!journal_sector_valid(sector, j->seq0 + i)) {
+            break;
+        }
+
+        nb_entries = be32_to_cpu(sector->nb_entries);
+        for (k = 0; k < nb_entries; k++) {
+            ret = qcow2_set_refcount(bs,
+                      be64_to_cpu(sector->entries[k].cluster_index),
+                      be64_to_cpu(sector->entries[k].refcount));
+            if (ret < 0) {
+                goto fail;
+            }
+            applied++;
+        }
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    trace_qcow2_journal_replay(bs, i, applied);
+    ret = journal_new_round(bs);
+
+fail:
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        /* Leave the repair to qcow2_check_refcounts() */
+        int dirty_ret;
+
+        error_report("qcow2: Could not replay the refcount journal: %s",
+                     strerror(-ret));
+        dirty_ret = qcow2_mark_dirty(bs);
+        if (dirty_ret < 0) {
+            return dirty_ret;
+        }
+        return journal_new_round(bs);
+    }
+
+    return 0;
+}
+
+static int journal_init(BlockDriverState *bs, int flags)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j;
+    int ret;
+
+    j = g_new0(Qcow2RefcountJournal, 1);
+    j->nb_sectors = s->refcount_journal_size / BDRV_SECTOR_SIZE;
+    j->buf = qemu_try_blockalign(bs->file, sizeof(*j->buf));
+    if (j->buf == NULL) {
+        g_free(j);
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->refcount_journal_offset, j->buf,
+                     sizeof(*j->buf));
+    if (ret < 0) {
+        qemu_vfree(j->buf);
+        g_free(j);
+        return ret;
+    }
+
+    if (journal_sector_valid(j->buf, be64_to_cpu(j->buf->seq))) {
+        j->seq0 = be64_to_cpu(j->buf->seq);
+    }
+    memset(j->buf, 0, sizeof(*j->buf));
+
+    s->refcount_journal = j;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL)) {
+        /* Nothing to replay, the old sectors must not be picked up again */
+        j->seq0 += j->nb_sectors;
+        return 0;
+    }
+
+    if (bs->read_only || (flags & (BDRV_O_CHECK | BDRV_O_INCOMING))) {
+        j->need_replay = true;
+        return 0;
+    }
+
+    return journal_replay(bs);
+}
+
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    int ret;
+
+    ret = journal_init(bs, flags);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not open refcount journal");
+        qcow2_journal_close(bs);
+        return ret;
+    }
+
+    return 0;
+}
+
+void qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+
+    if (j == NULL) {
+        return;
+    }
+
+    qemu_vfree(j->buf);
+    g_free(j);
+    s->refcount_journal = NULL;
+}
+
+/*
+ * Allocates a journal of @size bytes (a multiple of the cluster size), links
+ * it from the image header and starts using it.
+ */
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    assert(s->qcow_version >= 3);
+    assert(!s->refcount_journal_offset);
+    assert(size && !offset_into_cluster(s, size));
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        return offset;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_write_zeroes(bs->file, offset >> BDRV_SECTOR_BITS,
+                            size >> BDRV_SECTOR_BITS, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->refcount_journal_offset = offset;
+    s->refcount_journal_size = size;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->refcount_journal_offset = 0;
+        s->refcount_journal_size = 0;
+        goto fail;
+    }
+
+    return journal_init(bs, bs->open_flags);
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+    return ret;
+}
+
+/*
+ * Records that the refcount of @cluster_index is about to become @refcount.
+ * Must be called before the refcount block is modified.
+ */
+int qcow2_journal_add(BlockDriverState *bs, int64_t cluster_index,
+                      uint64_t refcount)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    Qcow2JournalEntry *entry;
+    int ret;
+
+    if (j == NULL || !qcow2_need_accurate_refcounts(s)) {
+        return 0;
+    }
+
+    if (j->need_replay) {
+        ret = journal_replay(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!qcow2_need_accurate_refcounts(s)) {
+            return 0;
+        }
+    }
+
+    if (j->nb_entries == QCOW2_JOURNAL_SECTOR_ENTRIES) {
+        ret = journal_write_sector(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (j->sector == j->nb_sectors) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    entry = &j->buf->entries[j->nb_entries++];
+    entry->cluster_index = cpu_to_be64(cluster_index);
+    entry->refcount = cpu_to_be64(refcount);
+
+    return 0;
+}
+
+/*
+ * Makes all refcount updates recorded so far stable in the journal.
+ */
+int qcow2_journal_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    int ret;
+
+    if (j == NULL) {
+        return 0;
+    }
+
+    /* Resolve the dependency even without entries, so that the L2 cache can
+     * depend on the journal afterwards */
+    ret = journal_flush_l2(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (j->nb_entries) {
+        ret = journal_write_sector(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (j->unsynced) {
+        ret = bdrv_flush(bs->file);
+        if (ret < 0) {
+            return ret;
+        }
+        j->unsynced = false;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes back all refcount blocks, so that the journal can be cleared and
+ * reused from its start.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2RefcountJournal *j = s->refcount_journal;
+    int ret;
+
+    if (j == NULL) {
+        return 0;
+    }
+
+    if (j->need_replay) {
+        return bs->read_only ? 0 : journal_replay(bs);
+    }
+
+    ret = qcow2_journal_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (j->sector == 0 && !(s->incompatible_features & QCOW2_INCOMPAT_JOURNAL)) {
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, j->sector);
+    return journal_new_round(bs);
+}
+
+/*
+ * Makes the next journal write wait until the L2 table cache is stable, which
+ * is what refcount decreases need.
+ */
+void qcow2_journal_depends_on_l2(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->refcount_journal) {
+        s->refcount_journal->depends_on_l2 = true;
+    }
+}
+
+bool qcow2_journal_has_l2_dependency(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return s->refcount_journal && s->refcount_journal->depends_on_l2;
+}
@@ -726,9 +726,6 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         }
         old_table_index = table_index;
 
-        qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache,
-                                     refcount_block);
-
         /* we can update the count and save it */
         block_index = cluster_index & (s->refcount_block_size - 1);
 
@@ -748,6 +745,16 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+
+        /* This may write back the refcount block, so only mark it dirty
+         * afterwards */
+        ret = qcow2_journal_add(bs, cluster_index, refcount);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache,
+                                     refcount_block);
         s->set_refcount(refcount_block, block_index, refcount);
 
         if (refcount == 0 && s->discard_passthrough[type]) {
@@ -780,6 +787,60 @@ fail:
     return ret;
 }
 
+/*
+ * Sets the refcount of a given cluster to an absolute value, e.g. when
+ * replaying the refcount journal. The refcount block must exist already,
+ * unless @refcount is 0.
+ */
+int qcow2_set_refcount(BlockDriverState *bs, int64_t cluster_index,
+                       uint64_t refcount)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t refcount_table_index, block_index;
+    int64_t refcount_block_offset;
+    int ret;
+    void *refcount_block;
+
+    if (refcount > s->refcount_max) {
+        return -EINVAL;
+    }
+
+    refcount_table_index = cluster_index >> s->refcount_block_bits;
+    if (refcount_table_index >= s->refcount_table_size) {
+        return refcount ? -ENOENT : 0;
+    }
+    refcount_block_offset =
+        s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+    if (!refcount_block_offset) {
+        return refcount ? -ENOENT : 0;
+    }
+
+    if (offset_into_cluster(s, refcount_block_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refcount_block_offset, refcount_table_index);
+        return -EIO;
+    }
+
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                          &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    block_index = cluster_index & (s->refcount_block_size - 1);
+    qcow2_cache_entry_mark_dirty(bs, s->refcount_block_cache, refcount_block);
+    s->set_refcount(refcount_block, block_index, refcount);
+
+    qcow2_cache_put(bs, s->refcount_block_cache, &refcount_block);
+
+    if (refcount == 0 && cluster_index < s->free_cluster_index) {
+        s->free_cluster_index = cluster_index;
+    }
+
+    return 0;
+}
+
 /*
  * Increases or decreases the refcount of a given cluster.
  *
@@ -813,10 +874,38 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 /* return < 0 if error */
+/*
+ * Returns true if the cluster lies in the unused part of an extent that is
+ * reserved for a sequential write stream. *end is set to the first cluster
+ * index after the extent.
+ */
+static bool cluster_is_reserved(BDRVQcowState *s, uint64_t cluster_index,
+                                uint64_t *end)
+{
+    int i;
+
+    if (!s->alloc_extent_size) {
+        return false;
+    }
+
+    for (i = 0; i < QCOW2_MAX_ALLOC_EXTENTS; i++) {
+        Qcow2AllocExtent *e = &s->alloc_extents[i];
+        if (e->host_end &&
+            cluster_index >= (e->host_next >> s->cluster_bits) &&
+            cluster_index < (e->host_end >> s->cluster_bits))
+        {
+            *end = e->host_end >> s->cluster_bits;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t i, nb_clusters, refcount, reserved_end;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -828,6 +917,10 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size)
 retry:
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
+        if (cluster_is_reserved(s, next_cluster_index, &reserved_end)) {
+            s->free_cluster_index = reserved_end;
+            goto retry;
+        }
         ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
 
         if (ret < 0) {
@@ -875,11 +968,11 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
     return offset;
 }
 
-int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
-    int nb_clusters)
+static int alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
+                             int nb_clusters, bool skip_reserved)
 {
     BDRVQcowState *s = bs->opaque;
-    uint64_t cluster_index, refcount;
+    uint64_t cluster_index, refcount, reserved_end;
     uint64_t i;
     int ret;
 
@@ -892,6 +985,11 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
         for(i = 0; i < nb_clusters; i++) {
+            if (skip_reserved &&
+                cluster_is_reserved(s, cluster_index, &reserved_end))
+            {
+                break;
+            }
             ret = qcow2_get_refcount(bs, cluster_index++, &refcount);
             if (ret < 0) {
                 return ret;
@@ -912,6 +1010,223 @@ int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
+    int nb_clusters)
+{
+    return alloc_clusters_at(bs, offset, nb_clusters, true);
+}
+
+/*
+ * Reserves alloc_extent_size bytes of free host clusters for the stream
+ * described by @e. Clusters directly following the old extent are preferred,
+ * so that a long sequential stream stays contiguous across extents.
+ */
+static int reserve_alloc_extent(BlockDriverState *bs, Qcow2AllocExtent *e)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t nb_clusters = s->alloc_extent_size >> s->cluster_bits;
+    uint64_t cluster_index, refcount, reserved_end, i;
+    int64_t offset = 0, file_length;
+    int ret;
+
+    /* Try to grow the old extent in place */
+    if (e->host_end) {
+        cluster_index = e->host_end >> s->cluster_bits;
+        e->host_end = 0;
+        for (i = 0; i < nb_clusters; i++) {
+            if (cluster_is_reserved(s, cluster_index + i, &reserved_end)) {
+                break;
+            }
+            ret = qcow2_get_refcount(bs, cluster_index + i, &refcount);
+            if (ret < 0) {
+                return ret;
+            } else if (refcount != 0) {
+                break;
+            }
+        }
+        if (i == nb_clusters) {
+            offset = cluster_index << s->cluster_bits;
+            if (s->free_cluster_index >= cluster_index &&
+                s->free_cluster_index < cluster_index + nb_clusters)
+            {
+                s->free_cluster_index = cluster_index + nb_clusters;
+            }
+        }
+    }
+
+    if (!offset) {
+        offset = alloc_clusters_noref(bs, s->alloc_extent_size);
+        if (offset < 0) {
+            return offset;
+        }
+    }
+
+    e->host_next = offset;
+    e->host_end = offset + s->alloc_extent_size;
+
+    /* Grow the file in one go (with fallocate() where the protocol supports
+     * it) instead of one cluster per write; this is only a hint, so errors
+     * are ignored */
+    file_length = bdrv_getlength(bs->file);
+    if (file_length >= 0 && e->host_end > file_length) {
+        uint64_t start = MAX(offset, ROUND_UP(file_length, BDRV_SECTOR_SIZE));
+        if (start < e->host_end) {
+            bdrv_write_zeroes(bs->file, start >> BDRV_SECTOR_BITS,
+                              (e->host_end - start) >> BDRV_SECTOR_BITS, 0);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Allocates data clusters for a guest write at @guest_offset from the host
+ * extent of the sequential stream that the write continues. An extent is only
+ * reserved when a second write continues a stream; the first write of a
+ * stream is allocated like without extents. If *host_offset is non-zero,
+ * clusters are only allocated at that offset.
+ *
+ * Returns 0 on success and sets *host_offset and *nb_clusters to the
+ * allocated range (*nb_clusters may be 0 if *host_offset was given and cannot
+ * be extended). Returns -errno on failure.
+ */
+int qcow2_alloc_clusters_extent(BlockDriverState *bs, uint64_t guest_offset,
+                                uint64_t *host_offset,
+                                unsigned int *nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2AllocExtent *e = NULL;
+    uint64_t min_lru_counter = UINT64_MAX;
+    int64_t offset;
+    int i, ret;
+
+    assert(s->alloc_extent_size);
+    guest_offset = start_of_cluster(s, guest_offset);
+
+    for (i = 0; i < QCOW2_MAX_ALLOC_EXTENTS; i++) {
+        if (s->alloc_extents[i].host_end &&
+            s->alloc_extents[i].guest_next == guest_offset)
+        {
+            e = &s->alloc_extents[i];
+            break;
+        }
+    }
+
+    if (*host_offset && (!e || e->host_next != *host_offset)) {
+        /* Continuing an allocation outside of any extent */
+        ret = qcow2_alloc_clusters_at(bs, *host_offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return 0;
+    }
+
+    if (!e) {
+        /* A write that doesn't continue a known stream is allocated normally.
+         * It only takes a slot, preferably one without a reservation, so that
+         * an extent can be reserved once the next write continues it. */
+        for (i = 0; i < QCOW2_MAX_ALLOC_EXTENTS; i++) {
+            Qcow2AllocExtent *slot = &s->alloc_extents[i];
+            uint64_t lru_counter = slot->lru_counter;
+
+            if (!slot->host_end) {
+                e = slot;
+                break;
+            }
+            if (slot->host_next != slot->host_end) {
+                lru_counter += s->alloc_extent_lru_counter;
+            }
+            if (lru_counter < min_lru_counter) {
+                min_lru_counter = lru_counter;
+                e = slot;
+            }
+        }
+
+        /* The unused rest of the evicted extent becomes free again */
+        if (e->host_next != e->host_end) {
+            s->free_cluster_index = MIN(s->free_cluster_index,
+                                        e->host_next >> s->cluster_bits);
+        }
+        e->host_end = 0;
+
+        offset = qcow2_alloc_clusters(bs, (uint64_t) *nb_clusters
+                                          << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        *host_offset = offset;
+
+        e->guest_next = guest_offset +
+                        ((uint64_t) *nb_clusters << s->cluster_bits);
+        e->host_next = offset + ((uint64_t) *nb_clusters << s->cluster_bits);
+        e->host_end = e->host_next;
+        e->lru_counter = ++s->alloc_extent_lru_counter;
+        return 0;
+    }
+
+    if (e->host_next == e->host_end) {
+        if (*host_offset && e->host_end) {
+            /* Only a contiguous extension is useful here */
+            uint64_t old_end = e->host_end;
+            ret = reserve_alloc_extent(bs, e);
+            if (ret < 0) {
+                return ret;
+            }
+            if (e->host_next != old_end) {
+                *nb_clusters = 0;
+                return 0;
+            }
+        } else {
+            ret = reserve_alloc_extent(bs, e);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    ret = alloc_clusters_at(bs, e->host_next,
+                            MIN(*nb_clusters,
+                                (e->host_end - e->host_next) >> s->cluster_bits),
+                            false);
+    if (ret < 0) {
+        return ret;
+    } else if (ret == 0) {
+        /* Something else has allocated from the extent, drop it */
+        e->host_end = 0;
+        if (*host_offset) {
+            *nb_clusters = 0;
+            return 0;
+        }
+        offset = qcow2_alloc_clusters(bs, (uint64_t) *nb_clusters
+                                          << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        *host_offset = offset;
+        return 0;
+    }
+
+    *host_offset = e->host_next;
+    *nb_clusters = ret;
+
+    e->host_next += (uint64_t) ret << s->cluster_bits;
+    e->guest_next = guest_offset + ((uint64_t) ret << s->cluster_bits);
+    e->lru_counter = ++s->alloc_extent_lru_counter;
+
+    return 0;
+}
+
+/*
+ * Drops all extent reservations, e.g. when the image is emptied.
+ */
+void qcow2_reset_alloc_extents(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    memset(s->alloc_extents, 0, sizeof(s->alloc_extents));
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1818,6 +2133,22 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* refcount journal */
+    ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        s->refcount_journal_offset, s->refcount_journal_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* deduplication index, unless another version may have given it up */
+    if (s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP) {
+        ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
+                            s->dedup_index_offset, s->dedup_index_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* refcount data */
     ret = inc_refcounts(bs, res, refcount_table, nb_clusters,
                         s->refcount_table_offset,
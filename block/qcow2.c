@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
@@ -61,6 +60,9 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_REFCOUNT_JOURNAL 0x726a6e6c
+#define  QCOW2_EXT_MAGIC_DEDUP_INDEX 0x64656475
+#define  QCOW2_EXT_MAGIC_COMPRESSION_TYPE 0x636d7074
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -160,6 +162,89 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_REFCOUNT_JOURNAL:
+        {
+            Qcow2JournalHeaderExt journal_ext;
+
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "ERROR: ext_refcount_journal: "
+                           "Invalid extension length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_refcount_journal: "
+                                 "Could not read journal location");
+                return ret;
+            }
+            be64_to_cpus(&journal_ext.offset);
+            be64_to_cpus(&journal_ext.size);
+
+            if (!journal_ext.offset || !journal_ext.size ||
+                offset_into_cluster(s, journal_ext.offset) ||
+                offset_into_cluster(s, journal_ext.size) ||
+                journal_ext.offset + journal_ext.size < journal_ext.offset)
+            {
+                error_setg(errp, "ERROR: ext_refcount_journal: "
+                           "Invalid journal location");
+                return -EINVAL;
+            }
+            s->refcount_journal_offset = journal_ext.offset;
+            s->refcount_journal_size = journal_ext.size;
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_DEDUP_INDEX:
+        {
+            Qcow2DedupHeaderExt dedup_ext;
+
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "ERROR: ext_dedup_index: "
+                           "Invalid extension length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &dedup_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_dedup_index: "
+                                 "Could not read index location");
+                return ret;
+            }
+            be64_to_cpus(&dedup_ext.offset);
+            be64_to_cpus(&dedup_ext.size);
+
+            if (!dedup_ext.offset || !dedup_ext.size ||
+                offset_into_cluster(s, dedup_ext.offset) ||
+                offset_into_cluster(s, dedup_ext.size) ||
+                dedup_ext.offset + dedup_ext.size < dedup_ext.offset)
+            {
+                error_setg(errp, "ERROR: ext_dedup_index: "
+                           "Invalid index location");
+                return -EINVAL;
+            }
+            s->dedup_index_offset = dedup_ext.offset;
+            s->dedup_index_size = dedup_ext.size;
+            break;
+        }
+
+        case QCOW2_EXT_MAGIC_COMPRESSION_TYPE:
+        {
+            Qcow2CompressionHeaderExt compression_ext;
+
+            if (ext.len != sizeof(compression_ext)) {
+                error_setg(errp, "ERROR: ext_compression_type: "
+                           "Invalid extension length");
+                return -EINVAL;
+            }
+            ret = bdrv_pread(bs->file, offset, &compression_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_compression_type: "
+                                 "Could not read compression type");
+                return ret;
+            }
+            s->compression_type = compression_ext.type;
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -284,10 +369,15 @@ int qcow2_mark_dirty(BlockDriverState *bs)
 static int qcow2_mark_clean(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    int ret;
 
-    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
-        int ret;
+    /* Write back all refcount blocks and clear the journal bit */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        return ret;
+    }
 
+    if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
 
         ret = bdrv_flush(bs);
@@ -334,7 +424,17 @@ int qcow2_mark_consistent(BlockDriverState *bs)
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
 {
-    int ret = qcow2_check_refcounts(bs, result, fix);
+    int ret;
+
+    /* Replay the refcount journal before refcounts are compared */
+    if (fix) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = qcow2_check_refcounts(bs, result, fix);
     if (ret < 0) {
         return ret;
     }
@@ -468,6 +568,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_EXTENT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the host extents reserved for sequential guest "
+                    "writes (0 to disable)",
+        },
         { /* end of list */ }
     },
 };
@@ -874,6 +980,30 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* A compression type other than zlib must be marked as incompatible */
+    if (!!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION) !=
+        (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB))
+    {
+        error_setg(errp, "Compression type header extension and feature bit "
+                   "do not match");
+        ret = -EINVAL;
+        goto fail;
+    }
+    ret = qcow2_compression_init(s->compression_type, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* A journal that may have to be replayed must be there */
+    if ((s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) &&
+        !s->refcount_journal_offset)
+    {
+        error_setg(errp, "Refcount journal feature bit is set, but there is "
+                   "no refcount journal header extension");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -904,8 +1034,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) &&
+        (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -915,6 +1046,16 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->data_writes_drained);
+
+    /* Replay the refcount journal; if that fails, the image is marked dirty
+     * and repaired below */
+    if (s->refcount_journal_offset && s->qcow_version >= 3) {
+        ret = qcow2_journal_open(bs, flags, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) && !bs->read_only &&
@@ -928,6 +1069,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         }
     }
 
+    /* This may allocate clusters, so refcounts must be consistent by now */
+    if (s->dedup_index_offset && s->qcow_version >= 3) {
+        ret = qcow2_dedup_open(bs, flags, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     /* Enable lazy_refcounts according to image and command line options */
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -942,6 +1091,17 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     s->discard_passthrough[QCOW2_DISCARD_OTHER] =
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
+    s->alloc_extent_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_EXTENT_SIZE,
+                                             0);
+    if (offset_into_cluster(s, s->alloc_extent_size) ||
+        s->alloc_extent_size > INT_MAX)
+    {
+        error_setg(errp, QCOW2_OPT_ALLOC_EXTENT_SIZE " must be a multiple of "
+                   "the cluster size and may not exceed 2 GB");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     opt_overlap_check = qemu_opt_get(opts, QCOW2_OPT_OVERLAP);
     opt_overlap_check_template = qemu_opt_get(opts, QCOW2_OPT_OVERLAP_TEMPLATE);
     if (opt_overlap_check_template && opt_overlap_check &&
@@ -1002,6 +1162,8 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
  fail:
     qemu_opts_del(opts);
+    qcow2_dedup_close(bs);
+    qcow2_journal_close(bs);
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -1153,8 +1315,6 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         /* prepare next request */
@@ -1164,8 +1324,15 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors);
         }
 
-        ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+        /* Only take the lock if the L2 table must be read from disk */
+        ret = qcow2_get_cluster_offset_nowait(bs, sector_num << 9,
             &cur_nr_sectors, &cluster_offset);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_cluster_offset(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1191,10 +1358,8 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                                       n1 * BDRV_SECTOR_SIZE);
 
                     BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-                    qemu_co_mutex_unlock(&s->lock);
                     ret = bdrv_co_readv(bs->backing_hd, sector_num,
                                         n1, &local_qiov);
-                    qemu_co_mutex_lock(&s->lock);
 
                     qemu_iovec_destroy(&local_qiov);
 
@@ -1214,14 +1379,17 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
 
         case QCOW2_CLUSTER_COMPRESSED:
             /* add AIO support for compressed blocks ? */
+            qemu_co_mutex_lock(&s->lock);
             ret = qcow2_decompress_cluster(bs, cluster_offset);
             if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
                 goto fail;
             }
 
             qemu_iovec_from_buf(&hd_qiov, 0,
                 s->cluster_cache + index_in_cluster * 512,
                 512 * cur_nr_sectors);
+            qemu_co_mutex_unlock(&s->lock);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -1255,11 +1423,9 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             }
 
             BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
-            qemu_co_mutex_unlock(&s->lock);
             ret = bdrv_co_readv(bs->file,
                                 (cluster_offset >> 9) + index_in_cluster,
                                 cur_nr_sectors, &hd_qiov);
-            qemu_co_mutex_lock(&s->lock);
             if (ret < 0) {
                 goto fail;
             }
@@ -1285,14 +1451,53 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cluster_data);
 
     return ret;
 }
 
+/*
+ * Guest data writes are counted from the moment their host offset is known
+ * until they are complete. A write started in the current epoch may target a
+ * cluster whose mapping or QCOW_OFLAG_COPIED was just changed, so code that
+ * needs such writes to be complete before it continues starts a new epoch and
+ * waits for the writes of the previous one.
+ */
+static unsigned int qcow2_data_write_begin(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int epoch = s->data_write_epoch & 1;
+
+    s->data_writes_in_flight[epoch]++;
+    return epoch;
+}
+
+static void qcow2_data_write_end(BlockDriverState *bs, unsigned int epoch)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    assert(s->data_writes_in_flight[epoch] > 0);
+    if (--s->data_writes_in_flight[epoch] == 0) {
+        qemu_co_queue_restart_all(&s->data_writes_drained);
+    }
+}
+
+/*
+ * Waits until all guest data writes that have been started so far are
+ * complete. Must be called with s->lock held, so that no writes through the
+ * locked path of qcow2_co_writev() can start with an outdated mapping.
+ */
+void coroutine_fn qcow2_drain_data_writes(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    unsigned int epoch = s->data_write_epoch++ & 1;
+
+    while (s->data_writes_in_flight[epoch] > 0) {
+        qemu_co_queue_wait(&s->data_writes_drained);
+    }
+}
+
 static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                            int64_t sector_num,
                            int remaining_sectors,
@@ -1307,16 +1512,34 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     uint64_t bytes_done = 0;
     uint8_t *cluster_data = NULL;
     QCowL2Meta *l2meta = NULL;
+    bool in_place;
+    unsigned int epoch;
+    bool dedup = s->dedup_index_cache != NULL;
+    bool dedup_cluster;
+    uint8_t dedup_hash[QCOW2_DEDUP_HASH_SIZE];
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), sector_num,
                                  remaining_sectors);
 
+    if (bs->encrypted) {
+        assert(s->crypt_method);
+        assert(!dedup);
+        cluster_data = qemu_try_blockalign(bs->file, QCOW_MAX_CRYPT_CLUSTERS
+                                                     * s->cluster_size);
+        if (cluster_data == NULL) {
+            return -ENOMEM;
+        }
+    } else if (dedup) {
+        cluster_data = qemu_try_blockalign(bs->file, s->cluster_size);
+        if (cluster_data == NULL) {
+            return -ENOMEM;
+        }
+    }
+
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    qemu_co_mutex_lock(&s->lock);
-
     while (remaining_sectors != 0) {
 
         l2meta = NULL;
@@ -1331,10 +1554,54 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors - index_in_cluster;
         }
 
-        ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
-            &cur_nr_sectors, &cluster_offset, &l2meta);
-        if (ret < 0) {
-            goto fail;
+        /* Deduplication looks at one whole cluster at a time */
+        dedup_cluster = false;
+        if (dedup) {
+            cur_nr_sectors = MIN(cur_nr_sectors,
+                                 s->cluster_sectors - index_in_cluster);
+            dedup_cluster = cur_nr_sectors == s->cluster_sectors;
+        }
+
+        if (dedup_cluster) {
+            qemu_iovec_to_buf(qiov, bytes_done, cluster_data, s->cluster_size);
+            qcow2_dedup_hash(bs, cluster_data, dedup_hash);
+
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_dedup_lookup(bs, sector_num << 9, cluster_data,
+                                     dedup_hash);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            } else if (ret > 0) {
+                /* Nothing to write, the guest cluster refers to a host
+                 * cluster with the same content now */
+                remaining_sectors -= cur_nr_sectors;
+                sector_num += cur_nr_sectors;
+                bytes_done += cur_nr_sectors * 512;
+                continue;
+            }
+        }
+
+        /*
+         * Overwriting clusters that are already allocated needs no metadata
+         * update, so skip s->lock if the L2 table is cached. The inactive L2
+         * overlap check may read from disk and is only done with the lock.
+         */
+        in_place = !(s->overlap_check & QCOW2_OL_INACTIVE_L2) &&
+            qcow2_get_copied_offset_nowait(bs, sector_num << 9,
+                                           &cur_nr_sectors, &cluster_offset) &&
+            qcow2_check_metadata_overlap(bs, 0,
+                cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                cur_nr_sectors * BDRV_SECTOR_SIZE) == 0;
+
+        if (!in_place) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_alloc_cluster_offset(bs, sector_num << 9,
+                &cur_nr_sectors, &cluster_offset, &l2meta);
+            if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                goto fail;
+            }
         }
 
         assert((cluster_offset & 511) == 0);
@@ -1344,17 +1611,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
             cur_nr_sectors * 512);
 
         if (bs->encrypted) {
-            assert(s->crypt_method);
-            if (!cluster_data) {
-                cluster_data = qemu_try_blockalign(bs->file,
-                                                   QCOW_MAX_CRYPT_CLUSTERS
-                                                   * s->cluster_size);
-                if (cluster_data == NULL) {
-                    ret = -ENOMEM;
-                    goto fail;
-                }
-            }
-
             assert(hd_qiov.size <=
                    QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
             qemu_iovec_to_buf(&hd_qiov, 0, cluster_data, hd_qiov.size);
@@ -1367,43 +1623,67 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
                 cur_nr_sectors * 512);
         }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0,
-                cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
-                cur_nr_sectors * BDRV_SECTOR_SIZE);
-        if (ret < 0) {
-            goto fail;
+        if (!in_place) {
+            ret = qcow2_pre_write_overlap_check(bs, 0,
+                    cluster_offset + index_in_cluster * BDRV_SECTOR_SIZE,
+                    cur_nr_sectors * BDRV_SECTOR_SIZE);
+            if (ret < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                goto fail;
+            }
+        }
+
+        /* Must be counted before s->lock is dropped */
+        epoch = qcow2_data_write_begin(bs);
+        if (!in_place) {
+            qemu_co_mutex_unlock(&s->lock);
         }
 
-        qemu_co_mutex_unlock(&s->lock);
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
         trace_qcow2_writev_data(qemu_coroutine_self(),
-                                (cluster_offset >> 9) + index_in_cluster);
+                                (cluster_offset >> 9) + index_in_cluster,
+                                in_place);
         ret = bdrv_co_writev(bs->file,
                              (cluster_offset >> 9) + index_in_cluster,
                              cur_nr_sectors, &hd_qiov);
-        qemu_co_mutex_lock(&s->lock);
+        qcow2_data_write_end(bs, epoch);
         if (ret < 0) {
             goto fail;
         }
 
-        while (l2meta != NULL) {
-            QCowL2Meta *next;
+        if (l2meta != NULL) {
+            qemu_co_mutex_lock(&s->lock);
+            while (l2meta != NULL) {
+                QCowL2Meta *next;
 
-            ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
-            if (ret < 0) {
-                goto fail;
-            }
+                ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
+                if (ret < 0) {
+                    qemu_co_mutex_unlock(&s->lock);
+                    goto fail;
+                }
 
-            /* Take the request off the list of running requests */
-            if (l2meta->nb_clusters != 0) {
-                QLIST_REMOVE(l2meta, next_in_flight);
-            }
+                /* Take the request off the list of running requests */
+                if (l2meta->nb_clusters != 0) {
+                    QLIST_REMOVE(l2meta, next_in_flight);
+                }
+
+                qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
-            qemu_co_queue_restart_all(&l2meta->dependent_requests);
+                next = l2meta->next;
+                g_free(l2meta);
+                l2meta = next;
+            }
+            qemu_co_mutex_unlock(&s->lock);
+        }
 
-            next = l2meta->next;
-            g_free(l2meta);
-            l2meta = next;
+        if (dedup_cluster) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_dedup_insert(bs, dedup_hash, sector_num << 9,
+                                     cluster_offset);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         remaining_sectors -= cur_nr_sectors;
@@ -1414,8 +1694,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
     ret = 0;
 
 fail:
-    qemu_co_mutex_unlock(&s->lock);
-
     while (l2meta != NULL) {
         QCowL2Meta *next;
 
@@ -1444,10 +1722,11 @@ static void qcow2_close(BlockDriverState *bs)
     s->l1_table = NULL;
 
     if (!(bs->open_flags & BDRV_O_INCOMING)) {
-        int ret1, ret2;
+        int ret1, ret2, ret3;
 
         ret1 = qcow2_cache_flush(bs, s->l2_table_cache);
         ret2 = qcow2_cache_flush(bs, s->refcount_block_cache);
+        ret3 = qcow2_dedup_flush(bs);
 
         if (ret1) {
             error_report("Failed to flush the L2 table cache: %s",
@@ -1457,6 +1736,10 @@ static void qcow2_close(BlockDriverState *bs)
             error_report("Failed to flush the refcount block cache: %s",
                          strerror(-ret2));
         }
+        if (ret3) {
+            error_report("Failed to flush the deduplication index: %s",
+                         strerror(-ret3));
+        }
 
         if (!ret1 && !ret2) {
             qcow2_mark_clean(bs);
@@ -1465,6 +1748,8 @@ static void qcow2_close(BlockDriverState *bs)
 
     qcow2_cache_destroy(bs, s->l2_table_cache);
     qcow2_cache_destroy(bs, s->refcount_block_cache);
+    qcow2_dedup_close(bs);
+    qcow2_journal_close(bs);
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
@@ -1651,6 +1936,57 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Refcount journal header extension */
+    if (s->refcount_journal_offset) {
+        Qcow2JournalHeaderExt journal_ext = {
+            .offset = cpu_to_be64(s->refcount_journal_offset),
+            .size   = cpu_to_be64(s->refcount_journal_size),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_REFCOUNT_JOURNAL,
+                             &journal_ext, sizeof(journal_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Deduplication index header extension */
+    if (s->dedup_index_offset) {
+        Qcow2DedupHeaderExt dedup_ext = {
+            .offset = cpu_to_be64(s->dedup_index_offset),
+            .size   = cpu_to_be64(s->dedup_index_size),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP_INDEX,
+                             &dedup_ext, sizeof(dedup_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
+    /* Compression type header extension */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        Qcow2CompressionHeaderExt compression_ext = {
+            .type = s->compression_type,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_TYPE,
+                             &compression_ext, sizeof(compression_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1663,11 +1999,26 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
             .name = "corrupt bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+            .name = "refcount journal",
+        },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+            .name = "compression type",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_DEDUP_BITNR,
+            .name = "deduplication index",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1809,7 +2160,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         int compression_type, Error **errp)
 {
     /* Calculate cluster_bits */
     int cluster_bits;
@@ -1996,6 +2347,36 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         goto out;
     }
 
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        BDRVQcowState *s = bs->opaque;
+
+        s->compression_type = compression_type;
+        s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not set compression type");
+            goto out;
+        }
+    }
+
+    if (flags & BLOCK_FLAG_REFCOUNT_JOURNAL) {
+        ret = qcow2_journal_create(bs, ROUND_UP(QCOW2_DEFAULT_JOURNAL_SIZE,
+                                                cluster_size));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not create refcount journal");
+            goto out;
+        }
+    }
+
+    if (flags & BLOCK_FLAG_DEDUP) {
+        ret = qcow2_dedup_create(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not create deduplication "
+                             "index");
+            goto out;
+        }
+    }
+
     /* Want a backing file? There you go.*/
     if (backing_file) {
         ret = bdrv_change_backing_file(bs, backing_file, backing_format);
@@ -2050,6 +2431,7 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    int compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     Error *local_err = NULL;
     int ret;
 
@@ -2089,6 +2471,26 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     if (qemu_opt_get_bool_del(opts, BLOCK_OPT_LAZY_REFCOUNTS, false)) {
         flags |= BLOCK_FLAG_LAZY_REFCOUNTS;
     }
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_REFCOUNT_JOURNAL, false)) {
+        flags |= BLOCK_FLAG_REFCOUNT_JOURNAL;
+    }
+    if (qemu_opt_get_bool_del(opts, BLOCK_OPT_DEDUP, false)) {
+        flags |= BLOCK_FLAG_DEDUP;
+    }
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    if (buf) {
+        compression_type = qcow2_compression_type_from_str(buf);
+        if (compression_type < 0) {
+            error_setg(errp, "Invalid compression type: '%s'", buf);
+            ret = -EINVAL;
+            goto finish;
+        }
+        ret = qcow2_compression_init(compression_type, errp);
+        if (ret < 0) {
+            goto finish;
+        }
+    }
 
     if (backing_file && prealloc != PREALLOC_MODE_OFF) {
         error_setg(errp, "Backing file and preallocation cannot be used at "
@@ -2104,6 +2506,35 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_REFCOUNT_JOURNAL)) {
+        error_setg(errp, "Refcount journals are only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (version < 3 && (flags & BLOCK_FLAG_DEDUP)) {
+        error_setg(errp, "Deduplication is only supported with compatibility "
+                   "level 1.1 and above (use compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if ((flags & BLOCK_FLAG_DEDUP) && (flags & BLOCK_FLAG_ENCRYPT)) {
+        error_setg(errp, "Deduplication cannot be used with encryption");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib are only "
+                   "supported with compatibility level 1.1 and above (use "
+                   "compat=1.1 or greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_bits = qemu_opt_get_number_del(opts, BLOCK_OPT_REFCOUNT_BITS,
                                             refcount_bits);
     if (refcount_bits > 64 || !is_power_of_2(refcount_bits)) {
@@ -2121,11 +2552,17 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
         goto finish;
     }
 
+    if (refcount_bits == 1 && (flags & BLOCK_FLAG_DEDUP)) {
+        error_setg(errp, "Deduplication requires refcount_bits of at least 2");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     refcount_order = ctz32(refcount_bits);
 
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
     }
@@ -2211,16 +2648,43 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/*
+ * Writes the compressed clusters collected in qiov to the image file at
+ * host_offset, where they were allocated back to back.
+ */
+static int qcow2_write_compressed_data(BlockDriverState *bs,
+                                       uint64_t host_offset,
+                                       QEMUIOVector *qiov)
+{
+    int ret;
+
+    if (qiov->size == 0) {
+        return 0;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, host_offset, qiov->size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwritev(bs->file, host_offset, qiov);
+    qemu_iovec_reset(qiov);
+    return ret < 0 ? ret : 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    QEMUIOVector qiov;
+    uint8_t *pad_buf = NULL;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    int *out_lens;
+    int nb_clusters, i, ret;
+    uint64_t cluster_offset, pending_offset = 0;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2229,79 +2693,88 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return bdrv_truncate(bs->file, cluster_offset);
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
+    if (sector_num & (s->cluster_sectors - 1)) {
+        return -EINVAL;
+    }
 
+    nb_clusters = DIV_ROUND_UP(nb_sectors, s->cluster_sectors);
+    if (nb_sectors & (s->cluster_sectors - 1)) {
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
         }
-        return ret;
+        pad_buf = qemu_blockalign(bs, (size_t)nb_clusters * s->cluster_size);
+        memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+        memset(pad_buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+               (size_t)nb_clusters * s->cluster_size -
+               nb_sectors * BDRV_SECTOR_SIZE);
+        buf = pad_buf;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    /* Compress all clusters in parallel, then allocate and write them in
+     * order so that they end up next to each other in the image file */
+    out_buf = g_malloc((size_t)nb_clusters * s->cluster_size);
+    out_lens = g_new(int, nb_clusters);
+    qemu_iovec_init(&qiov, nb_clusters);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    ret = qcow2_compress_clusters(bs, buf, nb_clusters, out_buf, out_lens);
+    if (ret < 0) {
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    for (i = 0; i < nb_clusters; i++) {
+        int64_t cluster_sector = sector_num + i * s->cluster_sectors;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
+        if (out_lens[i] == 0) {
+            /* could not compress: write normal cluster */
+            ret = qcow2_write_compressed_data(bs, pending_offset, &qiov);
+            if (ret < 0) {
+                goto fail;
+            }
+            ret = bdrv_write(bs, cluster_sector,
+                             buf + (size_t)i * s->cluster_size,
+                             MIN(s->cluster_sectors,
+                                 bs->total_sectors - cluster_sector));
+            if (ret < 0) {
+                goto fail;
+            }
+            continue;
         }
-    } else {
+
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            cluster_sector << BDRV_SECTOR_BITS, out_lens[i]);
         if (!cluster_offset) {
             ret = -EIO;
             goto fail;
         }
         cluster_offset &= s->cluster_offset_mask;
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
+        /* Merge writes of compressed clusters that are contiguous in the
+         * image file */
+        if (qiov.size && cluster_offset != pending_offset + qiov.size) {
+            ret = qcow2_write_compressed_data(bs, pending_offset, &qiov);
+            if (ret < 0) {
+                goto fail;
+            }
         }
-
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
+        if (!qiov.size) {
+            pending_offset = cluster_offset;
         }
+        qemu_iovec_add(&qiov, out_buf + (size_t)i * s->cluster_size,
+                       out_lens[i]);
+    }
+
+    ret = qcow2_write_compressed_data(bs, pending_offset, &qiov);
+    if (ret < 0) {
+        goto fail;
     }
 
     ret = 0;
 fail:
+    qemu_iovec_destroy(&qiov);
+    g_free(out_lens);
     g_free(out_buf);
+    qemu_vfree(pad_buf);
     return ret;
 }
 
@@ -2415,6 +2888,7 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    qcow2_reset_alloc_extents(bs);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -2462,13 +2936,14 @@ static int qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / sizeof(uint64_t));
 
-    if (s->qcow_version >= 3 && !s->snapshots &&
-        3 + l1_clusters <= s->refcount_block_size) {
+    if (s->qcow_version >= 3 && !s->snapshots && !s->refcount_journal_offset &&
+        !s->dedup_index_offset && 3 + l1_clusters <= s->refcount_block_size) {
         /* The following function only works for qcow2 v3 images (it requires
          * the dirty flag) and only as long as there are no snapshots (because
-         * it completely empties the image). Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one refcount
-         * block) have to fit inside one refcount block. */
+         * it completely empties the image) and no refcount journal or
+         * deduplication index (which would be truncated away). Furthermore,
+         * the L1 table and three additional clusters (image header, refcount
+         * table, one refcount block) have to fit inside one refcount block. */
         return make_completely_empty(bs);
     }
 
@@ -2507,15 +2982,23 @@ static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
     }
 
     if (qcow2_need_accurate_refcounts(s)) {
-        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        /* With a refcount journal, it is enough to make the journal stable;
+         * the refcount blocks are written back in batches */
+        if (s->refcount_journal) {
+            ret = qcow2_journal_flush(bs);
+        } else {
+            ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        }
         if (ret < 0) {
             qemu_co_mutex_unlock(&s->lock);
             return ret;
         }
     }
+
+    ret = qcow2_dedup_flush(bs);
     qemu_co_mutex_unlock(&s->lock);
 
-    return 0;
+    return ret;
 }
 
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -2581,18 +3064,41 @@ static void dump_refcounts(BlockDriverState *bs)
 }
 #endif
 
+/*
+ * The VM state lies beyond the end of the image, so zero_beyond_eof must be
+ * off while it is accessed. VM state requests may run concurrently in
+ * coroutines, so the setting is only restored when the last one completes.
+ */
+static void qcow2_vmstate_begin(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->vmstate_in_flight++ == 0) {
+        s->vmstate_zero_beyond_eof = bs->zero_beyond_eof;
+        bs->zero_beyond_eof = false;
+    }
+}
+
+static void qcow2_vmstate_end(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (--s->vmstate_in_flight == 0) {
+        bs->zero_beyond_eof = s->vmstate_zero_beyond_eof;
+    }
+}
+
 static int qcow2_save_vmstate(BlockDriverState *bs, QEMUIOVector *qiov,
                               int64_t pos)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t total_sectors = bs->total_sectors;
-    bool zero_beyond_eof = bs->zero_beyond_eof;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_SAVE);
-    bs->zero_beyond_eof = false;
+    qcow2_vmstate_begin(bs);
     ret = bdrv_pwritev(bs, qcow2_vm_state_offset(s) + pos, qiov);
-    bs->zero_beyond_eof = zero_beyond_eof;
+    qcow2_vmstate_end(bs);
 
     /* bdrv_co_do_writev will have increased the total_sectors value to include
      * the VM state - the VM state is however not an actual part of the block
@@ -2606,17 +3112,45 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
                               int64_t pos, int size)
 {
     BDRVQcowState *s = bs->opaque;
-    bool zero_beyond_eof = bs->zero_beyond_eof;
     int ret;
 
     BLKDBG_EVENT(bs->file, BLKDBG_VMSTATE_LOAD);
-    bs->zero_beyond_eof = false;
+    qcow2_vmstate_begin(bs);
     ret = bdrv_pread(bs, qcow2_vm_state_offset(s) + pos, buf, size);
-    bs->zero_beyond_eof = zero_beyond_eof;
+    qcow2_vmstate_end(bs);
 
     return ret;
 }
 
+/*
+ * Writes back all refcount blocks and frees the refcount journal.
+ */
+static int qcow2_drop_refcount_journal(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = s->refcount_journal_offset;
+    uint64_t size = s->refcount_journal_size;
+    int ret;
+
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_journal_close(bs);
+
+    s->refcount_journal_offset = 0;
+    s->refcount_journal_size = 0;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->refcount_journal_offset = offset;
+        s->refcount_journal_size = size;
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+    return 0;
+}
+
 /*
  * Downgrades an image's version. To achieve this, any incompatible features
  * have to be removed.
@@ -2647,6 +3181,13 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        /* compressed clusters would have to be recompressed with zlib */
+        error_report("qcow2_downgrade: Compression types other than zlib are "
+                     "not supported by compat=0.10.");
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -2655,6 +3196,14 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         }
     }
 
+    /* version 2 has no refcount journal */
+    if (s->refcount_journal_offset) {
+        ret = qcow2_drop_refcount_journal(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* with QCOW2_INCOMPAT_CORRUPT, it is pretty much impossible to get here in
      * the first place; if that happens nonetheless, returning -ENOTSUP is the
      * best thing to do anyway */
@@ -2668,6 +3217,14 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
+    /* the deduplication index would be leaked otherwise */
+    if (s->dedup_index_offset) {
+        ret = qcow2_dedup_drop(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
 
@@ -2693,6 +3250,8 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     uint64_t new_size = 0;
     const char *backing_file = NULL, *backing_format = NULL;
     bool lazy_refcounts = s->use_lazy_refcounts;
+    bool refcount_journal = s->refcount_journal_offset != 0;
+    bool dedup = s->dedup_index_offset != 0;
     const char *compat = NULL;
     uint64_t cluster_size = s->cluster_size;
     bool encrypt;
@@ -2746,9 +3305,18 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         } else if (!strcmp(desc->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             lazy_refcounts = qemu_opt_get_bool(opts, BLOCK_OPT_LAZY_REFCOUNTS,
                                                lazy_refcounts);
+        } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_JOURNAL)) {
+            refcount_journal = qemu_opt_get_bool(opts,
+                                                 BLOCK_OPT_REFCOUNT_JOURNAL,
+                                                 refcount_journal);
+        } else if (!strcmp(desc->name, BLOCK_OPT_DEDUP)) {
+            dedup = qemu_opt_get_bool(opts, BLOCK_OPT_DEDUP, dedup);
         } else if (!strcmp(desc->name, BLOCK_OPT_REFCOUNT_BITS)) {
             error_report("Cannot change refcount entry width");
             return -ENOTSUP;
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            error_report("Cannot change compression type");
+            return -ENOTSUP;
         } else {
             /* if this assertion fails, this probably means a new option was
              * added without having it covered here */
@@ -2815,6 +3383,51 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
         }
     }
 
+    if ((s->refcount_journal_offset != 0) != refcount_journal) {
+        if (refcount_journal) {
+            if (s->qcow_version < 3) {
+                error_report("Refcount journals are only supported with "
+                             "compatibility level 1.1 and above (use compat=1.1 "
+                             "or greater)");
+                return -EINVAL;
+            }
+            ret = qcow2_journal_create(bs,
+                                       ROUND_UP(QCOW2_DEFAULT_JOURNAL_SIZE,
+                                                s->cluster_size));
+        } else {
+            ret = qcow2_drop_refcount_journal(bs);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if ((s->dedup_index_offset != 0) != dedup) {
+        if (dedup) {
+            if (s->qcow_version < 3) {
+                error_report("Deduplication is only supported with "
+                             "compatibility level 1.1 and above (use compat=1.1 "
+                             "or greater)");
+                return -EINVAL;
+            }
+            if (bs->encrypted) {
+                error_report("Deduplication cannot be used with encryption");
+                return -EINVAL;
+            }
+            if (s->refcount_max < 2) {
+                error_report("Deduplication requires refcount_bits of at "
+                             "least 2");
+                return -EINVAL;
+            }
+            ret = qcow2_dedup_create(bs);
+        } else {
+            ret = qcow2_dedup_drop(bs);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (new_size) {
         ret = bdrv_truncate(bs, new_size);
         if (ret < 0) {
@@ -2923,6 +3536,22 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Postpone refcount updates",
             .def_value_str = "off"
         },
+        {
+            .name = BLOCK_OPT_REFCOUNT_JOURNAL,
+            .type = QEMU_OPT_BOOL,
+            .help = "Log refcount updates in a journal and write back "
+                    "refcount blocks in batches",
+        },
+        {
+            .name = BLOCK_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share clusters with identical content",
+        },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method for compressed clusters (zlib, lzo)",
+        },
         {
             .name = BLOCK_OPT_REFCOUNT_BITS,
             .type = QEMU_OPT_NUMBER,
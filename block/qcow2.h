@@ -78,6 +78,11 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of sequential write streams that get their own host extent */
+#define QCOW2_MAX_ALLOC_EXTENTS 8
+
+#define DEFAULT_DEDUP_CACHE_BYTE_SIZE 1048576 /* bytes */
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -96,6 +101,7 @@
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
+#define QCOW2_OPT_ALLOC_EXTENT_SIZE "alloc-extent-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -162,6 +168,9 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+struct Qcow2RefcountJournal;
+typedef struct Qcow2RefcountJournal Qcow2RefcountJournal;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -179,11 +188,17 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_JOURNAL_BITNR = 2,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_JOURNAL       = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION   = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_JOURNAL
+                                 | QCOW2_INCOMPAT_COMPRESSION,
 };
 
 /* Compatible feature bits */
@@ -194,6 +209,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_DEDUP_BITNR = 0,
+    QCOW2_AUTOCLEAR_DEDUP       = 1 << QCOW2_AUTOCLEAR_DEDUP_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK        = QCOW2_AUTOCLEAR_DEDUP,
+};
+
 enum qcow2_discard_type {
     QCOW2_DISCARD_NEVER = 0,
     QCOW2_DISCARD_ALWAYS,
@@ -209,6 +232,69 @@ typedef struct Qcow2Feature {
     char    name[46];
 } QEMU_PACKED Qcow2Feature;
 
+/* Refcount journal, see docs/specs/qcow2.txt */
+#define QCOW2_JOURNAL_MAGIC             0x514a524e /* "QJRN" */
+#define QCOW2_JOURNAL_SECTOR_ENTRIES    30
+#define QCOW2_DEFAULT_JOURNAL_SIZE      (1 * 1024 * 1024)
+
+typedef struct Qcow2JournalHeaderExt {
+    uint64_t offset;
+    uint64_t size;
+} QEMU_PACKED Qcow2JournalHeaderExt;
+
+typedef struct Qcow2JournalEntry {
+    uint64_t cluster_index;
+    uint64_t refcount;
+} QEMU_PACKED Qcow2JournalEntry;
+
+typedef struct Qcow2JournalSector {
+    uint32_t magic;
+    uint32_t nb_entries;
+    uint64_t seq;
+    uint32_t crc;
+    uint32_t reserved[3];
+    Qcow2JournalEntry entries[QCOW2_JOURNAL_SECTOR_ENTRIES];
+} QEMU_PACKED Qcow2JournalSector;
+
+/* Deduplication index, see docs/specs/qcow2.txt */
+#define QCOW2_DEDUP_HASH_SIZE           16
+#define QCOW2_DEDUP_BUCKET_ENTRIES      4
+#define QCOW2_MAX_DEDUP_INDEX_SIZE      (64 * 1024 * 1024)
+
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t offset;
+    uint64_t size;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+typedef struct Qcow2DedupEntry {
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    uint64_t host_offset;       /* 0 if the entry is unused */
+    uint64_t guest_offset;
+} QEMU_PACKED Qcow2DedupEntry;
+
+/* Compression type, see docs/specs/qcow2.txt */
+enum {
+    QCOW2_COMPRESSION_TYPE_ZLIB = 0,
+    QCOW2_COMPRESSION_TYPE_LZO  = 1,
+};
+
+typedef struct Qcow2CompressionHeaderExt {
+    uint8_t type;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2CompressionHeaderExt;
+
+/*
+ * Host range reserved for the data clusters of one guest-sequential write
+ * stream. The clusters in [host_next, host_end) are free, but are skipped by
+ * all other allocations.
+ */
+typedef struct Qcow2AllocExtent {
+    uint64_t guest_next;    /* guest offset that continues the stream */
+    uint64_t host_next;
+    uint64_t host_end;      /* 0 if the slot is unused */
+    uint64_t lru_counter;
+} Qcow2AllocExtent;
+
 typedef struct Qcow2DiscardRegion {
     BlockDriverState *bs;
     uint64_t offset;
@@ -240,6 +326,15 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
+    uint64_t refcount_journal_offset;
+    uint64_t refcount_journal_size;
+    Qcow2RefcountJournal *refcount_journal;
+
+    uint64_t dedup_index_offset;
+    uint64_t dedup_index_size;
+    Qcow2Cache *dedup_index_cache; /* NULL if deduplication is inactive */
+
+    int compression_type;
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
@@ -251,8 +346,25 @@ typedef struct BDRVQcowState {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    uint64_t alloc_extent_size; /* 0 if extent reservation is disabled */
+    Qcow2AllocExtent alloc_extents[QCOW2_MAX_ALLOC_EXTENTS];
+    uint64_t alloc_extent_lru_counter;
+
+    /*
+     * Protects metadata updates and all cache misses. Lookups that hit the
+     * L2 cache and don't yield may run without it, see
+     * qcow2_get_cluster_offset_nowait().
+     */
     CoMutex lock;
 
+    /*
+     * Guest data writes in flight, counted separately for the current and the
+     * previous epoch, see qcow2_drain_data_writes()
+     */
+    unsigned int data_write_epoch;
+    unsigned int data_writes_in_flight[2];
+    CoQueue data_writes_drained;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -292,6 +404,11 @@ typedef struct BDRVQcowState {
      * override) */
     char *image_backing_file;
     char *image_backing_format;
+
+    /* VM state requests in flight and the zero_beyond_eof setting that is
+     * restored when the last of them completes */
+    int vmstate_in_flight;
+    bool vmstate_zero_beyond_eof;
 } BDRVQcowState;
 
 struct QCowAIOCB;
@@ -492,6 +609,8 @@ int qcow2_mark_corrupt(BlockDriverState *bs);
 int qcow2_mark_consistent(BlockDriverState *bs);
 int qcow2_update_header(BlockDriverState *bs);
 
+void coroutine_fn qcow2_drain_data_writes(BlockDriverState *bs);
+
 void qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
                              int64_t size, const char *message_format, ...)
                              GCC_FMT_ATTR(5, 6);
@@ -502,6 +621,8 @@ void qcow2_refcount_close(BlockDriverState *bs);
 
 int qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                        uint64_t *refcount);
+int qcow2_set_refcount(BlockDriverState *bs, int64_t cluster_index,
+                       uint64_t refcount);
 
 int qcow2_update_cluster_refcount(BlockDriverState *bs, int64_t cluster_index,
                                   uint64_t addend, bool decrease,
@@ -510,6 +631,10 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs, int64_t cluster_index,
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     int nb_clusters);
+int qcow2_alloc_clusters_extent(BlockDriverState *bs, uint64_t guest_offset,
+                                uint64_t *host_offset,
+                                unsigned int *nb_clusters);
+void qcow2_reset_alloc_extents(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -530,6 +655,39 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
 int qcow2_pre_write_overlap_check(BlockDriverState *bs, int ign, int64_t offset,
                                   int64_t size);
 
+/* qcow2-journal.c functions */
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp);
+void qcow2_journal_close(BlockDriverState *bs);
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size);
+int qcow2_journal_add(BlockDriverState *bs, int64_t cluster_index,
+                      uint64_t refcount);
+int qcow2_journal_flush(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+void qcow2_journal_depends_on_l2(BlockDriverState *bs);
+bool qcow2_journal_has_l2_dependency(BlockDriverState *bs);
+
+/* qcow2-dedup.c functions */
+int qcow2_dedup_open(BlockDriverState *bs, int flags, Error **errp);
+void qcow2_dedup_close(BlockDriverState *bs);
+int qcow2_dedup_create(BlockDriverState *bs);
+int qcow2_dedup_drop(BlockDriverState *bs);
+int qcow2_dedup_flush(BlockDriverState *bs);
+void qcow2_dedup_hash(BlockDriverState *bs, const uint8_t *buf, uint8_t *hash);
+int coroutine_fn qcow2_dedup_lookup(BlockDriverState *bs, uint64_t guest_offset,
+                                    const uint8_t *buf, const uint8_t *hash);
+void qcow2_dedup_unshare(BlockDriverState *bs, uint64_t l2_entry);
+int qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                       uint64_t guest_offset, uint64_t host_offset);
+
+/* qcow2-compress.c functions */
+int qcow2_compression_type_from_str(const char *str);
+int qcow2_compression_init(int type, Error **errp);
+int qcow2_compress_clusters(BlockDriverState *bs, const uint8_t *buf,
+                            int nb_clusters, uint8_t *out_buf, int *out_lens);
+int qcow2_decompress_buffer(BlockDriverState *bs, uint8_t *out_buf,
+                            int out_buf_size, const uint8_t *buf,
+                            int buf_size);
+
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
                         bool exact_size);
@@ -543,6 +701,10 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_get_cluster_offset_nowait(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset);
+int qcow2_get_copied_offset_nowait(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *host_offset);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *host_offset, QCowL2Meta **m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -553,6 +715,10 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_set_copied_flag(BlockDriverState *bs, uint64_t guest_offset,
+                          bool copied);
+int qcow2_link_shared_cluster(BlockDriverState *bs, uint64_t guest_offset,
+                              uint64_t host_offset);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb);
@@ -590,6 +756,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_lookup(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
+    void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
 
 #endif
@@ -24,18 +24,25 @@
 #include "qapi/qmp/qlist.h"
 #include "qapi/qmp/qstring.h"
 #include "qapi-event.h"
+#include "qemu/crc32c.h"
 
 #define HASH_LENGTH 32
 
+/* With at most this many children, reads are grouped by comparing their data
+ * directly instead of hashing them first */
+#define QUORUM_MAX_DIRECT_COMPARE 3
+
 #define QUORUM_OPT_VOTE_THRESHOLD "vote-threshold"
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
+#define QUORUM_OPT_VOTE_HASH      "vote-hash"
+#define QUORUM_OPT_EARLY          "early-agreement"
 
 /* This union holds a vote hash value */
 typedef union QuorumVoteValue {
     char h[HASH_LENGTH];       /* SHA-256 hash */
-    int64_t l;                 /* simpler 64 bits hash */
+    int64_t l;                 /* simpler 64 bits hash, e.g. CRC32C */
 } QuorumVoteValue;
 
 /* A vote item */
@@ -57,10 +64,16 @@ typedef struct QuorumVoteVersion {
     QLIST_ENTRY(QuorumVoteVersion) next;
 } QuorumVoteVersion;
 
+typedef struct QuorumChildRequest QuorumChildRequest;
+
 /* this structure holds a group of vote versions together */
 typedef struct QuorumVotes {
     QLIST_HEAD(, QuorumVoteVersion) vote_list;
     bool (*compare)(QuorumVoteValue *a, QuorumVoteValue *b);
+    QuorumChildRequest *verify; /* if set, a read only joins a version with an
+                                 * equal value if its data is equal to the
+                                 * data of the version's first read, too
+                                 */
 } QuorumVotes;
 
 /* the following structure holds the state of one quorum instance */
@@ -83,6 +96,13 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+    QuorumVoteHash vote_hash;
+    bool early_agreement;  /* true if reads complete as soon as threshold
+                            * children returned the same data
+                            */
+    int early_in_flight;   /* requests that were completed early and still
+                            * wait for the remaining children
+                            */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -92,13 +112,14 @@ typedef struct QuorumAIOCB QuorumAIOCB;
  * So for each read/write operation coming from the upper layer there will be
  * $children_count QuorumChildRequest.
  */
-typedef struct QuorumChildRequest {
+struct QuorumChildRequest {
     BlockAIOCB *aiocb;
     QEMUIOVector qiov;
-    uint8_t *buf;
+    uint8_t *buf;               /* NULL if qiov points to the calling IOV */
     int ret;
+    bool done;
     QuorumAIOCB *parent;
-} QuorumChildRequest;
+};
 
 /* Quorum will use the following structure to track progress of each read/write
  * operation received by the upper layer.
@@ -127,6 +148,7 @@ struct QuorumAIOCB {
     bool is_read;
     int vote_ret;
     int child_iter;             /* which child to read in fifo pattern */
+    bool early_done;            /* the caller has already been completed */
 };
 
 static bool quorum_vote(QuorumAIOCB *acb);
@@ -158,7 +180,12 @@ static void quorum_aio_finalize(QuorumAIOCB *acb)
         ret = acb->vote_ret;
     }
 
-    acb->common.cb(acb->common.opaque, ret);
+    if (acb->early_done) {
+        BDRVQuorumState *s = acb->common.bs->opaque;
+        s->early_in_flight--;
+    } else {
+        acb->common.cb(acb->common.opaque, ret);
+    }
 
     if (acb->is_read) {
         /* on the quorum case acb->child_iter == s->num_children - 1 */
@@ -201,14 +228,28 @@ static QuorumAIOCB *quorum_aio_get(BDRVQuorumState *s,
     acb->count = 0;
     acb->success_count = 0;
     acb->rewrite_count = 0;
-    acb->votes.compare = quorum_sha256_compare;
+    if (s->vote_hash == QUORUM_VOTE_HASH_SHA256) {
+        acb->votes.compare = quorum_sha256_compare;
+        acb->votes.verify = NULL;
+    } else {
+        /* CRC32C collisions are easy to produce, so confirm equal hashes */
+        acb->votes.compare = quorum_64bits_compare;
+        acb->votes.verify = acb->qcrs;
+    }
+    if (s->num_children <= QUORUM_MAX_DIRECT_COMPARE) {
+        /* no hashes are computed at all, versions differ by data only */
+        acb->votes.compare = quorum_64bits_compare;
+        acb->votes.verify = acb->qcrs;
+    }
     QLIST_INIT(&acb->votes.vote_list);
     acb->is_read = false;
     acb->vote_ret = 0;
+    acb->early_done = false;
 
     for (i = 0; i < s->num_children; i++) {
         acb->qcrs[i].buf = NULL;
         acb->qcrs[i].ret = 0;
+        acb->qcrs[i].done = false;
         acb->qcrs[i].parent = acb;
     }
 
@@ -277,6 +318,47 @@ static void quorum_copy_qiov(QEMUIOVector *dest, QEMUIOVector *source)
     }
 }
 
+/* Copies the data read by child i to the calling IOV unless it was read there
+ * directly */
+static void quorum_copy_result(QuorumAIOCB *acb, int i)
+{
+    if (acb->qcrs[i].buf) {
+        quorum_copy_qiov(acb->qiov, &acb->qcrs[i].qiov);
+    }
+}
+
+static bool quorum_compare(QuorumAIOCB *acb,
+                           QEMUIOVector *a,
+                           QEMUIOVector *b);
+
+/* Completes the caller of a read once threshold children, including child i
+ * that has just completed successfully, returned the same data. The request
+ * itself stays around until all children have completed.
+ */
+static void quorum_check_early_agreement(QuorumAIOCB *acb, int i)
+{
+    BDRVQuorumState *s = acb->common.bs->opaque;
+    int j, agree = 1;
+
+    for (j = 0; j < s->num_children && agree < s->threshold; j++) {
+        if (j == i || !acb->qcrs[j].done || acb->qcrs[j].ret) {
+            continue;
+        }
+        if (quorum_compare(acb, &acb->qcrs[j].qiov, &acb->qcrs[i].qiov)) {
+            agree++;
+        }
+    }
+
+    if (agree < s->threshold) {
+        return;
+    }
+
+    quorum_copy_result(acb, i);
+    acb->early_done = true;
+    s->early_in_flight++;
+    acb->common.cb(acb->common.opaque, 0);
+}
+
 static void quorum_aio_cb(void *opaque, int ret)
 {
     QuorumChildRequest *sacb = opaque;
@@ -300,6 +382,7 @@ static void quorum_aio_cb(void *opaque, int ret)
     }
 
     sacb->ret = ret;
+    sacb->done = true;
     acb->count++;
     if (ret == 0) {
         acb->success_count++;
@@ -308,10 +391,25 @@ static void quorum_aio_cb(void *opaque, int ret)
     }
     assert(acb->count <= s->num_children);
     assert(acb->success_count <= s->num_children);
+
+    /* once all children have completed, the normal vote takes over */
+    if (acb->is_read && s->early_agreement && !acb->early_done && ret == 0 &&
+        acb->count < s->num_children) {
+        quorum_check_early_agreement(acb, sacb - acb->qcrs);
+    }
+
     if (acb->count < s->num_children) {
         return;
     }
 
+    /* The caller already got data that threshold children agreed on. The
+     * remaining children may have raced with later guest writes, so their
+     * data is neither voted on nor used for rewrites. */
+    if (acb->early_done) {
+        quorum_aio_finalize(acb);
+        return;
+    }
+
     /* Do the vote on read */
     if (acb->is_read) {
         rewrite = quorum_vote(acb);
@@ -327,13 +425,13 @@ static void quorum_aio_cb(void *opaque, int ret)
 
 static void quorum_report_bad_versions(BDRVQuorumState *s,
                                        QuorumAIOCB *acb,
-                                       QuorumVoteValue *value)
+                                       QuorumVoteVersion *winner)
 {
     QuorumVoteVersion *version;
     QuorumVoteItem *item;
 
     QLIST_FOREACH(version, &acb->votes.vote_list, next) {
-        if (acb->votes.compare(&version->value, value)) {
+        if (version == winner) {
             continue;
         }
         QLIST_FOREACH(item, &version->items, next) {
@@ -343,7 +441,7 @@ static void quorum_report_bad_versions(BDRVQuorumState *s,
 }
 
 static bool quorum_rewrite_bad_versions(BDRVQuorumState *s, QuorumAIOCB *acb,
-                                        QuorumVoteValue *value)
+                                        QuorumVoteVersion *winner)
 {
     QuorumVoteVersion *version;
     QuorumVoteItem *item;
@@ -353,7 +451,7 @@ static bool quorum_rewrite_bad_versions(BDRVQuorumState *s, QuorumAIOCB *acb,
      * issues.
      */
     QLIST_FOREACH(version, &acb->votes.vote_list, next) {
-        if (acb->votes.compare(&version->value, value)) {
+        if (version == winner) {
             continue;
         }
         QLIST_FOREACH(item, &version->items, next) {
@@ -366,7 +464,7 @@ static bool quorum_rewrite_bad_versions(BDRVQuorumState *s, QuorumAIOCB *acb,
 
     /* now fire the correcting rewrites */
     QLIST_FOREACH(version, &acb->votes.vote_list, next) {
-        if (acb->votes.compare(&version->value, value)) {
+        if (version == winner) {
             continue;
         }
         QLIST_FOREACH(item, &version->items, next) {
@@ -379,6 +477,8 @@ static bool quorum_rewrite_bad_versions(BDRVQuorumState *s, QuorumAIOCB *acb,
     return count;
 }
 
+static bool quorum_iovec_compare(QEMUIOVector *a, QEMUIOVector *b);
+
 static void quorum_count_vote(QuorumVotes *votes,
                               QuorumVoteValue *value,
                               int index)
@@ -388,10 +488,16 @@ static void quorum_count_vote(QuorumVotes *votes,
 
     /* look if we have something with this hash */
     QLIST_FOREACH(v, &votes->vote_list, next) {
-        if (votes->compare(&v->value, value)) {
-            version = v;
-            break;
+        if (!votes->compare(&v->value, value)) {
+            continue;
+        }
+        if (votes->verify &&
+            !quorum_iovec_compare(&votes->verify[v->index].qiov,
+                                  &votes->verify[index].qiov)) {
+            continue;
         }
+        version = v;
+        break;
     }
 
     /* It's a version not yet in the list add it */
@@ -428,10 +534,22 @@ static void quorum_free_vote_list(QuorumVotes *votes)
 
 static int quorum_compute_hash(QuorumAIOCB *acb, int i, QuorumVoteValue *hash)
 {
+    BDRVQuorumState *s = acb->common.bs->opaque;
     int j, ret;
     gnutls_hash_hd_t dig;
     QEMUIOVector *qiov = &acb->qcrs[i].qiov;
 
+    if (s->vote_hash == QUORUM_VOTE_HASH_CRC32C) {
+        uint32_t crc = 0xffffffff;
+
+        for (j = 0; j < qiov->niov; j++) {
+            crc = crc32c(crc, qiov->iov[j].iov_base, qiov->iov[j].iov_len);
+        }
+        memset(hash, 0, sizeof(*hash));
+        hash->l = crc ^ 0xffffffff;
+        return 0;
+    }
+
     ret = gnutls_hash_init(&dig, GNUTLS_DIG_SHA256);
 
     if (ret < 0) {
@@ -536,6 +654,7 @@ static int quorum_vote_error(QuorumAIOCB *acb)
 
     QLIST_INIT(&error_votes.vote_list);
     error_votes.compare = quorum_64bits_compare;
+    error_votes.verify = NULL;
 
     for (i = 0; i < s->num_children; i++) {
         ret = acb->qcrs[i].ret;
@@ -561,7 +680,7 @@ static bool quorum_vote(QuorumAIOCB *acb)
     bool quorum = true;
     bool rewrite = false;
     int i, j, ret;
-    QuorumVoteValue hash;
+    QuorumVoteValue hash = { .l = 0 };
     BDRVQuorumState *s = acb->common.bs->opaque;
     QuorumVoteVersion *winner;
 
@@ -593,20 +712,23 @@ static bool quorum_vote(QuorumAIOCB *acb)
 
     /* Every successful read agrees */
     if (quorum) {
-        quorum_copy_qiov(acb->qiov, &acb->qcrs[i].qiov);
+        quorum_copy_result(acb, i);
         return false;
     }
 
-    /* compute hashes for each successful read, also store indexes */
+    /* compute hashes for each successful read, also store indexes; with few
+     * children the data is compared directly instead */
     for (i = 0; i < s->num_children; i++) {
         if (acb->qcrs[i].ret) {
             continue;
         }
-        ret = quorum_compute_hash(acb, i, &hash);
-        /* if ever the hash computation failed */
-        if (ret < 0) {
-            acb->vote_ret = ret;
-            goto free_exit;
+        if (s->num_children > QUORUM_MAX_DIRECT_COMPARE) {
+            ret = quorum_compute_hash(acb, i, &hash);
+            /* if ever the hash computation failed */
+            if (ret < 0) {
+                acb->vote_ret = ret;
+                goto free_exit;
+            }
         }
         quorum_count_vote(&acb->votes, &hash, i);
     }
@@ -622,14 +744,14 @@ static bool quorum_vote(QuorumAIOCB *acb)
     }
 
     /* we have a winner: copy it */
-    quorum_copy_qiov(acb->qiov, &acb->qcrs[winner->index].qiov);
+    quorum_copy_result(acb, winner->index);
 
     /* some versions are bad print them */
-    quorum_report_bad_versions(s, acb, &winner->value);
+    quorum_report_bad_versions(s, acb, winner);
 
     /* corruption correction is enabled */
     if (s->rewrite_corrupted) {
-        rewrite = quorum_rewrite_bad_versions(s, acb, &winner->value);
+        rewrite = quorum_rewrite_bad_versions(s, acb, winner);
     }
 
 free_exit:
@@ -644,8 +766,21 @@ static BlockAIOCB *read_quorum_children(QuorumAIOCB *acb)
     int i;
 
     for (i = 0; i < s->num_children; i++) {
-        acb->qcrs[i].buf = qemu_blockalign(s->bs[i], acb->qiov->size);
         qemu_iovec_init(&acb->qcrs[i].qiov, acb->qiov->niov);
+
+        /* The first child reads into the calling IOV, which saves a copy if
+         * its data wins the vote. This is not possible if the caller may be
+         * completed before the first child. */
+        if (i == 0 && !s->early_agreement) {
+            int j;
+            for (j = 0; j < acb->qiov->niov; j++) {
+                qemu_iovec_add(&acb->qcrs[i].qiov, acb->qiov->iov[j].iov_base,
+                               acb->qiov->iov[j].iov_len);
+            }
+            continue;
+        }
+
+        acb->qcrs[i].buf = qemu_blockalign(s->bs[i], acb->qiov->size);
         qemu_iovec_clone(&acb->qcrs[i].qiov, acb->qiov, acb->qcrs[i].buf);
     }
 
@@ -765,6 +900,7 @@ static coroutine_fn int quorum_co_flush(BlockDriverState *bs)
 
     QLIST_INIT(&error_votes.vote_list);
     error_votes.compare = quorum_64bits_compare;
+    error_votes.verify = NULL;
 
     for (i = 0; i < s->num_children; i++) {
         result = bdrv_co_flush(s->bs[i]);
@@ -838,6 +974,16 @@ static QemuOptsList quorum_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Allowed pattern: quorum, fifo. Quorum is default",
         },
+        {
+            .name = QUORUM_OPT_VOTE_HASH,
+            .type = QEMU_OPT_STRING,
+            .help = "Hash used for voting: sha256, crc32c. sha256 is default",
+        },
+        {
+            .name = QUORUM_OPT_EARLY,
+            .type = QEMU_OPT_BOOL,
+            .help = "Complete reads as soon as the vote threshold agrees",
+        },
         { /* end of list */ }
     },
 };
@@ -860,6 +1006,23 @@ static int parse_read_pattern(const char *opt)
     return -EINVAL;
 }
 
+static int parse_vote_hash(const char *opt)
+{
+    int i;
+
+    if (!opt) {
+        return QUORUM_VOTE_HASH_SHA256;
+    }
+
+    for (i = 0; i < QUORUM_VOTE_HASH_MAX; i++) {
+        if (!strcmp(opt, QuorumVoteHash_lookup[i])) {
+            return i;
+        }
+    }
+
+    return -EINVAL;
+}
+
 static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
                        Error **errp)
 {
@@ -925,6 +1088,21 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
             ret = -EINVAL;
             goto exit;
         }
+
+        ret = parse_vote_hash(qemu_opt_get(opts, QUORUM_OPT_VOTE_HASH));
+        if (ret < 0) {
+            error_setg(&local_err, "Please set vote-hash as sha256 or crc32c");
+            goto exit;
+        }
+        s->vote_hash = ret;
+
+        s->early_agreement = qemu_opt_get_bool(opts, QUORUM_OPT_EARLY, false);
+        if (s->early_agreement && s->is_blkverify) {
+            error_setg(&local_err,
+                       "early-agreement=on cannot be used with blkverify=on");
+            ret = -EINVAL;
+            goto exit;
+        }
     }
 
     /* allocate the children BlockDriverState array */
@@ -967,11 +1145,25 @@ exit:
     return ret;
 }
 
+/* Requests that were completed early are not tracked by the block layer any
+ * more, so they must be waited for before the children go away or change
+ * their AioContext */
+static void quorum_wait_early_requests(BlockDriverState *bs)
+{
+    BDRVQuorumState *s = bs->opaque;
+
+    while (s->early_in_flight > 0) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
 static void quorum_close(BlockDriverState *bs)
 {
     BDRVQuorumState *s = bs->opaque;
     int i;
 
+    quorum_wait_early_requests(bs);
+
     for (i = 0; i < s->num_children; i++) {
         bdrv_unref(s->bs[i]);
     }
@@ -984,6 +1176,8 @@ static void quorum_detach_aio_context(BlockDriverState *bs)
     BDRVQuorumState *s = bs->opaque;
     int i;
 
+    quorum_wait_early_requests(bs);
+
     for (i = 0; i < s->num_children; i++) {
         bdrv_detach_aio_context(s->bs[i]);
     }
@@ -1028,6 +1222,11 @@ static void quorum_refresh_filename(BlockDriverState *bs)
                   QOBJECT(qbool_from_bool(s->is_blkverify)));
     qdict_put_obj(opts, QUORUM_OPT_REWRITE,
                   QOBJECT(qbool_from_bool(s->rewrite_corrupted)));
+    qdict_put_obj(opts, QUORUM_OPT_VOTE_HASH,
+                  QOBJECT(qstring_from_str(
+                      QuorumVoteHash_lookup[s->vote_hash])));
+    qdict_put_obj(opts, QUORUM_OPT_EARLY,
+                  QOBJECT(qbool_from_bool(s->early_agreement)));
     qdict_put_obj(opts, "children", QOBJECT(children));
 
     bs->full_open_options = opts;
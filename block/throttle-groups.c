@@ -51,6 +51,16 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BDS's timers only after verifying that that BDS
  * has throttled requests in the queue.
+ *
+ * By default the members of a group take turns in a round-robin
+ * fashion. With the weighted scheduler the group instead serves its
+ * members in start-time fair queueing order: every member has a
+ * virtual start time that advances by the size of each of its
+ * requests divided by its weight, and the pending member with the
+ * lowest virtual start time gets the next slot. Members that have
+ * fallen behind their guaranteed minimum of I/O operations per second
+ * are served before all others, and members that were idle may get
+ * ahead of the group by their burst credit.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
@@ -60,12 +70,22 @@ typedef struct ThrottleGroup {
     QLIST_HEAD(, BlockDriverState) head;
     BlockDriverState *tokens[2];
     bool any_timer_armed[2];
+    ThrottleGroupScheduler scheduler;
+    uint64_t vtime[2];
+
+    /* Updated atomically by the members, see block_acct_done() */
+    BlockAcctStats stats;
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
     QTAILQ_ENTRY(ThrottleGroup) list;
 } ThrottleGroup;
 
+/* Requests smaller than this are charged as if they had this size by the
+ * weighted scheduler, so that small requests are not for free in groups
+ * that are limited by the number of operations */
+#define THROTTLE_SHARE_MIN_COST 4096
+
 static QemuMutex throttle_groups_lock;
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
@@ -100,6 +120,7 @@ static ThrottleGroup *throttle_group_incref(const char *name)
         qemu_mutex_init(&tg->lock);
         throttle_init(&tg->ts);
         QLIST_INIT(&tg->head);
+        block_acct_init(&tg->stats, false);
 
         QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     }
@@ -164,6 +185,77 @@ static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
     return next;
 }
 
+/* Return the virtual time at which the next request of a
+ * BlockDriverState starts for the weighted scheduler. A member that
+ * has been idle starts at the current virtual time of the group, minus
+ * its burst credit.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        a BlockDriverState that is member of the group
+ * @is_write:  the type of operation (read/write)
+ * @ret:       the virtual start time
+ */
+static uint64_t throttle_group_vstart(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    ThrottleShare *share = &bs->throttle_share;
+    uint64_t credit, floor;
+
+    credit = share->burst_credit * THROTTLE_SHARE_DEFAULT_WEIGHT /
+             share->weight;
+    floor = tg->vtime[is_write] > credit ? tg->vtime[is_write] - credit : 0;
+
+    return MAX(bs->throttle_vstart[is_write], floor);
+}
+
+/* Return the BlockDriverState with pending I/O requests that the
+ * weighted scheduler serves next: the one that has fallen behind its
+ * minimum the longest if there is any, otherwise the one with the
+ * lowest virtual start time.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the current BlockDriverState
+ * @is_write:  the type of operation (read/write)
+ * @ret:       the next BlockDriverState with pending requests, or bs
+ *             if there is none.
+ */
+static BlockDriverState *next_weighted_token(BlockDriverState *bs,
+                                             bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    int64_t now = qemu_clock_get_ns(bs->throttle_timers.clock_type);
+    BlockDriverState *iter, *token = NULL, *reserved = NULL;
+    uint64_t vstart, min_vstart = UINT64_MAX;
+    int64_t min_tag = INT64_MAX;
+
+    QLIST_FOREACH(iter, &tg->head, round_robin) {
+        if (!iter->pending_reqs[is_write]) {
+            continue;
+        }
+
+        if (iter->throttle_share.iops_min &&
+            iter->throttle_reserve_tag[is_write] <= now &&
+            iter->throttle_reserve_tag[is_write] < min_tag) {
+            min_tag = iter->throttle_reserve_tag[is_write];
+            reserved = iter;
+        }
+
+        vstart = throttle_group_vstart(iter, is_write);
+        if (vstart < min_vstart) {
+            min_vstart = vstart;
+            token = iter;
+        }
+    }
+
+    if (reserved) {
+        return reserved;
+    }
+
+    return token ? token : bs;
+}
+
 /* Return the next BlockDriverState in the round-robin sequence with
  * pending I/O requests.
  *
@@ -180,6 +272,10 @@ static BlockDriverState *next_throttle_token(BlockDriverState *bs,
     ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
     BlockDriverState *token, *start;
 
+    if (tg->scheduler == THROTTLE_GROUP_SCHEDULER_WEIGHTED) {
+        return next_weighted_token(bs, is_write);
+    }
+
     start = token = tg->tokens[is_write];
 
     /* get next bs round in round robin style */
@@ -257,8 +353,11 @@ static void schedule_next_request(BlockDriverState *bs, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current bs */
+        /* Give preference to requests from the current bs, unless the
+         * weighted scheduler has picked a different one */
         if (qemu_in_coroutine() &&
+            (tg->scheduler != THROTTLE_GROUP_SCHEDULER_WEIGHTED ||
+             token == bs) &&
             qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
             token = bs;
         } else {
@@ -271,6 +370,42 @@ static void schedule_next_request(BlockDriverState *bs, bool is_write)
     }
 }
 
+/* Charge an I/O request that is about to be executed to the share of
+ * a BlockDriverState, advancing its virtual start time and the one of
+ * the group, and its reservation tag if it has a minimum.
+ *
+ * This is done with both schedulers so that switching to the weighted
+ * one starts from the current state of the group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @bs:        the current BlockDriverState
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_account_share(BlockDriverState *bs,
+                                         unsigned int bytes,
+                                         bool is_write)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    ThrottleShare *share = &bs->throttle_share;
+    uint64_t vstart, cost;
+
+    vstart = throttle_group_vstart(bs, is_write);
+    cost = MAX(bytes, THROTTLE_SHARE_MIN_COST);
+
+    tg->vtime[is_write] = MAX(tg->vtime[is_write], vstart);
+    bs->throttle_vstart[is_write] = vstart +
+        cost * THROTTLE_SHARE_DEFAULT_WEIGHT / share->weight;
+
+    if (share->iops_min) {
+        int64_t now = qemu_clock_get_ns(bs->throttle_timers.clock_type);
+        bs->throttle_reserve_tag[is_write] =
+            MAX(bs->throttle_reserve_tag[is_write], now) +
+            get_ticks_per_sec() / share->iops_min;
+    }
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -295,15 +430,27 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || bs->pending_reqs[is_write]) {
+        ThrottleWaitStats *stats = &bs->throttle_wait_stats;
+        QEMUClockType clock_type = bs->throttle_timers.clock_type;
+        int64_t start = qemu_clock_get_ns(clock_type);
+        uint64_t wait;
+
         bs->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
         bs->pending_reqs[is_write]--;
+
+        wait = qemu_clock_get_ns(clock_type) - start;
+        stats->throttled[is_write]++;
+        stats->total_wait_ns[is_write] += wait;
+        stats->max_wait_ns[is_write] = MAX(stats->max_wait_ns[is_write],
+                                           wait);
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(bs->throttle_state, is_write, bytes);
+    throttle_group_account_share(bs, bytes, is_write);
 
     /* Schedule the next request */
     schedule_next_request(bs, is_write);
@@ -351,6 +498,84 @@ void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the scheduler that a throttling group uses to pick the member
+ * whose request is executed next.
+ *
+ * @bs:        a BlockDriverState that is member of the group
+ * @scheduler: the scheduler to use
+ */
+void throttle_group_set_scheduler(BlockDriverState *bs,
+                                  ThrottleGroupScheduler scheduler)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    tg->scheduler = scheduler;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the scheduler of a throttling group.
+ *
+ * @bs:  a BlockDriverState that is member of the group
+ * @ret: the scheduler of the group
+ */
+ThrottleGroupScheduler throttle_group_get_scheduler(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    ThrottleGroupScheduler scheduler;
+
+    qemu_mutex_lock(&tg->lock);
+    scheduler = tg->scheduler;
+    qemu_mutex_unlock(&tg->lock);
+
+    return scheduler;
+}
+
+/* Update the share of a BlockDriverState in the weighted scheduler of
+ * its group.
+ *
+ * @bs:    a BlockDriverState that is member of a group
+ * @share: the share to set
+ */
+void throttle_group_set_share(BlockDriverState *bs, ThrottleShare *share)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+
+    assert(share->weight > 0);
+
+    qemu_mutex_lock(&tg->lock);
+    bs->throttle_share = *share;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the share of a BlockDriverState in the weighted scheduler of its
+ * group.
+ *
+ * @bs:    a BlockDriverState that is member of a group
+ * @share: the share will be written here
+ */
+void throttle_group_get_share(BlockDriverState *bs, ThrottleShare *share)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    *share = bs->throttle_share;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the statistics about the time that the requests of a
+ * BlockDriverState have been waiting in its group.
+ *
+ * @bs:    a BlockDriverState that is member of a group
+ * @stats: the statistics will be written here
+ */
+void throttle_group_get_wait_stats(BlockDriverState *bs,
+                                   ThrottleWaitStats *stats)
+{
+    ThrottleGroup *tg = container_of(bs->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    *stats = bs->throttle_wait_stats;
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -420,6 +645,13 @@ void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
     }
 
     QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+    bs->stats.group = &tg->stats;
+
+    /* Start at the current virtual time of the group */
+    for (i = 0; i < 2; i++) {
+        bs->throttle_vstart[i] = tg->vtime[i];
+        bs->throttle_reserve_tag[i] = 0;
+    }
 
     throttle_timers_init(&bs->throttle_timers,
                          bdrv_get_aio_context(bs),
@@ -458,6 +690,7 @@ void throttle_group_unregister_bs(BlockDriverState *bs)
 
     /* remove the current bs from the list */
     QLIST_REMOVE(bs, round_robin);
+    bs->stats.group = NULL;
     throttle_timers_destroy(&bs->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
@@ -1194,6 +1194,30 @@ static void vhdx_update_bat_table_entry(BlockDriverState *bs, BDRVVHDXState *s,
 
 }
 
+/*
+ * Write the BAT entries first..last, which have already been updated in
+ * s->bat, to the image with a single log entry and flush
+ */
+static int vhdx_log_bat_entries(BlockDriverState *bs, BDRVVHDXState *s,
+                                uint32_t first, uint32_t last)
+{
+    uint32_t i, count = last - first + 1;
+    uint64_t *entries;
+    int ret;
+
+    entries = g_new(uint64_t, count);
+    for (i = 0; i < count; i++) {
+        entries[i] = cpu_to_le64(s->bat[first + i]);
+    }
+
+    ret = vhdx_log_write_and_flush(bs, s, entries,
+                                   count * sizeof(VHDXBatEntry),
+                                   s->bat_offset +
+                                   first * sizeof(VHDXBatEntry));
+    g_free(entries);
+    return ret;
+}
+
 /* Per the spec, on the first write of guest-visible data to the file the
  * data write guid must be updated in the header */
 int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
@@ -1222,6 +1246,11 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     int bat_state;
     uint64_t bat_prior_offset = 0;
     bool bat_update = false;
+    /* BAT entries of blocks allocated by this request that still need to be
+     * logged; they are written together, and always before s->lock is
+     * dropped so that nobody can see a block whose BAT entry is not stable */
+    bool bat_pending = false;
+    uint32_t bat_first = 0, bat_last = 0;
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
@@ -1325,14 +1354,35 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                     qemu_iovec_concat(&hd_qiov, qiov,  bytes_done,
                                       sinfo.bytes_avail);
                 }
+
+                if (bat_update) {
+                    /* a newly allocated block must not be visible to other
+                     * requests before its data and BAT entry are written,
+                     * so keep the lock */
+                    ret = bdrv_co_writev(bs->file,
+                                         sinfo.file_offset >> BDRV_SECTOR_BITS,
+                                         sectors_to_write, &hd_qiov);
+                    if (ret < 0) {
+                        goto error_bat_restore;
+                    }
+                    break;
+                }
+
                 /* block exists, so we can just overwrite it */
+                if (bat_pending) {
+                    bat_pending = false;
+                    ret = vhdx_log_bat_entries(bs, s, bat_first, bat_last);
+                    if (ret < 0) {
+                        goto exit;
+                    }
+                }
                 qemu_co_mutex_unlock(&s->lock);
                 ret = bdrv_co_writev(bs->file,
                                     sinfo.file_offset >> BDRV_SECTOR_BITS,
                                     sectors_to_write, &hd_qiov);
                 qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
-                    goto error_bat_restore;
+                    goto exit;
                 }
                 break;
             case PAYLOAD_BLOCK_PARTIALLY_PRESENT:
@@ -1345,14 +1395,13 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             }
 
             if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
+                /* the BAT entry goes into the log journal together with
+                 * those of the following blocks of this request */
+                if (!bat_pending) {
+                    bat_pending = true;
+                    bat_first = sinfo.bat_idx;
                 }
+                bat_last = sinfo.bat_idx;
             }
 
             nb_sectors -= sinfo.sectors_avail;
@@ -1373,6 +1422,14 @@ error_bat_restore:
                                     &bat_entry_offset, bat_state);
     }
 exit:
+    if (bat_pending) {
+        /* this will update the BAT entries into the log journal, and then
+         * flush the log journal out to disk */
+        int log_ret = vhdx_log_bat_entries(bs, s, bat_first, bat_last);
+        if (ret >= 0) {
+            ret = log_ret;
+        }
+    }
     qemu_vfree(iov1.iov_base);
     qemu_vfree(iov2.iov_base);
     qemu_co_mutex_unlock(&s->lock);
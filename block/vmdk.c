@@ -132,9 +132,23 @@ typedef struct VmdkMetaData {
     unsigned int l2_index;
     unsigned int l2_offset;
     int valid;
+    bool new_allocation;
     uint32_t *l2_cache_entry;
 } VmdkMetaData;
 
+/* The L2 table updates of one request, which are written out together.
+ * The updated entries stay in [first, last] of a copy of the L2 table, so
+ * the cached table may be evicted meanwhile. */
+typedef struct VmdkL2Batch {
+    VmdkExtent *extent;
+    unsigned int l1_index;
+    unsigned int l2_offset;
+    unsigned int first;
+    unsigned int last;
+    uint32_t *entries;
+    bool pending;
+} VmdkL2Batch;
+
 typedef struct VmdkGrainMarker {
     uint64_t lba;
     uint32_t size;
@@ -1060,33 +1074,74 @@ exit:
     return ret;
 }
 
-static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data,
-                         uint32_t offset)
+/* Write the pending L2 table updates of @batch to the image */
+static int vmdk_L2flush(VmdkL2Batch *batch)
 {
-    offset = cpu_to_le32(offset);
+    VmdkExtent *extent = batch->extent;
+    uint32_t *entries = batch->entries + batch->first;
+    int len = (batch->last - batch->first + 1) * sizeof(uint32_t);
+    int64_t l2_offset;
+
+    if (!batch->pending) {
+        return VMDK_OK;
+    }
+    batch->pending = false;
+
     /* update L2 table */
-    if (bdrv_pwrite_sync(
+    if (bdrv_pwrite(
                 extent->file,
-                ((int64_t)m_data->l2_offset * 512)
-                    + (m_data->l2_index * sizeof(offset)),
-                &offset, sizeof(offset)) < 0) {
+                ((int64_t)batch->l2_offset * 512)
+                    + (batch->first * sizeof(uint32_t)),
+                entries, len) < 0) {
         return VMDK_ERROR;
     }
     /* update backup L2 table */
     if (extent->l1_backup_table_offset != 0) {
-        m_data->l2_offset = extent->l1_backup_table[m_data->l1_index];
-        if (bdrv_pwrite_sync(
+        l2_offset = extent->l1_backup_table[batch->l1_index];
+        if (bdrv_pwrite(
                     extent->file,
-                    ((int64_t)m_data->l2_offset * 512)
-                        + (m_data->l2_index * sizeof(offset)),
-                    &offset, sizeof(offset)) < 0) {
+                    (l2_offset * 512) + (batch->first * sizeof(uint32_t)),
+                    entries, len) < 0) {
+            return VMDK_ERROR;
+        }
+    }
+    if (bdrv_flush(extent->file) < 0) {
+        return VMDK_ERROR;
+    }
+
+    return VMDK_OK;
+}
+
+/* Update the L2 entry described by @m_data in the cache and add it to
+ * @batch. The image is only updated by vmdk_L2flush(), which must be called
+ * before s->lock is dropped. */
+static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data,
+                         uint32_t offset, VmdkL2Batch *batch)
+{
+    offset = cpu_to_le32(offset);
+
+    if (batch->pending &&
+        (batch->extent != extent || batch->l2_offset != m_data->l2_offset)) {
+        if (vmdk_L2flush(batch) != VMDK_OK) {
             return VMDK_ERROR;
         }
     }
-    if (m_data->l2_cache_entry) {
-        *m_data->l2_cache_entry = offset;
+    if (!batch->pending) {
+        batch->extent = extent;
+        batch->l1_index = m_data->l1_index;
+        batch->l2_offset = m_data->l2_offset;
+        batch->first = batch->last = m_data->l2_index;
+        batch->entries = g_renew(uint32_t, batch->entries, extent->l2_size);
+        memcpy(batch->entries, m_data->l2_cache_entry - m_data->l2_index,
+               extent->l2_size * sizeof(uint32_t));
+        batch->pending = true;
     }
 
+    batch->entries[m_data->l2_index] = offset;
+    batch->first = MIN(batch->first, m_data->l2_index);
+    batch->last = MAX(batch->last, m_data->l2_index);
+    *m_data->l2_cache_entry = offset;
+
     return VMDK_OK;
 }
 
@@ -1128,6 +1183,7 @@ static int get_cluster_offset(BlockDriverState *bs,
 
     if (m_data) {
         m_data->valid = 0;
+        m_data->new_allocation = false;
     }
     if (extent->flat) {
         *cluster_offset = extent->flat_start_offset;
@@ -1196,6 +1252,9 @@ static int get_cluster_offset(BlockDriverState *bs,
             return zeroed ? VMDK_ZEROED : VMDK_UNALLOC;
         }
 
+        if (m_data) {
+            m_data->new_allocation = true;
+        }
         cluster_sector = extent->next_cluster_sector;
         extent->next_cluster_sector += extent->cluster_sectors;
 
@@ -1291,36 +1350,39 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
 }
 
 static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, const uint8_t *buf,
-                            int nb_sectors, int64_t sector_num)
+                            int64_t offset_in_cluster, QEMUIOVector *qiov,
+                            int64_t sector_num)
 {
     int ret;
     VmdkGrainMarker *data = NULL;
     uLongf buf_len;
-    const uint8_t *write_buf = buf;
-    int write_len = nb_sectors * 512;
+    uint8_t *buf = NULL;
+    int write_len = qiov->size;
     int64_t write_offset;
     int64_t write_end_sector;
 
+    write_offset = cluster_offset + offset_in_cluster;
     if (extent->compressed) {
         if (!extent->has_marker) {
             ret = -EINVAL;
             goto out;
         }
+        buf = g_malloc(qiov->size);
+        qemu_iovec_to_buf(qiov, 0, buf, qiov->size);
         buf_len = (extent->cluster_sectors << 9) * 2;
         data = g_malloc(buf_len + sizeof(VmdkGrainMarker));
-        if (compress(data->data, &buf_len, buf, nb_sectors << 9) != Z_OK ||
+        if (compress(data->data, &buf_len, buf, qiov->size) != Z_OK ||
                 buf_len == 0) {
             ret = -EINVAL;
             goto out;
         }
         data->lba = sector_num;
         data->size = buf_len;
-        write_buf = (uint8_t *)data;
         write_len = buf_len + sizeof(VmdkGrainMarker);
+        ret = bdrv_pwrite(extent->file, write_offset, data, write_len);
+    } else {
+        ret = bdrv_pwritev(extent->file, write_offset, qiov);
     }
-    write_offset = cluster_offset + offset_in_cluster,
-    ret = bdrv_pwrite(extent->file, write_offset, write_buf, write_len);
 
     write_end_sector = DIV_ROUND_UP(write_offset + write_len, BDRV_SECTOR_SIZE);
 
@@ -1334,12 +1396,15 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     ret = 0;
  out:
     g_free(data);
+    g_free(buf);
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, uint8_t *buf,
-                            int nb_sectors)
+static int coroutine_fn vmdk_read_extent(VmdkExtent *extent,
+                                         int64_t cluster_offset,
+                                         int64_t offset_in_cluster,
+                                         QEMUIOVector *qiov,
+                                         int nb_sectors)
 {
     int ret;
     int cluster_bytes, buf_bytes;
@@ -1351,14 +1416,10 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
 
 
     if (!extent->compressed) {
-        ret = bdrv_pread(extent->file,
-                          cluster_offset + offset_in_cluster,
-                          buf, nb_sectors * 512);
-        if (ret == nb_sectors * 512) {
-            return 0;
-        } else {
-            return -EIO;
-        }
+        return bdrv_co_readv(extent->file,
+                             (cluster_offset + offset_in_cluster)
+                                 >> BDRV_SECTOR_BITS,
+                             nb_sectors, qiov);
     }
     cluster_bytes = extent->cluster_sectors * 512;
     /* Read two clusters in case GrainMarker + compressed data > one cluster */
@@ -1394,7 +1455,8 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    memcpy(buf, uncomp_buf + offset_in_cluster, nb_sectors * 512);
+    qemu_iovec_from_buf(qiov, 0, uncomp_buf + offset_in_cluster,
+                        nb_sectors * 512);
     ret = 0;
 
  out:
@@ -1403,19 +1465,30 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * s->lock only protects the metadata. Allocated grains never move, so their
+ * data is read without holding it, and so is the backing file.
+ */
+static coroutine_fn int vmdk_co_readv(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
     int ret;
     uint64_t n, index_in_cluster;
+    uint64_t bytes_done = 0;
     VmdkExtent *extent = NULL;
     uint64_t cluster_offset;
+    QEMUIOVector local_qiov;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto fail;
         }
         ret = get_cluster_offset(bs, extent, NULL,
                                  sector_num << 9, false, &cluster_offset,
@@ -1425,42 +1498,46 @@ static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
         if (n > nb_sectors) {
             n = nb_sectors;
         }
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
         if (ret != VMDK_OK) {
             /* if not allocated, try to read from parent image, if exist */
             if (bs->backing_hd && ret != VMDK_ZEROED) {
                 if (!vmdk_is_cid_valid(bs)) {
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto fail;
                 }
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                qemu_co_mutex_unlock(&s->lock);
+                ret = bdrv_co_readv(bs->backing_hd, sector_num, n,
+                                    &local_qiov);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
-                    return ret;
+                    goto fail;
                 }
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(&local_qiov, 0, 0, n * 512);
             }
         } else {
+            qemu_co_mutex_unlock(&s->lock);
             ret = vmdk_read_extent(extent,
                             cluster_offset, index_in_cluster * 512,
-                            buf, n);
+                            &local_qiov, n);
+            qemu_co_mutex_lock(&s->lock);
             if (ret) {
-                return ret;
+                goto fail;
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
-}
+    ret = 0;
 
-static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
-                                     uint8_t *buf, int nb_sectors)
-{
-    int ret;
-    BDRVVmdkState *s = bs->opaque;
-    qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_read(bs, sector_num, buf, nb_sectors);
+fail:
     qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&local_qiov);
     return ret;
 }
 
@@ -1472,10 +1549,14 @@ static coroutine_fn int vmdk_co_read(BlockDriverState *bs, int64_t sector_num,
  *                with each cluster. By dry run we can find if the zero write
  *                is possible without modifying image data.
  *
+ * Must be called with s->lock held. Grains that are already allocated are
+ * overwritten without holding it; allocating writes keep it until the grain
+ * has been written, and their L2 updates are written out together.
+ *
  * Returns: error code with 0 for success.
  */
 static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                      const uint8_t *buf, int nb_sectors,
+                      QEMUIOVector *qiov, int nb_sectors,
                       bool zeroed, bool zero_dry_run)
 {
     BDRVVmdkState *s = bs->opaque;
@@ -1483,7 +1564,10 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
     int ret;
     int64_t index_in_cluster, n;
     uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
     VmdkMetaData m_data;
+    VmdkL2Batch batch = { .pending = false };
+    QEMUIOVector local_qiov;
 
     if (sector_num > bs->total_sectors) {
         error_report("Wrong offset: sector_num=0x%" PRIx64
@@ -1492,10 +1576,15 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
         return -EIO;
     }
 
+    if (qiov) {
+        qemu_iovec_init(&local_qiov, qiov->niov);
+    }
+
     while (nb_sectors > 0) {
         extent = find_extent(s, sector_num, extent);
         if (!extent) {
-            return -EIO;
+            ret = -EIO;
+            goto out;
         }
         index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
         n = extent->cluster_sectors - index_in_cluster;
@@ -1511,7 +1600,8 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
                 /* Refuse write to allocated cluster for streamOptimized */
                 error_report("Could not write to allocated cluster"
                               " for streamOptimized");
-                return -EIO;
+                ret = -EIO;
+                goto out;
             } else {
                 /* allocate */
                 ret = get_cluster_offset(bs, extent, &m_data, sector_num << 9,
@@ -1519,64 +1609,101 @@ static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
             }
         }
         if (ret == VMDK_ERROR) {
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
         }
         if (zeroed) {
-            /* Do zeroed write, buf is ignored */
-            if (extent->has_zero_grain &&
+            /* Do zeroed write, qiov is ignored */
+            if (extent->has_zero_grain && m_data.valid &&
                     index_in_cluster == 0 &&
                     n >= extent->cluster_sectors) {
                 n = extent->cluster_sectors;
                 if (!zero_dry_run) {
                     /* update L2 tables */
-                    if (vmdk_L2update(extent, &m_data, VMDK_GTE_ZEROED)
-                            != VMDK_OK) {
-                        return -EIO;
+                    if (vmdk_L2update(extent, &m_data, VMDK_GTE_ZEROED,
+                                      &batch) != VMDK_OK) {
+                        ret = -EIO;
+                        goto out;
                     }
                 }
             } else {
-                return -ENOTSUP;
+                ret = -ENOTSUP;
+                goto out;
             }
         } else {
-            ret = vmdk_write_extent(extent,
-                            cluster_offset, index_in_cluster * 512,
-                            buf, n, sector_num);
-            if (ret) {
-                return ret;
+            if (ret != VMDK_OK) {
+                /* no grain table to allocate the grain in */
+                ret = -EIO;
+                goto out;
             }
-            if (m_data.valid) {
+            qemu_iovec_reset(&local_qiov);
+            qemu_iovec_concat(&local_qiov, qiov, bytes_done, n * 512);
+
+            if (m_data.valid && m_data.new_allocation) {
+                ret = vmdk_write_extent(extent,
+                                cluster_offset, index_in_cluster * 512,
+                                &local_qiov, sector_num);
+                if (ret) {
+                    goto out;
+                }
                 /* update L2 tables */
                 if (vmdk_L2update(extent, &m_data,
-                                  cluster_offset >> BDRV_SECTOR_BITS)
-                        != VMDK_OK) {
-                    return -EIO;
+                                  cluster_offset >> BDRV_SECTOR_BITS,
+                                  &batch) != VMDK_OK) {
+                    ret = -EIO;
+                    goto out;
+                }
+            } else {
+                if (vmdk_L2flush(&batch) != VMDK_OK) {
+                    ret = -EIO;
+                    goto out;
+                }
+                qemu_co_mutex_unlock(&s->lock);
+                ret = vmdk_write_extent(extent,
+                                cluster_offset, index_in_cluster * 512,
+                                &local_qiov, sector_num);
+                qemu_co_mutex_lock(&s->lock);
+                if (ret) {
+                    goto out;
                 }
             }
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
 
         /* update CID on the first write every time the virtual disk is
          * opened */
         if (!s->cid_updated) {
             ret = vmdk_write_cid(bs, g_random_int());
             if (ret < 0) {
-                return ret;
+                goto out;
             }
             s->cid_updated = true;
         }
     }
-    return 0;
+    ret = 0;
+
+out:
+    /* grains that were written before an error are still made visible */
+    if (vmdk_L2flush(&batch) != VMDK_OK && !ret) {
+        ret = -EIO;
+    }
+    g_free(batch.entries);
+    if (qiov) {
+        qemu_iovec_destroy(&local_qiov);
+    }
+    return ret;
 }
 
-static coroutine_fn int vmdk_co_write(BlockDriverState *bs, int64_t sector_num,
-                                      const uint8_t *buf, int nb_sectors)
+static coroutine_fn int vmdk_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
 {
     int ret;
     BDRVVmdkState *s = bs->opaque;
     qemu_co_mutex_lock(&s->lock);
-    ret = vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+    ret = vmdk_write(bs, sector_num, qiov, nb_sectors, false, false);
     qemu_co_mutex_unlock(&s->lock);
     return ret;
 }
@@ -1588,7 +1715,14 @@ static int vmdk_write_compressed(BlockDriverState *bs,
 {
     BDRVVmdkState *s = bs->opaque;
     if (s->num_extents == 1 && s->extents[0].compressed) {
-        return vmdk_write(bs, sector_num, buf, nb_sectors, false, false);
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base   = (void *) buf,
+            .iov_len    = nb_sectors * BDRV_SECTOR_SIZE,
+        };
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        return vmdk_write(bs, sector_num, &qiov, nb_sectors, false, false);
     } else {
         return -ENOTSUP;
     }
@@ -2273,8 +2407,8 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_open                    = vmdk_open,
     .bdrv_check                   = vmdk_check,
     .bdrv_reopen_prepare          = vmdk_reopen_prepare,
-    .bdrv_read                    = vmdk_co_read,
-    .bdrv_write                   = vmdk_co_write,
+    .bdrv_co_readv                = vmdk_co_readv,
+    .bdrv_co_writev               = vmdk_co_writev,
     .bdrv_write_compressed        = vmdk_write_compressed,
     .bdrv_co_write_zeroes         = vmdk_co_write_zeroes,
     .bdrv_close                   = vmdk_close,
@@ -340,6 +340,24 @@ static bool check_throttle_config(ThrottleConfig *cfg, Error **errp)
     return true;
 }
 
+static bool check_throttle_share(int64_t weight, int64_t iops_min,
+                                 int64_t burst_credit, Error **errp)
+{
+    if (weight < 1 || weight > THROTTLE_SHARE_MAX_WEIGHT) {
+        error_setg(errp, "weight must be between 1 and %d",
+                   THROTTLE_SHARE_MAX_WEIGHT);
+        return false;
+    }
+
+    if (iops_min < 0 || burst_credit < 0) {
+        error_setg(errp, "iops-min and burst-credit values must be 0 or "
+                         "greater");
+        return false;
+    }
+
+    return true;
+}
+
 typedef enum { MEDIA_DISK, MEDIA_CDROM } DriveMediaType;
 
 /* Takes the ownership of bs_opts */
@@ -353,6 +371,9 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockBackend *blk;
     BlockDriverState *bs;
     ThrottleConfig cfg;
+    ThrottleShare share;
+    ThrottleGroupScheduler scheduler;
+    int64_t weight, iops_min, burst_credit;
     int snapshot = 0;
     bool copy_on_read;
     Error *error = NULL;
@@ -470,6 +491,31 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    weight = qemu_opt_get_number(opts, "throttling.weight",
+                                 THROTTLE_SHARE_DEFAULT_WEIGHT);
+    iops_min = qemu_opt_get_number(opts, "throttling.iops-min", 0);
+    burst_credit = qemu_opt_get_number(opts, "throttling.burst-credit", 0);
+
+    if (!check_throttle_share(weight, iops_min, burst_credit, &error)) {
+        error_propagate(errp, error);
+        goto early_err;
+    }
+
+    share.weight = weight;
+    share.iops_min = iops_min;
+    share.burst_credit = burst_credit;
+
+    scheduler =
+        qapi_enum_parse(ThrottleGroupScheduler_lookup,
+                        qemu_opt_get(opts, "throttling.scheduler"),
+                        THROTTLE_GROUP_SCHEDULER_MAX,
+                        THROTTLE_GROUP_SCHEDULER_ROUND_ROBIN,
+                        &error);
+    if (error) {
+        error_propagate(errp, error);
+        goto early_err;
+    }
+
     on_write_error = BLOCKDEV_ON_ERROR_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         on_write_error = parse_block_error_action(buf, 0, &error);
@@ -558,6 +604,10 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         }
         bdrv_io_limits_enable(bs, throttling_group);
         bdrv_set_io_limits(bs, &cfg);
+        throttle_group_set_share(bs, &share);
+        if (qemu_opt_get(opts, "throttling.scheduler")) {
+            throttle_group_set_scheduler(bs, scheduler);
+        }
     }
 
     if (bdrv_key_required(bs)) {
@@ -721,6 +771,10 @@ DriveInfo *drive_new(QemuOpts *all_opts, BlockInterfaceType block_default_type)
         { "iops_size",      "throttling.iops-size" },
 
         { "group",          "throttling.group" },
+        { "scheduler",      "throttling.scheduler" },
+        { "weight",         "throttling.weight" },
+        { "iops_min",       "throttling.iops-min" },
+        { "burst_credit",   "throttling.burst-credit" },
 
         { "readonly",       "read-only" },
     };
@@ -1969,9 +2023,18 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
                                bool has_iops_size,
                                int64_t iops_size,
                                bool has_group,
-                               const char *group, Error **errp)
+                               const char *group,
+                               bool has_scheduler,
+                               ThrottleGroupScheduler scheduler,
+                               bool has_weight,
+                               int64_t weight,
+                               bool has_iops_min,
+                               int64_t iops_min,
+                               bool has_burst_credit,
+                               int64_t burst_credit, Error **errp)
 {
     ThrottleConfig cfg;
+    ThrottleShare share;
     BlockDriverState *bs;
     BlockBackend *blk;
     AioContext *aio_context;
@@ -2020,6 +2083,26 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    /* Parameters of the share that are omitted stay unchanged */
+    share = bs->throttle_share;
+    if (!has_weight) {
+        weight = share.weight;
+    }
+    if (!has_iops_min) {
+        iops_min = share.iops_min;
+    }
+    if (!has_burst_credit) {
+        burst_credit = share.burst_credit;
+    }
+
+    if (!check_throttle_share(weight, iops_min, burst_credit, errp)) {
+        return;
+    }
+
+    share.weight = weight;
+    share.iops_min = iops_min;
+    share.burst_credit = burst_credit;
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
@@ -2033,6 +2116,10 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         }
         /* Set the new throttling configuration */
         bdrv_set_io_limits(bs, &cfg);
+        throttle_group_set_share(bs, &share);
+        if (has_scheduler) {
+            throttle_group_set_scheduler(bs, scheduler);
+        }
     } else if (bs->io_limits_enabled) {
         /* If all throttling settings are set to 0, disable I/O limits */
         bdrv_io_limits_disable(bs);
@@ -3222,6 +3309,23 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.scheduler",
+            .type = QEMU_OPT_STRING,
+            .help = "scheduler of the throttling group (round-robin, "
+                    "weighted)",
+        },{
+            .name = "throttling.weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "weight of the drive in its throttling group",
+        },{
+            .name = "throttling.iops-min",
+            .type = QEMU_OPT_NUMBER,
+            .help = "guaranteed I/O operations per second",
+        },{
+            .name = "throttling.burst-credit",
+            .type = QEMU_OPT_NUMBER,
+            .help = "bytes that an idle drive may issue ahead of its share",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
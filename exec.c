@@ -1660,6 +1660,57 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+static void *qemu_ram_mmap_private(void *vaddr, ram_addr_t length, int fd,
+                                   off_t fd_offset)
+{
+    if (fd >= 0) {
+        return mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd, fd_offset);
+    }
+    return mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+}
+
+/*
+ * Replaces [offset, offset + length) of a block of private anonymous memory
+ * with a copy-on-write mapping of fd at fd_offset, or with fresh zero pages
+ * if fd is -1.  Returns -ENOTSUP for other kinds of blocks.  On failure the
+ * range holds zero pages.
+ */
+int qemu_ram_map_private(RAMBlock *block, ram_addr_t offset,
+                         ram_addr_t length, int fd, off_t fd_offset)
+{
+    void *vaddr, *area;
+    int ret = 0;
+
+    if ((block->flags & (RAM_PREALLOC | RAM_SHARED)) || block->fd >= 0 ||
+        xen_enabled() || phys_mem_alloc != qemu_anon_ram_alloc) {
+        return -ENOTSUP;
+    }
+    assert(offset + length <= block->max_length);
+
+    vaddr = ramblock_ptr(block, offset);
+    area = qemu_ram_mmap_private(vaddr, length, fd, fd_offset);
+    if (area != vaddr) {
+        /* A failed MAP_FIXED may already have unmapped the old memory */
+        ret = -errno;
+        area = qemu_ram_mmap_private(vaddr, length, -1, 0);
+        if (area != vaddr) {
+            fprintf(stderr, "Could not remap addr: "
+                    RAM_ADDR_FMT "@" RAM_ADDR_FMT "\n",
+                    length, block->offset + offset);
+            exit(1);
+        }
+    }
+
+    memory_try_enable_merging(vaddr, length);
+    qemu_ram_setup_dump(vaddr, length);
+    qemu_madvise(vaddr, length, QEMU_MADV_HUGEPAGE);
+    qemu_madvise(vaddr, length, QEMU_MADV_DONTFORK);
+
+    return ret;
+}
 #endif /* !_WIN32 */
 
 int qemu_get_ram_fd(ram_addr_t addr)
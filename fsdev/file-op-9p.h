@@ -76,6 +76,8 @@ typedef struct FsDriverEntry {
     char *path;
     int export_flags;
     FileOperations *ops;
+    int max_requests;
+    int64_t attr_timeout;
 } FsDriverEntry;
 
 typedef struct FsContext
@@ -73,6 +73,8 @@ int qemu_fsdev_add(QemuOpts *opts)
     } else {
         fsle->fse.export_flags &= ~V9FS_RDONLY;
     }
+    fsle->fse.max_requests = qemu_opt_get_number(opts, "max_requests", 0);
+    fsle->fse.attr_timeout = qemu_opt_get_number(opts, "attr_timeout", 0);
 
     if (fsle->fse.ops->parse_opts) {
         if (fsle->fse.ops->parse_opts(opts, &fsle->fse)) {
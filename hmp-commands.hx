@@ -311,19 +311,28 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save the RAM while the VM keeps running",
         .mhandler.cmd = hmp_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the RAM is saved while the virtual machine keeps
+running, and the virtual machine is only stopped to save the memory that
+it changed in the meantime and the state of its devices. The stop takes
+about as long as the maximum downtime set with @code{migrate_set_downtime}.
+The monitor waits until the snapshot is complete. Meanwhile, other
+monitors cannot save, load or delete snapshots, migrate, or remove the
+drive that receives the VM state.
 ETEXI
 
     {
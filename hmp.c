@@ -419,6 +419,17 @@ static void print_block_info(Monitor *mon, BlockInfo *info,
                         inserted->group);
     }
 
+    if (inserted->has_scheduler &&
+        inserted->scheduler == THROTTLE_GROUP_SCHEDULER_WEIGHTED) {
+        monitor_printf(mon, "    I/O scheduler:    weighted"
+                        " weight=%" PRId64
+                        " iops_min=%" PRId64
+                        " burst_credit=%" PRId64 "\n",
+                        inserted->weight,
+                        inserted->iops_min,
+                        inserted->burst_credit);
+    }
+
     if (verbose) {
         monitor_printf(mon, "\nImages:\n");
         image_info = inserted->image;
@@ -566,6 +577,16 @@ void hmp_info_vnc(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "    username: %s\n",
                            client->value->has_sasl_username ?
                            client->value->sasl_username : "none");
+            if (client->value->has_updates) {
+                monitor_printf(mon, "     updates: %" PRId64
+                               " (%" PRId64 " us encoding)\n",
+                               client->value->updates,
+                               client->value->encode_time / 1000);
+                monitor_printf(mon, "       bytes: %" PRId64 " encoded, %"
+                               PRId64 " sent\n",
+                               client->value->encoded_bytes,
+                               client->value->sent_bytes);
+            }
         }
     }
 
@@ -1362,7 +1383,15 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               false, /* No default I/O size */
                               0,
                               false,
-                              NULL, &err);
+                              NULL,
+                              false, /* No scheduler settings via HMP */
+                              0,
+                              false,
+                              0,
+                              false,
+                              0,
+                              false,
+                              0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -26,7 +26,7 @@ int v9fs_co_readdir_r(V9fsPDU *pdu, V9fsFidState *fidp, struct dirent *dent,
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             errno = 0;
             err = s->ops->readdir_r(&s->ctx, &fidp->fs, dent, result);
@@ -47,7 +47,7 @@ off_t v9fs_co_telldir(V9fsPDU *pdu, V9fsFidState *fidp)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->telldir(&s->ctx, &fidp->fs);
             if (err < 0) {
@@ -63,7 +63,7 @@ void v9fs_co_seekdir(V9fsPDU *pdu, V9fsFidState *fidp, off_t offset)
     if (v9fs_request_cancelled(pdu)) {
         return;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             s->ops->seekdir(&s->ctx, &fidp->fs, offset);
         });
@@ -75,7 +75,7 @@ void v9fs_co_rewinddir(V9fsPDU *pdu, V9fsFidState *fidp)
     if (v9fs_request_cancelled(pdu)) {
         return;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             s->ops->rewinddir(&s->ctx, &fidp->fs);
         });
@@ -97,7 +97,7 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
     cred.fc_uid = uid;
     cred.fc_gid = gid;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->mkdir(&s->ctx, &fidp->path, name->data,  &cred);
             if (err < 0) {
@@ -114,6 +114,7 @@ int v9fs_co_mkdir(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -127,7 +128,7 @@ int v9fs_co_opendir(V9fsPDU *pdu, V9fsFidState *fidp)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->opendir(&s->ctx, &fidp->path, &fidp->fs);
             if (err < 0) {
@@ -154,7 +155,7 @@ int v9fs_co_closedir(V9fsPDU *pdu, V9fsFidOpenState *fs)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->closedir(&s->ctx, fs);
             if (err < 0) {
@@ -15,8 +15,110 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu/thread.h"
 #include "block/coroutine.h"
+#include "qemu/timer.h"
 #include "virtio-9p-coth.h"
 
+/* Drop the whole attribute cache when it grows beyond this many entries */
+#define V9FS_ATTR_CACHE_MAX 16384
+
+typedef struct V9fsAttrEntry {
+    struct stat stbuf;
+    int64_t expires;
+} V9fsAttrEntry;
+
+static guint v9fs_path_hash(gconstpointer key)
+{
+    const V9fsPath *path = key;
+    guint h = 5381;
+    int i;
+
+    for (i = 0; i < path->size; i++) {
+        h = h * 33 + (unsigned char)path->data[i];
+    }
+    return h;
+}
+
+static gboolean v9fs_path_equal(gconstpointer a, gconstpointer b)
+{
+    const V9fsPath *pa = a, *pb = b;
+
+    return pa->size == pb->size && !memcmp(pa->data, pb->data, pa->size);
+}
+
+static void v9fs_path_key_free(gpointer key)
+{
+    v9fs_path_free(key);
+    g_free(key);
+}
+
+/*
+ * The attribute cache is only ever touched from the QEMU thread.  Entries
+ * are dropped by the operations that change a file's attributes; the
+ * timeout bounds how long changes made on the host side go unnoticed.
+ * A timeout of 0 disables the cache.
+ */
+void v9fs_attr_cache_init(V9fsState *s, int64_t timeout_ms)
+{
+    s->attr_timeout = timeout_ms * SCALE_MS;
+    if (s->attr_timeout) {
+        s->attr_cache = g_hash_table_new_full(v9fs_path_hash, v9fs_path_equal,
+                                              v9fs_path_key_free, g_free);
+    }
+}
+
+void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path)
+{
+    if (s->attr_cache) {
+        g_hash_table_remove(s->attr_cache, path);
+        s->attr_cache_gen++;
+    }
+}
+
+void v9fs_attr_cache_flush(V9fsState *s)
+{
+    if (s->attr_cache) {
+        g_hash_table_remove_all(s->attr_cache);
+        s->attr_cache_gen++;
+    }
+}
+
+static bool v9fs_attr_cache_lookup(V9fsState *s, V9fsPath *path,
+                                   struct stat *stbuf)
+{
+    V9fsAttrEntry *entry;
+
+    if (!s->attr_cache) {
+        return false;
+    }
+    entry = g_hash_table_lookup(s->attr_cache, path);
+    if (!entry) {
+        return false;
+    }
+    if (entry->expires <= qemu_clock_get_ns(QEMU_CLOCK_REALTIME)) {
+        g_hash_table_remove(s->attr_cache, path);
+        return false;
+    }
+    *stbuf = entry->stbuf;
+    return true;
+}
+
+static void v9fs_attr_cache_insert(V9fsState *s, V9fsPath *path,
+                                   const struct stat *stbuf)
+{
+    V9fsAttrEntry *entry;
+    V9fsPath *key;
+
+    if (g_hash_table_size(s->attr_cache) >= V9FS_ATTR_CACHE_MAX) {
+        g_hash_table_remove_all(s->attr_cache);
+    }
+    key = g_new0(V9fsPath, 1);
+    v9fs_path_copy(key, path);
+    entry = g_new(V9fsAttrEntry, 1);
+    entry->stbuf = *stbuf;
+    entry->expires = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + s->attr_timeout;
+    g_hash_table_replace(s->attr_cache, key, entry);
+}
+
 int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
                    V9fsStatDotl *v9stat)
 {
@@ -28,7 +130,7 @@ int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
     }
     if (s->ctx.exops.get_st_gen) {
         v9fs_path_read_lock(s);
-        v9fs_co_run_in_worker(
+        v9fs_co_run_in_worker(s,
             {
                 err = s->ctx.exops.get_st_gen(&s->ctx, path, st_mode,
                                               &v9stat->st_gen);
@@ -44,13 +146,18 @@ int v9fs_co_st_gen(V9fsPDU *pdu, V9fsPath *path, mode_t st_mode,
 int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
 {
     int err;
+    unsigned int gen;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
+    if (v9fs_attr_cache_lookup(s, path, stbuf)) {
+        return 0;
+    }
+    gen = s->attr_cache_gen;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->lstat(&s->ctx, path, stbuf);
             if (err < 0) {
@@ -58,6 +165,10 @@ int v9fs_co_lstat(V9fsPDU *pdu, V9fsPath *path, struct stat *stbuf)
             }
         });
     v9fs_path_unlock(s);
+    /* Don't cache a result that raced with a modification */
+    if (!err && s->attr_cache && gen == s->attr_cache_gen) {
+        v9fs_attr_cache_insert(s, path, stbuf);
+    }
     return err;
 }
 
@@ -69,7 +180,7 @@ int v9fs_co_fstat(V9fsPDU *pdu, V9fsFidState *fidp, struct stat *stbuf)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->fstat(&s->ctx, fidp->fid_type, &fidp->fs, stbuf);
             if (err < 0) {
@@ -102,7 +213,7 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->open(&s->ctx, &fidp->path, flags, &fidp->fs);
             if (err == -1) {
@@ -111,6 +222,9 @@ int v9fs_co_open(V9fsPDU *pdu, V9fsFidState *fidp, int flags)
                 err = 0;
             }
         });
+    if (flags & O_TRUNC) {
+        v9fs_attr_cache_invalidate(s, &fidp->path);
+    }
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -126,7 +240,7 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
 {
     int err;
     FsCred cred;
-    V9fsPath path;
+    V9fsPath path, dirpath;
     V9fsState *s = pdu->s;
 
     if (v9fs_request_cancelled(pdu)) {
@@ -142,7 +256,10 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
      * be used by any other operation.
      */
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    /* fidp->path is switched to the new file below */
+    v9fs_path_init(&dirpath);
+    v9fs_path_copy(&dirpath, &fidp->path);
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->open2(&s->ctx, &fidp->path,
                                 name->data, flags, &cred, &fidp->fs);
@@ -165,6 +282,8 @@ int v9fs_co_open2(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, gid_t gid,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &dirpath);
+    v9fs_path_free(&dirpath);
     v9fs_path_unlock(s);
     if (!err) {
         total_open_fd++;
@@ -183,7 +302,7 @@ int v9fs_co_close(V9fsPDU *pdu, V9fsFidOpenState *fs)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->close(&s->ctx, fs);
             if (err < 0) {
@@ -204,7 +323,7 @@ int v9fs_co_fsync(V9fsPDU *pdu, V9fsFidState *fidp, int datasync)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->fsync(&s->ctx, fidp->fid_type, &fidp->fs, datasync);
             if (err < 0) {
@@ -224,7 +343,7 @@ int v9fs_co_link(V9fsPDU *pdu, V9fsFidState *oldfid,
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->link(&s->ctx, &oldfid->path,
                                &newdirfid->path, name->data);
@@ -232,6 +351,8 @@ int v9fs_co_link(V9fsPDU *pdu, V9fsFidState *oldfid,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &oldfid->path);
+    v9fs_attr_cache_invalidate(s, &newdirfid->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -245,13 +366,14 @@ int v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->pwritev(&s->ctx, &fidp->fs, iov, iovcnt, offset);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     return err;
 }
 
@@ -264,7 +386,7 @@ int v9fs_co_preadv(V9fsPDU *pdu, V9fsFidState *fidp,
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->preadv(&s->ctx, &fidp->fs, iov, iovcnt, offset);
             if (err < 0) {
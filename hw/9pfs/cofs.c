@@ -58,7 +58,7 @@ int v9fs_co_readlink(V9fsPDU *pdu, V9fsPath *path, V9fsString *buf)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = __readlink(s, path, buf);
             if (err < 0) {
@@ -78,7 +78,7 @@ int v9fs_co_statfs(V9fsPDU *pdu, V9fsPath *path, struct statfs *stbuf)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->statfs(&s->ctx, path, stbuf);
             if (err < 0) {
@@ -101,13 +101,14 @@ int v9fs_co_chmod(V9fsPDU *pdu, V9fsPath *path, mode_t mode)
     cred_init(&cred);
     cred.fc_mode = mode;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->chmod(&s->ctx, path, &cred);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -122,13 +123,14 @@ int v9fs_co_utimensat(V9fsPDU *pdu, V9fsPath *path,
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->utimensat(&s->ctx, path, times);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -146,13 +148,14 @@ int v9fs_co_chown(V9fsPDU *pdu, V9fsPath *path, uid_t uid, gid_t gid)
     cred.fc_uid = uid;
     cred.fc_gid = gid;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->chown(&s->ctx, path, &cred);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -166,13 +169,14 @@ int v9fs_co_truncate(V9fsPDU *pdu, V9fsPath *path, off_t size)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->truncate(&s->ctx, path, size);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_invalidate(s, path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -194,7 +198,7 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
     cred.fc_mode = mode;
     cred.fc_rdev = dev;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->mknod(&s->ctx, &fidp->path, name->data, &cred);
             if (err < 0) {
@@ -211,6 +215,7 @@ int v9fs_co_mknod(V9fsPDU *pdu, V9fsFidState *fidp, V9fsString *name, uid_t uid,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &fidp->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -225,13 +230,14 @@ int v9fs_co_remove(V9fsPDU *pdu, V9fsPath *path)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->remove(&s->ctx, path->data);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     v9fs_path_unlock(s);
     return err;
 }
@@ -245,13 +251,14 @@ int v9fs_co_unlinkat(V9fsPDU *pdu, V9fsPath *path, V9fsString *name, int flags)
         return -EINTR;
     }
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->unlinkat(&s->ctx, path, name->data, flags);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     v9fs_path_unlock(s);
     return err;
 }
@@ -265,13 +272,14 @@ int v9fs_co_rename(V9fsPDU *pdu, V9fsPath *oldpath, V9fsPath *newpath)
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->rename(&s->ctx, oldpath->data, newpath->data);
             if (err < 0) {
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -284,7 +292,7 @@ int v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath, V9fsString *oldname,
     if (v9fs_request_cancelled(pdu)) {
         return -EINTR;
     }
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->renameat(&s->ctx, olddirpath, oldname->data,
                                    newdirpath, newname->data);
@@ -292,6 +300,7 @@ int v9fs_co_renameat(V9fsPDU *pdu, V9fsPath *olddirpath, V9fsString *oldname,
                 err = -errno;
             }
         });
+    v9fs_attr_cache_flush(s);
     return err;
 }
 
@@ -311,7 +320,7 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
     cred.fc_gid = gid;
     cred.fc_mode = 0777;
     v9fs_path_read_lock(s);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_in_worker(s,
         {
             err = s->ops->symlink(&s->ctx, oldpath, &dfidp->path,
                                   name->data, &cred);
@@ -329,6 +338,7 @@ int v9fs_co_symlink(V9fsPDU *pdu, V9fsFidState *dfidp, V9fsString *name,
                 v9fs_path_free(&path);
             }
         });
+    v9fs_attr_cache_invalidate(s, &dfidp->path);
     v9fs_path_unlock(s);
     return err;
 }
@@ -352,7 +362,7 @@ int v9fs_co_name_to_path(V9fsPDU *pdu, V9fsPath *dirpath,
         if (v9fs_request_cancelled(pdu)) {
             return -EINTR;
         }
-        v9fs_co_run_in_worker(
+        v9fs_co_run_in_worker(s,
             {
                 err = s->ops->name_to_path(&s->ctx, dirpath, name, path);
                 if (err < 0) {
@@ -15,6 +15,7 @@
 #include "fsdev/qemu-fsdev.h"
 #include "qemu/thread.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 #include "block/coroutine.h"
 #include "virtio-9p-coth.h"
 
@@ -27,13 +28,35 @@ void co_run_in_worker_bh(void *opaque)
     g_thread_pool_push(v9fs_pool.pool, co, NULL);
 }
 
+void coroutine_fn v9fs_co_worker_enter(V9fsState *s)
+{
+    while (s->max_requests && s->worker_requests >= s->max_requests) {
+        qemu_co_queue_wait(&s->worker_queue);
+    }
+    s->worker_requests++;
+}
+
+void v9fs_co_worker_leave(V9fsState *s)
+{
+    s->worker_requests--;
+    qemu_co_queue_next(&s->worker_queue);
+}
+
 static void v9fs_qemu_process_req_done(EventNotifier *e)
 {
     Coroutine *co;
 
     event_notifier_test_and_clear(e);
 
-    while ((co = g_async_queue_try_pop(v9fs_pool.completed)) != NULL) {
+    /*
+     * Workers only kick the notifier when pending goes from 0 to 1, so
+     * keep going until every completion accounted for has been seen.
+     * A worker that has already bumped pending is about to push its
+     * coroutine, so the blocking pop below waits only very briefly.
+     */
+    while (atomic_read(&v9fs_pool.pending) > 0) {
+        co = g_async_queue_pop(v9fs_pool.completed);
+        atomic_dec(&v9fs_pool.pending);
         qemu_coroutine_enter(co, NULL);
     }
 }
@@ -41,12 +64,19 @@ static void v9fs_qemu_process_req_done(EventNotifier *e)
 static void v9fs_thread_routine(gpointer data, gpointer user_data)
 {
     Coroutine *co = data;
+    bool kick;
 
     qemu_coroutine_enter(co, NULL);
 
+    /*
+     * Batch completions: only the first one of a burst needs to wake up
+     * the QEMU thread, which then drains the whole queue.
+     */
+    kick = atomic_fetch_inc(&v9fs_pool.pending) == 0;
     g_async_queue_push(v9fs_pool.completed, co);
-
-    event_notifier_set(&v9fs_pool.e);
+    if (kick) {
+        event_notifier_set(&v9fs_pool.e);
+    }
 }
 
 int v9fs_init_worker_threads(void)
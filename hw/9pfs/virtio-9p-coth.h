@@ -25,6 +25,8 @@ typedef struct V9fsThPool {
 
     GThreadPool *pool;
     GAsyncQueue *completed;
+    /* completions pushed or about to be pushed, but not yet processed */
+    int pending;
 } V9fsThPool;
 
 /*
@@ -36,10 +38,14 @@ typedef struct V9fsThPool {
  *   3. Enter the coroutine in the worker thread.
  * we cannot swap step 1 and 2, because that would imply worker thread
  * can enter coroutine while step1 is still running
+ *
+ * At most s->max_requests requests of an export run in worker threads
+ * at the same time; others wait in the QEMU thread for a free slot.
  */
-#define v9fs_co_run_in_worker(code_block)                               \
+#define v9fs_co_run_in_worker(s, code_block)                            \
     do {                                                                \
         QEMUBH *co_bh;                                                  \
+        v9fs_co_worker_enter(s);                                        \
         co_bh = qemu_bh_new(co_run_in_worker_bh,                        \
                             qemu_coroutine_self());                     \
         qemu_bh_schedule(co_bh);                                        \
@@ -52,9 +58,15 @@ typedef struct V9fsThPool {
         code_block;                                                     \
         /* re-enter back to qemu thread */                              \
         qemu_coroutine_yield();                                         \
+        v9fs_co_worker_leave(s);                                        \
     } while (0)
 
 extern void co_run_in_worker_bh(void *);
+extern void coroutine_fn v9fs_co_worker_enter(V9fsState *s);
+extern void v9fs_co_worker_leave(V9fsState *s);
+extern void v9fs_attr_cache_init(V9fsState *s, int64_t timeout_ms);
+extern void v9fs_attr_cache_invalidate(V9fsState *s, V9fsPath *path);
+extern void v9fs_attr_cache_flush(V9fsState *s);
 extern int v9fs_init_worker_threads(void);
 extern int v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
 extern int v9fs_co_readdir_r(V9fsPDU *, V9fsFidState *,
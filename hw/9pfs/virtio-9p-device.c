@@ -51,6 +51,12 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
     FsDriverEntry *fse;
     V9fsPath path;
 
+    if (s->queue_size < 2 || s->queue_size > VIRTQUEUE_MAX_SIZE) {
+        error_setg(errp, "queue_size must be between 2 and %d",
+                   VIRTQUEUE_MAX_SIZE);
+        return;
+    }
+
     virtio_init(vdev, "virtio-9p", VIRTIO_ID_9P,
                 sizeof(struct virtio_9p_config) + MAX_TAG_LEN);
 
@@ -61,7 +67,7 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
         QLIST_INSERT_HEAD(&s->free_list, &s->pdus[i], next);
     }
 
-    s->vq = virtio_add_queue(vdev, MAX_REQ, handle_9p_output);
+    s->vq = virtio_add_queue(vdev, s->queue_size, handle_9p_output);
 
     v9fs_path_init(&path);
 
@@ -99,6 +105,9 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
     s->config_size = sizeof(struct virtio_9p_config) + len;
     s->fid_list = NULL;
     qemu_co_rwlock_init(&s->rename_lock);
+    s->max_requests = fse->max_requests;
+    qemu_co_queue_init(&s->worker_queue);
+    v9fs_attr_cache_init(s, fse->attr_timeout);
 
     if (s->ops->init(&s->ctx) < 0) {
         error_setg(errp, "Virtio-9p Failed to initialize fs-driver with id:%s"
@@ -142,6 +151,7 @@ out:
 static Property virtio_9p_properties[] = {
     DEFINE_PROP_STRING("mount_tag", V9fsState, fsconf.tag),
     DEFINE_PROP_STRING("fsdev", V9fsState, fsconf.fsdev_id),
+    DEFINE_PROP_UINT16("queue_size", V9fsState, queue_size, V9FS_QUEUE_SIZE),
     DEFINE_PROP_END_OF_LIST(),
 };
 
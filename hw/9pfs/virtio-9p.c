@@ -1720,37 +1720,46 @@ static void v9fs_read(void *opaque)
     } else if (fidp->fid_type == P9_FID_FILE) {
         QEMUIOVector qiov_full;
         QEMUIOVector qiov;
+        QEMUIOVector *cur = &qiov_full;
         int32_t len;
 
+        /*
+         * The data is read straight into the guest buffers; only a short
+         * read needs a trimmed copy of the scatter-gather list.
+         */
         v9fs_init_qiov_from_pdu(&qiov_full, pdu, offset + 4, max_count, false);
         qemu_iovec_init(&qiov, qiov_full.niov);
         do {
-            qemu_iovec_reset(&qiov);
-            qemu_iovec_concat(&qiov, &qiov_full, count, qiov_full.size - count);
+            if (count) {
+                qemu_iovec_reset(&qiov);
+                qemu_iovec_concat(&qiov, &qiov_full, count,
+                                  qiov_full.size - count);
+                cur = &qiov;
+            }
             if (0) {
-                print_sg(qiov.iov, qiov.niov);
+                print_sg(cur->iov, cur->niov);
             }
             /* Loop in case of EINTR */
             do {
-                len = v9fs_co_preadv(pdu, fidp, qiov.iov, qiov.niov, off);
+                len = v9fs_co_preadv(pdu, fidp, cur->iov, cur->niov, off);
                 if (len >= 0) {
                     off   += len;
                     count += len;
                 }
             } while (len == -EINTR && !pdu->cancelled);
-            if (len < 0) {
-                /* IO error return the error */
-                err = len;
-                goto out;
-            }
-        } while (count < max_count && len > 0);
+        } while (len > 0 && count < qiov_full.size);
+        qemu_iovec_destroy(&qiov);
+        qemu_iovec_destroy(&qiov_full);
+        if (len < 0) {
+            /* IO error return the error */
+            err = len;
+            goto out;
+        }
         err = pdu_marshal(pdu, offset, "d", count);
         if (err < 0) {
             goto out;
         }
         err += offset + count;
-        qemu_iovec_destroy(&qiov);
-        qemu_iovec_destroy(&qiov_full);
     } else if (fidp->fid_type == P9_FID_XATTR) {
         err = v9fs_xattr_read(s, pdu, fidp, off, max_count);
     } else {
@@ -1979,16 +1988,26 @@ static void v9fs_write(void *opaque)
         err = -EINVAL;
         goto out;
     }
+    /*
+     * The data is written straight from the guest buffers; only a short
+     * write needs a trimmed copy of the scatter-gather list.
+     */
     qemu_iovec_init(&qiov, qiov_full.niov);
     do {
-        qemu_iovec_reset(&qiov);
-        qemu_iovec_concat(&qiov, &qiov_full, total, qiov_full.size - total);
+        QEMUIOVector *cur = &qiov_full;
+
+        if (total) {
+            qemu_iovec_reset(&qiov);
+            qemu_iovec_concat(&qiov, &qiov_full, total,
+                              qiov_full.size - total);
+            cur = &qiov;
+        }
         if (0) {
-            print_sg(qiov.iov, qiov.niov);
+            print_sg(cur->iov, cur->niov);
         }
         /* Loop in case of EINTR */
         do {
-            len = v9fs_co_pwritev(pdu, fidp, qiov.iov, qiov.niov, off);
+            len = v9fs_co_pwritev(pdu, fidp, cur->iov, cur->niov, off);
             if (len >= 0) {
                 off   += len;
                 total += len;
@@ -144,6 +144,11 @@ struct V9fsPDU
 
 #define MAX_REQ         128
 #define MAX_TAG_LEN     32
+/*
+ * Default virtqueue size.  Each descriptor maps a guest page of a request,
+ * so this is what allows the guest to negotiate an msize of several MB.
+ */
+#define V9FS_QUEUE_SIZE VIRTQUEUE_MAX_SIZE
 
 #define BUG_ON(cond) assert(!(cond))
 
@@ -219,6 +224,15 @@ typedef struct V9fsState
     int32_t root_fid;
     Error *migration_blocker;
     V9fsConf fsconf;
+    uint16_t queue_size;
+    /* requests running in worker threads, bounded by max_requests if set */
+    int max_requests;
+    int worker_requests;
+    CoQueue worker_queue;
+    /* lstat results keyed by V9fsPath, valid for attr_timeout ns */
+    GHashTable *attr_cache;
+    int64_t attr_timeout;
+    unsigned int attr_cache_gen;
 } V9fsState;
 
 typedef struct V9fsStatState {
@@ -18,6 +18,10 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * Optional properties:
+ *      num_queues=<n>      number of queues, admin queue included (2-2048)
+ *      iothread=<id>       process I/O queues in the given IOThread
  */
 
 #include <hw/block/block.h>
@@ -25,12 +29,106 @@
 #include <hw/pci/msix.h>
 #include <hw/pci/pci.h>
 #include "sysemu/sysemu.h"
+#include "sysemu/kvm.h"
+#include "sysemu/iothread.h"
 #include "qapi/visitor.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
 #include "sysemu/block-backend.h"
 
 #include "nvme.h"
 
+/* One MSI-X vector per queue, and MSI-X has at most 2048 of them */
+#define NVME_MAX_QUEUES 2048
+
 static void nvme_process_sq(void *opaque);
+static void nvme_process_admin_sq(void *opaque);
+
+/*
+ * Guest memory accesses of the controller.  With an IOThread the I/O
+ * queues run without the global mutex, so only RAM may be accessed:
+ * anything else (MMIO, unassigned space) fails like a DMA error rather
+ * than calling into other devices.
+ */
+static bool nvme_addr_is_ram(NvmeCtrl *n, hwaddr addr, hwaddr len,
+                             bool is_write, MemoryRegionSection *section)
+{
+    AddressSpace *as = pci_get_address_space(&n->parent_obj);
+
+    *section = memory_region_find(as->root, addr, len);
+    if (!section->mr) {
+        return false;
+    }
+    if (!memory_region_is_ram(section->mr) ||
+        int128_get64(section->size) < len ||
+        (is_write && memory_region_is_rom(section->mr))) {
+        memory_region_unref(section->mr);
+        return false;
+    }
+    return true;
+}
+
+static int nvme_addr_rw(NvmeCtrl *n, hwaddr addr, void *buf, int len,
+                        DMADirection dir)
+{
+    bool is_write = dir == DMA_DIRECTION_FROM_DEVICE;
+    MemoryRegionSection section;
+    uint8_t *ptr;
+
+    if (!n->iothread) {
+        return pci_dma_rw(&n->parent_obj, addr, buf, len, dir);
+    }
+
+    if (!nvme_addr_is_ram(n, addr, len, is_write, &section)) {
+        return -1;
+    }
+    ptr = memory_region_get_ram_ptr(section.mr) +
+          section.offset_within_region;
+    smp_mb();
+    if (is_write) {
+        memcpy(ptr, buf, len);
+        memory_region_set_dirty(section.mr, section.offset_within_region,
+                                len);
+    } else {
+        memcpy(buf, ptr, len);
+    }
+    memory_region_unref(section.mr);
+    return 0;
+}
+
+static inline int nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf,
+                                 int len)
+{
+    return nvme_addr_rw(n, addr, buf, len, DMA_DIRECTION_TO_DEVICE);
+}
+
+static inline int nvme_addr_write(NvmeCtrl *n, hwaddr addr, void *buf,
+                                  int len)
+{
+    return nvme_addr_rw(n, addr, buf, len, DMA_DIRECTION_FROM_DEVICE);
+}
+
+/*
+ * The data buffers of a request must be RAM when it runs in an IOThread;
+ * @is_write is true if the buffers receive data from the device.
+ */
+static bool nvme_sg_is_ram(NvmeCtrl *n, QEMUSGList *qsg, bool is_write)
+{
+    MemoryRegionSection section;
+    int i;
+
+    if (!n->iothread) {
+        return true;
+    }
+    for (i = 0; i < qsg->nsg; i++) {
+        if (!nvme_addr_is_ram(n, qsg->sg[i].base, qsg->sg[i].len, is_write,
+                              &section)) {
+            return false;
+        }
+        memory_region_unref(section.mr);
+    }
+    return true;
+}
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -66,8 +164,62 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
-static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
+/*
+ * Shadow doorbells: with the Doorbell Buffer Config command the guest
+ * writes I/O queue doorbell values to a buffer in its memory, and only
+ * rings the MMIO doorbell when the value moves past the event index that
+ * the controller publishes in a second buffer.
+ */
+static bool nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+    uint32_t tail;
+
+    if (nvme_addr_read(n, sq->db_addr, &tail, sizeof(tail))) {
+        return false;
+    }
+    tail = le32_to_cpu(tail);
+    if (tail >= sq->size || tail == sq->tail) {
+        return false;
+    }
+    sq->tail = tail;
+    return true;
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
 {
+    uint32_t ei = cpu_to_le32(sq->tail);
+
+    nvme_addr_write(sq->ctrl, sq->ei_addr, &ei, sizeof(ei));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+    uint32_t head;
+
+    if (nvme_addr_read(n, cq->db_addr, &head, sizeof(head))) {
+        return;
+    }
+    head = le32_to_cpu(head);
+    if (head < cq->size) {
+        cq->head = head;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t ei = cpu_to_le32(cq->head);
+
+    nvme_addr_write(cq->ctrl, cq->ei_addr, &ei, sizeof(ei));
+}
+
+/* Context: QEMU global mutex held */
+static void nvme_cq_notify(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
     if (cq->irq_enabled) {
         if (msix_enabled(&(n->parent_obj))) {
             msix_notify(&(n->parent_obj), cq->vector);
@@ -77,6 +229,18 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Completions can be posted from an IOThread, so the interrupt is raised
+ * from a bottom half in the main loop.  This also coalesces the
+ * interrupts for completions posted in the same main loop iteration.
+ */
+static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (cq->irq_enabled) {
+        qemu_bh_schedule(cq->notify_bh);
+    }
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -102,7 +266,9 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
 
             nents = (len + n->page_size - 1) >> n->page_bits;
             prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-            pci_dma_read(&n->parent_obj, prp2, (void *)prp_list, prp_trans);
+            if (nvme_addr_read(n, prp2, (void *)prp_list, prp_trans)) {
+                goto unmap;
+            }
             while (len != 0) {
                 uint64_t prp_ent = le64_to_cpu(prp_list[i]);
 
@@ -114,8 +280,10 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
                     i = 0;
                     nents = (len + n->page_size - 1) >> n->page_bits;
                     prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-                    pci_dma_read(&n->parent_obj, prp_ent, (void *)prp_list,
-                        prp_trans);
+                    if (nvme_addr_read(n, prp_ent, (void *)prp_list,
+                                       prp_trans)) {
+                        goto unmap;
+                    }
                     prp_ent = le64_to_cpu(prp_list[i]);
                 }
 
@@ -158,18 +326,30 @@ static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return NVME_SUCCESS;
 }
 
-static void nvme_post_cqes(void *opaque)
+static void nvme_post_cqes(NvmeCQueue *cq)
 {
-    NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    bool posted = false;
 
+    if (cq->db_addr && !QTAILQ_EMPTY(&cq->req_list)) {
+        nvme_update_cq_head(cq);
+    }
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
         if (nvme_cq_full(cq)) {
-            break;
+            if (!cq->db_addr) {
+                break;
+            }
+            /* ask for a doorbell once the guest made room, then recheck */
+            nvme_update_cq_eventidx(cq);
+            smp_mb();
+            nvme_update_cq_head(cq);
+            if (nvme_cq_full(cq)) {
+                break;
+            }
         }
 
         QTAILQ_REMOVE(&cq->req_list, req, entry);
@@ -179,11 +359,18 @@ static void nvme_post_cqes(void *opaque)
         req->cqe.sq_head = cpu_to_le16(sq->head);
         addr = cq->dma_addr + cq->tail * n->cqe_size;
         nvme_inc_cq_tail(cq);
-        pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
+        nvme_addr_write(n, addr, (void *)&req->cqe,
             sizeof(req->cqe));
+        if (QTAILQ_EMPTY(&sq->req_list)) {
+            /* the queue ran out of requests, pick up where it stopped */
+            qemu_bh_schedule(sq->bh);
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted = true;
+    }
+    if (posted) {
+        nvme_isr_notify(n, cq);
     }
-    nvme_isr_notify(n, cq);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -191,7 +378,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    nvme_post_cqes(cq);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -210,6 +397,10 @@ static void nvme_rw_cb(void *opaque, int ret)
 
     qemu_sglist_destroy(&req->qsg);
     nvme_enqueue_req_completion(cq, req);
+    if (sq->db_addr) {
+        /* look for commands the guest queued without ringing */
+        qemu_bh_schedule(sq->bh);
+    }
 }
 
 static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
@@ -234,6 +425,10 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     assert((nlb << data_shift) == req->qsg.size);
+    if (!nvme_sg_is_ram(n, &req->qsg, !is_write)) {
+        qemu_sglist_destroy(&req->qsg);
+        return NVME_DATA_TRAS_ERROR | NVME_DNR;
+    }
 
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg,
                    is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
@@ -265,11 +460,56 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    uint32_t tail = cpu_to_le32(sq->tail);
+    hwaddr offset = 0x1000 + (sq->sqid << 3);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_addr_write(n, sq->db_addr, &tail, sizeof(tail));
+
+    /*
+     * The tail is read from the shadow doorbell, so the value written to
+     * the MMIO doorbell is not needed and an ioeventfd can take the write.
+     */
+    if (kvm_eventfds_enabled() && !event_notifier_init(&sq->notifier, 0)) {
+        memory_region_add_eventfd(&n->iomem, offset, 4, false, 0,
+                                  &sq->notifier);
+        aio_set_event_notifier(n->ctx, &sq->notifier, nvme_sq_notifier);
+        sq->ioeventfd = true;
+    }
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    uint32_t head = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_addr_write(n, cq->db_addr, &head, sizeof(head));
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    if (sq->ioeventfd) {
+        aio_set_event_notifier(n->ctx, &sq->notifier, NULL);
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                                  false, 0, &sq->notifier);
+        event_notifier_cleanup(&sq->notifier);
+        sq->ioeventfd = false;
+    }
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -323,6 +563,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_new(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -331,12 +572,22 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (sqid) {
+        sq->bh = aio_bh_new(n->ctx, nvme_process_sq, sq);
+    } else {
+        /* admin commands need the global mutex, keep them in the main loop */
+        sq->bh = qemu_bh_new(nvme_process_admin_sq, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    /* the admin queue always uses the MMIO doorbells */
+    if (sqid && n->dbbuf_dbs) {
+        nvme_init_sq_dbbuf(sq, n);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -353,7 +604,7 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!cqid || nvme_check_cqid(n, cqid)) {
         return NVME_INVALID_CQID | NVME_DNR;
     }
-    if (!sqid || (sqid && !nvme_check_sqid(n, sqid))) {
+    if (!sqid || sqid >= n->num_queues || !nvme_check_sqid(n, sqid)) {
         return NVME_INVALID_QID | NVME_DNR;
     }
     if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
@@ -373,8 +624,7 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    qemu_bh_delete(cq->notify_bh);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -410,11 +660,16 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->notify_bh = qemu_bh_new(nvme_cq_notify, cq);
+
+    if (cqid && n->dbbuf_dbs) {
+        nvme_init_cq_dbbuf(cq, n);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -427,7 +682,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     uint16_t qflags = le16_to_cpu(c->cq_flags);
     uint64_t prp1 = le64_to_cpu(c->prp1);
 
-    if (!cqid || (cqid && !nvme_check_cqid(n, cqid))) {
+    if (!cqid || cqid >= n->num_queues || !nvme_check_cqid(n, cqid)) {
         return NVME_INVALID_CQID | NVME_DNR;
     }
     if (!qsize || qsize > NVME_CAP_MQES(n->bar.cap)) {
@@ -436,7 +691,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -504,6 +759,30 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || !eis_addr ||
+        (dbs_addr | eis_addr) & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i], n);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i], n);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -521,6 +800,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -536,10 +817,18 @@ static void nvme_process_sq(void *opaque)
     hwaddr addr;
     NvmeCmd cmd;
     NvmeRequest *req;
+    bool fetched;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+again:
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+        fetched = !nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
+        if (!fetched) {
+            memset(&cmd, 0, sizeof(cmd));
+        }
         nvme_inc_sq_head(sq);
 
         req = QTAILQ_FIRST(&sq->req_list);
@@ -548,13 +837,48 @@ static void nvme_process_sq(void *opaque)
         memset(&req->cqe, 0, sizeof(req->cqe));
         req->cqe.cid = cmd.cid;
 
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
+        if (!fetched) {
+            status = NVME_DATA_TRAS_ERROR | NVME_DNR;
+        } else if (sq->sqid) {
+            status = nvme_io_cmd(n, &cmd, req);
+        } else {
+            status = nvme_admin_cmd(n, &cmd, req);
+        }
         if (status != NVME_NO_COMPLETE) {
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
     }
+
+    if (sq->db_addr) {
+        /*
+         * While commands are in flight their completions poll the shadow
+         * doorbell again, so the event index is left behind and the guest
+         * does not ring.  Once idle, ask for a doorbell and recheck the
+         * tail in case the guest wrote it before seeing the new index.
+         */
+        if (QTAILQ_EMPTY(&sq->out_req_list)) {
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+        }
+        if (nvme_update_sq_tail(sq)) {
+            goto again;
+        }
+    }
+}
+
+/*
+ * The admin queue runs in the main loop even when the I/O queues are in
+ * an IOThread, and takes the AioContext to look at their state.
+ */
+static void nvme_process_admin_sq(void *opaque)
+{
+    NvmeSQueue *sq = opaque;
+    NvmeCtrl *n = sq->ctrl;
+
+    aio_context_acquire(n->ctx);
+    nvme_process_sq(sq);
+    aio_context_release(n->ctx);
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
@@ -574,6 +898,7 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -705,10 +1030,10 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         cq->head = new_head;
         if (start_sqs) {
             NvmeSQueue *sq;
+            nvme_post_cqes(cq);
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                qemu_bh_schedule(sq->bh);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
         }
 
         if (cq->tail != cq->head) {
@@ -729,19 +1054,26 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        nvme_process_sq(sq);
     }
 }
 
+/*
+ * Queue state is shared with the IOThread, if any, so the MMIO handler
+ * runs with its AioContext held.
+ */
 static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    aio_context_acquire(n->ctx);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
         nvme_process_db(n, addr, data);
     }
+    aio_context_release(n->ctx);
 }
 
 static const MemoryRegionOps nvme_mmio_ops = {
@@ -778,6 +1110,49 @@ static int nvme_init(PCIDevice *pci_dev)
     }
     blkconf_blocksizes(&n->conf);
 
+    if (n->num_queues < 2 || n->num_queues > NVME_MAX_QUEUES) {
+        error_report("nvme: num_queues must be between 2 and %d",
+                     NVME_MAX_QUEUES);
+        return -1;
+    }
+
+    if (n->iothread) {
+        Error *local_err = NULL;
+
+        if (blk_op_is_blocked(n->conf.blk, BLOCK_OP_TYPE_DATAPLANE,
+                              &local_err)) {
+            error_report("nvme: cannot use iothread: %s",
+                         error_get_pretty(local_err));
+            error_free(local_err);
+            return -1;
+        }
+        error_setg(&n->blocker, "block device is in use by an nvme iothread");
+        blk_op_block_all(n->conf.blk, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_RESIZE, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_DRIVE_DEL, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_BACKUP_SOURCE, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_CHANGE, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_COMMIT_SOURCE, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_COMMIT_TARGET, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_EJECT, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT,
+                       n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT,
+                       n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT_DELETE,
+                       n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_MIRROR, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_STREAM, n->blocker);
+        blk_op_unblock(n->conf.blk, BLOCK_OP_TYPE_REPLACE, n->blocker);
+
+        n->ctx = iothread_get_aio_context(n->iothread);
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+        aio_context_release(n->ctx);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -785,7 +1160,6 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = 1 << qemu_fls(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
@@ -809,7 +1183,7 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
@@ -851,7 +1225,17 @@ static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
 
+    aio_context_acquire(n->ctx);
     nvme_clear_ctrl(n);
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    aio_context_release(n->ctx);
+    if (n->blocker) {
+        blk_op_unblock_all(n->conf.blk, n->blocker);
+        error_free(n->blocker);
+        n->blocker = NULL;
+    }
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -861,6 +1245,7 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -923,10 +1308,16 @@ out:
 
 static void nvme_instance_init(Object *obj)
 {
+    NvmeCtrl *n = NVME(obj);
+
     object_property_add(obj, "bootindex", "int32",
                         nvme_get_bootindex,
                         nvme_set_bootindex, NULL, NULL, NULL);
     object_property_set_int(obj, -1, "bootindex", NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static const TypeInfo nvme_info = {
@@ -20,17 +20,23 @@
  */
 
 #include "qxl.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 
-static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
+/*
+ * The display surface holds what was blitted last time, so rows which
+ * did not change in the guest are skipped and the rectangle is shrunk to
+ * the rows which did.  Returns false when nothing changed at all.
+ */
+static bool qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
 {
     DisplaySurface *surface = qemu_console_surface(qxl->vga.con);
     uint8_t *dst = surface_data(surface);
     uint8_t *src;
-    int len, i;
+    int len, i, first = -1, last = -1;
 
     if (is_buffer_shared(surface)) {
-        return;
+        return true;
     }
     trace_qxl_render_blit(qxl->guest_primary.qxl_stride,
             rect->left, rect->right, rect->top, rect->bottom);
@@ -49,10 +55,23 @@ static void qxl_blit(PCIQXLDevice *qxl, QXLRect *rect)
     len  = (rect->right - rect->left) * qxl->guest_primary.bytes_pp;
 
     for (i = rect->top; i < rect->bottom; i++) {
-        memcpy(dst, src, len);
+        if (memcmp(dst, src, len) != 0) {
+            memcpy(dst, src, len);
+            if (first < 0) {
+                first = i;
+            }
+            last = i;
+        }
         dst += qxl->guest_primary.abs_stride;
         src += qxl->guest_primary.qxl_stride;
     }
+
+    if (first < 0) {
+        return false;
+    }
+    rect->top = first;
+    rect->bottom = last + 1;
+    return true;
 }
 
 void qxl_render_resize(PCIQXLDevice *qxl)
@@ -93,6 +112,31 @@ static void qxl_set_rect_to_surface(PCIQXLDevice *qxl, QXLRect *area)
     area->bottom = qxl->guest_primary.surface.height;
 }
 
+/*
+ * Check whether the console surface can keep showing the guest primary
+ * after the guest re-created it, typically with the same mode it had
+ * before.  Reusing it avoids a surface switch in the display frontends
+ * and lets qxl_blit skip rows that are still identical.
+ */
+static bool qxl_render_surface_reusable(PCIQXLDevice *qxl,
+                                        DisplaySurface *surface)
+{
+    if (!surface ||
+        surface_width(surface) != qxl->guest_primary.surface.width ||
+        surface_height(surface) != qxl->guest_primary.surface.height ||
+        surface_stride(surface) != qxl->guest_primary.abs_stride) {
+        return false;
+    }
+    if (qxl->guest_primary.qxl_stride > 0) {
+        return is_buffer_shared(surface) &&
+            surface_data(surface) == qxl->guest_primary.data &&
+            surface->format ==
+            qemu_default_pixman_format(qxl->guest_primary.bits_pp, true);
+    }
+    return !is_buffer_shared(surface) &&
+        surface->format == qemu_default_pixman_format(32, true);
+}
+
 static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
 {
     VGACommonState *vga = &qxl->vga;
@@ -115,7 +159,12 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                qxl->guest_primary.qxl_stride,
                qxl->guest_primary.bytes_pp,
                qxl->guest_primary.bits_pp);
-        if (qxl->guest_primary.qxl_stride > 0) {
+        surface = qemu_console_surface(vga->con);
+        if (qxl_render_surface_reusable(qxl, surface)) {
+            trace_qxl_render_surface_reused(qxl->guest_primary.surface.width,
+                                            qxl->guest_primary.surface.height,
+                                            qxl->guest_primary.qxl_stride);
+        } else if (qxl->guest_primary.qxl_stride > 0) {
             pixman_format_code_t format =
                 qemu_default_pixman_format(qxl->guest_primary.bits_pp, true);
             surface = qemu_create_displaysurface_from
@@ -124,12 +173,13 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
                  format,
                  qxl->guest_primary.abs_stride,
                  qxl->guest_primary.data);
+            dpy_gfx_replace_surface(vga->con, surface);
         } else {
             surface = qemu_create_displaysurface
                 (qxl->guest_primary.surface.width,
                  qxl->guest_primary.surface.height);
+            dpy_gfx_replace_surface(vga->con, surface);
         }
-        dpy_gfx_replace_surface(vga->con, surface);
     }
 
     if (!qxl->guest_primary.data) {
@@ -147,7 +197,13 @@ static void qxl_render_update_area_unlocked(PCIQXLDevice *qxl)
             qxl->dirty[i].bottom > qxl->guest_primary.surface.height) {
             continue;
         }
-        qxl_blit(qxl, qxl->dirty+i);
+        if (!qxl_blit(qxl, qxl->dirty+i)) {
+            continue;
+        }
+        atomic_set(&qxl->stats_rendered_bytes, qxl->stats_rendered_bytes +
+                   (uint64_t)(qxl->dirty[i].right - qxl->dirty[i].left) *
+                   (qxl->dirty[i].bottom - qxl->dirty[i].top) *
+                   qxl->guest_primary.bytes_pp);
         dpy_gfx_update(vga->con,
                        qxl->dirty[i].left, qxl->dirty[i].top,
                        qxl->dirty[i].right - qxl->dirty[i].left,
@@ -26,6 +26,7 @@
 #include "qemu/queue.h"
 #include "qemu/atomic.h"
 #include "sysemu/sysemu.h"
+#include "qapi/visitor.h"
 #include "trace.h"
 
 #include "qxl.h"
@@ -579,6 +580,31 @@ static const char *io_port_to_string(uint32_t io_port)
     return io_port_to_string[io_port];
 }
 
+/* called from spice server thread context only */
+static void qxl_stats_command(PCIQXLDevice *qxl)
+{
+    uint64_t commands = qxl->stats_commands + 1;
+    uint64_t rendered;
+    int64_t now, delta;
+
+    atomic_set(&qxl->stats_commands, commands);
+    if (commands % QXL_CMD_BATCH_SIZE) {
+        return;
+    }
+    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    delta = now - qxl->stats_time;
+    if (delta < 1000) {
+        return;
+    }
+    rendered = atomic_read(&qxl->stats_rendered_bytes);
+    trace_qxl_stats(qxl->id,
+                    (commands - qxl->stats_last_commands) * 1000 / delta,
+                    (rendered - qxl->stats_last_rendered_bytes) * 1000 / delta);
+    qxl->stats_time = now;
+    qxl->stats_last_commands = commands;
+    qxl->stats_last_rendered_bytes = rendered;
+}
+
 /* called from spice server thread context only */
 static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
 {
@@ -621,11 +647,23 @@ static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
         ext->group_id = MEMSLOT_GROUP_GUEST;
         ext->flags    = qxl->cmdflags;
         SPICE_RING_POP(ring, notify);
-        qxl_ring_set_dirty(qxl);
+        /*
+         * The ring only has to be dirty by the time migration copies it,
+         * so mark it once per batch instead of once per command: when the
+         * guest wants a notification, when the batch is full, or when the
+         * ring drains (the spice server then goes through
+         * interface_req_cmd_notification, which marks it as well).
+         */
+        if (notify || ++qxl->cmd_batch >= QXL_CMD_BATCH_SIZE ||
+            SPICE_RING_IS_EMPTY(ring)) {
+            qxl->cmd_batch = 0;
+            qxl_ring_set_dirty(qxl);
+        }
         if (notify) {
             qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
         }
         qxl->guest_primary.commands++;
+        qxl_stats_command(qxl);
         qxl_track_command(qxl, ext);
         qxl_log_command(qxl, "cmd", ext);
         trace_qxl_ring_command_get(qxl->id, qxl_mode_to_string(qxl->mode));
@@ -1826,6 +1864,8 @@ static void qxl_vm_change_state_handler(void *opaque, int running,
     } else {
         /* make sure surfaces are saved before migration */
         qxl_dirty_surfaces(qxl);
+        /* and the ring, in case a command batch is still pending */
+        qxl_ring_set_dirty(qxl);
     }
 }
 
@@ -1929,6 +1969,7 @@ static void qxl_realize_common(PCIQXLDevice *qxl, Error **errp)
     qemu_mutex_init(&qxl->async_lock);
     qxl->current_async = QXL_UNDEFINED_IO;
     qxl->guest_bug = 0;
+    qxl->stats_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     switch (qxl->revision) {
     case 1: /* spice 0.4 -- qxl-1 */
@@ -2277,6 +2318,32 @@ static Property qxl_properties[] = {
         DEFINE_PROP_END_OF_LIST(),
 };
 
+static void qxl_get_commands(Object *obj, Visitor *v, void *opaque,
+                             const char *name, Error **errp)
+{
+    PCIQXLDevice *qxl = PCI_QXL(obj);
+    uint64_t value = atomic_read(&qxl->stats_commands);
+
+    visit_type_uint64(v, &value, name, errp);
+}
+
+static void qxl_get_rendered_bytes(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    PCIQXLDevice *qxl = PCI_QXL(obj);
+    uint64_t value = atomic_read(&qxl->stats_rendered_bytes);
+
+    visit_type_uint64(v, &value, name, errp);
+}
+
+static void qxl_instance_init(Object *obj)
+{
+    object_property_add(obj, "commands", "uint64",
+                        qxl_get_commands, NULL, NULL, NULL, NULL);
+    object_property_add(obj, "rendered-bytes", "uint64",
+                        qxl_get_rendered_bytes, NULL, NULL, NULL, NULL);
+}
+
 static void qxl_pci_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -2294,6 +2361,7 @@ static const TypeInfo qxl_pci_type_info = {
     .name = TYPE_PCI_QXL,
     .parent = TYPE_PCI_DEVICE,
     .instance_size = sizeof(PCIQXLDevice),
+    .instance_init = qxl_instance_init,
     .abstract = true,
     .class_init = qxl_pci_class_init,
 };
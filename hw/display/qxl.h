@@ -27,6 +27,9 @@ enum qxl_mode {
 
 #define QXL_NUM_DIRTY_RECTS 64
 
+/* commands fetched from the guest ring before the ring is marked dirty */
+#define QXL_CMD_BATCH_SIZE 32
+
 #define QXL_PAGE_BITS 12
 #define QXL_PAGE_SIZE (1 << QXL_PAGE_BITS);
 
@@ -81,6 +84,16 @@ typedef struct PCIQXLDevice {
 
     QemuMutex          track_lock;
 
+    /* deferred ring dirty tracking (see interface_get_command) */
+    uint32_t           cmd_batch;
+
+    /* statistics, exposed as read-only properties and the qxl_stats trace */
+    uint64_t           stats_commands;
+    uint64_t           stats_rendered_bytes;
+    int64_t            stats_time;
+    uint64_t           stats_last_commands;
+    uint64_t           stats_last_rendered_bytes;
+
     /* thread signaling */
     QEMUBH             *update_irq;
 
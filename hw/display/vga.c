@@ -1422,6 +1422,60 @@ void vga_dirty_log_stop(VGACommonState *s)
     memory_region_set_log(&s->vram, false, DIRTY_MEMORY_VGA);
 }
 
+/*
+ * Return true if any byte of the scanout, @height lines of @bwidth bytes
+ * starting at @addr, was written since the last refresh.  This is a
+ * single walk of the dirty bitmap, which lets idle screens skip the
+ * per-line checks entirely.  Only valid for linear (non CGA) addressing.
+ */
+static bool vga_scanout_is_dirty(VGACommonState *s, uint32_t addr,
+                                 int height, int bwidth)
+{
+    uint64_t size = (uint64_t)s->line_offset * height + bwidth;
+    int y;
+
+    for (y = 0; y < height; y += 32) {
+        if (s->invalidated_y_table[y >> 5]) {
+            return true;
+        }
+    }
+    if (s->line_compare < height) {
+        /* the lines after line_compare restart at the top of vram */
+        size += addr;
+        addr = 0;
+    }
+    if (addr >= s->vram_size) {
+        return true;
+    }
+    size = MIN(size, s->vram_size - addr);
+    return memory_region_get_dirty(&s->vram, addr, size, DIRTY_MEMORY_VGA);
+}
+
+/*
+ * Narrow a dirty scanline [page0, page1] to the pages that were actually
+ * written.  Returns the byte offsets of the first and last dirty byte
+ * range relative to page0.
+ */
+static void vga_line_dirty_extent(VGACommonState *s, ram_addr_t page0,
+                                  ram_addr_t page1, int *first, int *last)
+{
+    ram_addr_t start = page0, end;
+
+    *first = -1;
+    *last = -1;
+    while (start <= page1) {
+        end = MIN((start | ~TARGET_PAGE_MASK) + 1, page1 + 1);
+        if (memory_region_get_dirty(&s->vram, start, end - start,
+                                    DIRTY_MEMORY_VGA)) {
+            if (*first < 0) {
+                *first = start - page0;
+            }
+            *last = end - 1 - page0;
+        }
+        start = end;
+    }
+}
+
 /*
  * graphic modes
  */
@@ -1432,10 +1486,11 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     int width, height, shift_control, line_offset, bwidth, bits;
     ram_addr_t page0, page1, page_min, page_max;
     int disp_width, multi_scan, multi_run;
+    int x_start, x_end;
     uint8_t *d;
     uint32_t v, addr1, addr;
     vga_draw_line_func *vga_draw_line = NULL;
-    bool share_surface;
+    bool share_surface, linear;
     pixman_format_code_t format;
 #ifdef HOST_WORDS_BIGENDIAN
     bool byteswap = !s->big_endian_fb;
@@ -1597,7 +1652,15 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
 #endif
     addr1 = (s->start_addr * 4);
     bwidth = (width * bits + 7) / 8;
+    linear = (s->cr[VGA_CRTC_MODE] & 3) == 3;
+    if (!full_update && linear &&
+        !vga_scanout_is_dirty(s, addr1, height, bwidth)) {
+        /* nothing changed: no line needs converting or updating */
+        return;
+    }
     y_start = -1;
+    x_start = disp_width;
+    x_end = 0;
     page_min = -1;
     page_max = 0;
     d = surface_data(surface);
@@ -1617,10 +1680,30 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         update = full_update;
         page0 = addr;
         page1 = addr + bwidth - 1;
-        update |= memory_region_get_dirty(&s->vram, page0, page1 - page0,
-                                          DIRTY_MEMORY_VGA);
         /* explicit invalidation for the hardware cursor */
         update |= (s->invalidated_y_table[y >> 5] >> (y & 0x1f)) & 1;
+        if (update) {
+            x_start = 0;
+            x_end = disp_width;
+        } else if (bits >= 8 && page1 - page0 >= TARGET_PAGE_SIZE) {
+            int first, last;
+
+            /* only report the columns covered by dirty pages */
+            vga_line_dirty_extent(s, page0, page1, &first, &last);
+            if (first >= 0) {
+                update = 1;
+                x_start = MIN(x_start, (int64_t)first * 8 / bits
+                                       * disp_width / width);
+                x_end = MAX(x_end, DIV_ROUND_UP((int64_t)(last + 1) * 8 / bits
+                                                * disp_width, width));
+                x_end = MIN(x_end, disp_width);
+            }
+        } else if (memory_region_get_dirty(&s->vram, page0, page1 - page0,
+                                           DIRTY_MEMORY_VGA)) {
+            update = 1;
+            x_start = 0;
+            x_end = disp_width;
+        }
         if (update) {
             if (y_start < 0)
                 y_start = y;
@@ -1636,9 +1719,11 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         } else {
             if (y_start >= 0) {
                 /* flush to display */
-                dpy_gfx_update(s->con, 0, y_start,
-                               disp_width, y - y_start);
+                dpy_gfx_update(s->con, x_start, y_start,
+                               x_end - x_start, y - y_start);
                 y_start = -1;
+                x_start = disp_width;
+                x_end = 0;
             }
         }
         if (!multi_run) {
@@ -1657,8 +1742,8 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     }
     if (y_start >= 0) {
         /* flush to display */
-        dpy_gfx_update(s->con, 0, y_start,
-                       disp_width, y - y_start);
+        dpy_gfx_update(s->con, x_start, y_start,
+                       x_end - x_start, y - y_start);
     }
     /* reset modified pages */
     if (page_max >= page_min) {
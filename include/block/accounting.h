@@ -27,6 +27,7 @@
 #include <stdint.h>
 
 #include "qemu/typedefs.h"
+#include "qemu/timed-average.h"
 
 enum BlockAcctType {
     BLOCK_ACCT_READ,
@@ -35,13 +36,40 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
-typedef struct BlockAcctStats {
+/* Bucket i of a latency histogram counts requests that took [2^i, 2^(i+1))
+ * microseconds, bucket i of a size histogram requests of [2^(i+9), 2^(i+10))
+ * bytes. The first and last bucket also count all smaller and larger values.
+ */
+#define BLOCK_ACCT_LATENCY_BUCKETS 32
+#define BLOCK_ACCT_SIZE_BUCKETS    16
+
+/* Lengths of the intervals in seconds over which timed statistics are kept */
+#define BLOCK_ACCT_INTERVALS       3
+extern const unsigned block_acct_interval_lengths[BLOCK_ACCT_INTERVALS];
+
+typedef struct BlockAcctTimedStats {
+    unsigned interval_length; /* in seconds */
+    TimedAverage latency[BLOCK_MAX_IOTYPE];
+} BlockAcctTimedStats;
+
+typedef struct BlockAcctStats BlockAcctStats;
+
+struct BlockAcctStats {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
     uint64_t wr_highest_sector;
-} BlockAcctStats;
+    uint64_t latency_histogram[BLOCK_MAX_IOTYPE][BLOCK_ACCT_LATENCY_BUCKETS];
+    uint64_t size_histogram[BLOCK_MAX_IOTYPE][BLOCK_ACCT_SIZE_BUCKETS];
+    BlockAcctTimedStats timed_stats[BLOCK_ACCT_INTERVALS];
+    bool has_timed_stats;
+
+    /* Statistics of the throttle group this device belongs to, or NULL.
+     * Its members may run in different threads, so they update it with
+     * atomic operations and without the timed statistics. */
+    BlockAcctStats *group;
+};
 
 typedef struct BlockAcctCookie {
     int64_t bytes;
@@ -49,6 +77,7 @@ typedef struct BlockAcctCookie {
     enum BlockAcctType type;
 } BlockAcctCookie;
 
+void block_acct_init(BlockAcctStats *stats, bool timed_stats);
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type);
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie);
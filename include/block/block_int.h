@@ -39,6 +39,8 @@
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_COMPAT6          4
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_REFCOUNT_JOURNAL 16
+#define BLOCK_FLAG_DEDUP            32
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -51,11 +53,14 @@
 #define BLOCK_OPT_SUBFMT            "subformat"
 #define BLOCK_OPT_COMPAT_LEVEL      "compat"
 #define BLOCK_OPT_LAZY_REFCOUNTS    "lazy_refcounts"
+#define BLOCK_OPT_REFCOUNT_JOURNAL  "refcount_journal"
+#define BLOCK_OPT_DEDUP             "dedup"
 #define BLOCK_OPT_ADAPTER_TYPE      "adapter_type"
 #define BLOCK_OPT_REDUNDANCY        "redundancy"
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -203,6 +208,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -317,6 +323,29 @@ typedef struct BlockLimits {
     size_t opt_mem_alignment;
 } BlockLimits;
 
+/* Share of a device in the proportional-share scheduler of its throttle
+ * group, see block/throttle-groups.c */
+#define THROTTLE_SHARE_DEFAULT_WEIGHT 100
+#define THROTTLE_SHARE_MAX_WEIGHT     10000
+
+typedef struct ThrottleShare {
+    /* relative share of the group's bandwidth */
+    unsigned weight;
+
+    /* I/O operations per second that are served first, 0 if none */
+    uint64_t iops_min;
+
+    /* bytes that a device can issue ahead of its share after being idle */
+    uint64_t burst_credit;
+} ThrottleShare;
+
+/* Time that requests of a device spent waiting in its throttle group */
+typedef struct ThrottleWaitStats {
+    uint64_t throttled[2];
+    uint64_t total_wait_ns[2];
+    uint64_t max_wait_ns[2];
+} ThrottleWaitStats;
+
 typedef struct BdrvOpBlocker BdrvOpBlocker;
 
 typedef struct BdrvAioNotifier {
@@ -398,6 +427,10 @@ struct BlockDriverState {
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
     QLIST_ENTRY(BlockDriverState) round_robin;
+    ThrottleShare  throttle_share;
+    uint64_t       throttle_vstart[2];
+    int64_t        throttle_reserve_tag[2];
+    ThrottleWaitStats throttle_wait_stats;
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
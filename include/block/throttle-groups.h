@@ -33,6 +33,14 @@ const char *throttle_group_get_name(BlockDriverState *bs);
 void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg);
 
+void throttle_group_set_scheduler(BlockDriverState *bs,
+                                  ThrottleGroupScheduler scheduler);
+ThrottleGroupScheduler throttle_group_get_scheduler(BlockDriverState *bs);
+void throttle_group_set_share(BlockDriverState *bs, ThrottleShare *share);
+void throttle_group_get_share(BlockDriverState *bs, ThrottleShare *share);
+void throttle_group_get_wait_stats(BlockDriverState *bs,
+                                   ThrottleWaitStats *stats);
+
 void throttle_group_register_bs(BlockDriverState *bs, const char *groupname);
 void throttle_group_unregister_bs(BlockDriverState *bs);
 
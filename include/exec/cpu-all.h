@@ -282,6 +282,10 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* fixed-ram migration: file offsets and pages present in the file */
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
+    unsigned long *file_bmap;
 };
 
 static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
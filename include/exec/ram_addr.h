@@ -40,6 +40,10 @@ void qemu_ram_free(ram_addr_t addr);
 void qemu_ram_free_from_ptr(ram_addr_t addr);
 
 int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp);
+#ifndef _WIN32
+int qemu_ram_map_private(RAMBlock *block, ram_addr_t offset,
+                         ram_addr_t length, int fd, off_t fd_offset);
+#endif
 
 #define DIRTY_CLIENTS_ALL     ((1 << DIRTY_MEMORY_NUM) - 1)
 #define DIRTY_CLIENTS_NOCODE  (DIRTY_CLIENTS_ALL & ~(1 << DIRTY_MEMORY_CODE))
@@ -2,7 +2,11 @@
 #define HW_COMPAT_H
 
 #define HW_COMPAT_2_3 \
-        /* empty */
+        {\
+            .driver   = "virtio-9p-device",\
+            .property = "queue_size",\
+            .value    = stringify(128),\
+        },
 
 #define HW_COMPAT_2_2 \
         /* empty */
@@ -479,6 +479,16 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 
+#define BUFFER_CMP_AND_COPY_UNROLL_FACTOR 4
+static inline bool
+can_use_buffer_cmp_and_copy(const void *dst, const void *src, size_t len)
+{
+    return (len % (BUFFER_CMP_AND_COPY_UNROLL_FACTOR * sizeof(VECTYPE)) == 0
+            && ((uintptr_t) dst) % sizeof(VECTYPE) == 0
+            && ((uintptr_t) src) % sizeof(VECTYPE) == 0);
+}
+bool buffer_cmp_and_copy(void *dst, const void *src, size_t len);
+
 /*
  * helper to parse debug environment variables
  */
@@ -78,6 +78,7 @@ void hmp_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void hmp_delvm(Monitor *mon, const QDict *qdict);
 void hmp_info_snapshots(Monitor *mon, const QDict *qdict);
+bool savevm_live_in_progress(Error **errp);
 
 void qemu_announce_self(void);
 
@@ -0,0 +1,64 @@
+/*
+ * QEMU live migration to and from regular files
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "block/block.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    DPRINTF("Attempting to start an outgoing migration to %s\n", path);
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    s->file = qemu_fopen_seekable(fd, "wb");
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    int fd;
+    QEMUFile *f;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    f = qemu_fopen_seekable(fd, "rb");
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, f);
+}
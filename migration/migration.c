@@ -129,6 +129,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
 #endif
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -592,6 +594,19 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM]) {
+        if (!strstart(uri, "file:", NULL)) {
+            error_setg(errp, "Capability fixed-ram requires a file: URI");
+            return;
+        }
+        if (s->enabled_capabilities[MIGRATION_CAPABILITY_XBZRLE] ||
+            s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Capability fixed-ram cannot be combined with "
+                       "xbzrle or compress");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -607,6 +622,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
@@ -713,6 +730,15 @@ bool migrate_use_compression(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
 }
 
+bool migrate_use_fixed_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FIXED_RAM];
+}
+
 int migrate_compress_level(void)
 {
     MigrationState *s;
@@ -821,7 +847,8 @@ static void *migration_thread(void *opaque)
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         if (current_time >= initial_time + BUFFER_DELAY) {
-            uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
+            uint64_t transferred_bytes = qemu_file_transferred(s->file) -
+                                         initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
             max_size = bandwidth * migrate_max_downtime() / 1000000;
@@ -839,7 +866,7 @@ static void *migration_thread(void *opaque)
 
             qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
-            initial_bytes = qemu_ftell(s->file);
+            initial_bytes = qemu_file_transferred(s->file);
         }
         if (qemu_file_rate_limit(s->file)) {
             /* usleep expects microseconds */
@@ -850,7 +877,7 @@ static void *migration_thread(void *opaque)
     qemu_mutex_lock_iothread();
     if (s->state == MIGRATION_STATUS_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-        uint64_t transferred_bytes = qemu_ftell(s->file);
+        uint64_t transferred_bytes = qemu_file_transferred(s->file);
         s->total_time = end_time - s->total_time;
         s->downtime = end_time - start_time;
         if (s->total_time) {
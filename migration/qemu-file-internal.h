@@ -38,6 +38,8 @@ struct QEMUFile {
     int64_t bytes_xfer;
     int64_t xfer_limit;
 
+    int64_t transferred; /* bytes written, including out-of-band writes */
+
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
     int buf_index;
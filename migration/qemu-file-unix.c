@@ -236,3 +236,81 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
     }
     return s->file;
 }
+
+/*
+ * Regular files: reads and writes go to the stream position, so the
+ * RAM code can lay pages out at fixed offsets and qemu_fseek() past them.
+ */
+static ssize_t file_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len, total = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        size_t done = 0;
+
+        while (done < iov[i].iov_len) {
+            len = pwrite(s->fd, iov[i].iov_base + done,
+                         iov[i].iov_len - done, pos + total);
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            if (len == -1) {
+                return -errno;
+            }
+            done += len;
+            total += len;
+        }
+    }
+
+    return total;
+}
+
+static int file_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileSocket *s = opaque;
+    ssize_t len;
+
+    do {
+        len = pread(s->fd, buf, size, pos);
+    } while (len == -1 && errno == EINTR);
+
+    if (len == -1) {
+        len = -errno;
+    }
+    return len;
+}
+
+static const QEMUFileOps file_read_ops = {
+    .get_fd =     socket_get_fd,
+    .get_buffer = file_get_buffer,
+    .close =      unix_close,
+    .seekable =   true,
+};
+
+static const QEMUFileOps file_write_ops = {
+    .get_fd =        socket_get_fd,
+    .writev_buffer = file_writev_buffer,
+    .close =         unix_close,
+    .seekable =      true,
+};
+
+QEMUFile *qemu_fopen_seekable(int fd, const char *mode)
+{
+    QEMUFileSocket *s;
+
+    if (qemu_file_mode_is_not_valid(mode)) {
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileSocket));
+    s->fd = fd;
+    if (mode[0] == 'w') {
+        s->file = qemu_fopen_ops(s, &file_write_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &file_read_ops);
+    }
+    return s->file;
+}
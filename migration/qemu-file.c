@@ -116,6 +116,7 @@ void qemu_fflush(QEMUFile *f)
     }
     if (ret >= 0) {
         f->pos += ret;
+        f->transferred += ret;
     }
     f->buf_index = 0;
     f->iovcnt = 0;
@@ -231,6 +232,19 @@ int qemu_get_fd(QEMUFile *f)
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
+    f->transferred += size;
+}
+
+/*
+ * Account for data that was written to the underlying file outside
+ * the QEMUFile buffer, so that rate limiting and bandwidth estimation
+ * see it.  Unlike qemu_update_position() the stream position is left
+ * alone.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->bytes_xfer += size;
+    f->transferred += size;
 }
 
 /** Closes the file
@@ -479,6 +493,44 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seekable;
+}
+
+/*
+ * Move the stream position of a seekable file.  Pending writes are
+ * flushed first, buffered read data is dropped.
+ */
+int qemu_fseek(QEMUFile *f, int64_t pos)
+{
+    int ret;
+
+    if (!qemu_file_is_seekable(f)) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+    f->pos = pos;
+    return 0;
+}
+
+/* Number of bytes written so far, regardless of the stream position */
+int64_t qemu_file_transferred(QEMUFile *f)
+{
+    qemu_fflush(f);
+    return f->transferred;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -65,6 +65,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* Or'ed into RAM_SAVE_FLAG_MEM_SIZE: pages live at fixed file offsets */
+#define RAM_SAVE_FLAG_FIXED_RAM        0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -900,6 +902,300 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
     return pages;
 }
 
+/*
+ * Fixed-ram: with a seekable migration file every page of a RAMBlock has
+ * its own slot in the file, so pages are not streamed but written in
+ * place by a small pool of threads.  The migration thread coalesces
+ * contiguous pages into runs and queues them; the queue is drained at
+ * the end of each iteration so that no write is outstanding while the
+ * RAM block list can change.
+ */
+#define FIXED_RAM_ALIGN     (1 * 1024 * 1024)
+#define FIXED_RAM_THREADS   4
+#define FIXED_RAM_QUEUE     64
+#define FIXED_RAM_MAX_RUN   (1 * 1024 * 1024)
+
+typedef struct FixedRamRun {
+    uint8_t *host;
+    uint64_t file_offset;
+    size_t len;
+} FixedRamRun;
+
+static struct {
+    bool active;
+    bool quit;
+    int fd;
+    QemuThread threads[FIXED_RAM_THREADS];
+    QemuMutex lock;
+    QemuCond work_cond;     /* a run was queued or quit was set */
+    QemuCond done_cond;     /* a run was written */
+    FixedRamRun queue[FIXED_RAM_QUEUE];
+    int head;
+    int count;              /* runs queued but not picked up yet */
+    int in_flight;          /* runs being written */
+    int error;
+    /* Run being built by the migration thread, not queued yet */
+    FixedRamRun cur;
+} fixed_ram;
+
+static int fixed_ram_pwrite(int fd, const uint8_t *buf, size_t len,
+                            uint64_t offset)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void *fixed_ram_write_thread(void *opaque)
+{
+    FixedRamRun run;
+    int ret;
+
+    qemu_mutex_lock(&fixed_ram.lock);
+    while (true) {
+        while (!fixed_ram.count && !fixed_ram.quit) {
+            qemu_cond_wait(&fixed_ram.work_cond, &fixed_ram.lock);
+        }
+        if (!fixed_ram.count) {
+            break;
+        }
+        run = fixed_ram.queue[fixed_ram.head];
+        fixed_ram.head = (fixed_ram.head + 1) % FIXED_RAM_QUEUE;
+        fixed_ram.count--;
+        fixed_ram.in_flight++;
+        qemu_mutex_unlock(&fixed_ram.lock);
+
+        ret = fixed_ram_pwrite(fixed_ram.fd, run.host, run.len,
+                               run.file_offset);
+
+        qemu_mutex_lock(&fixed_ram.lock);
+        if (ret < 0 && !fixed_ram.error) {
+            fixed_ram.error = ret;
+        }
+        fixed_ram.in_flight--;
+        qemu_cond_broadcast(&fixed_ram.done_cond);
+    }
+    qemu_mutex_unlock(&fixed_ram.lock);
+
+    return NULL;
+}
+
+static void fixed_ram_start(int fd)
+{
+    int i;
+
+    fixed_ram.fd = fd;
+    fixed_ram.quit = false;
+    fixed_ram.head = 0;
+    fixed_ram.count = 0;
+    fixed_ram.in_flight = 0;
+    fixed_ram.error = 0;
+    fixed_ram.cur.len = 0;
+    qemu_mutex_init(&fixed_ram.lock);
+    qemu_cond_init(&fixed_ram.work_cond);
+    qemu_cond_init(&fixed_ram.done_cond);
+    for (i = 0; i < FIXED_RAM_THREADS; i++) {
+        qemu_thread_create(&fixed_ram.threads[i], "fixed-ram",
+                           fixed_ram_write_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    fixed_ram.active = true;
+}
+
+static void fixed_ram_stop(void)
+{
+    int i;
+
+    if (!fixed_ram.active) {
+        return;
+    }
+
+    qemu_mutex_lock(&fixed_ram.lock);
+    fixed_ram.quit = true;
+    qemu_cond_broadcast(&fixed_ram.work_cond);
+    qemu_mutex_unlock(&fixed_ram.lock);
+
+    for (i = 0; i < FIXED_RAM_THREADS; i++) {
+        qemu_thread_join(&fixed_ram.threads[i]);
+    }
+    qemu_cond_destroy(&fixed_ram.done_cond);
+    qemu_cond_destroy(&fixed_ram.work_cond);
+    qemu_mutex_destroy(&fixed_ram.lock);
+    fixed_ram.active = false;
+}
+
+static void fixed_ram_queue_run(void)
+{
+    if (!fixed_ram.cur.len) {
+        return;
+    }
+
+    qemu_mutex_lock(&fixed_ram.lock);
+    while (fixed_ram.count == FIXED_RAM_QUEUE) {
+        qemu_cond_wait(&fixed_ram.done_cond, &fixed_ram.lock);
+    }
+    fixed_ram.queue[(fixed_ram.head + fixed_ram.count) % FIXED_RAM_QUEUE] =
+        fixed_ram.cur;
+    fixed_ram.count++;
+    qemu_cond_signal(&fixed_ram.work_cond);
+    qemu_mutex_unlock(&fixed_ram.lock);
+
+    fixed_ram.cur.len = 0;
+}
+
+/* Wait until every page handed to the writer threads is in the file */
+static int fixed_ram_flush(QEMUFile *f)
+{
+    int ret;
+
+    fixed_ram_queue_run();
+
+    qemu_mutex_lock(&fixed_ram.lock);
+    while (fixed_ram.count || fixed_ram.in_flight) {
+        qemu_cond_wait(&fixed_ram.done_cond, &fixed_ram.lock);
+    }
+    ret = fixed_ram.error;
+    qemu_mutex_unlock(&fixed_ram.lock);
+
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+    return ret;
+}
+
+/* Reserve the bitmap and the page slots of @block after its header */
+static void fixed_ram_setup_block(QEMUFile *f, RAMBlock *block)
+{
+    uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+    int64_t pos = qemu_ftell(f) + 2 * sizeof(uint64_t);
+    int ret;
+
+    block->bitmap_offset = pos;
+    block->pages_offset = ROUND_UP(pos + DIV_ROUND_UP(pages, 8),
+                                   FIXED_RAM_ALIGN);
+    g_free(block->file_bmap);
+    block->file_bmap = bitmap_new(pages);
+
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    ret = qemu_fseek(f, block->pages_offset + block->used_length);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+/*
+ * The bitmap records which slots hold data; slots that were never
+ * written are holes in the file and stand for zero pages.
+ */
+static int fixed_ram_write_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+    uint64_t pages, i;
+    size_t size;
+    uint8_t *buf;
+    int ret;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!block->file_bmap) {
+            continue;
+        }
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        size = DIV_ROUND_UP(pages, 8);
+        buf = g_malloc0(size);
+        for (i = find_first_bit(block->file_bmap, pages); i < pages;
+             i = find_next_bit(block->file_bmap, pages, i + 1)) {
+            buf[i / 8] |= 1 << (i % 8);
+        }
+        ret = fixed_ram_pwrite(fixed_ram.fd, buf, size, block->bitmap_offset);
+        g_free(buf);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+        qemu_file_credit_transfer(f, size);
+    }
+    return 0;
+}
+
+static void fixed_ram_free_bitmaps(void)
+{
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * ram_save_fixed_page: Write the given page to its slot in the file
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_fixed_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset, uint64_t *bytes_transferred)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+    uint64_t file_offset = block->pages_offset + offset;
+    uint8_t *p;
+
+    if (!block->file_bmap) {
+        /* Block appeared after setup, it has no room in the file */
+        error_report("RAM block \"%s\" has no fixed-ram slot", block->idstr);
+        qemu_file_set_error(f, -EINVAL);
+        return 1;
+    }
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    /* A slot that was never written already reads back as zeroes */
+    if (!test_bit(page, block->file_bmap) &&
+        is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        return 1;
+    }
+    set_bit(page, block->file_bmap);
+
+    if (fixed_ram.cur.len &&
+        fixed_ram.cur.host + fixed_ram.cur.len == p &&
+        fixed_ram.cur.file_offset + fixed_ram.cur.len == file_offset &&
+        fixed_ram.cur.len < FIXED_RAM_MAX_RUN) {
+        fixed_ram.cur.len += TARGET_PAGE_SIZE;
+    } else {
+        fixed_ram_queue_run();
+        fixed_ram.cur.host = p;
+        fixed_ram.cur.file_offset = file_offset;
+        fixed_ram.cur.len = TARGET_PAGE_SIZE;
+    }
+
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -948,7 +1244,10 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                 }
             }
         } else {
-            if (compression_switch && migrate_use_compression()) {
+            if (fixed_ram.active) {
+                pages = ram_save_fixed_page(f, block, offset,
+                                            bytes_transferred);
+            } else if (compression_switch && migrate_use_compression()) {
                 pages = ram_save_compressed_page(f, block, offset, last_stage,
                                                  bytes_transferred);
             } else {
@@ -1017,6 +1316,11 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    if (fixed_ram.active) {
+        fixed_ram_stop();
+        fixed_ram_free_bitmaps();
+    }
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -1062,6 +1366,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
+    bool use_fixed_ram;
 
     mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
@@ -1120,16 +1425,28 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    /* Only migration to a file has room for pages at fixed offsets */
+    use_fixed_ram = migrate_use_fixed_ram() && qemu_file_is_seekable(f) &&
+                    qemu_get_fd(f) >= 0;
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE |
+                     (use_fixed_ram ? RAM_SAVE_FLAG_FIXED_RAM : 0));
 
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (use_fixed_ram) {
+            fixed_ram_setup_block(f, block);
+        }
     }
 
     rcu_read_unlock();
 
+    if (use_fixed_ram) {
+        fixed_ram_start(qemu_get_fd(f));
+    }
+
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
@@ -1184,6 +1501,9 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    if (fixed_ram.active) {
+        fixed_ram_flush(f);
+    }
     rcu_read_unlock();
 
     /*
@@ -1226,6 +1546,9 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    if (fixed_ram.active && fixed_ram_flush(f) == 0) {
+        fixed_ram_write_bitmaps(f);
+    }
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
 
@@ -1426,6 +1749,323 @@ static void decompress_data_with_multi_threads(uint8_t *compbuf,
     }
 }
 
+typedef struct FixedRamLoadParam {
+    int fd;
+    uint8_t *host;
+    const uint8_t *bitmap;
+    uint64_t pages_offset;
+    uint64_t start;
+    uint64_t end;
+    int ret;
+} FixedRamLoadParam;
+
+static int fixed_ram_pread(int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t ret;
+
+    while (len) {
+        ret = pread(fd, buf, len, offset);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* Truncated file */
+            return -EINVAL;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static inline bool fixed_ram_test_page(const uint8_t *bitmap, uint64_t page)
+{
+    return bitmap[page / 8] & (1 << (page % 8));
+}
+
+/* Returns the end of the run of equal bitmap bits that starts at page */
+static uint64_t fixed_ram_run_end(const uint8_t *bitmap, uint64_t page,
+                                  uint64_t end)
+{
+    bool present = fixed_ram_test_page(bitmap, page);
+    uint64_t next;
+
+    for (next = page + 1; next < end; next++) {
+        if (fixed_ram_test_page(bitmap, next) != present) {
+            break;
+        }
+    }
+    return next;
+}
+
+/* Load pages [start, end) of a block, one run of equal bitmap bits at once */
+static void *fixed_ram_load_thread(void *opaque)
+{
+    FixedRamLoadParam *p = opaque;
+    uint64_t page = p->start;
+    uint64_t next;
+
+    while (page < p->end) {
+        next = fixed_ram_run_end(p->bitmap, page, p->end);
+
+        if (fixed_ram_test_page(p->bitmap, page)) {
+            p->ret = fixed_ram_pread(p->fd,
+                                     p->host + (page << TARGET_PAGE_BITS),
+                                     (next - page) << TARGET_PAGE_BITS,
+                                     p->pages_offset +
+                                     (page << TARGET_PAGE_BITS));
+            if (p->ret < 0) {
+                break;
+            }
+        } else {
+            ram_handle_compressed(p->host + (page << TARGET_PAGE_BITS), 0,
+                                  (next - page) << TARGET_PAGE_BITS);
+        }
+        page = next;
+    }
+
+    return NULL;
+}
+
+/*
+ * Rather than reading a block before the guest may run, its present pages
+ * can be mapped copy-on-write from the file, so that each page is read
+ * when it is first touched.  A prefetch thread then writes to every mapped
+ * page in file order, which reads it in ahead of the guest and makes it
+ * private; until it is done the guest depends on the file, so migrating
+ * (which could truncate the file) is blocked.
+ */
+#ifndef _WIN32
+#define FIXED_RAM_MAX_MAPPINGS      1024
+#define FIXED_RAM_PREFETCH_CHUNK    (1 * 1024 * 1024)
+
+typedef struct FixedRamMapping {
+    ram_addr_t offset;
+    ram_addr_t len;
+} FixedRamMapping;
+
+typedef struct FixedRamPrefetch {
+    RAMBlock *block;
+    uint8_t *host;
+    FixedRamMapping *runs;
+    int nb_runs;
+    QemuThread thread;
+    QEMUBH *bh;
+    Error *blocker;
+} FixedRamPrefetch;
+
+/* Must be called with rcu_read_lock held */
+static bool fixed_ram_prefetch_block_valid(FixedRamPrefetch *p)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (block == p->block) {
+            return block->host == p->host;
+        }
+    }
+    return false;
+}
+
+static void *fixed_ram_prefetch_thread(void *opaque)
+{
+    FixedRamPrefetch *p = opaque;
+    size_t page_size = getpagesize();
+    ram_addr_t offset, end, addr;
+    int i;
+
+    rcu_register_thread();
+
+    for (i = 0; i < p->nb_runs; i++) {
+        end = p->runs[i].offset + p->runs[i].len;
+        for (offset = p->runs[i].offset; offset < end;
+             offset += FIXED_RAM_PREFETCH_CHUNK) {
+            rcu_read_lock();
+            if (!fixed_ram_prefetch_block_valid(p)) {
+                /* The block was unplugged, its memory is going away */
+                rcu_read_unlock();
+                goto out;
+            }
+            for (addr = offset;
+                 addr < MIN(offset + FIXED_RAM_PREFETCH_CHUNK, end);
+                 addr += page_size) {
+                /* An atomic add of zero unshares the page without
+                 * losing a concurrent write by the guest */
+                atomic_add((uint32_t *)(p->host + addr), 0);
+            }
+            rcu_read_unlock();
+        }
+    }
+
+out:
+    rcu_unregister_thread();
+    qemu_bh_schedule(p->bh);
+    return NULL;
+}
+
+static void fixed_ram_prefetch_done(void *opaque)
+{
+    FixedRamPrefetch *p = opaque;
+
+    qemu_thread_join(&p->thread);
+    qemu_bh_delete(p->bh);
+    migrate_del_blocker(p->blocker);
+    error_free(p->blocker);
+    g_free(p->runs);
+    g_free(p);
+}
+
+/*
+ * Map the present pages of @block from the file and start prefetching them.
+ * Returns -ENOTSUP if the block or the file layout does not allow mapping;
+ * on any error, the pages of the block are zero.
+ */
+static int fixed_ram_map_block(int fd, RAMBlock *block, const uint8_t *bitmap,
+                               uint64_t pages_offset)
+{
+    uint64_t pages = block->used_length >> TARGET_PAGE_BITS;
+    uint64_t page, next, offset, len;
+    FixedRamPrefetch *p;
+    int nb_runs = 0;
+    int ret;
+
+    if (getpagesize() > TARGET_PAGE_SIZE ||
+        pages_offset % getpagesize() != 0) {
+        return -ENOTSUP;
+    }
+
+    /* Every run of present pages needs a mapping of its own */
+    for (page = 0; page < pages; page = next) {
+        next = fixed_ram_run_end(bitmap, page, pages);
+        if (fixed_ram_test_page(bitmap, page)) {
+            nb_runs++;
+        }
+    }
+    if (nb_runs > FIXED_RAM_MAX_MAPPINGS) {
+        return -ENOTSUP;
+    }
+
+    /* Drop the old contents, pages that are not in the file are zero */
+    ret = qemu_ram_map_private(block, 0, block->used_length, -1, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    p = g_new0(FixedRamPrefetch, 1);
+    p->block = block;
+    p->host = block->host;
+    p->runs = g_new(FixedRamMapping, nb_runs);
+
+    for (page = 0; page < pages; page = next) {
+        next = fixed_ram_run_end(bitmap, page, pages);
+        if (!fixed_ram_test_page(bitmap, page)) {
+            continue;
+        }
+
+        offset = page << TARGET_PAGE_BITS;
+        len = (next - page) << TARGET_PAGE_BITS;
+        ret = qemu_ram_map_private(block, offset, len, fd,
+                                   pages_offset + offset);
+        if (ret < 0) {
+            /* Leave no mapping of the file behind */
+            qemu_ram_map_private(block, 0, block->used_length, -1, 0);
+            g_free(p->runs);
+            g_free(p);
+            return ret;
+        }
+        p->runs[p->nb_runs].offset = offset;
+        p->runs[p->nb_runs].len = len;
+        p->nb_runs++;
+    }
+
+    error_setg(&p->blocker, "RAM block \"%s\" is still being read from "
+               "the migration file", block->idstr);
+    migrate_add_blocker(p->blocker);
+    p->bh = qemu_bh_new(fixed_ram_prefetch_done, p);
+    qemu_thread_create(&p->thread, "fixed-ram-prefetch",
+                       fixed_ram_prefetch_thread, p, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+#else
+static int fixed_ram_map_block(int fd, RAMBlock *block, const uint8_t *bitmap,
+                               uint64_t pages_offset)
+{
+    return -ENOTSUP;
+}
+#endif
+
+/*
+ * Read the fixed-ram header that follows a block in the
+ * RAM_SAVE_FLAG_MEM_SIZE record, map or load the pages of the block and
+ * continue the stream after them.
+ */
+static int ram_load_fixed_block(QEMUFile *f, RAMBlock *block)
+{
+    FixedRamLoadParam param[FIXED_RAM_THREADS];
+    QemuThread threads[FIXED_RAM_THREADS];
+    uint64_t bitmap_offset, pages_offset, pages, slice;
+    uint8_t *bitmap;
+    int fd = qemu_get_fd(f);
+    int i, ret;
+
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (!qemu_file_is_seekable(f) || fd < 0) {
+        error_report("fixed-ram migration stream must be loaded from a file");
+        return -EINVAL;
+    }
+
+    pages = block->used_length >> TARGET_PAGE_BITS;
+    bitmap = g_malloc(DIV_ROUND_UP(pages, 8));
+    ret = fixed_ram_pread(fd, bitmap, DIV_ROUND_UP(pages, 8), bitmap_offset);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (fixed_ram_map_block(fd, block, bitmap, pages_offset) == 0) {
+        goto done;
+    }
+
+    slice = DIV_ROUND_UP(pages, FIXED_RAM_THREADS);
+    for (i = 0; i < FIXED_RAM_THREADS; i++) {
+        param[i].fd = fd;
+        param[i].host = memory_region_get_ram_ptr(block->mr);
+        param[i].bitmap = bitmap;
+        param[i].pages_offset = pages_offset;
+        param[i].start = MIN(i * slice, pages);
+        param[i].end = MIN((i + 1) * slice, pages);
+        param[i].ret = 0;
+        qemu_thread_create(threads + i, "fixed-ram-load",
+                           fixed_ram_load_thread, param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < FIXED_RAM_THREADS; i++) {
+        qemu_thread_join(threads + i);
+        if (param[i].ret < 0 && !ret) {
+            ret = param[i].ret;
+        }
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+done:
+    ret = qemu_fseek(f, pages_offset + block->used_length);
+
+out:
+    if (ret < 0) {
+        error_report("Failed to load RAM block \"%s\": %s", block->idstr,
+                     strerror(-ret));
+    }
+    g_free(bitmap);
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -1453,7 +2093,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
-        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        switch (flags & ~(RAM_SAVE_FLAG_CONTINUE | RAM_SAVE_FLAG_FIXED_RAM)) {
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
@@ -1485,6 +2125,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
                     ret = -EINVAL;
+                } else if (!ret && (flags & RAM_SAVE_FLAG_FIXED_RAM)) {
+                    ret = ram_load_fixed_block(f, block);
                 }
 
                 total_ram_bytes -= length;
@@ -48,6 +48,7 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "block/qapi.h"
+#include "block/coroutine.h"
 
 
 #ifndef ETH_P_RARP
@@ -145,9 +146,103 @@ static int block_put_buffer(void *opaque, const uint8_t *buf,
     return size;
 }
 
+/*
+ * The VM state is read sequentially in small pieces by the QEMUFile, so
+ * reading it synchronously pays the latency of the image for every one of
+ * them.  Instead, the next few megabytes of the VM state are always being
+ * read ahead in coroutines while the state that has arrived is loaded.
+ */
+#define VMSTATE_READAHEAD_CHUNK_SIZE    (1 * 1024 * 1024)
+#define VMSTATE_READAHEAD_CHUNKS        8
+
+typedef struct BdrvVMStateChunk {
+    BlockDriverState *bs;
+    int64_t pos;
+    int len;
+    uint8_t *buf;
+    int ret;
+    bool in_flight;
+    bool valid;
+} BdrvVMStateChunk;
+
+typedef struct BdrvVMStateReader {
+    BlockDriverState *bs;
+    int64_t size;
+    BdrvVMStateChunk chunks[VMSTATE_READAHEAD_CHUNKS];
+} BdrvVMStateReader;
+
+static void coroutine_fn block_readahead_co(void *opaque)
+{
+    BdrvVMStateChunk *c = opaque;
+
+    c->ret = bdrv_load_vmstate(c->bs, c->buf, c->pos, c->len);
+    c->in_flight = false;
+    c->valid = true;
+}
+
+/* Starts reading the chunks following pos that are not being read yet */
+static void block_readahead(BdrvVMStateReader *r, int64_t pos)
+{
+    int64_t chunk_pos = QEMU_ALIGN_DOWN(pos, VMSTATE_READAHEAD_CHUNK_SIZE);
+    int i;
+
+    for (i = 0; i < VMSTATE_READAHEAD_CHUNKS; i++) {
+        int64_t index = chunk_pos / VMSTATE_READAHEAD_CHUNK_SIZE;
+        BdrvVMStateChunk *c = &r->chunks[index % VMSTATE_READAHEAD_CHUNKS];
+        Coroutine *co;
+
+        if (chunk_pos >= r->size) {
+            break;
+        }
+        if (c->pos == chunk_pos && (c->in_flight || c->valid)) {
+            chunk_pos += VMSTATE_READAHEAD_CHUNK_SIZE;
+            continue;
+        }
+        if (c->in_flight) {
+            /* still reading an older chunk into this slot */
+            break;
+        }
+
+        c->pos = chunk_pos;
+        c->len = MIN(VMSTATE_READAHEAD_CHUNK_SIZE, r->size - chunk_pos);
+        c->in_flight = true;
+        c->valid = false;
+        co = qemu_coroutine_create(block_readahead_co);
+        qemu_coroutine_enter(co, c);
+
+        chunk_pos += VMSTATE_READAHEAD_CHUNK_SIZE;
+    }
+}
+
 static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
-    return bdrv_load_vmstate(opaque, buf, pos, size);
+    BdrvVMStateReader *r = opaque;
+    int64_t chunk_pos = QEMU_ALIGN_DOWN(pos, VMSTATE_READAHEAD_CHUNK_SIZE);
+    int64_t index = chunk_pos / VMSTATE_READAHEAD_CHUNK_SIZE;
+    BdrvVMStateChunk *c = &r->chunks[index % VMSTATE_READAHEAD_CHUNKS];
+    int offset;
+
+    if (pos >= r->size) {
+        return bdrv_load_vmstate(r->bs, buf, pos, size);
+    }
+
+    block_readahead(r, pos);
+    while (c->in_flight) {
+        aio_poll(bdrv_get_aio_context(r->bs), true);
+    }
+    if (c->pos != chunk_pos || !c->valid) {
+        /* the slot was still busy when the readahead got here */
+        return bdrv_load_vmstate(r->bs, buf, pos, size);
+    }
+    if (c->ret < 0) {
+        return c->ret;
+    }
+
+    offset = pos - chunk_pos;
+    size = MIN(size, c->len - offset);
+    memcpy(buf, c->buf + offset, size);
+
+    return size;
 }
 
 static int bdrv_fclose(void *opaque)
@@ -155,9 +250,25 @@ static int bdrv_fclose(void *opaque)
     return bdrv_flush(opaque);
 }
 
+static int block_reader_fclose(void *opaque)
+{
+    BdrvVMStateReader *r = opaque;
+    int i;
+
+    for (i = 0; i < VMSTATE_READAHEAD_CHUNKS; i++) {
+        while (r->chunks[i].in_flight) {
+            aio_poll(bdrv_get_aio_context(r->bs), true);
+        }
+        qemu_vfree(r->chunks[i].buf);
+    }
+    g_free(r);
+
+    return 0;
+}
+
 static const QEMUFileOps bdrv_read_ops = {
     .get_buffer = block_get_buffer,
-    .close =      bdrv_fclose
+    .close =      block_reader_fclose
 };
 
 static const QEMUFileOps bdrv_write_ops = {
@@ -168,10 +279,25 @@ static const QEMUFileOps bdrv_write_ops = {
 
 static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
-    if (is_writable) {
-        return qemu_fopen_ops(bs, &bdrv_write_ops);
+    assert(is_writable);
+    return qemu_fopen_ops(bs, &bdrv_write_ops);
+}
+
+/* Opens the VM state of bs for reading. size is the size of the VM state,
+ * nothing beyond it is read ahead. */
+static QEMUFile *qemu_fopen_bdrv_vmstate(BlockDriverState *bs, int64_t size)
+{
+    BdrvVMStateReader *r = g_new0(BdrvVMStateReader, 1);
+    int i;
+
+    r->bs = bs;
+    r->size = size;
+    for (i = 0; i < VMSTATE_READAHEAD_CHUNKS; i++) {
+        r->chunks[i].bs = bs;
+        r->chunks[i].buf = qemu_blockalign(bs, VMSTATE_READAHEAD_CHUNK_SIZE);
     }
-    return qemu_fopen_ops(bs, &bdrv_read_ops);
+
+    return qemu_fopen_ops(r, &bdrv_read_ops);
 }
 
 
@@ -898,6 +1024,20 @@ void qemu_savevm_state_cancel(void)
     }
 }
 
+/* Set while a live snapshot is saved in the background by hmp_savevm */
+static struct SaveVMLiveState *savevm_live_state;
+
+/* The live snapshot owns the RAM dirty logging and the VM state area, so
+ * nothing else may save, load or delete snapshots until it has finished. */
+bool savevm_live_in_progress(Error **errp)
+{
+    if (savevm_live_state) {
+        error_setg(errp, "A live snapshot is being saved");
+        return true;
+    }
+    return false;
+}
+
 static int qemu_savevm_state(QEMUFile *f, Error **errp)
 {
     int ret;
@@ -906,7 +1046,7 @@ static int qemu_savevm_state(QEMUFile *f, Error **errp)
         .shared = 0
     };
 
-    if (qemu_savevm_state_blocked(errp)) {
+    if (savevm_live_in_progress(errp) || qemu_savevm_state_blocked(errp)) {
         return -EINVAL;
     }
 
@@ -1192,18 +1332,11 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void hmp_savevm(Monitor *mon, const QDict *qdict)
+/* Checks that all writable devices can be snapshotted and returns the one
+ * that gets the VM state, or NULL on error. */
+static BlockDriverState *savevm_find_vmstate_bs(Monitor *mon)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
-    qemu_timeval tv;
-    struct tm tm;
-    const char *name = qdict_get_try_str(qdict, "name");
-    Error *local_err = NULL;
+    BlockDriverState *bs;
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -1216,18 +1349,28 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
         if (!bdrv_can_snapshot(bs)) {
             monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
                                bdrv_get_device_name(bs));
-            return;
+            return NULL;
         }
     }
 
     bs = find_vmstate_bs();
     if (!bs) {
         monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        return NULL;
     }
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+    return bs;
+}
+
+/* Fills in the snapshot info for savevm and deletes old snapshots with the
+ * same name. */
+static int savevm_prepare(Monitor *mon, BlockDriverState *bs,
+                          const char *name, QEMUSnapshotInfo *sn)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    qemu_timeval tv;
+    struct tm tm;
+    int ret;
 
     memset(sn, 0, sizeof(*sn));
 
@@ -1253,6 +1396,253 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
 
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Creates the disk snapshots once the VM state has been saved to bs */
+static void savevm_create_snapshots(Monitor *mon, BlockDriverState *bs,
+                                    QEMUSnapshotInfo *sn,
+                                    uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+            }
+        }
+    }
+}
+
+/*
+ * Live savevm
+ *
+ * The RAM is saved with the iterative part of the migration code while the
+ * guest keeps running, and dirty logging makes sure that pages written in the
+ * meantime are saved again.  The guest is only stopped once the remaining
+ * dirty memory can be written within the maximum downtime of migration, then
+ * the rest of the VM state is saved and the disk snapshots are taken.
+ *
+ * This runs in a coroutine in the main loop, so devices and other monitors
+ * keep working.  The monitor that issued the command is suspended until the
+ * snapshot is complete.
+ */
+
+/* How often the bandwidth to the VM state is measured */
+#define SAVEVM_LIVE_BANDWIDTH_MS    100
+
+/* Give up on converging once this many times the size of the RAM have been
+ * written, so that a guest that dirties memory faster than it can be saved
+ * does not fill the image */
+#define SAVEVM_LIVE_MAX_PASSES      3
+
+typedef struct SaveVMLiveState {
+    Monitor *mon;
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn;
+    Error *blocker;
+} SaveVMLiveState;
+
+static int coroutine_fn savevm_live_save(SaveVMLiveState *s, QEMUFile *f,
+                                         bool *vm_running)
+{
+    int64_t initial_time, current_time;
+    uint64_t initial_bytes, max_size = 0;
+    uint64_t max_bytes = SAVEVM_LIVE_MAX_PASSES * ram_bytes_total();
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    int ret;
+
+    qemu_mutex_unlock_iothread();
+    qemu_savevm_state_header(f);
+    qemu_savevm_state_begin(f, &params);
+    qemu_mutex_lock_iothread();
+
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    initial_bytes = qemu_ftell(f);
+
+    while (qemu_file_get_error(f) == 0) {
+        uint64_t pending_size;
+
+        /* ram_save_pending() takes the iothread lock itself */
+        qemu_mutex_unlock_iothread();
+        pending_size = qemu_savevm_state_pending(f, max_size);
+        qemu_mutex_lock_iothread();
+
+        if (!pending_size || pending_size < max_size ||
+            qemu_ftell(f) > max_bytes) {
+            break;
+        }
+
+        qemu_savevm_state_iterate(f);
+
+        current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (current_time >= initial_time + SAVEVM_LIVE_BANDWIDTH_MS) {
+            uint64_t transferred_bytes = qemu_ftell(f) - initial_bytes;
+            uint64_t time_spent = current_time - initial_time;
+            double bandwidth = transferred_bytes / time_spent;
+
+            max_size = bandwidth * migrate_max_downtime() / 1000000;
+            initial_time = current_time;
+            initial_bytes = qemu_ftell(f);
+        }
+
+        /* Let the main loop run before saving the next chunk */
+        co_aio_sleep_ns(qemu_get_aio_context(), QEMU_CLOCK_REALTIME, 0);
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *vm_running = runstate_is_running();
+    ret = vm_stop(RUN_STATE_SAVE_VM);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->sn.vm_clock_nsec = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    qemu_savevm_state_complete(f);
+    return qemu_file_get_error(f);
+}
+
+static void coroutine_fn savevm_live_co(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    Monitor *mon = s->mon;
+    bool vm_running = false;
+    uint64_t vm_state_size;
+    QEMUFile *f;
+    int ret;
+
+    f = qemu_fopen_bdrv(s->bs, 1);
+    if (!f) {
+        monitor_printf(mon, "Could not open VM state file\n");
+        goto out;
+    }
+
+    ret = savevm_live_save(s, f, &vm_running);
+    vm_state_size = qemu_ftell(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        qemu_savevm_state_cancel();
+        monitor_printf(mon, "Error while writing VM state: %s\n",
+                       strerror(-ret));
+        goto out;
+    }
+
+    savevm_create_snapshots(mon, s->bs, &s->sn, vm_state_size);
+
+out:
+    if (vm_running) {
+        vm_start();
+    }
+    bdrv_op_unblock_all(s->bs, s->blocker);
+    bdrv_unref(s->bs);
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    savevm_live_state = NULL;
+    g_free(s);
+    monitor_resume(mon);
+}
+
+static void hmp_savevm_live(Monitor *mon, const char *name)
+{
+    MigrationState *ms = migrate_get_current();
+    SaveVMLiveState *s;
+    BlockDriverState *bs;
+    Coroutine *co;
+    Error *local_err = NULL;
+
+    if (ms->state == MIGRATION_STATUS_ACTIVE ||
+        ms->state == MIGRATION_STATUS_SETUP ||
+        ms->state == MIGRATION_STATUS_CANCELLING) {
+        monitor_printf(mon, "Cannot save a live snapshot during migration\n");
+        return;
+    }
+
+    if (qemu_savevm_state_blocked(&local_err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    bs = savevm_find_vmstate_bs(mon);
+    if (!bs) {
+        return;
+    }
+
+    if (monitor_suspend(mon) < 0) {
+        monitor_printf(mon, "Terminal does not allow live snapshots\n");
+        return;
+    }
+
+    s = g_new0(SaveVMLiveState, 1);
+    if (savevm_prepare(mon, bs, name, &s->sn) < 0) {
+        g_free(s);
+        monitor_resume(mon);
+        return;
+    }
+
+    s->mon = mon;
+    s->bs = bs;
+
+    /* Migration uses the same dirty logging and RAM state, and the device
+     * with the VM state must stay around until the snapshot is created */
+    error_setg(&s->blocker, "A live snapshot is being saved");
+    migrate_add_blocker(s->blocker);
+    bdrv_ref(bs);
+    bdrv_op_block_all(bs, s->blocker);
+    savevm_live_state = s;
+
+    co = qemu_coroutine_create(savevm_live_co);
+    qemu_coroutine_enter(co, s);
+}
+
+void hmp_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+    Error *local_err = NULL;
+
+    if (savevm_live_in_progress(&local_err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
+
+    if (qdict_get_try_bool(qdict, "live", 0)) {
+        hmp_savevm_live(mon, name);
+        return;
+    }
+
+    bs = savevm_find_vmstate_bs(mon);
+    if (!bs) {
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    if (savevm_prepare(mon, bs, name, sn) < 0) {
         goto the_end;
     }
 
@@ -1272,19 +1662,7 @@ void hmp_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running) {
@@ -1323,8 +1701,15 @@ int load_vmstate(const char *name)
     BlockDriverState *bs, *bs_vm_state;
     QEMUSnapshotInfo sn;
     QEMUFile *f;
+    uint64_t vm_state_size;
+    Error *local_err = NULL;
     int ret;
 
+    if (savevm_live_in_progress(&local_err)) {
+        error_report_err(local_err);
+        return -EBUSY;
+    }
+
     bs_vm_state = find_vmstate_bs();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -1340,6 +1725,7 @@ int load_vmstate(const char *name)
             "using qemu-img.");
         return -EINVAL;
     }
+    vm_state_size = sn.vm_state_size;
 
     /* Verify if there is any device that doesn't support snapshots and is
     writable and check if the requested snapshot is available too. */
@@ -1380,7 +1766,7 @@ int load_vmstate(const char *name)
     }
 
     /* restore the VM state */
-    f = qemu_fopen_bdrv(bs_vm_state, 0);
+    f = qemu_fopen_bdrv_vmstate(bs_vm_state, vm_state_size);
     if (!f) {
         error_report("Could not open VM state file");
         return -EINVAL;
@@ -1406,6 +1792,13 @@ void hmp_delvm(Monitor *mon, const QDict *qdict)
     Error *err;
     const char *name = qdict_get_str(qdict, "name");
 
+    err = NULL;
+    if (savevm_live_in_progress(&err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
     if (!find_vmstate_bs()) {
         monitor_printf(mon, "No block device supports snapshots\n");
         return;
@@ -2149,6 +2149,14 @@ static void hmp_loadvm(Monitor *mon, const QDict *qdict)
 {
     int saved_vm_running  = runstate_is_running();
     const char *name = qdict_get_str(qdict, "name");
+    Error *local_err = NULL;
+
+    /* Refuse before stopping the VM, the live snapshot would keep it stopped */
+    if (savevm_live_in_progress(&local_err)) {
+        monitor_printf(mon, "%s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        return;
+    }
 
     vm_stop(RUN_STATE_RESTORE_VM);
 
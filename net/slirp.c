@@ -138,7 +138,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *vhostname, const char *tftp_export,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *smb_export,
-                          const char *vsmbserver, const char **dnssearch)
+                          const char *vsmbserver, const char **dnssearch,
+                          uint64_t tcp_sndspace, uint64_t tcp_rcvspace)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -235,6 +236,13 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     }
 #endif
 
+    if (tcp_sndspace > SLIRP_TCP_SPACE_MAX ||
+        tcp_rcvspace > SLIRP_TCP_SPACE_MAX) {
+        error_report("TCP buffer size must not exceed %d bytes",
+                     SLIRP_TCP_SPACE_MAX);
+        return -1;
+    }
+
     nc = qemu_new_net_client(&net_slirp_info, peer, model, name);
 
     snprintf(nc->info_str, sizeof(nc->info_str),
@@ -244,7 +252,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     s = DO_UPCAST(SlirpState, nc, nc);
 
     s->slirp = slirp_init(restricted, net, mask, host, vhostname,
-                          tftp_export, bootfile, dhcp, dns, dnssearch, s);
+                          tftp_export, bootfile, dhcp, dns, dnssearch,
+                          tcp_sndspace, tcp_rcvspace, s);
     QTAILQ_INSERT_TAIL(&slirp_stacks, s, entry);
 
     for (config = slirp_configs; config; config = config->next) {
@@ -763,7 +772,8 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     ret = net_slirp_init(peer, "user", name, user->q_restrict, vnet,
                          user->host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart, user->dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch, user->tcp_sndbuf,
+                         user->tcp_rcvbuf);
 
     while (slirp_configs) {
         config = slirp_configs;
@@ -73,5 +73,11 @@ DEF("amend", img_amend,
     "amend [-p] [-q] [-f fmt] [-t cache] -o options filename")
 STEXI
 @item amend [-p] [-q] [-f @var{fmt}] [-t @var{cache}] -o @var{options} @var{filename}
+ETEXI
+
+DEF("bench", img_bench,
+    "bench [-c count] [-d depth] [-f fmt] [-n] [-P pattern] [-q] [-s buffer_size] [-t cache] [-w] filename")
+STEXI
+@item bench [-c @var{count}] [-d @var{depth}] [-f @var{fmt}] [-n] [-P @var{pattern}] [-q] [-s @var{buffer_size}] [-t @var{cache}] [-w] @var{filename}
 @end table
 ETEXI
@@ -1359,15 +1359,30 @@ static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
 
         case BLK_DATA:
             /* We must always write compressed clusters as a whole, so don't
-             * try to find zeroed parts in the buffer. We can only save the
-             * write if the buffer is completely zeroed and we're allowed to
-             * keep the target sparse. */
+             * try to find zeroed parts in a cluster. We can only save the
+             * write of clusters that are completely zeroed and only if we're
+             * allowed to keep the target sparse. Consecutive clusters with
+             * data are passed down together so that they can be compressed
+             * in parallel. */
             if (s->compressed) {
-                if (s->has_zero_init && s->min_sparse &&
-                    buffer_is_zero(buf, n * BDRV_SECTOR_SIZE))
-                {
-                    assert(!s->target_has_backing);
-                    break;
+                if (s->has_zero_init && s->min_sparse) {
+                    bool zero;
+
+                    n = MIN(nb_sectors, s->cluster_sectors);
+                    zero = buffer_is_zero(buf, n * BDRV_SECTOR_SIZE);
+                    while (n < nb_sectors) {
+                        int next = MIN(nb_sectors - n, s->cluster_sectors);
+                        if (buffer_is_zero(buf + n * BDRV_SECTOR_SIZE,
+                                           next * BDRV_SECTOR_SIZE) != zero) {
+                            break;
+                        }
+                        n += next;
+                    }
+
+                    if (zero) {
+                        assert(!s->target_has_backing);
+                        break;
+                    }
                 }
 
                 ret = blk_write_compressed(s->target, sector_num, buf, n);
@@ -1431,15 +1446,15 @@ static int convert_do_copy(ImgConvertState *s)
         }
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only whole
+     * clusters can be copied. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             ret = -EINVAL;
             goto fail;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
@@ -3042,6 +3057,248 @@ out:
     return 0;
 }
 
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+} BenchRequest;
+
+struct BenchData {
+    BlockBackend *blk;
+    uint64_t image_size;
+    bool write;
+    int bufsize;
+    int nrreq;
+    int n;
+    uint8_t *buf;
+    BenchRequest *reqs;
+
+    int in_flight;
+    uint64_t offset;
+};
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_issue(BenchRequest *req)
+{
+    BenchData *b = req->b;
+    int64_t sector_num = b->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = b->bufsize >> BDRV_SECTOR_BITS;
+    BlockAIOCB *acb;
+
+    if (b->write) {
+        acb = blk_aio_writev(b->blk, sector_num, &req->qiov, nb_sectors,
+                             bench_cb, req);
+    } else {
+        acb = blk_aio_readv(b->blk, sector_num, &req->qiov, nb_sectors,
+                            bench_cb, req);
+    }
+    if (!acb) {
+        error_report("Failed to issue request");
+        exit(EXIT_FAILURE);
+    }
+    b->in_flight++;
+    b->offset += b->bufsize;
+    b->offset %= b->image_size;
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    b->n--;
+    b->in_flight--;
+
+    /* The buffer of the completed request is free, reuse it for the next one
+     * until all requests have been issued */
+    if (b->n > b->in_flight) {
+        bench_issue(req);
+    }
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, ret = 0;
+    const char *fmt = NULL, *filename;
+    bool quiet = false;
+    bool is_write = false;
+    int count = 75000;
+    int depth = 64;
+    int pattern = 0;
+    size_t bufsize = 4096;
+    int flags = BDRV_O_FLAGS;
+    BlockBackend *blk = NULL;
+    BenchData data = {};
+    qemu_timeval t1, t2;
+    double elapsed;
+    int i;
+
+    for (;;) {
+        c = getopt(argc, argv, "hc:d:f:nP:qs:t:w");
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+        case '?':
+            help();
+            break;
+        case 'c':
+        {
+            unsigned long val;
+            char *end;
+
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val == 0 || val > INT_MAX) {
+                error_report("Invalid request count specified");
+                return 1;
+            }
+            count = val;
+            break;
+        }
+        case 'd':
+        {
+            unsigned long val;
+            char *end;
+
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val == 0 || val > INT_MAX) {
+                error_report("Invalid queue depth specified");
+                return 1;
+            }
+            depth = val;
+            break;
+        }
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'n':
+            flags |= BDRV_O_NOCACHE | BDRV_O_NATIVE_AIO;
+            break;
+        case 'P':
+        {
+            unsigned long val;
+            char *end;
+
+            errno = 0;
+            val = strtoul(optarg, &end, 0);
+            if (errno || *end || val > 0xff) {
+                error_report("Invalid pattern byte specified");
+                return 1;
+            }
+            pattern = val;
+            break;
+        }
+        case 'q':
+            quiet = true;
+            break;
+        case 's':
+        {
+            int64_t sval;
+            char *end;
+
+            sval = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (sval <= 0 || sval > INT_MAX || *end ||
+                sval % BDRV_SECTOR_SIZE) {
+                error_report("Invalid buffer size specified");
+                return 1;
+            }
+            bufsize = sval;
+            break;
+        }
+        case 't':
+            ret = bdrv_parse_cache_flags(optarg, &flags);
+            if (ret < 0) {
+                error_report("Invalid cache mode");
+                return 1;
+            }
+            break;
+        case 'w':
+            flags |= BDRV_O_RDWR;
+            is_write = true;
+            break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        error_exit("Expecting one image file name");
+    }
+    filename = argv[argc - 1];
+
+    blk = img_open("image", filename, fmt, flags, true, quiet);
+    if (!blk) {
+        ret = -1;
+        goto out;
+    }
+
+    data = (BenchData) {
+        .blk        = blk,
+        .image_size = blk_getlength(blk),
+        .write      = is_write,
+        .bufsize    = bufsize,
+        .nrreq      = depth,
+        .n          = count,
+    };
+    if ((int64_t)data.image_size < (int64_t)bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
+    /* Requests must not straddle the end of the image */
+    data.image_size -= data.image_size % bufsize;
+
+    qprintf(quiet, "Sending %d %s requests, %d bytes each, %d in parallel\n",
+            count, is_write ? "write" : "read", data.bufsize, depth);
+
+    data.buf = blk_blockalign(blk, (size_t)depth * bufsize);
+    memset(data.buf, pattern, (size_t)depth * bufsize);
+    data.reqs = g_new(BenchRequest, depth);
+    for (i = 0; i < depth; i++) {
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov, data.buf + (size_t)i * bufsize,
+                       bufsize);
+    }
+
+    qemu_gettimeofday(&t1);
+    for (i = 0; i < depth && i < count; i++) {
+        bench_issue(&data.reqs[i]);
+    }
+
+    while (data.n > 0) {
+        main_loop_wait(false);
+    }
+    qemu_gettimeofday(&t2);
+
+    elapsed = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+    qprintf(quiet, "Run completed in %3.3f seconds, %.0f IOPS.\n",
+            elapsed, elapsed > 0 ? count / elapsed : 0);
+
+out:
+    if (data.reqs) {
+        for (i = 0; i < depth; i++) {
+            qemu_iovec_destroy(&data.reqs[i].qiov);
+        }
+        g_free(data.reqs);
+    }
+    qemu_vfree(data.buf);
+    blk_unref(blk);
+
+    if (ret) {
+        return 1;
+    }
+    return 0;
+}
+
 static const img_cmd_t img_cmds[] = {
 #define DEF(option, callback, arg_string)        \
     { option, callback },
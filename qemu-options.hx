@@ -470,6 +470,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
     "       [[,iops_size=is]]\n"
     "       [[,group=g]]\n"
+    "       [[,scheduler=round-robin|weighted][,weight=w][,iops_min=im]\n"
+    "       [,burst_credit=bc]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -673,12 +675,13 @@ ETEXI
 
 DEF("fsdev", HAS_ARG, QEMU_OPTION_fsdev,
     "-fsdev fsdriver,id=id[,path=path,][security_model={mapped-xattr|mapped-file|passthrough|none}]\n"
-    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    " [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    " [,max_requests=n][,attr_timeout=ms]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -fsdev @var{fsdriver},id=@var{id},path=@var{path},[security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,max_requests=@var{n}][,attr_timeout=@var{ms}]
 @findex -fsdev
 Define a new file system device. Valid options are:
 @table @option
@@ -719,6 +722,14 @@ with virtfs-proxy-helper
 Enables proxy filesystem driver to use passed socket descriptor for
 communicating with virtfs-proxy-helper. Usually a helper like libvirt
 will create socketpair and pass one of the fds as sock_fd
+@item max_requests=@var{n}
+Limits the number of filesystem operations of this export that are run
+in worker threads at the same time. By default there is no limit.
+@item attr_timeout=@var{ms}
+Caches file attributes looked up by the guest for up to @var{ms}
+milliseconds. Attributes are refreshed when the guest modifies the file,
+but changes made on the host are only seen after the timeout expires.
+By default attributes are not cached.
 @end table
 
 -fsdev option is used along with -device driver "virtio-9p-pci".
@@ -735,12 +746,13 @@ ETEXI
 
 DEF("virtfs", HAS_ARG, QEMU_OPTION_virtfs,
     "-virtfs local,path=path,mount_tag=tag,security_model=[mapped-xattr|mapped-file|passthrough|none]\n"
-    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n",
+    "        [,writeout=immediate][,readonly][,socket=socket|sock_fd=sock_fd]\n"
+    "        [,max_requests=n][,attr_timeout=ms]\n",
     QEMU_ARCH_ALL)
 
 STEXI
 
-@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}]
+@item -virtfs @var{fsdriver}[,path=@var{path}],mount_tag=@var{mount_tag}[,security_model=@var{security_model}][,writeout=@var{writeout}][,readonly][,socket=@var{socket}|sock_fd=@var{sock_fd}][,max_requests=@var{n}][,attr_timeout=@var{ms}]
 @findex -virtfs
 
 The general form of a Virtual File system pass-through options are:
@@ -782,6 +794,14 @@ will create socketpair and pass one of the fds as sock_fd
 @item sock_fd
 Enables proxy filesystem driver to use passed 'sock_fd' as the socket
 descriptor for interfacing with virtfs-proxy-helper
+@item max_requests=@var{n}
+Limits the number of filesystem operations of this export that are run
+in worker threads at the same time. By default there is no limit.
+@item attr_timeout=@var{ms}
+Caches file attributes looked up by the guest for up to @var{ms}
+milliseconds. Attributes are refreshed when the guest modifies the file,
+but changes made on the host are only seen after the timeout expires.
+By default attributes are not cached.
 @end table
 ETEXI
 
@@ -1309,6 +1329,27 @@ This can be really helpful to save bandwidth when playing videos. Disabling
 adaptive encodings restores the original static behavior of encodings
 like Tight.
 
+@item video-fps=@var{n}
+
+Send updates of the regions detected as video by the adaptive encodings
+at most @var{n} times per second. The other regions of the screen are
+still updated at the normal refresh rate. @var{n} must be between 1 and
+60. By default no limit is applied.
+
+@item video-rate=@var{kbps}
+
+Bandwidth target, in kbit/s, for the JPEG data sent for video regions.
+The JPEG quality of these regions is lowered while the target is exceeded
+and raised back up to the quality requested by the client otherwise. When
+a region stops changing it is sent again losslessly. @var{kbps} must be
+between 1 and 1000000. By default no target is applied.
+
+@item encoder-threads=@var{n}
+
+Number of threads used to encode framebuffer updates (default 1). The
+threads are shared by all the VNC displays and serve the connected clients
+in parallel; the updates for a single client are always encoded in order.
+
 @item share=[allow-exclusive|force-shared|ignore]
 
 Set display sharing policy.  'allow-exclusive' allows clients to ask
@@ -1461,7 +1502,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #ifdef CONFIG_SLIRP
     "-netdev user,id=str[,net=addr[/mask]][,host=addr][,restrict=on|off]\n"
     "         [,hostname=host][,dhcpstart=addr][,dns=addr][,dnssearch=domain][,tftp=dir]\n"
-    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]\n"
+    "         [,tcp-sndbuf=nbytes][,tcp-rcvbuf=nbytes]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -1735,6 +1777,13 @@ so that QEMU behaves similar to an inetd process for that virtual server:
 qemu -net 'user,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 @end example
 
+@item tcp-sndbuf=@var{nbytes}
+@itemx tcp-rcvbuf=@var{nbytes}
+Size of the buffers kept for each TCP connection, for data flowing to the
+guest and for data coming from the guest respectively. The default of 8192
+bytes limits throughput on fast links; larger values (up to 16M) allow more
+data in flight and enable TCP window scaling towards the guest.
+
 @end table
 
 Note: Legacy stand-alone options -tftp, -bootp, -smb and -redir are still
@@ -3275,6 +3324,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                load incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -3293,6 +3344,9 @@ Accept incoming migration from a given filedescriptor.
 @item -incoming exec:@var{cmdline}
 Accept incoming migration as an output from specified external command.
 
+@item -incoming file:@var{filename}
+Load incoming migration from a file written by @code{migrate file:}.
+
 @item -incoming defer
 Wait for the URI to be specified via migrate_incoming.  The monitor can
 be used to change settings (such as migration parameters) prior to issuing
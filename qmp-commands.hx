@@ -1853,7 +1853,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?,scheduler:s?,weight:l?,iops_min:l?,burst_credit:l?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1880,6 +1880,13 @@ Arguments:
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
 - "group": throttle group name (json-string)
+- "scheduler": scheduler of the throttle group, "round-robin" or
+               "weighted" (json-string, optional)
+- "weight": weight of the device in the throttle group (json-int, optional)
+- "iops_min": I/O operations per second guaranteed to the device by the
+              weighted scheduler (json-int, optional)
+- "burst_credit": bytes that the device may issue ahead of its share after
+                  being idle (json-int, optional)
 
 Example:
 
@@ -2293,6 +2300,14 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group name (json-string, optional)
+         - "scheduler": scheduler of the throttle group (json-string,
+                        optional)
+         - "weight": weight of the device in the throttle group (json-int,
+                     optional)
+         - "iops_min": guaranteed I/O operations per second (json-int,
+                       optional)
+         - "burst_credit": burst credit in bytes (json-int, optional)
          - "detect_zeroes": detect and optimize zero writing (json-string)
              - Possible values: "off", "on", "unmap"
          - "write_threshold": write offset threshold in bytes, a event will be
@@ -2459,10 +2474,35 @@ Each json-object contain the following:
                    another request (json-int)
     - "wr_merged": number of write requests that have been merged into
                    another request (json-int)
+    - "histograms": A json-object with log2 bucketed histograms of the
+                    completed requests, each a json-array of json-int:
+        - "rd_latency", "wr_latency", "flush_latency": element i counts the
+          requests that took [2^i, 2^(i+1)) microseconds
+        - "rd_size", "wr_size": element i counts the requests of
+          [2^(i+9), 2^(i+10)) bytes
+    - "timed_stats": A json-array of json-objects with the statistics of the
+                     last 1, 60 and 300 seconds (json-array, optional):
+        - "interval_length": length of the interval in seconds (json-int)
+        - "min_rd_latency_ns", "max_rd_latency_ns", "avg_rd_latency_ns",
+          and the same for "wr" and "flush": latencies in nano-seconds
+          (json-int)
+        - "avg_rd_queue_depth", "avg_wr_queue_depth": average number of
+          pending requests (json-number)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
             (json-object, optional)
+- "throttle-group-stats": Statistics of all devices in the I/O throttling
+                          group of the device, without "timed_stats"
+                          (json-object, optional)
+- "throttle-wait-stats": Time that requests of the device spent waiting in
+                         its I/O throttling group (json-object, optional)
+    - "rd_throttled", "wr_throttled": number of requests that had to wait
+                                      (json-int)
+    - "rd_total_wait_ns", "wr_total_wait_ns": total waiting time in
+                                              nano-seconds (json-int)
+    - "rd_max_wait_ns", "wr_max_wait_ns": longest waiting time in
+                                          nano-seconds (json-int)
 
 Example:
 
@@ -3008,6 +3048,10 @@ Clients are described by a json-object, each one contain the following:
 - "service": client's port number (json-string)
 - "x509_dname": TLS dname (json-string, optional)
 - "sasl_username": SASL username (json-string, optional)
+- "updates": framebuffer updates encoded (json-int, optional)
+- "encode-time": time spent encoding, in nanoseconds (json-int, optional)
+- "encoded-bytes": size of the encoded updates (json-int, optional)
+- "sent-bytes": bytes written to the client socket (json-int, optional)
 
 Example:
 
@@ -3023,7 +3067,11 @@ Example:
             {
                "host":"127.0.0.1",
                "service":"50401",
-               "family":"ipv4"
+               "family":"ipv4",
+               "updates":1024,
+               "encode-time":51200000,
+               "encoded-bytes":8388608,
+               "sent-bytes":8388608
             }
          ]
       }
@@ -3403,6 +3451,7 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "fixed-ram": store RAM pages at fixed offsets of a "file:" migration target
 
 Arguments:
 
@@ -29,6 +29,7 @@ class QEMUQtestProtocol(object):
         """
         self._address = address
         self._sock = self._get_sock()
+        self._sockfile = None
         if server:
             self._sock.bind(self._address)
             self._sock.listen(1)
@@ -47,6 +48,7 @@ class QEMUQtestProtocol(object):
         @raise socket.error on socket connection errors
         """
         self._sock.connect(self._address)
+        self._sockfile = self._sock.makefile()
 
     def accept(self):
         """
@@ -55,17 +57,22 @@ class QEMUQtestProtocol(object):
         @raise socket.error on socket connection errors
         """
         self._sock, _ = self._sock.accept()
+        self._sockfile = self._sock.makefile()
 
     def cmd(self, qtest_cmd):
         """
-        Send a qtest command on the wire.
+        Send a qtest command on the wire and wait for the response.
 
         @param qtest_cmd: qtest command text to be sent
+        @return the response line
         """
         self._sock.sendall(qtest_cmd + "\n")
+        return self._sockfile.readline()
 
     def close(self):
         self._sock.close()
+        if self._sockfile:
+            self._sockfile.close()
 
     def settimeout(self, timeout):
         self._sock.settimeout(timeout)
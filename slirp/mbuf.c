@@ -17,14 +17,17 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  * XXX if_maxlinkhdr already in mtu
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
 
+/* Size classes of pooled M_EXT buffers, smallest first */
+static const int m_ext_sizes[MBUF_EXT_CLASSES] = {
+    MINCSIZE, 4 * MINCSIZE, 65536 + IF_MAXLINKHDR + 2
+};
+
 void
 m_init(Slirp *slirp)
 {
@@ -35,6 +38,8 @@ m_init(Slirp *slirp)
 void m_cleanup(Slirp *slirp)
 {
     struct mbuf *m, *next;
+    char *ext;
+    int i;
 
     m = slirp->m_usedlist.m_next;
     while (m != &slirp->m_usedlist) {
@@ -51,6 +56,59 @@ void m_cleanup(Slirp *slirp)
         free(m);
         m = next;
     }
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        while ((ext = slirp->m_ext_freelist[i]) != NULL) {
+            slirp->m_ext_freelist[i] = *(char **)ext;
+            free(ext);
+        }
+    }
+}
+
+/*
+ * Allocate an external buffer of at least *size bytes, taking it from
+ * the matching size class if there is one.  *size is updated to the
+ * real size of the buffer.
+ */
+static char *
+m_ext_get(Slirp *slirp, int *size)
+{
+    char *ext;
+    int i;
+
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        if (*size <= m_ext_sizes[i]) {
+            *size = m_ext_sizes[i];
+            ext = slirp->m_ext_freelist[i];
+            if (ext) {
+                slirp->m_ext_freelist[i] = *(char **)ext;
+                slirp->m_ext_free[i]--;
+                return ext;
+            }
+            break;
+        }
+    }
+    return (char *)malloc(*size);
+}
+
+/*
+ * Return an external buffer to its size class, or free() it if it
+ * does not belong to one or the class already holds enough buffers
+ */
+static void
+m_ext_put(Slirp *slirp, char *ext, int size)
+{
+    int i;
+
+    for (i = 0; i < MBUF_EXT_CLASSES; i++) {
+        if (size == m_ext_sizes[i] &&
+            slirp->m_ext_free[i] < MBUF_FREELIST_MAX) {
+            *(char **)ext = slirp->m_ext_freelist[i];
+            slirp->m_ext_freelist[i] = ext;
+            slirp->m_ext_free[i]++;
+            return;
+        }
+    }
+    free(ext);
 }
 
 /*
@@ -58,14 +116,13 @@ void m_cleanup(Slirp *slirp)
  * malloc one
  *
  * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * free old mbufs, m_free only keeps MBUF_FREELIST_MAX mbufs around
+ * and free()s the rest
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
 	register struct mbuf *m;
-	int flags = 0;
 
 	DEBUG_CALL("m_get");
 
@@ -73,17 +130,16 @@ m_get(Slirp *slirp)
 		m = (struct mbuf *)malloc(SLIRP_MSIZE);
 		if (m == NULL) goto end_error;
 		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
 		m->slirp = slirp;
 	} else {
 		m = slirp->m_freelist.m_next;
 		remque(m);
+		slirp->mbuf_free--;
 	}
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -106,22 +162,27 @@ m_free(struct mbuf *m)
   DEBUG_ARG("m = %lx", (long )m);
 
   if(m) {
+	Slirp *slirp = m->slirp;
+
 	/* Remove from m_usedlist */
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
-	/* If it's M_EXT, free() it */
+	/* If it's M_EXT, give the buffer back to its pool */
 	if (m->m_flags & M_EXT)
-	   free(m->m_ext);
+	   m_ext_put(slirp, m->m_ext, m->m_size);
 
 	/*
 	 * Either free() it or put it on the free list
 	 */
-	if (m->m_flags & M_DOFREE) {
-		m->slirp->mbuf_alloced--;
+	if (m->m_flags & M_FREELIST) {
+		return;
+	} else if (slirp->mbuf_free >= MBUF_FREELIST_MAX) {
+		slirp->mbuf_alloced--;
 		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
-		insque(m,&m->slirp->m_freelist);
+	} else {
+		insque(m,&slirp->m_freelist);
+		slirp->mbuf_free++;
 		m->m_flags = M_FREELIST; /* Clobber other flags */
 	}
   } /* if(m) */
@@ -153,25 +214,24 @@ void
 m_inc(struct mbuf *m, int size)
 {
 	int datasize;
+	char *dat;
 
 	/* some compiles throw up on gotos.  This one we can fake. */
         if(m->m_size>size) return;
 
+        dat = m_ext_get(m->slirp, &size);
         if (m->m_flags & M_EXT) {
 	  datasize = m->m_data - m->m_ext;
-	  m->m_ext = (char *)realloc(m->m_ext,size);
-	  m->m_data = m->m_ext + datasize;
+	  memcpy(dat, m->m_ext, m->m_size);
+	  m_ext_put(m->slirp, m->m_ext, m->m_size);
         } else {
-	  char *dat;
 	  datasize = m->m_data - m->m_dat;
-	  dat = (char *)malloc(size);
 	  memcpy(dat, m->m_dat, m->m_size);
-
-	  m->m_ext = dat;
-	  m->m_data = m->m_ext + datasize;
-	  m->m_flags |= M_EXT;
         }
 
+        m->m_ext = dat;
+        m->m_data = m->m_ext + datasize;
+        m->m_flags |= M_EXT;
         m->m_size = size;
 
 }
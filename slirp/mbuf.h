@@ -97,8 +97,14 @@ struct mbuf {
 #define M_EXT			0x01	/* m_ext points to more (malloced) data */
 #define M_FREELIST		0x02	/* mbuf is on free list */
 #define M_USEDLIST		0x04	/* XXX mbuf is on used list (for dtom()) */
-#define M_DOFREE		0x08	/* when m_free is called on the mbuf, free()
-					 * it rather than putting it on the free list */
+
+/*
+ * Free mbufs are kept on a list of at most MBUF_FREELIST_MAX entries.
+ * M_EXT buffers are rounded up to one of the MBUF_EXT_CLASSES size
+ * classes and recycled through per-class lists of the same depth.
+ */
+#define MBUF_FREELIST_MAX	256
+#define MBUF_EXT_CLASSES	3
 
 void m_init(Slirp *);
 void m_cleanup(Slirp *slirp);
@@ -96,10 +96,18 @@ sbappend(struct socket *so, struct mbuf *m)
 
 	/*
 	 * We only write if there's nothing in the buffer,
-	 * ottherwise it'll arrive out of order, and hence corrupt
+	 * ottherwise it'll arrive out of order, and hence corrupt.
+	 * Full-sized segments are most likely part of a bulk transfer:
+	 * queue them and let sowrite() push the whole burst with a single
+	 * writev() instead of doing one send() per segment.
 	 */
-	if (!so->so_rcv.sb_cc)
-	   ret = slirp_send(so, m->m_data, m->m_len, 0);
+	if (!so->so_rcv.sb_cc) {
+	    if (so->s != -1 && m->m_len >= so->so_tcpcb->t_maxseg) {
+	        qemu_notify_event();
+	    } else {
+	        ret = slirp_send(so, m->m_data, m->m_len, 0);
+	    }
+	}
 
 	if (ret <= 0) {
 		/*
@@ -202,7 +202,7 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   const char *vhostname, const char *tftp_path,
                   const char *bootfile, struct in_addr vdhcp_start,
                   struct in_addr vnameserver, const char **vdnssearch,
-                  void *opaque)
+                  int tcp_sndspace, int tcp_rcvspace, void *opaque)
 {
     Slirp *slirp = g_malloc0(sizeof(Slirp));
 
@@ -227,6 +227,8 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
     slirp->bootp_filename = g_strdup(bootfile);
     slirp->vdhcp_startaddr = vdhcp_start;
     slirp->vnameserver_addr = vnameserver;
+    slirp->tcp_sndspace = tcp_sndspace ? tcp_sndspace : TCP_SNDSPACE;
+    slirp->tcp_rcvspace = tcp_rcvspace ? tcp_rcvspace : TCP_RCVSPACE;
 
     if (vdnssearch) {
         translate_dnssearch(slirp, vdnssearch);
@@ -570,13 +572,15 @@ void slirp_pollfds_poll(GArray *pollfds, int select_error)
                         /* continue; */
                     } else {
                         ret = sowrite(so);
+                        /*
+                         * If we wrote something (a lot), there could be
+                         * a need for a window update; tcp_output sends
+                         * one if enough space was freed.
+                         */
+                        if (ret > 0) {
+                            tcp_output(sototcpcb(so));
+                        }
                     }
-                    /*
-                     * XXXXX If we wrote something (a lot), there
-                     * could be a need for a window update.
-                     * In the worst case, the remote will send
-                     * a window probe to get things going again
-                     */
                 }
 
                 /*
@@ -1138,6 +1142,7 @@ static int slirp_socket_load(QEMUFile *f, struct socket *so)
     so->so_laddr.s_addr = qemu_get_be32(f);
     so->so_fport = qemu_get_be16(f);
     so->so_lport = qemu_get_be16(f);
+    tcp_hash(so);
     so->so_iptos = qemu_get_byte(f);
     so->so_emu = qemu_get_byte(f);
     so->so_type = qemu_get_byte(f);
@@ -223,6 +223,9 @@ struct Slirp {
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    int mbuf_free;
+    char *m_ext_freelist[MBUF_EXT_CLASSES];
+    int m_ext_free[MBUF_EXT_CLASSES];
 
     /* if states */
     struct mbuf if_fastq;   /* fast queue (for interactive data) */
@@ -242,12 +245,16 @@ struct Slirp {
 
     /* tcp states */
     struct socket tcb;
+    struct socket *tcb_hash[SO_HASH_SIZE];
     struct socket *tcp_last_so;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
+    int tcp_sndspace;       /* size of so_snd, data towards the guest */
+    int tcp_rcvspace;       /* size of so_rcv, data from the guest */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
 
     /* udp states */
     struct socket udb;
+    struct socket *udb_hash[SO_HASH_SIZE];
     struct socket *udp_last_so;
 
     /* icmp states */
@@ -335,6 +342,7 @@ void tcp_sockclosed(struct tcpcb *);
 int tcp_fconnect(struct socket *);
 void tcp_connect(struct socket *);
 int tcp_attach(struct socket *);
+void tcp_hash(struct socket *);
 uint8_t tcp_tos(struct socket *);
 int tcp_emu(struct socket *, struct mbuf *);
 int tcp_ctl(struct socket *);
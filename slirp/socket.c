@@ -15,13 +15,64 @@
 static void sofcantrcvmore(struct socket *so);
 static void sofcantsendmore(struct socket *so);
 
+/*
+ * Hash a socket 4-tuple into a bucket of a SO_HASH_SIZE table.
+ * Addresses and ports are in network byte order.
+ */
+unsigned int
+so_hash(struct in_addr laddr, u_int lport, struct in_addr faddr, u_int fport)
+{
+	uint32_t h;
+
+	h = laddr.s_addr ^ (faddr.s_addr * 0x9e3779b1);
+	h ^= (lport << 16) | fport;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+
+	return h & (SO_HASH_SIZE - 1);
+}
+
+/*
+ * Insert a socket at the head of a hash bucket, removing it from the
+ * bucket it was previously in (if any).  Must be called again whenever
+ * the fields the hash is keyed on change.
+ */
+void
+so_hash_insert(struct socket **table, struct socket *so, unsigned int hash)
+{
+	so_hash_remove(so);
+
+	so->so_hash_next = table[hash];
+	if (so->so_hash_next) {
+		so->so_hash_next->so_hash_pprev = &so->so_hash_next;
+	}
+	table[hash] = so;
+	so->so_hash_pprev = &table[hash];
+}
+
+void
+so_hash_remove(struct socket *so)
+{
+	if (!so->so_hash_pprev) {
+		return;
+	}
+	*so->so_hash_pprev = so->so_hash_next;
+	if (so->so_hash_next) {
+		so->so_hash_next->so_hash_pprev = so->so_hash_pprev;
+	}
+	so->so_hash_next = NULL;
+	so->so_hash_pprev = NULL;
+}
+
 struct socket *
-solookup(struct socket *head, struct in_addr laddr, u_int lport,
+solookup(struct socket **table, struct in_addr laddr, u_int lport,
          struct in_addr faddr, u_int fport)
 {
 	struct socket *so;
 
-	for (so = head->so_next; so != head; so = so->so_next) {
+	for (so = table[so_hash(laddr, lport, faddr, fport)]; so;
+	     so = so->so_hash_next) {
 		if (so->so_lport == lport &&
 		    so->so_laddr.s_addr == laddr.s_addr &&
 		    so->so_faddr.s_addr == faddr.s_addr &&
@@ -29,10 +80,7 @@ solookup(struct socket *head, struct in_addr laddr, u_int lport,
 		   break;
 	}
 
-	if (so == head)
-	   return (struct socket *)NULL;
 	return so;
-
 }
 
 /*
@@ -76,6 +124,7 @@ sofree(struct socket *so)
       slirp->icmp_last_so = &slirp->icmp;
   }
   m_free(so->so_m);
+  so_hash_remove(so);
 
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
@@ -150,7 +199,7 @@ size_t sopreprbuf(struct socket *so, struct iovec *iov, int *np)
 int
 soread(struct socket *so)
 {
-	int n, nn;
+	int n, nn, len, total = 0;
 	struct sbuf *sb = &so->so_snd;
 	struct iovec iov[2];
 
@@ -161,7 +210,8 @@ soread(struct socket *so)
 	 * No need to check if there's enough room to read.
 	 * soread wouldn't have been called if there weren't
 	 */
-	sopreprbuf(so, iov, &n);
+again:
+	len = sopreprbuf(so, iov, &n);
 
 #ifdef HAVE_READV
 	nn = readv(so->s, (struct iovec *)iov, n);
@@ -170,6 +220,9 @@ soread(struct socket *so)
 	nn = qemu_recv(so->s, iov[0].iov_base, iov[0].iov_len,0);
 #endif
 	if (nn <= 0) {
+		if (total)
+			/* Report EOF or errors on the next call */
+			return total;
 		if (nn < 0 && (errno == EINTR || errno == EAGAIN))
 			return 0;
 		else {
@@ -205,7 +258,18 @@ soread(struct socket *so)
 	sb->sb_wptr += nn;
 	if (sb->sb_wptr >= (sb->sb_data + sb->sb_datalen))
 		sb->sb_wptr -= sb->sb_datalen;
-	return nn;
+	total += nn;
+
+	/*
+	 * If the read filled everything we asked for, the host may have
+	 * more queued.  Keep going while there is room so that tcp_output
+	 * can cut full-sized segments for the guest instead of sending one
+	 * short segment per read.
+	 */
+	if (nn == len && sbspace(sb) > 0 && !(so->so_state & SS_FCANTRCVMORE))
+		goto again;
+
+	return total;
 }
 
 int soreadbuf(struct socket *so, const char *buf, int size)
@@ -650,6 +714,7 @@ tcp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	   so->so_faddr = slirp->vhost_addr;
 	else
 	   so->so_faddr = addr.sin_addr;
+	tcp_hash(so);
 
 	so->s = s;
 	return so;
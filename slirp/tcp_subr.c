@@ -194,6 +194,16 @@ tcp_newtcpcb(struct socket *so)
 	tp->t_flags = TCP_DO_RFC1323 ? (TF_REQ_SCALE|TF_REQ_TSTMP) : 0;
 	tp->t_socket = so;
 
+	/*
+	 * Only ask for window scaling if the receive buffer
+	 * cannot be advertised in an unscaled window.
+	 */
+	while (tp->request_r_scale < TCP_MAX_WINSHIFT &&
+	       (TCP_MAXWIN << tp->request_r_scale) < so->slirp->tcp_rcvspace)
+		tp->request_r_scale++;
+	if (tp->request_r_scale)
+		tp->t_flags |= TF_REQ_SCALE;
+
 	/*
 	 * Init srtt to TCPTV_SRTTBASE (0), so we can tell that we have no
 	 * rtt estimate.  Set rttvar so that srtt + 2 * rttvar gives
@@ -438,6 +448,7 @@ void tcp_connect(struct socket *inso)
         (loopback_addr.s_addr & loopback_mask)) {
         so->so_faddr = slirp->vhost_addr;
     }
+    tcp_hash(so);
 
     /* Close the accept() socket, set right state */
     if (inso->so_state & SS_FACCEPTONCE) {
@@ -478,6 +489,17 @@ tcp_attach(struct socket *so)
 	return 0;
 }
 
+/*
+ * (Re)insert a socket into the TCP lookup table, keyed on its 4-tuple
+ */
+void
+tcp_hash(struct socket *so)
+{
+	so_hash_insert(so->slirp->tcb_hash, so,
+	               so_hash(so->so_laddr, so->so_lport,
+	                       so->so_faddr, so->so_fport));
+}
+
 /*
  * Set the socket's type of service field
  */
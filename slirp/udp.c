@@ -154,19 +154,17 @@ udp_input(register struct mbuf *m, int iphlen)
 	so = slirp->udp_last_so;
 	if (so == &slirp->udb || so->so_lport != uh->uh_sport ||
 	    so->so_laddr.s_addr != ip->ip_src.s_addr) {
-		struct socket *tmp;
+		struct in_addr any = { 0 };
 
-		for (tmp = slirp->udb.so_next; tmp != &slirp->udb;
-		     tmp = tmp->so_next) {
-			if (tmp->so_lport == uh->uh_sport &&
-			    tmp->so_laddr.s_addr == ip->ip_src.s_addr) {
-				so = tmp;
+		for (so = slirp->udb_hash[so_hash(ip->ip_src, uh->uh_sport,
+		                                  any, 0)];
+		     so; so = so->so_hash_next) {
+			if (so->so_lport == uh->uh_sport &&
+			    so->so_laddr.s_addr == ip->ip_src.s_addr) {
 				break;
 			}
 		}
-		if (tmp == &slirp->udb) {
-		  so = NULL;
-		} else {
+		if (so) {
 		  slirp->udp_last_so = so;
 		}
 	}
@@ -192,6 +190,7 @@ udp_input(register struct mbuf *m, int iphlen)
 	   */
 	  so->so_laddr = ip->ip_src;
 	  so->so_lport = uh->uh_sport;
+	  udp_hash(so);
 
 	  if ((so->so_iptos = udp_tos(so)) == 0)
 	    so->so_iptos = ip->ip_tos;
@@ -319,6 +318,19 @@ udp_attach(struct socket *so)
   return(so->s);
 }
 
+/*
+ * (Re)insert a socket into the UDP lookup table.  Datagrams from the
+ * guest are matched on their source address and port only.
+ */
+void
+udp_hash(struct socket *so)
+{
+	struct in_addr any = { 0 };
+
+	so_hash_insert(so->slirp->udb_hash, so,
+	               so_hash(so->so_laddr, so->so_lport, any, 0));
+}
+
 void
 udp_detach(struct socket *so)
 {
@@ -384,6 +396,7 @@ udp_listen(Slirp *slirp, uint32_t haddr, u_int hport, uint32_t laddr,
 	}
 	so->so_lport = lport;
 	so->so_laddr.s_addr = laddr;
+	udp_hash(so);
 	if (flags != SS_FACCEPTONCE)
 	   so->so_expire = 0;
 
@@ -0,0 +1,778 @@
+/*
+ * Display pipeline benchmark
+ *
+ * Drives std-vga, cirrus and qxl-vga with scripted drawing patterns and
+ * reads the result back through the VNC server, so that the whole path
+ * from the device model through ui/console.c to the VNC encoders is
+ * exercised.  For each run it reports frames per second, QEMU CPU time
+ * per frame and the number of encoded bytes.
+ *
+ * Without -m perf every device and pattern only runs for a few frames
+ * with one encoding, as a smoke test.  With -m perf all encodings are
+ * run for long enough to give stable numbers, e.g.
+ *
+ *   QTEST_QEMU_BINARY=x86_64-softmmu/qemu-system-x86_64 \
+ *       tests/display-bench -m perf --verbose -p /display/bench/stdvga
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "qemu/osdep.h"
+#include "qapi/qmp/qlist.h"
+
+#define BENCH_WIDTH     800
+#define BENCH_HEIGHT    600
+#define BENCH_STRIDE    (BENCH_WIDTH * 4)
+#define BENCH_DEVFN     QPCI_DEVFN(4, 0)
+
+#define GLYPH_WIDTH     8
+#define GLYPH_HEIGHT    16
+
+#define VIDEO_WIDTH     320
+#define VIDEO_HEIGHT    240
+
+/* frame period of the idle pattern, in microseconds */
+#define IDLE_PERIOD     33333
+
+/* how long to wait for the VNC server, in milliseconds */
+#define VNC_TIMEOUT     10000
+
+#define VBE_DISPI_INDEX_XRES        0x1
+#define VBE_DISPI_INDEX_YRES        0x2
+#define VBE_DISPI_INDEX_BPP         0x3
+#define VBE_DISPI_INDEX_ENABLE      0x4
+#define VBE_DISPI_ENABLED           0x01
+#define VBE_DISPI_LFB_ENABLED       0x40
+
+#define VNC_MSG_FRAMEBUFFER_UPDATE  0
+#define VNC_MSG_BELL                2
+#define VNC_MSG_CUT_TEXT            3
+
+#define VNC_ENCODING_RAW            0
+#define VNC_ENCODING_ZLIB           6
+#define VNC_ENCODING_TIGHT          7
+#define VNC_ENCODING_ZRLE           16
+#define VNC_ENCODING_DESKTOPRESIZE  -223
+#define VNC_ENCODING_QUALITY(n)     (-32 + (n))
+
+#define VNC_TIGHT_FILL              0x08
+#define VNC_TIGHT_JPEG              0x09
+#define VNC_TIGHT_EXPLICIT_FILTER   0x04
+#define VNC_TIGHT_FILTER_COPY       0x00
+#define VNC_TIGHT_FILTER_PALETTE    0x01
+#define VNC_TIGHT_FILTER_GRADIENT   0x02
+#define VNC_TIGHT_MIN_TO_COMPRESS   12
+/* 32bpp, depth 24 pixels are sent as three bytes */
+#define VNC_TIGHT_PIXEL_SIZE        3
+
+typedef struct VncClient {
+    int fd;
+    int width;
+    int height;
+    uint64_t bytes;
+} VncClient;
+
+typedef struct Bench {
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    uint64_t fb_base;
+    uint32_t *fb;
+    uint32_t seed;
+    VncClient vnc;
+} Bench;
+
+typedef struct BenchDevice {
+    const char *name;
+    const char *driver;
+    void (*set_mode)(void);
+} BenchDevice;
+
+typedef struct BenchPattern {
+    const char *name;
+    int frames;
+    /* draws frame @n and writes it to the guest, false if nothing changed */
+    bool (*draw)(Bench *b, int n);
+} BenchPattern;
+
+typedef struct BenchEncoding {
+    const char *name;
+    int n_encodings;
+    int32_t encodings[2];
+} BenchEncoding;
+
+typedef struct BenchCase {
+    const BenchDevice *device;
+    const BenchPattern *pattern;
+    const BenchEncoding *encoding;
+} BenchCase;
+
+/* VGA programming */
+
+static void vga_write_seq(uint8_t index, uint8_t val)
+{
+    outb(0x3c4, index);
+    outb(0x3c5, val);
+}
+
+static void vga_write_gfx(uint8_t index, uint8_t val)
+{
+    outb(0x3ce, index);
+    outb(0x3cf, val);
+}
+
+static void vga_write_crtc(uint8_t index, uint8_t val)
+{
+    outb(0x3d4, index);
+    outb(0x3d5, val);
+}
+
+static void vga_unblank(void)
+{
+    inb(0x3da);             /* reset the attribute controller flip-flop */
+    outb(0x3c0, 0x20);      /* palette address source: enable the display */
+}
+
+static void vbe_write(uint16_t index, uint16_t val)
+{
+    outw(0x1ce, index);
+    outw(0x1cf, val);
+}
+
+static void vbe_set_mode(void)
+{
+    vbe_write(VBE_DISPI_INDEX_ENABLE, 0);
+    vbe_write(VBE_DISPI_INDEX_XRES, BENCH_WIDTH);
+    vbe_write(VBE_DISPI_INDEX_YRES, BENCH_HEIGHT);
+    vbe_write(VBE_DISPI_INDEX_BPP, 32);
+    vbe_write(VBE_DISPI_INDEX_ENABLE,
+              VBE_DISPI_ENABLED | VBE_DISPI_LFB_ENABLED);
+    vga_unblank();
+}
+
+static void cirrus_set_mode(void)
+{
+    unsigned int vde = BENCH_HEIGHT - 1;
+    unsigned int offset = BENCH_STRIDE / 8;
+
+    outb(0x3c2, 0x03);                  /* colour I/O addresses */
+    vga_write_seq(0x06, 0x12);          /* unlock the extensions */
+    vga_write_seq(0x07, 0x09);          /* extended mode, 32 bpp */
+    vga_write_gfx(0x05, 0x40);          /* 256 colour shift mode */
+    vga_write_gfx(0x06, 0x01);          /* graphics mode */
+    vga_write_crtc(0x01, BENCH_WIDTH / 8 - 1);
+    vga_write_crtc(0x12, vde & 0xff);
+    /* vertical display end bits 8 and 9, line compare bit 8 */
+    vga_write_crtc(0x07, ((vde >> 8) & 1) << 1 | ((vde >> 9) & 1) << 6 |
+                   0x10);
+    vga_write_crtc(0x09, 0x40);         /* line compare bit 9, no scan x2 */
+    vga_write_crtc(0x18, 0xff);         /* line compare out of the way */
+    vga_write_crtc(0x0c, 0);
+    vga_write_crtc(0x0d, 0);
+    vga_write_crtc(0x13, offset & 0xff);
+    vga_write_crtc(0x1b, ((offset >> 8) & 1) << 4);
+    vga_write_crtc(0x17, 0x03);         /* no CGA/Hercules address wrap */
+    vga_unblank();
+}
+
+static const BenchDevice bench_devices[] = {
+    { "stdvga", "VGA", vbe_set_mode },
+    { "cirrus", "cirrus-vga", cirrus_set_mode },
+    /* exercised in VGA mode, which also feeds the spice display channel */
+    { "qxl", "qxl-vga", vbe_set_mode },
+};
+
+/* VNC client */
+
+static void vnc_read(VncClient *c, void *buf, size_t len)
+{
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    uint8_t *p = buf;
+    ssize_t ret;
+
+    c->bytes += len;
+    while (len) {
+        g_assert_cmpint(poll(&pfd, 1, VNC_TIMEOUT), ==, 1);
+        ret = read(c->fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        p += ret;
+        len -= ret;
+    }
+}
+
+static void vnc_skip(VncClient *c, size_t len)
+{
+    uint8_t buf[4096];
+    size_t chunk;
+
+    while (len) {
+        chunk = MIN(len, sizeof(buf));
+        vnc_read(c, buf, chunk);
+        len -= chunk;
+    }
+}
+
+static uint8_t vnc_read_u8(VncClient *c)
+{
+    uint8_t val;
+
+    vnc_read(c, &val, 1);
+    return val;
+}
+
+static uint16_t vnc_read_u16(VncClient *c)
+{
+    uint16_t val;
+
+    vnc_read(c, &val, 2);
+    return ntohs(val);
+}
+
+static uint32_t vnc_read_u32(VncClient *c)
+{
+    uint32_t val;
+
+    vnc_read(c, &val, 4);
+    return ntohl(val);
+}
+
+static void vnc_write(VncClient *c, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len) {
+        ret = write(c->fd, p, len);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        p += ret;
+        len -= ret;
+    }
+}
+
+static void vnc_connect(VncClient *c, const char *path,
+                        const BenchEncoding *encoding)
+{
+    static const uint8_t pixel_format[20] = {
+        0, 0, 0, 0,             /* SetPixelFormat, padding */
+        32, 24, 0, 1,           /* bpp, depth, little endian, true colour */
+        0, 255, 0, 255, 0, 255, /* red, green, blue max */
+        16, 8, 0,               /* red, green, blue shift */
+        0, 0, 0,                /* padding */
+    };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    uint8_t buf[16];
+    uint32_t enc;
+    int i, n;
+
+    memset(c, 0, sizeof(*c));
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(c->fd, >=, 0);
+    g_assert_cmpint(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)),
+                    ==, 0);
+
+    vnc_read(c, buf, 12);
+    g_assert(memcmp(buf, "RFB 003.", 8) == 0);
+    vnc_write(c, "RFB 003.008\n", 12);
+
+    /* security type "None" */
+    n = vnc_read_u8(c);
+    g_assert_cmpint(n, >, 0);
+    for (i = 0; i < n; i++) {
+        buf[i] = vnc_read_u8(c);
+    }
+    g_assert(memchr(buf, 1, n));
+    vnc_write(c, "\x01", 1);
+    g_assert_cmpint(vnc_read_u32(c), ==, 0);
+
+    /* ClientInit (shared), ServerInit */
+    vnc_write(c, "\x01", 1);
+    c->width = vnc_read_u16(c);
+    c->height = vnc_read_u16(c);
+    vnc_skip(c, 16);
+    vnc_skip(c, vnc_read_u32(c));
+
+    vnc_write(c, pixel_format, sizeof(pixel_format));
+
+    buf[0] = 2;                 /* SetEncodings */
+    buf[1] = 0;
+    *(uint16_t *)&buf[2] = htons(encoding->n_encodings + 1);
+    vnc_write(c, buf, 4);
+    for (i = 0; i < encoding->n_encodings; i++) {
+        enc = htonl(encoding->encodings[i]);
+        vnc_write(c, &enc, 4);
+    }
+    enc = htonl(VNC_ENCODING_DESKTOPRESIZE);
+    vnc_write(c, &enc, 4);
+}
+
+static void vnc_request(VncClient *c, bool incremental)
+{
+    uint8_t msg[10];
+
+    msg[0] = 3;                 /* FramebufferUpdateRequest */
+    msg[1] = incremental;
+    *(uint16_t *)&msg[2] = htons(0);
+    *(uint16_t *)&msg[4] = htons(0);
+    *(uint16_t *)&msg[6] = htons(c->width);
+    *(uint16_t *)&msg[8] = htons(c->height);
+    vnc_write(c, msg, sizeof(msg));
+}
+
+static uint32_t vnc_read_compact_len(VncClient *c)
+{
+    uint32_t len;
+    uint8_t b;
+
+    b = vnc_read_u8(c);
+    len = b & 0x7f;
+    if (b & 0x80) {
+        b = vnc_read_u8(c);
+        len |= (b & 0x7f) << 7;
+        if (b & 0x80) {
+            len |= vnc_read_u8(c) << 14;
+        }
+    }
+    return len;
+}
+
+static void vnc_skip_tight(VncClient *c, int w, int h)
+{
+    uint8_t ctl = vnc_read_u8(c) >> 4;
+    uint8_t filter = VNC_TIGHT_FILTER_COPY;
+    size_t size;
+    int colors;
+
+    if (ctl == VNC_TIGHT_FILL) {
+        vnc_skip(c, VNC_TIGHT_PIXEL_SIZE);
+        return;
+    }
+    if (ctl == VNC_TIGHT_JPEG) {
+        vnc_skip(c, vnc_read_compact_len(c));
+        return;
+    }
+    g_assert_cmpint(ctl, <, VNC_TIGHT_FILL);
+
+    if (ctl & VNC_TIGHT_EXPLICIT_FILTER) {
+        filter = vnc_read_u8(c);
+    }
+    switch (filter) {
+    case VNC_TIGHT_FILTER_COPY:
+    case VNC_TIGHT_FILTER_GRADIENT:
+        size = (size_t)w * h * VNC_TIGHT_PIXEL_SIZE;
+        break;
+    case VNC_TIGHT_FILTER_PALETTE:
+        colors = vnc_read_u8(c) + 1;
+        vnc_skip(c, colors * VNC_TIGHT_PIXEL_SIZE);
+        size = (size_t)(colors <= 2 ? (w + 7) / 8 : w) * h;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    if (size < VNC_TIGHT_MIN_TO_COMPRESS) {
+        vnc_skip(c, size);
+    } else {
+        vnc_skip(c, vnc_read_compact_len(c));
+    }
+}
+
+/*
+ * Wait up to @timeout milliseconds for a framebuffer update and consume
+ * it.  Returns false on timeout.
+ */
+static bool vnc_wait_update(VncClient *c, int timeout)
+{
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int i, n, w, h;
+    int32_t encoding;
+
+    for (;;) {
+        if (poll(&pfd, 1, timeout) == 0) {
+            return false;
+        }
+        switch (vnc_read_u8(c)) {
+        case VNC_MSG_FRAMEBUFFER_UPDATE:
+            break;
+        case VNC_MSG_BELL:
+            continue;
+        case VNC_MSG_CUT_TEXT:
+            vnc_skip(c, 3);
+            vnc_skip(c, vnc_read_u32(c));
+            continue;
+        default:
+            g_assert_not_reached();
+        }
+
+        vnc_skip(c, 1);
+        n = vnc_read_u16(c);
+        for (i = 0; i < n; i++) {
+            vnc_skip(c, 4);     /* x, y */
+            w = vnc_read_u16(c);
+            h = vnc_read_u16(c);
+            encoding = vnc_read_u32(c);
+
+            switch (encoding) {
+            case VNC_ENCODING_RAW:
+                vnc_skip(c, (size_t)w * h * 4);
+                break;
+            case VNC_ENCODING_ZLIB:
+            case VNC_ENCODING_ZRLE:
+                vnc_skip(c, vnc_read_u32(c));
+                break;
+            case VNC_ENCODING_TIGHT:
+                vnc_skip_tight(c, w, h);
+                break;
+            case VNC_ENCODING_DESKTOPRESIZE:
+                c->width = w;
+                c->height = h;
+                break;
+            default:
+                g_assert_not_reached();
+            }
+        }
+        return true;
+    }
+}
+
+/* Wait until the client sees the benchmark mode and a full update of it */
+static void vnc_sync(VncClient *c)
+{
+    gint64 deadline = g_get_monotonic_time() + VNC_TIMEOUT * 1000;
+
+    do {
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        vnc_request(c, false);
+        vnc_wait_update(c, VNC_TIMEOUT);
+    } while (c->width != BENCH_WIDTH || c->height != BENCH_HEIGHT);
+    vnc_request(c, false);
+    g_assert(vnc_wait_update(c, VNC_TIMEOUT));
+}
+
+/* Statistics */
+
+static uint64_t qemu_cpu_time_us(void)
+{
+#ifdef __linux__
+    unsigned long utime, stime;
+    gchar *path, *stat, *p;
+    int ret;
+
+    path = g_strdup_printf("/proc/%d/stat", (int)qtest_pid(global_qtest));
+    g_assert(g_file_get_contents(path, &stat, NULL, NULL));
+    /* skip pid and the command name, which may contain spaces */
+    p = strrchr(stat, ')');
+    g_assert(p);
+    ret = sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                 &utime, &stime);
+    g_assert_cmpint(ret, ==, 2);
+    g_free(stat);
+    g_free(path);
+    return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+#else
+    return 0;
+#endif
+}
+
+/* encode time (ns) and encoded bytes of the first VNC client */
+static void vnc_server_stats(int64_t *encode_time, int64_t *encoded_bytes)
+{
+    QDict *resp, *ret, *client;
+    QList *clients;
+
+    *encode_time = *encoded_bytes = 0;
+    resp = qmp("{ 'execute': 'query-vnc' }");
+    ret = qdict_get_qdict(resp, "return");
+    clients = ret && qdict_haskey(ret, "clients") ?
+              qdict_get_qlist(ret, "clients") : NULL;
+    if (clients && !qlist_empty(clients)) {
+        client = qobject_to_qdict(qlist_peek(clients));
+        if (qdict_haskey(client, "encode-time")) {
+            *encode_time = qdict_get_int(client, "encode-time");
+            *encoded_bytes = qdict_get_int(client, "encoded-bytes");
+        }
+    }
+    QDECREF(resp);
+}
+
+/* Drawing patterns */
+
+static uint32_t bench_rand(Bench *b)
+{
+    b->seed = b->seed * 1103515245 + 12345;
+    return b->seed >> 16;
+}
+
+static void fb_fill(Bench *b, int x, int y, int w, int h, uint32_t color)
+{
+    int i, j;
+
+    for (j = y; j < y + h; j++) {
+        for (i = x; i < x + w; i++) {
+            b->fb[j * BENCH_WIDTH + i] = color;
+        }
+    }
+}
+
+static void fb_flush(Bench *b, int x, int y, int w, int h)
+{
+    int j;
+
+    if (x == 0 && w == BENCH_WIDTH) {
+        bufwrite(b->fb_base + y * BENCH_STRIDE, b->fb + y * BENCH_WIDTH,
+                 h * BENCH_STRIDE);
+        return;
+    }
+    for (j = y; j < y + h; j++) {
+        bufwrite(b->fb_base + j * BENCH_STRIDE + x * 4,
+                 b->fb + j * BENCH_WIDTH + x, w * 4);
+    }
+}
+
+/* a random glyph-like bitmap in one text cell */
+static void fb_glyph(Bench *b, int x, int y, uint32_t fg, uint32_t bg)
+{
+    uint32_t bits;
+    int i, j;
+
+    for (j = 0; j < GLYPH_HEIGHT; j++) {
+        bits = (j < 2 || j > GLYPH_HEIGHT - 4) ? 0 : bench_rand(b) & 0x7e;
+        for (i = 0; i < GLYPH_WIDTH; i++) {
+            b->fb[(y + j) * BENCH_WIDTH + x + i] =
+                (bits & (0x80 >> i)) ? fg : bg;
+        }
+    }
+}
+
+static void draw_desktop(Bench *b)
+{
+    int y;
+
+    for (y = 0; y < BENCH_HEIGHT; y++) {
+        fb_fill(b, 0, y, BENCH_WIDTH, 1, 0x203060 + (y * 0x40 / BENCH_HEIGHT));
+    }
+    /* a couple of windows with title bars */
+    fb_fill(b, 40, 40, 420, 300, 0xe0e0e0);
+    fb_fill(b, 40, 40, 420, 20, 0x3050a0);
+    fb_fill(b, 300, 200, 460, 340, 0xf0f0f0);
+    fb_fill(b, 300, 200, 460, 20, 0x3050a0);
+    /* task bar */
+    fb_fill(b, 0, BENCH_HEIGHT - 28, BENCH_WIDTH, 28, 0xc0c0c0);
+}
+
+static bool draw_idle(Bench *b, int n)
+{
+    g_usleep(IDLE_PERIOD);
+    return false;
+}
+
+/* a full screen terminal scrolling by one text line per frame */
+static bool draw_scroll(Bench *b, int n)
+{
+    int x, y = BENCH_HEIGHT - GLYPH_HEIGHT;
+
+    memmove(b->fb, b->fb + GLYPH_HEIGHT * BENCH_WIDTH,
+            y * BENCH_STRIDE);
+    for (x = 0; x < BENCH_WIDTH; x += GLYPH_WIDTH) {
+        if (x / GLYPH_WIDTH < (bench_rand(b) % 80) + 10) {
+            fb_glyph(b, x, y, 0xc0c0c0, 0x000000);
+        } else {
+            fb_fill(b, x, y, GLYPH_WIDTH, GLYPH_HEIGHT, 0x000000);
+        }
+    }
+    fb_flush(b, 0, 0, BENCH_WIDTH, BENCH_HEIGHT);
+    return true;
+}
+
+/* a moving, slightly noisy picture in a window on the desktop */
+static bool draw_video(Bench *b, int n)
+{
+    int x0 = (BENCH_WIDTH - VIDEO_WIDTH) / 2;
+    int y0 = (BENCH_HEIGHT - VIDEO_HEIGHT) / 2;
+    uint32_t r, g, bl;
+    int x, y;
+
+    for (y = 0; y < VIDEO_HEIGHT; y++) {
+        for (x = 0; x < VIDEO_WIDTH; x++) {
+            r = (x + n * 3) & 0xff;
+            g = (y + n * 2) & 0xff;
+            bl = ((x ^ y) + n + (bench_rand(b) & 0xf)) & 0xff;
+            b->fb[(y0 + y) * BENCH_WIDTH + x0 + x] = r << 16 | g << 8 | bl;
+        }
+    }
+    fb_flush(b, x0, y0, VIDEO_WIDTH, VIDEO_HEIGHT);
+    return true;
+}
+
+static const BenchPattern bench_patterns[] = {
+    { "idle", 150, draw_idle },
+    { "scroll", 150, draw_scroll },
+    { "video", 300, draw_video },
+};
+
+static const BenchEncoding bench_encodings[] = {
+    { "raw", 1, { VNC_ENCODING_RAW } },
+    { "zlib", 1, { VNC_ENCODING_ZLIB } },
+    { "zrle", 1, { VNC_ENCODING_ZRLE } },
+    { "tight", 1, { VNC_ENCODING_TIGHT } },
+    { "tight-jpeg", 2, { VNC_ENCODING_TIGHT, VNC_ENCODING_QUALITY(6) } },
+};
+
+/* frames run per pattern without -m perf */
+#define SMOKE_FRAMES 3
+
+static void bench_run(gconstpointer data)
+{
+    const BenchCase *bc = data;
+    Bench b = { .seed = 1 };
+    gchar *vnc_path, *args;
+    int64_t encode_time[2], encoded_bytes[2];
+    uint64_t cpu[2], bytes;
+    int frames, displayed = 0, i;
+    double elapsed;
+
+    vnc_path = g_strdup_printf("/tmp/display-bench-%d.vnc", getpid());
+    args = g_strdup_printf("-vga none -device %s,addr=04.0 -vnc unix:%s",
+                           bc->device->driver, vnc_path);
+    qtest_start(args);
+
+    b.bus = qpci_init_pc();
+    b.dev = qpci_device_find(b.bus, BENCH_DEVFN);
+    g_assert(b.dev != NULL);
+    qpci_device_enable(b.dev);
+    b.fb_base = (uintptr_t)qpci_iomap(b.dev, 0, NULL);
+    bc->device->set_mode();
+
+    b.fb = g_new0(uint32_t, BENCH_WIDTH * BENCH_HEIGHT);
+    draw_desktop(&b);
+    fb_flush(&b, 0, 0, BENCH_WIDTH, BENCH_HEIGHT);
+
+    vnc_connect(&b.vnc, vnc_path, bc->encoding);
+    vnc_sync(&b.vnc);
+
+    frames = g_test_perf() ? bc->pattern->frames : SMOKE_FRAMES;
+    bytes = b.vnc.bytes;
+    cpu[0] = qemu_cpu_time_us();
+    vnc_server_stats(&encode_time[0], &encoded_bytes[0]);
+    g_test_timer_start();
+
+    for (i = 0; i < frames; i++) {
+        bool changed = bc->pattern->draw(&b, i);
+
+        vnc_request(&b.vnc, true);
+        if (vnc_wait_update(&b.vnc, changed ? VNC_TIMEOUT : 0)) {
+            displayed++;
+        }
+    }
+
+    elapsed = g_test_timer_elapsed();
+    cpu[1] = qemu_cpu_time_us();
+    vnc_server_stats(&encode_time[1], &encoded_bytes[1]);
+    bytes = b.vnc.bytes - bytes;
+
+    g_test_message("%s/%s/%s: %d frames, %d updates in %.2f s, %.1f fps\n",
+                   bc->device->name, bc->pattern->name, bc->encoding->name,
+                   frames, displayed, elapsed, displayed / elapsed);
+    g_test_message("  cpu %.2f ms/frame (%.1f ms/s), encoder %.2f ms/frame\n",
+                   (cpu[1] - cpu[0]) / 1000.0 / frames,
+                   (cpu[1] - cpu[0]) / 1000.0 / elapsed,
+                   (encode_time[1] - encode_time[0]) / 1000000.0 / frames);
+    g_test_message("  %" PRIu64 " bytes received (%" PRIu64 " per frame), "
+                   "%" PRId64 " encoded by the server\n",
+                   bytes, bytes / frames, encoded_bytes[1] - encoded_bytes[0]);
+
+    close(b.vnc.fd);
+    g_free(b.fb);
+    g_free(b.dev);
+    qpci_free_pc(b.bus);
+    qtest_end();
+    unlink(vnc_path);
+    g_free(vnc_path);
+    g_free(args);
+}
+
+/* Check which of the devices exist in this build, and that VNC does */
+static bool bench_probe(bool *has_device)
+{
+    const QListEntry *entry;
+    QDict *resp, *type;
+    bool has_vnc;
+    int i;
+
+    qtest_start("-vga none");
+    resp = qmp("{ 'execute': 'query-vnc' }");
+    has_vnc = qdict_haskey(resp, "return");
+    QDECREF(resp);
+
+    resp = qmp("{ 'execute': 'qom-list-types',"
+               "  'arguments': { 'implements': 'pci-device' } }");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(resp, "return"), entry) {
+        type = qobject_to_qdict(qlist_entry_obj(entry));
+        for (i = 0; i < ARRAY_SIZE(bench_devices); i++) {
+            if (!strcmp(qdict_get_str(type, "name"),
+                        bench_devices[i].driver)) {
+                has_device[i] = true;
+            }
+        }
+    }
+    QDECREF(resp);
+    qtest_end();
+
+    return has_vnc;
+}
+
+int main(int argc, char **argv)
+{
+    bool has_device[ARRAY_SIZE(bench_devices)] = { false };
+    BenchCase *bc;
+    gchar *path;
+    int d, p, e;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (bench_probe(has_device)) {
+        for (d = 0; d < ARRAY_SIZE(bench_devices); d++) {
+            if (!has_device[d]) {
+                continue;
+            }
+            for (p = 0; p < ARRAY_SIZE(bench_patterns); p++) {
+                for (e = 0; e < ARRAY_SIZE(bench_encodings); e++) {
+                    /* the smoke test only uses zlib */
+                    if (!g_test_perf() &&
+                        bench_encodings[e].encodings[0] != VNC_ENCODING_ZLIB) {
+                        continue;
+                    }
+                    bc = g_new(BenchCase, 1);
+                    bc->device = &bench_devices[d];
+                    bc->pattern = &bench_patterns[p];
+                    bc->encoding = &bench_encodings[e];
+                    path = g_strdup_printf("/display/bench/%s/%s/%s",
+                                           bc->device->name, bc->pattern->name,
+                                           bc->encoding->name);
+                    qtest_add_data_func(path, bc, bench_run);
+                    g_free(path);
+                }
+            }
+        }
+    }
+
+    return g_test_run();
+}
@@ -223,6 +223,11 @@ void qtest_quit(QTestState *s)
     g_free(s);
 }
 
+pid_t qtest_pid(QTestState *s)
+{
+    return s->qemu_pid;
+}
+
 static void socket_send(int fd, const char *buf, size_t size)
 {
     size_t offset;
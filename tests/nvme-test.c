@@ -11,10 +11,358 @@
 #include <string.h>
 #include "libqtest.h"
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
+#define NVME_REG_CC         0x14
+#define NVME_REG_CSTS       0x1c
+#define NVME_REG_AQA        0x24
+#define NVME_REG_ASQ        0x28
+#define NVME_REG_ACQ        0x30
+#define NVME_REG_DBS        0x1000
+
+#define NVME_ADM_DELETE_SQ  0x00
+#define NVME_ADM_CREATE_SQ  0x01
+#define NVME_ADM_DELETE_CQ  0x04
+#define NVME_ADM_CREATE_CQ  0x05
+#define NVME_ADM_DBBUF      0x7c
+#define NVME_CMD_FLUSH      0x00
+
+#define NVME_INVALID_CQID       0x0100
+#define NVME_INVALID_QID        0x0101
+#define NVME_INVALID_QUEUE_DEL  0x010c
+
+#define QUEUE_SIZE          8
+#define NUM_QUEUES          4
+#define TIMEOUT_US          (5 * 1000 * 1000)
+
+typedef struct TestQueue {
+    uint16_t qid;
+    uint64_t sq;
+    uint64_t cq;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;
+} TestQueue;
+
+typedef struct TestNvme {
+    QPCIDevice *dev;
+    void *bar;
+    QGuestAllocator *alloc;
+    TestQueue admin;
+    TestQueue io[NUM_QUEUES];
+    uint16_t cid;
+} TestNvme;
+
+/* Tests only initialization */
 static void nop(void)
 {
+    qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
+                "-device nvme,drive=drv0,serial=foo");
+    qtest_end();
+}
+
+static void iothread(void)
+{
+    qtest_start("-object iothread,id=io0 "
+                    "-drive id=drv1,if=none,file=/dev/null,format=raw "
+                    "-device nvme,drive=drv1,serial=bar,num_queues=8,"
+                    "iothread=io0");
+    qtest_end();
+}
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = (QPCIDevice **) data;
+
+    *pdev = dev;
+}
+
+static void nvme_reg_writel(TestNvme *t, uint32_t reg, uint32_t val)
+{
+    qpci_io_writel(t->dev, t->bar + reg, val);
+}
+
+static uint32_t nvme_reg_readl(TestNvme *t, uint32_t reg)
+{
+    return qpci_io_readl(t->dev, t->bar + reg);
+}
+
+static void queue_init(TestNvme *t, TestQueue *q, uint16_t qid)
+{
+    q->qid = qid;
+    if (!q->sq) {
+        q->sq = guest_alloc(t->alloc, QUEUE_SIZE * 64);
+        q->cq = guest_alloc(t->alloc, QUEUE_SIZE * 16);
+    }
+    /* stale entries of a previous incarnation must not look completed */
+    qmemset(q->cq, 0, QUEUE_SIZE * 16);
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+}
+
+/* Write a command to the next SQ entry without ringing the doorbell */
+static void queue_cmd(TestNvme *t, TestQueue *q, uint32_t *cmd)
+{
+    int i;
+
+    cmd[0] |= (uint32_t)t->cid++ << 16;
+    for (i = 0; i < 16; i++) {
+        cmd[i] = cpu_to_le32(cmd[i]);
+    }
+    memwrite(q->sq + q->sq_tail * 64, cmd, 64);
+    q->sq_tail = (q->sq_tail + 1) % QUEUE_SIZE;
+}
+
+/*
+ * Wait for the next completion and return its status code; the new CQ head
+ * is not passed to the controller
+ */
+static uint16_t wait_cqe(TestQueue *q)
+{
+    uint16_t status;
+    int waited;
+
+    for (waited = 0; ; waited += 1000) {
+        memread(q->cq + q->cq_head * 16 + 14, &status, 2);
+        status = le16_to_cpu(status);
+        if ((status & 1) == q->phase) {
+            break;
+        }
+        g_assert_cmpint(waited, <, TIMEOUT_US);
+        g_usleep(1000);
+    }
+
+    q->cq_head = (q->cq_head + 1) % QUEUE_SIZE;
+    if (!q->cq_head) {
+        q->phase ^= 1;
+    }
+
+    /* status code type and status code, without phase and DNR */
+    return (status >> 1) & 0x3fff;
+}
+
+/* Submit one command and return the status code of its completion */
+static uint16_t submit(TestNvme *t, TestQueue *q, uint32_t *cmd)
+{
+    uint16_t status;
+
+    queue_cmd(t, q, cmd);
+    nvme_reg_writel(t, NVME_REG_DBS + 8 * q->qid, q->sq_tail);
+    status = wait_cqe(q);
+    nvme_reg_writel(t, NVME_REG_DBS + 8 * q->qid + 4, q->cq_head);
+
+    return status;
+}
+
+static uint16_t create_cq(TestNvme *t, TestQueue *q)
+{
+    uint32_t cmd[16] = { NVME_ADM_CREATE_CQ };
+
+    cmd[6] = q->cq;
+    cmd[7] = q->cq >> 32;
+    cmd[10] = q->qid | ((QUEUE_SIZE - 1) << 16);
+    cmd[11] = 1;                        /* physically contiguous, no irq */
+    return submit(t, &t->admin, cmd);
+}
+
+static uint16_t create_sq(TestNvme *t, TestQueue *q)
+{
+    uint32_t cmd[16] = { NVME_ADM_CREATE_SQ };
+
+    cmd[6] = q->sq;
+    cmd[7] = q->sq >> 32;
+    cmd[10] = q->qid | ((QUEUE_SIZE - 1) << 16);
+    cmd[11] = 1 | (q->qid << 16);       /* completions go to CQ qid */
+    return submit(t, &t->admin, cmd);
+}
+
+static uint16_t delete_queue(TestNvme *t, uint8_t opcode, uint16_t qid)
+{
+    uint32_t cmd[16] = { opcode };
+
+    cmd[10] = qid;
+    return submit(t, &t->admin, cmd);
+}
+
+static void nvme_setup(TestNvme *t)
+{
+    QPCIBus *bus;
+
+    memset(t, 0, sizeof(*t));
+    bus = qpci_init_pc();
+    t->alloc = pc_alloc_init();
+    t->dev = NULL;
+    qpci_device_foreach(bus, 0x8086, 0x5845, save_fn, &t->dev);
+    g_assert(t->dev != NULL);
+    qpci_device_enable(t->dev);
+    t->bar = qpci_iomap(t->dev, 0, NULL);
+
+    queue_init(t, &t->admin, 0);
+    nvme_reg_writel(t, NVME_REG_AQA,
+                    (QUEUE_SIZE - 1) | ((QUEUE_SIZE - 1) << 16));
+    nvme_reg_writel(t, NVME_REG_ASQ, t->admin.sq);
+    nvme_reg_writel(t, NVME_REG_ASQ + 4, t->admin.sq >> 32);
+    nvme_reg_writel(t, NVME_REG_ACQ, t->admin.cq);
+    nvme_reg_writel(t, NVME_REG_ACQ + 4, t->admin.cq >> 32);
+    /* 64 byte SQ entries, 16 byte CQ entries, 4k pages, enable */
+    nvme_reg_writel(t, NVME_REG_CC, (6 << 16) | (4 << 20) | 1);
+    g_assert_cmpint(nvme_reg_readl(t, NVME_REG_CSTS) & 3, ==, 1);
+}
+
+/*
+ * Create and delete I/O queues through the admin queue while the I/O
+ * queues live in an IOThread, and run a command on each of them.
+ */
+static void iothread_queues(void)
+{
+    TestNvme t;
+    uint32_t cmd[16];
+    int round, i;
+
+    qtest_start("-object iothread,id=io0 "
+                "-drive id=drv2,if=none,file=/dev/null,format=raw "
+                "-device nvme,drive=drv2,serial=baz,num_queues=4,"
+                "iothread=io0");
+    nvme_setup(&t);
+
+    for (round = 0; round < 3; round++) {
+        for (i = 1; i < NUM_QUEUES; i++) {
+            queue_init(&t, &t.io[i], i);
+            g_assert_cmpint(create_cq(&t, &t.io[i]), ==, 0);
+            g_assert_cmpint(create_sq(&t, &t.io[i]), ==, 0);
+        }
+
+        for (i = 1; i < NUM_QUEUES; i++) {
+            memset(cmd, 0, sizeof(cmd));
+            cmd[0] = NVME_CMD_FLUSH;
+            cmd[1] = 1;
+            g_assert_cmpint(submit(&t, &t.io[i], cmd), ==, 0);
+        }
+
+        /* a CQ with a SQ attached cannot go away */
+        g_assert_cmpint(delete_queue(&t, NVME_ADM_DELETE_CQ, 1), ==,
+                        NVME_INVALID_QUEUE_DEL);
+
+        for (i = 1; i < NUM_QUEUES; i++) {
+            g_assert_cmpint(delete_queue(&t, NVME_ADM_DELETE_SQ, i), ==, 0);
+            g_assert_cmpint(delete_queue(&t, NVME_ADM_DELETE_CQ, i), ==, 0);
+        }
+    }
+
+    /* queue ids are bounded by num_queues */
+    queue_init(&t, &t.io[0], NUM_QUEUES);
+    g_assert_cmpint(create_cq(&t, &t.io[0]), ==, NVME_INVALID_CQID);
+    g_assert_cmpint(delete_queue(&t, NVME_ADM_DELETE_SQ, 1), ==,
+                    NVME_INVALID_QID);
+
+    nvme_reg_writel(&t, NVME_REG_CC, 0);
+    g_assert_cmpint(nvme_reg_readl(&t, NVME_REG_CSTS) & 1, ==, 0);
+
+    g_free(t.dev);
+    pc_alloc_uninit(t.alloc);
+    qtest_end();
+}
+
+static void queue_flush(TestNvme *t, TestQueue *q)
+{
+    uint32_t cmd[16] = { NVME_CMD_FLUSH, 1 };
+
+    queue_cmd(t, q, cmd);
+}
+
+/* Wait until the controller has published @val as an event index */
+static void wait_eventidx(uint64_t addr, uint32_t val)
+{
+    int waited;
+
+    for (waited = 0; readl(addr) != val; waited += 1000) {
+        g_assert_cmpint(waited, <, TIMEOUT_US);
+        g_usleep(1000);
+    }
+}
+
+/*
+ * With shadow doorbells configured, the controller takes the SQ tail and CQ
+ * head from the shadow buffer; the values written to the MMIO doorbells are
+ * stale on purpose here and must not matter.
+ */
+static void dbbuf(void)
+{
+    TestNvme t;
+    TestQueue *q = &t.io[1];
+    uint32_t cmd[16] = { NVME_ADM_DBBUF };
+    uint64_t dbs, eis;
+    uint16_t old_head;
+    int i;
+
+    qtest_start("-drive id=drv3,if=none,file=/dev/null,format=raw "
+                "-device nvme,drive=drv3,serial=qux,num_queues=2");
+    nvme_setup(&t);
+
+    queue_init(&t, q, 1);
+    g_assert_cmpint(create_cq(&t, q), ==, 0);
+    g_assert_cmpint(create_sq(&t, q), ==, 0);
+
+    dbs = guest_alloc(t.alloc, 4096);
+    eis = guest_alloc(t.alloc, 4096);
+    qmemset(dbs, 0xff, 4096);
+    qmemset(eis, 0xff, 4096);
+
+    cmd[6] = dbs;
+    cmd[7] = dbs >> 32;
+    cmd[8] = eis;
+    cmd[9] = eis >> 32;
+    g_assert_cmpint(submit(&t, &t.admin, cmd), ==, 0);
+
+    /* The current doorbell values of the I/O queues are published */
+    g_assert_cmphex(readl(dbs), ==, 0xffffffff);
+    g_assert_cmphex(readl(dbs + 8), ==, 0);
+    g_assert_cmphex(readl(dbs + 12), ==, 0);
+
+    /* Two commands, announced with one stale doorbell write */
+    queue_flush(&t, q);
+    queue_flush(&t, q);
+    writel(dbs + 8, q->sq_tail);
+    nvme_reg_writel(&t, NVME_REG_DBS + 8, 0);
+    g_assert_cmpint(wait_cqe(q), ==, 0);
+    g_assert_cmpint(wait_cqe(q), ==, 0);
+    writel(dbs + 12, q->cq_head);
+
+    /* Once idle, the controller asks for a doorbell past the tail */
+    wait_eventidx(eis + 8, q->sq_tail);
+
+    /* Fill the CQ, which holds QUEUE_SIZE - 1 entries */
+    old_head = q->cq_head;
+    for (i = 0; i < QUEUE_SIZE - 1; i++) {
+        queue_flush(&t, q);
+    }
+    writel(dbs + 8, q->sq_tail);
+    nvme_reg_writel(&t, NVME_REG_DBS + 8, 0);
+    for (i = 0; i < QUEUE_SIZE - 1; i++) {
+        g_assert_cmpint(wait_cqe(q), ==, 0);
+    }
+
+    /* The next completion waits for room and asks for a CQ doorbell */
+    queue_flush(&t, q);
+    writel(dbs + 8, q->sq_tail);
+    nvme_reg_writel(&t, NVME_REG_DBS + 8, 0);
+    wait_eventidx(eis + 12, old_head);
+
+    /* The MMIO doorbell still says the CQ is full, the shadow does not */
+    writel(dbs + 12, q->cq_head);
+    nvme_reg_writel(&t, NVME_REG_DBS + 12, old_head);
+    g_assert_cmpint(wait_cqe(q), ==, 0);
+    writel(dbs + 12, q->cq_head);
+
+    nvme_reg_writel(&t, NVME_REG_CC, 0);
+    g_assert_cmpint(nvme_reg_readl(&t, NVME_REG_CSTS) & 1, ==, 0);
+
+    g_free(t.dev);
+    pc_alloc_uninit(t.alloc);
+    qtest_end();
 }
 
 int main(int argc, char **argv)
@@ -23,12 +371,11 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/nvme/nop", nop);
+    qtest_add_func("/nvme/iothread", iothread);
+    qtest_add_func("/nvme/iothread/queues", iothread_queues);
+    qtest_add_func("/nvme/dbbuf", dbbuf);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
-                "-device nvme,drive=drv0,serial=foo");
     ret = g_test_run();
 
-    qtest_end();
-
     return ret;
 }
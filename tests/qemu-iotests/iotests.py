@@ -22,6 +22,7 @@ import subprocess
 import string
 import unittest
 import sys
+import time
 sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'scripts'))
 sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'scripts', 'qmp'))
 import qmp
@@ -117,6 +118,11 @@ class VM(object):
         self._args.append('-monitor')
         self._args.append(args)
 
+    def add_args(self, *args):
+        '''Append extra arguments to the command line'''
+        self._args.extend(args)
+        return self
+
     def add_drive(self, path, opts=''):
         '''Add a virtio-blk drive to the VM'''
         options = ['if=virtio',
@@ -326,6 +332,50 @@ class QMPTestCase(unittest.TestCase):
         self.assert_no_active_block_jobs()
         return event
 
+    # Guest RAM checks for savevm and migration tests: a different pattern
+    # in every MiB of a range of guest RAM, written through qtest
+    ram_pattern_base = 16 * 1024 * 1024
+    ram_pattern_mib = 24
+
+    def write_ram_pattern(self, vm, first=1):
+        '''Fill MiB i of the pattern range with the byte first + i'''
+        for i in range(self.ram_pattern_mib):
+            vm.qtest('memset 0x%x 0x100000 0x%x' %
+                     (self.ram_pattern_base + i * 0x100000, (first + i) % 256))
+
+    def check_ram_pattern(self, vm, first=1):
+        '''Check the pattern written by write_ram_pattern()'''
+        dump = os.path.join(test_dir, 'ram-pattern.dump')
+        result = vm.qmp('pmemsave', val=self.ram_pattern_base,
+                        size=self.ram_pattern_mib * 0x100000, filename=dump)
+        self.assert_qmp(result, 'return', {})
+        try:
+            with open(dump, 'rb') as f:
+                for i in range(self.ram_pattern_mib):
+                    self.assertEqual(f.read(0x100000),
+                                     chr((first + i) % 256) * 0x100000,
+                                     'RAM differs at MiB %d of the pattern' % i)
+        finally:
+            os.remove(dump)
+
+    def wait_migration(self, vm):
+        '''Wait for an outgoing migration to complete, returning its info'''
+        while True:
+            result = vm.qmp('query-migrate')
+            if result['return']['status'] not in ['setup', 'active']:
+                self.assert_qmp(result, 'return/status', 'completed')
+                return result
+            time.sleep(0.1)
+
+    def wait_incoming(self, vm):
+        '''Wait for a VM started with -incoming to load its state'''
+        while True:
+            result = vm.qmp('query-status')
+            if result['return']['status'] != 'inmigrate':
+                break
+            time.sleep(0.1)
+        self.assert_qmp(result, 'return/status', 'running')
+
 def notrun(reason):
     '''Skip this test suite'''
     # Each test in qemu-iotests has a number ("seq")
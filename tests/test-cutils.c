@@ -226,6 +226,99 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+#define CMP_COPY_LEN (BUFFER_CMP_AND_COPY_UNROLL_FACTOR * sizeof(VECTYPE) * 4)
+
+static void test_cmp_and_copy_equal(void)
+{
+    VECTYPE dst[CMP_COPY_LEN / sizeof(VECTYPE)];
+    VECTYPE src[CMP_COPY_LEN / sizeof(VECTYPE)];
+
+    memset(dst, 0x5a, sizeof(dst));
+    memset(src, 0x5a, sizeof(src));
+    g_assert(can_use_buffer_cmp_and_copy(dst, src, sizeof(dst)));
+    g_assert(!buffer_cmp_and_copy(dst, src, sizeof(dst)));
+    g_assert(memcmp(dst, src, sizeof(dst)) == 0);
+}
+
+static void test_cmp_and_copy_differ(void)
+{
+    VECTYPE dst[CMP_COPY_LEN / sizeof(VECTYPE)];
+    VECTYPE src[CMP_COPY_LEN / sizeof(VECTYPE)];
+    size_t i;
+
+    for (i = 0; i < sizeof(dst); i++) {
+        memset(dst, 0x5a, sizeof(dst));
+        memset(src, 0x5a, sizeof(src));
+        ((uint8_t *)src)[i] = 0xa5;
+        g_assert(buffer_cmp_and_copy(dst, src, sizeof(dst)));
+        g_assert(memcmp(dst, src, sizeof(dst)) == 0);
+    }
+}
+
+/*
+ * Refresh of a 32bpp surface split in 16 pixel cells, as done by the VNC
+ * server, with one changed cell every @spacing cells.
+ */
+static void perf_cmp_and_copy(int width, int height, int spacing)
+{
+    const size_t cell = 16 * 4;
+    size_t len = (size_t)width * height * 4;
+    size_t ncells = len / cell;
+    uint8_t *dst_buf = g_malloc(len + 64);
+    uint8_t *src_buf = g_malloc(len + 64);
+    uint8_t *dst = (uint8_t *)QEMU_ALIGN_UP((uintptr_t)dst_buf, 64);
+    uint8_t *src = (uint8_t *)QEMU_ALIGN_UP((uintptr_t)src_buf, 64);
+    size_t i, changed = 0;
+    double duration;
+
+    memset(dst, 0, len);
+    memset(src, 0, len);
+    for (i = 0; i < ncells; i += spacing) {
+        src[i * cell + cell - 1] = 1;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < ncells; i++) {
+        changed += buffer_cmp_and_copy(dst + i * cell, src + i * cell, cell);
+    }
+    duration = g_test_timer_elapsed();
+    g_assert_cmpint(changed, ==, DIV_ROUND_UP(ncells, spacing));
+    g_test_message("cmp_and_copy %dx%d (1/%d dirty): %f ms\n",
+                   width, height, spacing, duration * 1000);
+
+    memset(dst, 0, len);
+    changed = 0;
+    g_test_timer_start();
+    for (i = 0; i < ncells; i++) {
+        if (memcmp(dst + i * cell, src + i * cell, cell)) {
+            memcpy(dst + i * cell, src + i * cell, cell);
+            changed++;
+        }
+    }
+    duration = g_test_timer_elapsed();
+    g_assert_cmpint(changed, ==, DIV_ROUND_UP(ncells, spacing));
+    g_test_message("memcmp+memcpy %dx%d (1/%d dirty): %f ms\n",
+                   width, height, spacing, duration * 1000);
+
+    g_free(dst_buf);
+    g_free(src_buf);
+}
+
+static void perf_cmp_and_copy_xga(void)
+{
+    perf_cmp_and_copy(1024, 768, 64);
+}
+
+static void perf_cmp_and_copy_1080p(void)
+{
+    perf_cmp_and_copy(1920, 1080, 64);
+}
+
+static void perf_cmp_and_copy_4k(void)
+{
+    perf_cmp_and_copy(3840, 2160, 64);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +339,15 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/cmp_and_copy/equal", test_cmp_and_copy_equal);
+    g_test_add_func("/cutils/cmp_and_copy/differ", test_cmp_and_copy_differ);
+
+    if (g_test_perf()) {
+        g_test_add_func("/perf/cmp_and_copy/1024x768", perf_cmp_and_copy_xga);
+        g_test_add_func("/perf/cmp_and_copy/1920x1080",
+                        perf_cmp_and_copy_1080p);
+        g_test_add_func("/perf/cmp_and_copy/3840x2160", perf_cmp_and_copy_4k);
+    }
 
     return g_test_run();
 }
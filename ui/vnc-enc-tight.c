@@ -45,6 +45,7 @@
 #endif
 
 #include "qemu/bswap.h"
+#include "qemu/timer.h"
 #include "qapi/qmp/qint.h"
 #include "vnc.h"
 #include "vnc-enc-tight.h"
@@ -1422,6 +1423,55 @@ static int send_sub_rect_nojpeg(VncState *vs, int x, int y, int w, int h,
 }
 
 #ifdef CONFIG_VNC_JPEG
+/*
+ * JPEG quality for regions detected as video.  Without a bandwidth target
+ * this is the quality asked for by the client.  Otherwise the quality is
+ * lowered while the JPEG data sent over the last window exceeds the
+ * target, and raised back, up to the client's setting, when it is well
+ * below.
+ */
+static int tight_video_quality(VncState *vs)
+{
+    int max = tight_conf[vs->tight.quality].jpeg_quality;
+    int64_t now, elapsed;
+    uint64_t rate;
+
+    if (!vs->vd->video_rate) {
+        return max;
+    }
+    if (!vs->tight.video_quality) {
+        vs->tight.video_quality = max;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed = now - vs->tight.video_window_ns;
+    if (elapsed >= VNC_TIGHT_VIDEO_WINDOW) {
+        /* kbit/s sent during the window that just ended */
+        rate = (uint64_t)vs->tight.video_bytes * 8 * 1000000 / elapsed;
+        if (rate > vs->vd->video_rate) {
+            vs->tight.video_quality -= VNC_TIGHT_VIDEO_QUALITY_STEP * 2;
+        } else if (rate < vs->vd->video_rate * 3 / 4) {
+            vs->tight.video_quality += VNC_TIGHT_VIDEO_QUALITY_STEP;
+        }
+        vs->tight.video_window_ns = now;
+        vs->tight.video_bytes = 0;
+    }
+    vs->tight.video_quality = MAX(vs->tight.video_quality,
+                                  VNC_TIGHT_VIDEO_MIN_QUALITY);
+    vs->tight.video_quality = MIN(vs->tight.video_quality, max);
+    return vs->tight.video_quality;
+}
+
+static int send_video_rect(VncState *vs, int x, int y, int w, int h)
+{
+    size_t offset = vs->output.offset;
+    int ret;
+
+    ret = send_jpeg_rect(vs, x, y, w, h, tight_video_quality(vs));
+    vs->tight.video_bytes += vs->output.offset - offset;
+    return ret;
+}
+
 static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
                               int bg, int fg, int colors,
                               VncPalette *palette, bool force)
@@ -1429,8 +1479,10 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     int ret;
 
     if (colors == 0) {
-        if (force || (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
-                      tight_detect_smooth_image(vs, w, h))) {
+        if (force) {
+            ret = send_video_rect(vs, x, y, w, h);
+        } else if (tight_jpeg_conf[vs->tight.quality].jpeg_full &&
+                   tight_detect_smooth_image(vs, w, h)) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
@@ -1442,9 +1494,11 @@ static int send_sub_rect_jpeg(VncState *vs, int x, int y, int w, int h,
     } else if (colors == 2) {
         ret = send_mono_rect(vs, x, y, w, h, bg, fg);
     } else if (colors <= 256) {
-        if (force || (colors > 96 &&
-                      tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
-                      tight_detect_smooth_image(vs, w, h))) {
+        if (force) {
+            ret = send_video_rect(vs, x, y, w, h);
+        } else if (colors > 96 &&
+                   tight_jpeg_conf[vs->tight.quality].jpeg_idx &&
+                   tight_detect_smooth_image(vs, w, h)) {
             int quality = tight_conf[vs->tight.quality].jpeg_quality;
 
             ret = send_jpeg_rect(vs, x, y, w, h, quality);
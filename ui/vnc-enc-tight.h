@@ -180,4 +180,9 @@
 #define VNC_TIGHT_DETECT_MIN_WIDTH           8
 #define VNC_TIGHT_DETECT_MIN_HEIGHT          8
 
+/* JPEG rate control for video regions (see tight_video_quality) */
+#define VNC_TIGHT_VIDEO_WINDOW       250000000 /* ns */
+#define VNC_TIGHT_VIDEO_QUALITY_STEP         5
+#define VNC_TIGHT_VIDEO_MIN_QUALITY         10
+
 #endif /* VNC_ENCODING_TIGHT_H */
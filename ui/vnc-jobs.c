@@ -29,6 +29,7 @@
 #include "vnc.h"
 #include "vnc-jobs.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 #include "block/aio.h"
 
 /*
@@ -38,32 +39,48 @@
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
  * - VncDisplay global lock: mainly used for framebuffer updates to avoid
  *                      screen corruption if the framebuffer is updated
- *                      while the worker is doing something.
+ *                      while a worker is doing something.
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
- * to avoid screen corruption (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not held because the thread works on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds a shared reference on the
+ * VncDisplay lock to avoid screen corruption (this does not block
+ * vnc_refresh() because it uses trylock()) but the output lock is not held
+ * because the thread works on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Several workers can run at the same time.  The persistent encoder state
+ * (zlib streams, lossy map...) lives in the VncState, so the jobs of one
+ * client are always run one at a time and in order: a worker only picks a
+ * job if no earlier job for the same client is still queued or running.
+ * A busy client therefore keeps at most one worker busy, and the other
+ * workers go on serving the remaining clients.
  */
 
+#define VNC_MAX_WORKER_THREADS 64
+
+typedef struct VncJobQueue VncJobQueue;
+
+typedef struct VncWorker {
+    VncJobQueue *queue;
+    QemuThread thread;
+    Buffer buffer;
+} VncWorker;
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    VncWorker *workers[VNC_MAX_WORKER_THREADS];
+    int nb_workers;
+    int nb_running;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
 
-typedef struct VncJobQueue VncJobQueue;
-
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue shared by all the displays; every worker
+ * thread pulls its jobs from there.
  */
 static VncJobQueue *queue;
 
@@ -143,7 +160,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* Running jobs are removed by their worker */
+        if ((job->vs == vs || !vs) && !job->running) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -180,7 +198,8 @@ void vnc_jobs_consume_buffer(VncState *vs)
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncWorker *worker, VncState *orig,
+                                     VncState *local)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -193,13 +212,14 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output =  worker->buffer;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncWorker *worker, VncState *orig,
+                                   VncState *local)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -207,28 +227,55 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    worker->buffer = local->output;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+/*
+ * Return the first job that can run now, that is the first job which is
+ * not running and has no older job for the same client in the queue.
+ */
+static VncJob *vnc_queue_next_job_locked(VncJobQueue *queue)
 {
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->running) {
+            continue;
+        }
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static int vnc_worker_thread_loop(VncWorker *worker)
+{
+    VncJobQueue *queue = worker->queue;
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
     int n_rectangles;
     int saved_offset;
+    int64_t start;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!(job = vnc_queue_next_job_locked(queue)) && !queue->exit) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
     /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->running = true;
+    vnc_unlock_queue(queue);
 
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
@@ -237,8 +284,10 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     }
     vnc_unlock_output(job->vs);
 
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(worker, job->vs, &vs);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -247,14 +296,14 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
-            vnc_async_encoding_end(job->vs, &vs);
+            vnc_async_encoding_end(worker, job->vs, &vs);
             goto disconnected;
         }
 
@@ -266,24 +315,28 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
     vs.output.buffer[saved_offset + 1] = n_rectangles & 0xFF;
 
     vnc_lock_output(job->vs);
+    job->vs->stats.encode_time_ns +=
+        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    job->vs->stats.encoded_bytes += vs.output.offset;
+    job->vs->stats.updates++;
     if (job->vs->csock != -1) {
         buffer_reserve(&job->vs->jobs_buffer, vs.output.offset);
         buffer_append(&job->vs->jobs_buffer, vs.output.buffer,
                       vs.output.offset);
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(worker, job->vs, &vs);
 
 	qemu_bh_schedule(job->vs->bh);
     }  else {
         /* Copy persistent encoding data */
-        vnc_async_encoding_end(job->vs, &vs);
+        vnc_async_encoding_end(worker, job->vs, &vs);
     }
     vnc_unlock_output(job->vs);
 
@@ -308,21 +361,34 @@ static VncJobQueue *vnc_queue_init(void)
 
 static void vnc_queue_clear(VncJobQueue *q)
 {
+    int i;
+
+    for (i = 0; i < q->nb_workers; i++) {
+        g_free(q->workers[i]);
+    }
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     g_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
+
+    qemu_thread_get_self(&worker->thread);
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(worker)) ;
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    buffer_free(&worker->buffer);
+    vnc_lock_queue(queue);
+    last = --queue->nb_running == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -331,15 +397,37 @@ static bool vnc_worker_thread_running(void)
     return queue; /* Check global queue */
 }
 
-void vnc_start_worker_thread(void)
+/*
+ * Grow the worker pool to @nb_threads encoding threads.  The pool never
+ * shrinks: it is shared by all displays, and the largest request wins.
+ */
+void vnc_start_worker_threads(int nb_threads)
 {
-    VncJobQueue *q;
+    VncJobQueue *q = queue;
+
+    if (!vnc_worker_thread_running()) {
+        q = vnc_queue_init();
+        queue = q; /* Set global queue */
+    }
+
+    nb_threads = MIN(nb_threads, VNC_MAX_WORKER_THREADS);
+    vnc_lock_queue(q);
+    while (q->nb_workers < nb_threads) {
+        VncWorker *worker = g_new0(VncWorker, 1);
 
+        worker->queue = q;
+        q->workers[q->nb_workers++] = worker;
+        q->nb_running++;
+        qemu_thread_create(&worker->thread, "vnc_worker", vnc_worker_thread,
+                           worker, QEMU_THREAD_DETACHED);
+    }
+    vnc_unlock_queue(q);
+}
+
+void vnc_start_worker_thread(void)
+{
     if (vnc_worker_thread_running())
         return ;
 
-    q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
-    queue = q; /* Set global queue */
+    vnc_start_worker_threads(1);
 }
@@ -40,11 +40,19 @@ void vnc_jobs_join(VncState *vs);
 
 void vnc_jobs_consume_buffer(VncState *vs);
 void vnc_start_worker_thread(void);
+void vnc_start_worker_threads(int nb_threads);
 
 /* Locks */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
-    return qemu_mutex_trylock(&vd->mutex);
+    int ret = qemu_mutex_trylock(&vd->mutex);
+
+    /* Encoders are still reading the server surface */
+    if (!ret && vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        ret = -EBUSY;
+    }
+    return ret;
 }
 
 static inline void vnc_lock_display(VncDisplay *vd)
@@ -57,6 +65,25 @@ static inline void vnc_unlock_display(VncDisplay *vd)
     qemu_mutex_unlock(&vd->mutex);
 }
 
+/*
+ * Worker threads only read the server surface, so any number of them can
+ * hold the display at the same time; vnc_trylock_display() fails until the
+ * last one is done.
+ */
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
+    qemu_mutex_unlock(&vd->mutex);
+}
+
 static inline void vnc_lock_output(VncState *vs)
 {
     qemu_mutex_lock(&vs->output_mutex);
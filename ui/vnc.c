@@ -46,6 +46,11 @@
 #define VNC_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
+/* Regions updated more often than this (in Hz) are treated as video */
+#define VNC_VIDEO_FREQ 10
+/* Limits of the video-fps= (frames/s) and video-rate= (kbit/s) options */
+#define VNC_VIDEO_FPS_MAX  60
+#define VNC_VIDEO_RATE_MAX (1000 * 1000)
 
 #include "vnc_keysym.h"
 #include "d3des.h"
@@ -331,7 +336,7 @@ static void vnc_qmp_event(VncState *vs, QAPIEvent event)
     qapi_free_VncServerInfo(si);
 }
 
-static VncClientInfo *qmp_query_vnc_client(const VncState *client)
+static VncClientInfo *qmp_query_vnc_client(VncState *client)
 {
     struct sockaddr_storage sa;
     socklen_t salen = sizeof(sa);
@@ -372,6 +377,17 @@ static VncClientInfo *qmp_query_vnc_client(const VncState *client)
     }
 #endif
 
+    vnc_lock_output(client);
+    info->has_updates = true;
+    info->updates = client->stats.updates;
+    info->has_encode_time = true;
+    info->encode_time = client->stats.encode_time_ns;
+    info->has_encoded_bytes = true;
+    info->encoded_bytes = client->stats.encoded_bytes;
+    info->has_sent_bytes = true;
+    info->sent_bytes = client->stats.sent_bytes;
+    vnc_unlock_output(client);
+
     return info;
 }
 
@@ -605,6 +621,7 @@ VncInfo2List *qmp_query_vnc_servers(Error **errp)
 */
 
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync);
+static VncRectStat *vnc_stat_rect(VncDisplay *vd, int x, int y);
 static void vnc_disconnect_start(VncState *vs);
 
 static void vnc_colordepth(VncState *vs);
@@ -792,6 +809,8 @@ static void vnc_dpy_switch(DisplayChangeListener *dcl,
             vnc_cursor_define(vs);
         }
         memset(vs->dirty, 0x00, sizeof(vs->dirty));
+        memset(vs->video_dirty, 0x00, sizeof(vs->video_dirty));
+        vs->has_video_dirty = false;
         vnc_set_area_dirty(vs->dirty, width, height, 0, 0,
                            width, height);
     }
@@ -1063,6 +1082,64 @@ static int find_and_clear_dirty_height(VncState *vs,
     return h;
 }
 
+/*
+ * Hold back the dirty cells of video regions until the next video frame
+ * is due, so that they are sent at most video_fps times per second.  The
+ * rest of the screen is not affected.  Returns true if some cells were
+ * deferred.
+ */
+static bool vnc_throttle_video(VncState *vs)
+{
+    VncDisplay *vd = vs->vd;
+    int width = pixman_image_get_width(vd->server);
+    int height = pixman_image_get_height(vd->server);
+    int64_t now;
+    int x, y, j;
+    bool deferred = false;
+
+    if (vd->non_adaptive || !vd->video_fps) {
+        return false;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (now - vs->video_frame_ns >= get_ticks_per_sec() / vd->video_fps) {
+        /* a new video frame is due: release what was held back */
+        vs->video_frame_ns = now;
+        if (vs->has_video_dirty) {
+            for (y = 0; y < height; y++) {
+                bitmap_or(vs->dirty[y], vs->dirty[y], vs->video_dirty[y],
+                          VNC_DIRTY_BITS);
+                bitmap_zero(vs->video_dirty[y], VNC_DIRTY_BITS);
+            }
+            vs->has_video_dirty = false;
+        }
+        return false;
+    }
+
+    for (y = 0; y < height; y += VNC_STAT_RECT) {
+        for (x = 0; x < width; x += VNC_STAT_RECT) {
+            int start = x / VNC_DIRTY_PIXELS_PER_BIT;
+            int end = MIN(x + VNC_STAT_RECT, width);
+
+            end = DIV_ROUND_UP(end, VNC_DIRTY_PIXELS_PER_BIT);
+            if (vnc_stat_rect(vd, x, y)->freq < VNC_VIDEO_FREQ) {
+                continue;
+            }
+            for (j = y; j < MIN(y + VNC_STAT_RECT, height); j++) {
+                int i = find_next_bit(vs->dirty[j], end, start);
+
+                for (; i < end; i = find_next_bit(vs->dirty[j], end, i + 1)) {
+                    clear_bit(i, vs->dirty[j]);
+                    set_bit(i, vs->video_dirty[j]);
+                    deferred = true;
+                }
+            }
+        }
+    }
+    vs->has_video_dirty |= deferred;
+    return deferred;
+}
+
 static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
 {
     vs->has_dirty += has_dirty;
@@ -1072,6 +1149,7 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         int y;
         int height, width;
         int n = 0;
+        bool deferred;
 
         if (vs->output.offset && !vs->audio_cap && !vs->force_update)
             /* kernel send buffers are full -> drop frames to throttle */
@@ -1080,6 +1158,8 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
         if (!vs->has_dirty && !vs->audio_cap && !vs->force_update)
             return 0;
 
+        deferred = vnc_throttle_video(vs);
+
         /*
          * Send screen updates to the vnc client using the server
          * surface and server dirty map.  guest surface updates
@@ -1126,7 +1206,8 @@ static int vnc_update_client(VncState *vs, int has_dirty, bool sync)
             vnc_jobs_join(vs);
         }
         vs->force_update = 0;
-        vs->has_dirty = 0;
+        /* come back for the video cells that were held back */
+        vs->has_dirty = deferred;
         return n;
     }
 
@@ -1351,6 +1432,9 @@ long vnc_client_write_buf(VncState *vs, const uint8_t *data, size_t datalen)
     }
 #endif /* CONFIG_VNC_TLS */
     VNC_DEBUG("Wrote wire %p %zd -> %ld\n", data, datalen, ret);
+    if (ret > 0) {
+        vs->stats.sent_bytes += ret;
+    }
     return vnc_client_io_error(vs, ret, socket_error());
 }
 
@@ -2897,7 +2981,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     min_stride = MIN(server_stride, guest_stride);
 
     for (;;) {
-        int x;
+        int x, x0, x_max;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2907,7 +2991,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             break;
         }
         y = offset / VNC_DIRTY_BPL(&vd->guest);
-        x = offset % VNC_DIRTY_BPL(&vd->guest);
+        x = x0 = offset % VNC_DIRTY_BPL(&vd->guest);
 
         server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
 
@@ -2919,19 +3003,31 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         }
         guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+        /*
+         * Only visit the cells the guest marked dirty; the rest of the
+         * scanline is skipped without looking at the pixels.
+         */
+        x_max = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+        for (; x < x_max;
+             x = find_next_bit(vd->guest.dirty[y], x_max, x + 1)) {
             int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
+            uint8_t *g = guest_ptr + (x - x0) * cmp_bytes;
+            uint8_t *s = server_ptr + (x - x0) * cmp_bytes;
+
             if ((x + 1) * cmp_bytes > min_stride) {
                 _cmp_bytes = min_stride - x * cmp_bytes;
             }
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
+            if (can_use_buffer_cmp_and_copy(s, g, _cmp_bytes)) {
+                /* one cell is a cache line, compared a vector at a time */
+                if (!buffer_cmp_and_copy(s, g, _cmp_bytes)) {
+                    continue;
+                }
+            } else {
+                if (memcmp(s, g, _cmp_bytes) == 0) {
+                    continue;
+                }
+                memcpy(s, g, _cmp_bytes);
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
@@ -2941,6 +3037,9 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             }
             has_dirty++;
         }
+        if (x_max > x0) {
+            bitmap_clear(vd->guest.dirty[y], x0, x_max - x0);
+        }
 
         y++;
     }
@@ -3302,6 +3401,15 @@ static QemuOptsList qemu_vnc_opts = {
         },{
             .name = "non-adaptive",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "encoder-threads",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "video-fps",
+            .type = QEMU_OPT_NUMBER,
+        },{
+            .name = "video-rate",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -3462,6 +3570,7 @@ void vnc_display_open(const char *id, Error **errp)
     int acl = 0;
 #endif
     int lock_key_sync = 1;
+    int64_t encoder_threads;
 
     if (!vs) {
         error_setg(errp, "VNC display not active");
@@ -3598,6 +3707,33 @@ void vnc_display_open(const char *id, Error **errp)
     if (!vs->lossy) {
         vs->non_adaptive = true;
     }
+    vs->video_fps = 0;
+    vs->video_rate = 0;
+    if (qemu_opt_get(opts, "video-fps")) {
+        uint64_t fps = qemu_opt_get_number(opts, "video-fps", 0);
+        if (fps < 1 || fps > VNC_VIDEO_FPS_MAX) {
+            error_setg(errp, "video-fps must be between 1 and %d",
+                       VNC_VIDEO_FPS_MAX);
+            goto fail;
+        }
+        vs->video_fps = fps;
+    }
+    if (qemu_opt_get(opts, "video-rate")) {
+        uint64_t rate = qemu_opt_get_number(opts, "video-rate", 0);
+        if (rate < 1 || rate > VNC_VIDEO_RATE_MAX) {
+            error_setg(errp, "video-rate must be between 1 and %d",
+                       VNC_VIDEO_RATE_MAX);
+            goto fail;
+        }
+        vs->video_rate = rate;
+    }
+
+    encoder_threads = qemu_opt_get_number(opts, "encoder-threads", 1);
+    if (encoder_threads < 1) {
+        error_setg(errp, "encoder-threads must be at least 1");
+        goto fail;
+    }
+    vnc_start_worker_threads(encoder_threads);
 
 #ifdef CONFIG_VNC_TLS
     if (acl && x509 && vs->tls.x509verify) {
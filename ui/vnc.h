@@ -165,6 +165,7 @@ struct VncDisplay
     kbd_layout_t *kbd_layout;
     int lock_key_sync;
     QemuMutex mutex;
+    int encoders; /* worker threads reading the server surface */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -185,6 +186,8 @@ struct VncDisplay
     bool ws_tls; /* Used by websockets */
     bool lossy;
     bool non_adaptive;
+    int video_fps;     /* frame rate limit for video regions, 0 = none */
+    int video_rate;    /* JPEG bandwidth target in kbit/s, 0 = none */
 #ifdef CONFIG_VNC_TLS
     VncDisplayTLS tls;
 #endif
@@ -210,6 +213,10 @@ typedef struct VncTight {
 #endif
     int levels[4];
     z_stream stream[4];
+    /* rate control of the JPEG data sent for video regions */
+    int video_quality;
+    int64_t video_window_ns;
+    size_t video_bytes;
 } VncTight;
 
 typedef struct VncHextile {
@@ -254,6 +261,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -264,6 +272,10 @@ struct VncState
     int csock;
 
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
+    /* cells of video regions held back until the next video frame */
+    DECLARE_BITMAP(video_dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
+    bool has_video_dirty;
+    int64_t video_frame_ns;
     uint8_t **lossy_rect; /* Not an Array to avoid costly memcpy in
                            * vnc-jobs-async.c */
 
@@ -330,6 +342,14 @@ struct VncState
     QEMUBH *bh;
     Buffer jobs_buffer;
 
+    /* Protected by output_mutex */
+    struct {
+        uint64_t updates;        /* framebuffer updates encoded */
+        uint64_t encode_time_ns; /* time spent by the workers encoding */
+        uint64_t encoded_bytes;  /* output of the encoders */
+        uint64_t sent_bytes;     /* bytes written to the socket */
+    } stats;
+
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
      */
@@ -221,6 +221,50 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+/*
+ * Makes @dst identical to @src
+ *
+ * Attention! The len must be a multiple of
+ * BUFFER_CMP_AND_COPY_UNROLL_FACTOR * sizeof(VECTYPE) and both
+ * buffers must be aligned to sizeof(VECTYPE).
+ *
+ * can_use_buffer_cmp_and_copy() can be used to check these requirements.
+ *
+ * The buffers are compared one vector at a time and only the part
+ * starting at the first difference is written, so that unchanged data
+ * (the common case when refreshing a display) is never stored.
+ *
+ * Returns true if @dst was modified.
+ */
+bool buffer_cmp_and_copy(void *dst, const void *src, size_t len)
+{
+    VECTYPE *d = dst;
+    const VECTYPE *s = src;
+    size_t i, j, n = len / sizeof(VECTYPE);
+
+    assert(can_use_buffer_cmp_and_copy(dst, src, len));
+
+    for (i = 0; i < n; i += BUFFER_CMP_AND_COPY_UNROLL_FACTOR) {
+        bool equal = true;
+
+        /* constant trip count, the compiler unrolls this */
+        for (j = 0; j < BUFFER_CMP_AND_COPY_UNROLL_FACTOR; j++) {
+            equal &= ALL_EQ(d[i + j], s[i + j]);
+        }
+        if (!equal) {
+            break;
+        }
+    }
+    if (i == n) {
+        return false;
+    }
+
+    for (; i < n; i++) {
+        d[i] = s[i];
+    }
+    return true;
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
@@ -3440,6 +3440,7 @@ int main(int argc, char **argv, char **envp)
                 QemuOpts *fsdev;
                 QemuOpts *device;
                 const char *writeout, *sock_fd, *socket;
+                const char *max_requests, *attr_timeout;
 
                 olist = qemu_find_opts("virtfs");
                 if (!olist) {
@@ -3490,6 +3491,16 @@ int main(int argc, char **argv, char **envp)
                 if (sock_fd) {
                     qemu_opt_set(fsdev, "sock_fd", sock_fd, &error_abort);
                 }
+                max_requests = qemu_opt_get(opts, "max_requests");
+                if (max_requests) {
+                    qemu_opt_set(fsdev, "max_requests", max_requests,
+                                 &error_abort);
+                }
+                attr_timeout = qemu_opt_get(opts, "attr_timeout");
+                if (attr_timeout) {
+                    qemu_opt_set(fsdev, "attr_timeout", attr_timeout,
+                                 &error_abort);
+                }
 
                 qemu_opt_set_bool(fsdev, "readonly",
                                   qemu_opt_get_bool(opts, "readonly", 0),